@@ -0,0 +1,311 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*
+ * Benchmark of the background caching pipeline, the stages of
+ * create_cached_image_command(): loading the source scaled and cropped,
+ * encoding the cached PNG and loading it back at size.  It runs against
+ * generated JPEG and PNG images of several sizes and prints one line
+ * per stage and image with tab separated fields:
+ *
+ *   stage format width height iterations min-us median-us heap-kb rss-kb
+ *
+ * heap-kb is the heap growth over the stage, rss-kb the peak resident
+ * set size of the process so far.
+ *
+ * Build with "make bench-backgrounds", run as
+ * bench-backgrounds [iterations] [directory].
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include <glib/gstdio.h>
+
+#include "hd-pixbuf-utils.h"
+
+#define DEFAULT_ITERATIONS 5
+
+/* The cached image size, see hd-backgrounds.c */
+#define CACHED_WIDTH  800
+#define CACHED_HEIGHT 480
+
+static const HDImageSize corpus_sizes[] =
+{
+  {  800,  480 },
+  { 1600, 1200 },   /*  2 MP */
+  { 2592, 1944 },   /*  5 MP */
+  { 3264, 2448 },   /*  8 MP */
+  { 4000, 3000 },   /* 12 MP */
+  { 5184, 3888 },   /* 20 MP */
+};
+
+static const gchar *corpus_formats[] = { "jpeg", "png" };
+
+typedef gboolean (*StageFunc) (GFile     *file,
+                               gpointer   data,
+                               GError   **error);
+
+static glong
+get_peak_rss (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+
+  return usage.ru_maxrss;
+}
+
+static glong
+get_heap_size (void)
+{
+#ifdef HAVE_MALLINFO2
+  struct mallinfo2 info = mallinfo2 ();
+#else
+  struct mallinfo info = mallinfo ();
+#endif
+
+  return info.uordblks + info.hblkhd;
+}
+
+static int
+compare_times (gconstpointer a,
+               gconstpointer b)
+{
+  gint64 lhs = *(const gint64 *) a, rhs = *(const gint64 *) b;
+
+  return lhs < rhs ? -1 : lhs > rhs;
+}
+
+/* Creates a photo-like test image, smooth gradients with some noise
+ * so the encoders can not compress it unrealistically well. */
+static GdkPixbuf *
+create_test_pixbuf (const HDImageSize *size)
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  gint rowstride, x, y;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
+                           size->width, size->height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y = 0; y < size->height; y++)
+    {
+      guchar *p = pixels + y * rowstride;
+
+      for (x = 0; x < size->width; x++, p += 3)
+        {
+          gint noise = g_random_int_range (-8, 8);
+
+          p[0] = CLAMP (255 * x / size->width + noise, 0, 255);
+          p[1] = CLAMP (255 * y / size->height + noise, 0, 255);
+          p[2] = CLAMP (128 + (x ^ y) % 64 + noise, 0, 255);
+        }
+    }
+
+  return pixbuf;
+}
+
+static GFile *
+create_test_file (const gchar       *directory,
+                  const HDImageSize *size,
+                  const gchar       *format)
+{
+  GdkPixbuf *pixbuf;
+  gchar *basename, *filename;
+  GFile *file;
+  GError *error = NULL;
+
+  basename = g_strdup_printf ("%dx%d.%s", size->width, size->height, format);
+  filename = g_build_filename (directory, basename, NULL);
+  file = g_file_new_for_path (filename);
+
+  if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+    {
+      pixbuf = create_test_pixbuf (size);
+      if (!hd_pixbuf_utils_save (file, pixbuf, format, NULL, &error))
+        {
+          g_warning ("%s. Could not create %s. %s",
+                     __FUNCTION__, filename, error->message);
+          g_clear_error (&error);
+          file = (g_object_unref (file), NULL);
+        }
+      g_object_unref (pixbuf);
+    }
+
+  g_free (basename);
+  g_free (filename);
+
+  return file;
+}
+
+static gboolean
+stage_load_scaled_and_cropped (GFile     *file,
+                               gpointer   data,
+                               GError   **error)
+{
+  HDImageSize size = { CACHED_WIDTH, CACHED_HEIGHT };
+  GdkPixbuf *pixbuf;
+
+  pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (file, &size,
+                                                    NULL, NULL, error);
+  if (!pixbuf)
+    return FALSE;
+
+  if (data && !*(GdkPixbuf **) data)
+    *(GdkPixbuf **) data = g_object_ref (pixbuf);
+
+  g_object_unref (pixbuf);
+
+  return TRUE;
+}
+
+static gboolean
+stage_save_cached_image (GFile     *file,
+                         gpointer   data,
+                         GError   **error)
+{
+  return hd_pixbuf_utils_save (file, data, "png", NULL, error);
+}
+
+static gboolean
+stage_load_at_size (GFile     *file,
+                    gpointer   data,
+                    GError   **error)
+{
+  HDImageSize size = { CACHED_WIDTH, CACHED_HEIGHT };
+  GdkPixbuf *pixbuf;
+
+  pixbuf = hd_pixbuf_utils_load_at_size (file, &size, NULL, NULL, error);
+  if (!pixbuf)
+    return FALSE;
+
+  g_object_unref (pixbuf);
+
+  return TRUE;
+}
+
+static void
+run_stage (const gchar       *stage,
+           StageFunc          func,
+           GFile             *file,
+           gpointer           data,
+           const gchar       *format,
+           const HDImageSize *size,
+           guint              iterations)
+{
+  gint64 *times;
+  glong heap;
+  guint i;
+  GError *error = NULL;
+
+  times = g_new (gint64, iterations);
+  heap = get_heap_size ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      gint64 start = g_get_monotonic_time ();
+
+      if (!func (file, data, &error))
+        {
+          g_warning ("%s. %s failed. %s", __FUNCTION__, stage, error->message);
+          g_error_free (error);
+          g_free (times);
+          return;
+        }
+
+      times[i] = g_get_monotonic_time () - start;
+    }
+
+  qsort (times, iterations, sizeof (gint64), compare_times);
+
+  g_print ("%s\t%s\t%d\t%d\t%u\t%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT
+           "\t%ld\t%ld\n",
+           stage, format, size->width, size->height, iterations,
+           times[0], times[iterations / 2],
+           (get_heap_size () - heap) / 1024, get_peak_rss ());
+
+  g_free (times);
+}
+
+int
+main (int argc, char **argv)
+{
+  guint iterations = DEFAULT_ITERATIONS, i, j;
+  gchar *directory, *cached_filename;
+  GFile *cached_file;
+
+  if (argc > 1)
+    iterations = MAX (atoi (argv[1]), 1);
+
+  if (argc > 2)
+    directory = g_strdup (argv[2]);
+  else
+    directory = g_build_filename (g_get_tmp_dir (), "bench-backgrounds", NULL);
+  g_mkdir_with_parents (directory, 0755);
+
+  cached_filename = g_build_filename (directory, "background-1.png", NULL);
+  cached_file = g_file_new_for_path (cached_filename);
+
+  g_print ("# stage\tformat\twidth\theight\titerations\tmin-us\tmedian-us"
+           "\theap-kb\trss-kb\n");
+
+  for (i = 0; i < G_N_ELEMENTS (corpus_formats); i++)
+    for (j = 0; j < G_N_ELEMENTS (corpus_sizes); j++)
+      {
+        const HDImageSize *size = &corpus_sizes[j];
+        const gchar *format = corpus_formats[i];
+        GdkPixbuf *cached = NULL;
+        GFile *file;
+
+        file = create_test_file (directory, size, format);
+        if (!file)
+          continue;
+
+        run_stage ("load-scaled-and-cropped", stage_load_scaled_and_cropped,
+                   file, &cached, format, size, iterations);
+        if (cached)
+          {
+            run_stage ("save-cached-image", stage_save_cached_image,
+                       cached_file, cached, format, size, iterations);
+            run_stage ("load-at-size", stage_load_at_size,
+                       cached_file, NULL, format, size, iterations);
+            g_object_unref (cached);
+          }
+
+        g_object_unref (file);
+      }
+
+  g_unlink (cached_filename);
+  g_object_unref (cached_file);
+  g_free (cached_filename);
+  g_free (directory);
+
+  return 0;
+}
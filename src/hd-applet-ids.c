@@ -0,0 +1,292 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "hd-applet-ids.h"
+
+struct _HDAppletIds
+{
+  /* Ids in the items key file */
+  GHashTable *used;
+
+  /* Next instance number by basename */
+  GHashTable *next;
+};
+
+HDAppletIds *
+hd_applet_ids_new (void)
+{
+  HDAppletIds *ids;
+
+  ids = g_slice_new (HDAppletIds);
+  ids->used = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  ids->next = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  return ids;
+}
+
+void
+hd_applet_ids_free (HDAppletIds *ids)
+{
+  g_hash_table_destroy (ids->used);
+  g_hash_table_destroy (ids->next);
+  g_slice_free (HDAppletIds, ids);
+}
+
+/**
+ * hd_applet_ids_clear:
+ * @ids: a #HDAppletIds
+ *
+ * Forgets the used ids, when the items key file is reloaded.  The
+ * counters are kept so ids of applets removed meanwhile are not reused.
+ */
+void
+hd_applet_ids_clear (HDAppletIds *ids)
+{
+  g_hash_table_remove_all (ids->used);
+}
+
+/* Makes sure instance ids of @id's applet are allocated after it */
+static void
+note_instance (HDAppletIds *ids,
+               const gchar *id)
+{
+  const gchar *dash;
+  gchar *end, *basename;
+  guint index;
+
+  dash = strrchr (id, '-');
+  if (!dash || !dash[1])
+    return;
+
+  index = strtoul (dash + 1, &end, 10);
+  if (*end)
+    return;
+
+  basename = g_strndup (id, dash - id);
+  if (GPOINTER_TO_UINT (g_hash_table_lookup (ids->next, basename)) <= index)
+    g_hash_table_insert (ids->next, basename, GUINT_TO_POINTER (index + 1));
+  else
+    g_free (basename);
+}
+
+/**
+ * hd_applet_ids_add:
+ * @ids: a #HDAppletIds
+ * @id: a group of the items key file
+ *
+ * Marks @id as used.
+ */
+void
+hd_applet_ids_add (HDAppletIds *ids,
+                   const gchar *id)
+{
+  g_hash_table_insert (ids->used, g_strdup (id), GUINT_TO_POINTER (1));
+  note_instance (ids, id);
+}
+
+/**
+ * hd_applet_ids_allocate:
+ * @ids: a #HDAppletIds
+ * @basename: the basename of the applet's desktop file
+ *
+ * Returns a new unique instance id for an applet from @basename and
+ * marks it as used.
+ *
+ * Returns: the id, free with g_free()
+ */
+gchar *
+hd_applet_ids_allocate (HDAppletIds *ids,
+                        const gchar *basename)
+{
+  guint index;
+  gchar *id;
+
+  index = GPOINTER_TO_UINT (g_hash_table_lookup (ids->next, basename));
+
+  /* Only groups not written by the allocator can be in the way */
+  id = g_strdup_printf ("%s-%u", basename, index++);
+  while (g_hash_table_lookup (ids->used, id))
+    {
+      g_free (id);
+      id = g_strdup_printf ("%s-%u", basename, index++);
+    }
+
+  g_hash_table_insert (ids->next,
+                       g_strdup (basename),
+                       GUINT_TO_POINTER (index));
+  g_hash_table_insert (ids->used,
+                       g_strdup (id),
+                       GUINT_TO_POINTER (1));
+
+  return id;
+}
+
+#ifdef COMPILE_FOR_TEST
+
+static void
+test_unique (void)
+{
+  HDAppletIds *ids;
+  GHashTable *seen;
+  guint i;
+
+  ids = hd_applet_ids_new ();
+  seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (i = 0; i < 100; i++)
+    {
+      gchar *id, *expected;
+
+      id = hd_applet_ids_allocate (ids, i % 2 ? "clock.desktop" : "hello-world.desktop");
+      g_assert (!g_hash_table_lookup (seen, id));
+
+      expected = g_strdup_printf ("%s-%u",
+                                  i % 2 ? "clock.desktop" : "hello-world.desktop",
+                                  i / 2);
+      g_assert_cmpstr (id, ==, expected);
+      g_free (expected);
+
+      g_hash_table_insert (seen, id, GUINT_TO_POINTER (1));
+    }
+
+  g_hash_table_destroy (seen);
+  hd_applet_ids_free (ids);
+}
+
+static void
+test_loaded (void)
+{
+  HDAppletIds *ids;
+  gchar *id;
+
+  ids = hd_applet_ids_new ();
+
+  /* Loaded configuration, with holes and groups from older versions */
+  hd_applet_ids_add (ids, "clock.desktop-0");
+  hd_applet_ids_add (ids, "clock.desktop-5");
+  hd_applet_ids_add (ids, "clock.desktop-2");
+  hd_applet_ids_add (ids, "notes.desktop");
+  hd_applet_ids_add (ids, "notes.desktop-x");
+
+  id = hd_applet_ids_allocate (ids, "clock.desktop");
+  g_assert_cmpstr (id, ==, "clock.desktop-6");
+  g_free (id);
+
+  id = hd_applet_ids_allocate (ids, "notes.desktop");
+  g_assert_cmpstr (id, ==, "notes.desktop-0");
+  g_free (id);
+
+  /* Allocated before the configuration is stored and loaded again */
+  id = hd_applet_ids_allocate (ids, "clock.desktop");
+  g_assert_cmpstr (id, ==, "clock.desktop-7");
+  g_free (id);
+
+  hd_applet_ids_free (ids);
+}
+
+static void
+test_not_reused (void)
+{
+  HDAppletIds *ids;
+  gchar *id;
+
+  ids = hd_applet_ids_new ();
+
+  hd_applet_ids_add (ids, "clock.desktop-0");
+  g_free (hd_applet_ids_allocate (ids, "clock.desktop"));
+  g_free (hd_applet_ids_allocate (ids, "clock.desktop"));
+
+  /* clock.desktop-1 and -2 are removed, the configuration reloaded */
+  hd_applet_ids_clear (ids);
+  hd_applet_ids_add (ids, "clock.desktop-0");
+
+  id = hd_applet_ids_allocate (ids, "clock.desktop");
+  g_assert_cmpstr (id, ==, "clock.desktop-3");
+  g_free (id);
+
+  hd_applet_ids_free (ids);
+}
+
+static void
+test_benchmark (void)
+{
+  HDAppletIds *ids;
+  GHashTable *used;
+  gdouble elapsed, probing;
+  guint i, n = 2000;
+
+  /* As before the allocator, probing "%s-0", "%s-1", ... each time */
+  used = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_test_timer_start ();
+  for (i = 0; i < n; i++)
+    {
+      gchar *id;
+      guint j = 0;
+
+      do
+        {
+          id = g_strdup_printf ("%s-%u", "clock.desktop", j++);
+          if (!g_hash_table_lookup (used, id))
+            break;
+          g_free (id);
+        }
+      while (TRUE);
+
+      g_hash_table_insert (used, id, GUINT_TO_POINTER (1));
+    }
+  probing = g_test_timer_elapsed ();
+  g_hash_table_destroy (used);
+
+  ids = hd_applet_ids_new ();
+  g_test_timer_start ();
+  for (i = 0; i < n; i++)
+    g_free (hd_applet_ids_allocate (ids, "clock.desktop"));
+  elapsed = g_test_timer_elapsed ();
+  hd_applet_ids_free (ids);
+
+  g_test_message ("%u instances by probing: %.1f ms", n, probing * 1000);
+  g_test_minimized_result (elapsed * 1000,
+                           "%u instances allocated: %.1f ms", n, elapsed * 1000);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/applet-ids/unique", test_unique);
+  g_test_add_func ("/applet-ids/loaded", test_loaded);
+  g_test_add_func ("/applet-ids/not-reused", test_not_reused);
+  if (g_test_perf ())
+    g_test_add_func ("/applet-ids/benchmark", test_benchmark);
+
+  return g_test_run ();
+}
+
+#endif
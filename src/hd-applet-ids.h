@@ -0,0 +1,47 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_APPLET_IDS_H__
+#define __HD_APPLET_IDS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Instance ids of the applets in the items key file, "<basename>-<n>".
+ * A counter per basename hands out increasing @n, so allocating does not
+ * probe all existing instances and ids of removed applets are not given
+ * to new ones. */
+typedef struct _HDAppletIds HDAppletIds;
+
+HDAppletIds *hd_applet_ids_new      (void);
+void         hd_applet_ids_free     (HDAppletIds *ids);
+
+void         hd_applet_ids_clear    (HDAppletIds *ids);
+void         hd_applet_ids_add      (HDAppletIds *ids,
+                                     const gchar *id);
+gchar       *hd_applet_ids_allocate (HDAppletIds *ids,
+                                     const gchar *basename);
+
+G_END_DECLS
+
+#endif
@@ -31,11 +31,18 @@
 
 #include <X11/Xlib.h>
 
+#include <gconf/gconf-client.h>
+
 #include <string.h>
 
 #include <libhildondesktop/libhildondesktop.h>
 
+#include "hd-applet-ids.h"
 #include "hd-applet-manager.h"
+#include "hd-applet-queue.h"
+#include "hd-applet-stats.h"
+#include "hd-delayed-write.h"
+#include "hd-metrics.h"
 
 #define HD_APPLET_MANAGER_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_APPLET_MANAGER, HDAppletManagerPrivate))
@@ -47,6 +54,15 @@
 #define DESKTOP_KEY_TEXT_DOMAIN "X-Text-Domain"
 #define DESKTOP_KEY_MULTIPLE "X-Multiple"
 
+#define GCONF_CURRENT_DESKTOP_KEY "/apps/osso/hildon-desktop/views/current"
+#define GCONF_APPLET_VIEW_KEY     "/apps/osso/hildon-desktop/applets/%s/view"
+
+/* Time a single main loop iteration may spend showing throttled applets */
+#define SHOW_THROTTLED_BUDGET_US  8000
+
+/* Changes to the items key file are written at most this often */
+#define STORE_ITEMS_DELAY_MS 500
+
 struct _HDAppletManagerPrivate 
 {
   HDPluginManager *plugin_manager;
@@ -54,14 +70,20 @@ struct _HDAppletManagerPrivate
   GtkTreeModel *model;
 
   GHashTable *displayed_applets;
-  GHashTable *used_ids;
+  HDAppletIds *ids;
 
   GHashTable *installed;
 
   gboolean plugins_throttled;
-  GPtrArray *throttled_plugins;
+  HDAppletQueue *throttled_plugins;
+  gint current_view;
+
+  GConfClient *gconf_client;
 
   GKeyFile *applets_key_file;
+  HDDelayedWrite *store_items;
+
+  GHashTable *applet_stats;
 };
 
 typedef struct
@@ -85,6 +107,54 @@ hd_plugin_info_free (HDPluginInfo *info)
   g_slice_free (HDPluginInfo, info);
 }
 
+/* Only the top level applet window is instrumented, its children are
+ * accounted to it as far as they are handled from its expose */
+static gboolean
+applet_event_cb (GtkWidget     *widget,
+                 GdkEvent      *event,
+                 HDAppletStats *stats)
+{
+  hd_applet_stats_begin (stats,
+                         event->type == GDK_EXPOSE ? HD_APPLET_STATS_EXPOSE
+                                                   : HD_APPLET_STATS_EVENT);
+
+  return FALSE;
+}
+
+static void
+applet_event_after_cb (GtkWidget     *widget,
+                       GdkEvent      *event,
+                       HDAppletStats *stats)
+{
+  hd_applet_stats_end (stats);
+}
+
+/* A handler unrealizing the applet does not get to ::event-after */
+static void
+applet_unrealize_cb (GtkWidget     *widget,
+                     HDAppletStats *stats)
+{
+  hd_applet_stats_abort (stats);
+}
+
+static void
+show_applet (HDAppletManager *manager,
+             GObject         *plugin)
+{
+  HDAppletStats *stats = g_hash_table_lookup (manager->priv->applet_stats,
+                                              plugin);
+
+  if (!stats)
+    {
+      gtk_widget_show (GTK_WIDGET (plugin));
+      return;
+    }
+
+  hd_applet_stats_begin (stats, HD_APPLET_STATS_REALIZE);
+  gtk_widget_show (GTK_WIDGET (plugin));
+  hd_applet_stats_end (stats);
+}
+
 static HDPluginInfo *
 load_desktop_widget_from_desktop_file (const char *desktop_file)
 {
@@ -150,6 +220,14 @@ cleanup:
   return info;
 }
 
+static void
+write_items_key_file (HDAppletManager *manager)
+{
+  HDAppletManagerPrivate *priv = manager->priv;
+
+  hd_plugin_configuration_store_items_key_file (HD_PLUGIN_CONFIGURATION (priv->plugin_manager));
+}
+
 static void
 items_configuration_loaded_cb (HDPluginConfiguration *configuration,
                                GKeyFile              *key_file,
@@ -166,7 +244,7 @@ items_configuration_loaded_cb (HDPluginConfiguration *configuration,
 
   /* Clear displayed applets */
   g_hash_table_remove_all (priv->displayed_applets);
-  g_hash_table_remove_all (priv->used_ids);
+  hd_applet_ids_clear (priv->ids);
 
   /* Iterate over all groups and get all displayed applets */
   groups = g_key_file_get_groups (key_file, NULL);
@@ -174,9 +252,7 @@ items_configuration_loaded_cb (HDPluginConfiguration *configuration,
     {
       gchar *desktop_file;
 
-      g_hash_table_insert (priv->used_ids,
-                           g_strdup (groups[i]),
-                           GUINT_TO_POINTER (1));
+      hd_applet_ids_add (priv->ids, groups[i]);
 
       desktop_file = g_key_file_get_string (key_file,
                                             groups[i],
@@ -249,27 +325,40 @@ plugin_added_cb (HDPluginManager *pm,
 
   if (HD_IS_HOME_PLUGIN_ITEM (plugin))
     {
+      HDAppletStats *stats;
+      gchar *plugin_id;
       Display *display;
       Window root;
 
       g_signal_connect (plugin, "delete-event",
                         G_CALLBACK (delete_event_cb), manager);
 
+      hd_metrics_add (HD_METRICS_APPLETS, 1);
+
+      plugin_id = hd_plugin_item_get_plugin_id (HD_PLUGIN_ITEM (plugin));
+      stats = hd_applet_stats_new (plugin_id);
+      g_free (plugin_id);
+      g_hash_table_insert (priv->applet_stats, plugin, stats);
+
+      g_signal_connect (plugin, "event",
+                        G_CALLBACK (applet_event_cb), stats);
+      g_signal_connect (plugin, "event-after",
+                        G_CALLBACK (applet_event_after_cb), stats);
+      g_signal_connect (plugin, "unrealize",
+                        G_CALLBACK (applet_unrealize_cb), stats);
+
       /* Set widget transient for root window */
+      hd_applet_stats_begin (stats, HD_APPLET_STATS_REALIZE);
       gtk_widget_realize (GTK_WIDGET (plugin));
+      hd_applet_stats_end (stats);
       display = GDK_DISPLAY_XDISPLAY (gtk_widget_get_display (GTK_WIDGET (plugin)));
       root = RootWindow (display, GDK_SCREEN_XNUMBER (gtk_widget_get_screen (GTK_WIDGET (plugin))));
       XSetTransientForHint (display, GDK_WINDOW_XID (GTK_WIDGET (plugin)->window), root);
 
       if (priv->plugins_throttled)
-        {
-          if (!priv->throttled_plugins)
-            priv->throttled_plugins = g_ptr_array_new ();
-          g_assert (!g_ptr_array_remove (priv->throttled_plugins, plugin));
-          g_ptr_array_add (priv->throttled_plugins, plugin);
-        }
+        hd_applet_queue_push (priv->throttled_plugins, plugin);
       else
-        gtk_widget_show (GTK_WIDGET (plugin));
+        show_applet (manager, plugin);
     }
 }
 
@@ -282,9 +371,22 @@ plugin_removed_cb (HDPluginManager *pm,
 
   if (HD_IS_HOME_PLUGIN_ITEM (plugin))
     {
+      HDAppletStats *stats;
+
+      hd_metrics_add (HD_METRICS_APPLETS, -1);
+
+      stats = g_hash_table_lookup (priv->applet_stats, plugin);
+      if (stats)
+        {
+          g_signal_handlers_disconnect_matched (plugin,
+                                                G_SIGNAL_MATCH_DATA,
+                                                0, 0, NULL, NULL,
+                                                stats);
+          g_hash_table_remove (priv->applet_stats, plugin);
+        }
+
       gtk_widget_destroy (GTK_WIDGET (plugin));
-      if (priv->throttled_plugins)
-        g_ptr_array_remove (priv->throttled_plugins, plugin);
+      hd_applet_queue_remove (priv->throttled_plugins, plugin);
     }
 }
 
@@ -357,7 +459,7 @@ plugin_module_removed_cb (HDPluginConfiguration *pc,
   g_strfreev (groups);
 
   if (changed)
-    hd_plugin_configuration_store_items_key_file (HD_PLUGIN_CONFIGURATION (priv->plugin_manager));
+    hd_delayed_write_schedule (priv->store_items);
 }
 
 static gboolean
@@ -369,6 +471,38 @@ run_idle (gpointer data)
   return FALSE;
 }
 
+static gboolean
+plugin_on_current_view (GObject         *plugin,
+                        HDAppletManager *manager)
+{
+  HDAppletManagerPrivate *priv = manager->priv;
+  gchar *plugin_id, *key;
+  gint view;
+
+  plugin_id = hd_plugin_item_get_plugin_id (HD_PLUGIN_ITEM (plugin));
+  key = g_strdup_printf (GCONF_APPLET_VIEW_KEY, plugin_id);
+
+  view = gconf_client_get_int (priv->gconf_client, key, NULL);
+
+  g_free (key);
+  g_free (plugin_id);
+
+  return view == priv->current_view;
+}
+
+static void
+show_throttled_applet (GObject         *plugin,
+                       HDAppletManager *manager)
+{
+  show_applet (manager, plugin);
+}
+
+static gint
+throttled_applets_gauge (HDAppletManagerPrivate *priv)
+{
+  return priv->throttled_plugins ? hd_applet_queue_get_length (priv->throttled_plugins) : 0;
+}
+
 static void
 hd_applet_manager_init (HDAppletManager *manager)
 {
@@ -378,8 +512,21 @@ hd_applet_manager_init (HDAppletManager *manager)
 
   priv->plugin_manager = hd_plugin_manager_new (hd_config_file_new_with_defaults ("home.conf"));
 
+  priv->gconf_client = gconf_client_get_default ();
+
+  priv->store_items = hd_delayed_write_new (STORE_ITEMS_DELAY_MS,
+                                            (HDDelayedWriteFunc) write_items_key_file,
+                                            manager);
+
+  priv->throttled_plugins = hd_applet_queue_new (SHOW_THROTTLED_BUDGET_US,
+                                                 (HDAppletQueueShowFunc) show_throttled_applet,
+                                                 (HDAppletQueueFilterFunc) plugin_on_current_view,
+                                                 manager);
+
   priv->displayed_applets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  priv->used_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  priv->ids = hd_applet_ids_new ();
+  priv->applet_stats = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                              NULL, (GDestroyNotify) hd_applet_stats_free);
   priv->installed = g_hash_table_new_full (g_str_hash, g_str_equal,
                                            g_free, (GDestroyNotify) hd_plugin_info_free);
 
@@ -399,6 +546,10 @@ hd_applet_manager_init (HDAppletManager *manager)
   g_signal_connect (priv->plugin_manager, "plugin-module-removed",
                     G_CALLBACK (plugin_module_removed_cb), manager);
 
+  hd_metrics_set_gauge_func (HD_METRICS_THROTTLED_APPLETS,
+                             (HDMetricsGaugeFunc) throttled_applets_gauge,
+                             priv);
+
   gdk_threads_add_idle (run_idle, priv->plugin_manager);
 }
 
@@ -407,12 +558,24 @@ hd_applet_manager_dispose (GObject *object)
 {
   HDAppletManagerPrivate *priv = HD_APPLET_MANAGER (object)->priv;
 
+  hd_metrics_set_gauge_func (HD_METRICS_THROTTLED_APPLETS, NULL, NULL);
+
+  /* Writes pending changes */
+  if (priv->store_items)
+    priv->store_items = (hd_delayed_write_free (priv->store_items), NULL);
+
+  if (priv->throttled_plugins)
+    priv->throttled_plugins = (hd_applet_queue_free (priv->throttled_plugins), NULL);
+
   if (priv->plugin_manager)
     priv->plugin_manager = (g_object_unref (priv->plugin_manager), NULL);
 
   if (priv->model)
     priv->model = (g_object_unref (priv->model), NULL);
 
+  if (priv->gconf_client)
+    priv->gconf_client = (g_object_unref (priv->gconf_client), NULL);
+
   G_OBJECT_CLASS (hd_applet_manager_parent_class)->dispose (object);
 }
 
@@ -424,8 +587,11 @@ hd_applet_manager_finalize (GObject *object)
   if (priv->displayed_applets)
     priv->displayed_applets = (g_hash_table_destroy (priv->displayed_applets), NULL);
 
-  if (priv->used_ids)
-    priv->used_ids = (g_hash_table_destroy (priv->used_ids), NULL);
+  if (priv->ids)
+    priv->ids = (hd_applet_ids_free (priv->ids), NULL);
+
+  if (priv->applet_stats)
+    priv->applet_stats = (g_hash_table_destroy (priv->applet_stats), NULL);
 
   if (priv->installed)
     priv->installed = (g_hash_table_destroy (priv->installed), NULL);
@@ -531,14 +697,9 @@ hd_applet_manager_install_applet_from_desktop_file (HDAppletManager *manager,
 {
   HDAppletManagerPrivate *priv = manager->priv;
   gchar *basename, *id;
-  guint i = 0;
 
   basename = g_path_get_basename (desktop_file);
-
-  /* Find unique id */
-  do
-    id = g_strdup_printf ("%s-%u", basename, i++);
-  while (g_hash_table_lookup (priv->used_ids, id));
+  id = hd_applet_ids_allocate (priv->ids, basename);
 
   g_key_file_set_string (priv->applets_key_file,
                          id,
@@ -548,8 +709,7 @@ hd_applet_manager_install_applet_from_desktop_file (HDAppletManager *manager,
   g_free (basename);
   g_free (id);
 
-  /* Store file atomically */
-  hd_plugin_configuration_store_items_key_file (HD_PLUGIN_CONFIGURATION (priv->plugin_manager));
+  hd_delayed_write_schedule (priv->store_items);
 }
 
 void
@@ -561,10 +721,7 @@ hd_applet_manager_remove_applet (HDAppletManager *manager,
   if (g_key_file_remove_group (priv->applets_key_file,
                                plugin_id,
                                NULL))
-    {
-      /* Store file atomically */
-      hd_plugin_configuration_store_items_key_file (HD_PLUGIN_CONFIGURATION (priv->plugin_manager));
-    }
+    hd_delayed_write_schedule (priv->store_items);
 }
 
 void
@@ -573,11 +730,39 @@ hd_applet_manager_throttled (HDAppletManager *manager, gboolean throttled)
   HDAppletManagerPrivate *priv = manager->priv;
 
   if ((priv->plugins_throttled = throttled) != FALSE)
-    return;
-  if (!priv->throttled_plugins)
-    return;
+    {
+      hd_applet_queue_stop (priv->throttled_plugins);
+      return;
+    }
+
+  priv->current_view = gconf_client_get_int (priv->gconf_client,
+                                             GCONF_CURRENT_DESKTOP_KEY,
+                                             NULL);
+
+  hd_applet_queue_start (priv->throttled_plugins);
+}
+
+/* Returns a new map of applet instance ids to a{sv} maps of their
+ * accounting, suitable to be sent as a{sa{sv}}.  See
+ * hd_applet_stats_collect (). */
+GHashTable *
+hd_applet_manager_collect_stats (HDAppletManager *manager)
+{
+  HDAppletManagerPrivate *priv = manager->priv;
+  GHashTable *applets;
+  GHashTableIter iter;
+  gpointer value;
+
+  applets = g_hash_table_new_full (g_str_hash,
+                                   g_str_equal,
+                                   NULL,
+                                   (GDestroyNotify) g_hash_table_destroy);
+
+  g_hash_table_iter_init (&iter, priv->applet_stats);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_hash_table_insert (applets,
+                         (gpointer) hd_applet_stats_get_plugin_id (value),
+                         hd_applet_stats_collect (value));
 
-  g_ptr_array_foreach (priv->throttled_plugins, (GFunc)gtk_widget_show, NULL);
-  g_ptr_array_free (priv->throttled_plugins, TRUE);
-  priv->throttled_plugins = NULL;
+  return applets;
 }
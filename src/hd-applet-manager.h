@@ -58,6 +58,8 @@ void       hd_applet_manager_remove_applet  (HDAppletManager *manager,
 void       hd_applet_manager_throttled      (HDAppletManager *manager,
                                              gboolean         throttled);
 
+GHashTable *hd_applet_manager_collect_stats (HDAppletManager *manager);
+
 G_END_DECLS
 
 #endif /* __HD_APPLET_MANAGER_H__ */
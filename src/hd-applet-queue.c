@@ -0,0 +1,506 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gdk/gdk.h>
+
+#include "hd-applet-queue.h"
+#include "hd-trace.h"
+
+/* Applets of the current view are shown right after each redraw, the
+ * others only when nothing else is pending */
+#define CURRENT_VIEW_PRIORITY (G_PRIORITY_HIGH_IDLE + 30)
+#define OTHER_VIEWS_PRIORITY  G_PRIORITY_DEFAULT_IDLE
+
+struct _HDAppletQueue
+{
+  gint64                   budget;
+  HDAppletQueueShowFunc    show;
+  HDAppletQueueFilterFunc  on_current_view;
+  gpointer                 data;
+
+  /* The applets of the current view are the first @n_current */
+  GPtrArray               *applets;
+  guint                    n_current;
+
+  guint                    idle_id;
+  gint                     priority;
+};
+
+HDAppletQueue *
+hd_applet_queue_new (gint64                   budget,
+                     HDAppletQueueShowFunc    show,
+                     HDAppletQueueFilterFunc  on_current_view,
+                     gpointer                 data)
+{
+  HDAppletQueue *queue;
+
+  queue = g_slice_new0 (HDAppletQueue);
+  queue->budget = budget;
+  queue->show = show;
+  queue->on_current_view = on_current_view;
+  queue->data = data;
+  queue->applets = g_ptr_array_new ();
+
+  return queue;
+}
+
+void
+hd_applet_queue_free (HDAppletQueue *queue)
+{
+  hd_applet_queue_stop (queue);
+  g_ptr_array_free (queue->applets, TRUE);
+  g_slice_free (HDAppletQueue, queue);
+}
+
+void
+hd_applet_queue_push (HDAppletQueue *queue,
+                      gpointer       applet)
+{
+  g_ptr_array_add (queue->applets, applet);
+}
+
+void
+hd_applet_queue_remove (HDAppletQueue *queue,
+                        gpointer       applet)
+{
+  guint i;
+
+  for (i = 0; i < queue->applets->len; i++)
+    if (g_ptr_array_index (queue->applets, i) == applet)
+      {
+        g_ptr_array_remove_index (queue->applets, i);
+        if (i < queue->n_current)
+          queue->n_current--;
+        return;
+      }
+}
+
+guint
+hd_applet_queue_get_length (HDAppletQueue *queue)
+{
+  return queue->applets->len;
+}
+
+static gboolean show_idle (HDAppletQueue *queue);
+
+static void
+schedule (HDAppletQueue *queue,
+          gint           priority)
+{
+  queue->priority = priority;
+  queue->idle_id = gdk_threads_add_idle_full (priority,
+                                              (GSourceFunc) show_idle,
+                                              queue,
+                                              NULL);
+}
+
+/* Shows queued applets until the budget of this iteration is used up.
+ * Showing realizes and maps the applet which makes it draw itself, so
+ * doing all of them at once would stall the main loop for a long time. */
+static gboolean
+show_idle (HDAppletQueue *queue)
+{
+  gint64 start;
+
+  HD_TRACE_BEGIN ("show-throttled-applets");
+
+  start = g_get_monotonic_time ();
+  while (queue->applets->len > 0)
+    {
+      gpointer applet;
+
+      /* Let the current view be drawn before going on with the others */
+      if (queue->n_current == 0 && queue->priority == CURRENT_VIEW_PRIORITY)
+        {
+          HD_TRACE_END ("show-throttled-applets");
+          schedule (queue, OTHER_VIEWS_PRIORITY);
+          return FALSE;
+        }
+
+      applet = g_ptr_array_remove_index (queue->applets, 0);
+      if (queue->n_current > 0)
+        queue->n_current--;
+
+      queue->show (applet, queue->data);
+
+      if (g_get_monotonic_time () - start >= queue->budget)
+        break;
+    }
+
+  HD_TRACE_END ("show-throttled-applets");
+
+  if (queue->applets->len == 0)
+    {
+      queue->idle_id = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * hd_applet_queue_start:
+ * @queue: a #HDAppletQueue
+ *
+ * Starts showing the queued applets, the applets of the current view
+ * first.  Does nothing if they are already being shown.
+ */
+void
+hd_applet_queue_start (HDAppletQueue *queue)
+{
+  GPtrArray *others;
+  guint i;
+
+  if (queue->idle_id || queue->applets->len == 0)
+    return;
+
+  /* Move the applets of the current view first, keeping the order */
+  others = g_ptr_array_new ();
+  for (i = 0; i < queue->applets->len;)
+    {
+      gpointer applet = g_ptr_array_index (queue->applets, i);
+
+      if (queue->on_current_view (applet, queue->data))
+        i++;
+      else
+        g_ptr_array_add (others, g_ptr_array_remove_index (queue->applets, i));
+    }
+  queue->n_current = queue->applets->len;
+  for (i = 0; i < others->len; i++)
+    g_ptr_array_add (queue->applets, g_ptr_array_index (others, i));
+  g_ptr_array_free (others, TRUE);
+
+  schedule (queue,
+            queue->n_current > 0 ? CURRENT_VIEW_PRIORITY
+                                 : OTHER_VIEWS_PRIORITY);
+}
+
+/**
+ * hd_applet_queue_stop:
+ * @queue: a #HDAppletQueue
+ *
+ * Stops showing the queued applets, they stay queued.
+ */
+void
+hd_applet_queue_stop (HDAppletQueue *queue)
+{
+  if (queue->idle_id)
+    queue->idle_id = (g_source_remove (queue->idle_id), 0);
+}
+
+#ifdef COMPILE_FOR_TEST
+
+#define TEST_BUDGET 8000
+
+/* A synthetic applet taking @cost us to show itself */
+typedef struct
+{
+  gint   view;
+  gint64 cost;
+  gint64 shown_at;
+} TestApplet;
+
+static gint test_current_view;
+static GString *test_order;
+static gint64 test_start;
+
+static void
+test_show (TestApplet *applet,
+           TestApplet *applets)
+{
+  gint64 end = g_get_monotonic_time () + applet->cost;
+
+  while (g_get_monotonic_time () < end)
+    ;
+
+  applet->shown_at = g_get_monotonic_time () - test_start;
+  g_string_append_c (test_order, 'a' + (applet - applets));
+}
+
+static gboolean
+test_on_current_view (TestApplet *applet,
+                      TestApplet *applets)
+{
+  return applet->view == test_current_view;
+}
+
+static HDAppletQueue *
+test_queue_new (gint64      budget,
+                TestApplet *applets,
+                guint       n_applets)
+{
+  HDAppletQueue *queue;
+  guint i;
+
+  queue = hd_applet_queue_new (budget,
+                               (HDAppletQueueShowFunc) test_show,
+                               (HDAppletQueueFilterFunc) test_on_current_view,
+                               applets);
+  for (i = 0; i < n_applets; i++)
+    hd_applet_queue_push (queue, &applets[i]);
+
+  g_string_truncate (test_order, 0);
+
+  return queue;
+}
+
+/* Input, a timeout dispatched as soon as the main loop gets to it */
+typedef struct
+{
+  gint64 last;
+  gint64 max_stall;
+  guint  dispatches;
+} TestInput;
+
+static gboolean
+test_input (TestInput *input)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  input->max_stall = MAX (input->max_stall, now - input->last);
+  input->last = now;
+  input->dispatches++;
+
+  return TRUE;
+}
+
+/* Runs the main loop until @queue is empty, returns the longest time
+ * input waited and the time until all applets were shown in @total */
+static gint64
+drain (HDAppletQueue *queue,
+       gint64        *total)
+{
+  TestInput input = { 0, 0, 0 };
+  guint id;
+
+  test_start = input.last = g_get_monotonic_time ();
+  id = g_timeout_add (1, (GSourceFunc) test_input, &input);
+
+  hd_applet_queue_start (queue);
+  while (hd_applet_queue_get_length (queue) > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (total)
+    *total = g_get_monotonic_time () - test_start;
+
+  /* The input waiting for the last batch */
+  g_main_context_iteration (NULL, TRUE);
+  g_source_remove (id);
+
+  return input.max_stall;
+}
+
+/* Applets of the current view come first, each group in queued order */
+static void
+test_order_by_view (void)
+{
+  TestApplet applets[] = { { 1 }, { 0 }, { 1 }, { 2 }, { 0 }, { 1 } };
+  HDAppletQueue *queue;
+
+  test_current_view = 1;
+  queue = test_queue_new (TEST_BUDGET, applets, G_N_ELEMENTS (applets));
+  drain (queue, NULL);
+  g_assert_cmpstr (test_order->str, ==, "acfbde");
+  hd_applet_queue_free (queue);
+
+  /* None on the current view */
+  test_current_view = 3;
+  queue = test_queue_new (TEST_BUDGET, applets, G_N_ELEMENTS (applets));
+  drain (queue, NULL);
+  g_assert_cmpstr (test_order->str, ==, "abcdef");
+  hd_applet_queue_free (queue);
+}
+
+/* No batch runs much longer than the budget, input is handled between
+ * the batches */
+static void
+test_budget (void)
+{
+  TestApplet applets[20];
+  HDAppletQueue *queue;
+  gint64 stall;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (applets); i++)
+    {
+      applets[i].view = i % 2;
+      applets[i].cost = 3000;
+    }
+
+  test_current_view = 0;
+  queue = test_queue_new (TEST_BUDGET, applets, G_N_ELEMENTS (applets));
+  stall = drain (queue, NULL);
+  g_assert_cmpuint (test_order->len, ==, G_N_ELEMENTS (applets));
+
+  /* A batch ends with the applet which overran the budget, the slack
+   * is for a loaded machine */
+  g_assert_cmpint (stall, <, TEST_BUDGET + 2 * 3000 + 10000);
+
+  hd_applet_queue_free (queue);
+}
+
+/* A stopped queue shows nothing until started again, removed applets
+ * are not shown */
+static void
+test_stop (void)
+{
+  TestApplet applets[] = { { 0 }, { 1 }, { 0 }, { 1 }, { 0 }, { 1 } };
+  HDAppletQueue *queue;
+  gint64 end;
+
+  test_current_view = 0;
+
+  /* One applet per batch */
+  queue = test_queue_new (0, applets, G_N_ELEMENTS (applets));
+  hd_applet_queue_start (queue);
+  g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (test_order->str, ==, "a");
+
+  hd_applet_queue_stop (queue);
+  end = g_get_monotonic_time () + 20000;
+  while (g_get_monotonic_time () < end)
+    g_main_context_iteration (NULL, FALSE);
+  g_assert_cmpstr (test_order->str, ==, "a");
+  g_assert_cmpuint (hd_applet_queue_get_length (queue), ==, 5);
+
+  hd_applet_queue_remove (queue, &applets[2]);
+  hd_applet_queue_remove (queue, &applets[3]);
+  drain (queue, NULL);
+  g_assert_cmpstr (test_order->str, ==, "aebf");
+
+  hd_applet_queue_free (queue);
+}
+
+/* Shows all @applets from one idle, as they were before the queue */
+typedef struct
+{
+  TestApplet *applets;
+  guint       n_applets;
+  gboolean    done;
+} TestAtOnce;
+
+static gboolean
+test_show_at_once (TestAtOnce *at_once)
+{
+  guint i;
+
+  for (i = 0; i < at_once->n_applets; i++)
+    test_show (&at_once->applets[i], at_once->applets);
+  at_once->done = TRUE;
+
+  return FALSE;
+}
+
+static gint64
+drain_at_once (TestApplet *applets,
+               guint       n_applets,
+               gint64     *total)
+{
+  TestAtOnce at_once = { applets, n_applets, FALSE };
+  TestInput input = { 0, 0, 0 };
+  guint id;
+
+  test_start = input.last = g_get_monotonic_time ();
+  id = g_timeout_add (1, (GSourceFunc) test_input, &input);
+
+  g_idle_add ((GSourceFunc) test_show_at_once, &at_once);
+  while (!at_once.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  *total = g_get_monotonic_time () - test_start;
+
+  g_main_context_iteration (NULL, TRUE);
+  g_source_remove (id);
+
+  return input.max_stall;
+}
+
+/* Synthetic applets taking 20 ms to show, 10 of them on the current
+ * view.  Reports the longest main loop stall and the time until the
+ * current view and all views are complete, also for showing them all
+ * in one go as before. */
+static void
+test_benchmark (void)
+{
+  TestApplet applets[30];
+  guint i, j;
+
+  test_current_view = 0;
+
+  for (i = 0; i < 2; i++)
+    {
+      gint64 stall, total, current = 0;
+
+      for (j = 0; j < G_N_ELEMENTS (applets); j++)
+        {
+          applets[j].view = j % 3;
+          applets[j].cost = 20000;
+        }
+
+      if (i == 0)
+        {
+          HDAppletQueue *queue;
+
+          queue = test_queue_new (TEST_BUDGET,
+                                  applets, G_N_ELEMENTS (applets));
+          stall = drain (queue, &total);
+          hd_applet_queue_free (queue);
+        }
+      else
+        stall = drain_at_once (applets, G_N_ELEMENTS (applets), &total);
+
+      for (j = 0; j < G_N_ELEMENTS (applets); j++)
+        if (applets[j].view == test_current_view)
+          current = MAX (current, applets[j].shown_at);
+
+      g_test_message ("%s: longest stall %.1f ms, current view after "
+                      "%.1f ms, all views after %.1f ms",
+                      i == 0 ? "queued" : "in one go",
+                      stall / 1e3, current / 1e3, total / 1e3);
+      if (i == 0)
+        g_test_minimized_result (stall / 1e6,
+                                 "longest stall showing 30 applets of 20 ms: "
+                                 "%.1f ms", stall / 1e3);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  test_order = g_string_new (NULL);
+
+  g_test_add_func ("/applet-queue/order", test_order_by_view);
+  g_test_add_func ("/applet-queue/budget", test_budget);
+  g_test_add_func ("/applet-queue/stop", test_stop);
+  if (g_test_perf ())
+    g_test_add_func ("/applet-queue/benchmark", test_benchmark);
+
+  return g_test_run ();
+}
+
+#endif
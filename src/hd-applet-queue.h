@@ -0,0 +1,65 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_APPLET_QUEUE_H__
+#define __HD_APPLET_QUEUE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HDAppletQueue HDAppletQueue;
+
+typedef gboolean (*HDAppletQueueFilterFunc) (gpointer applet,
+                                             gpointer data);
+typedef void     (*HDAppletQueueShowFunc)   (gpointer applet,
+                                             gpointer data);
+
+/** HDAppletQueue:
+ *
+ * Applets whose showing was deferred during startup.  Once started,
+ * the queue shows them from idles in the main loop, spending at most
+ * about @budget microseconds in each iteration so input and redraws
+ * are handled in between.
+ *
+ * Applets for which @on_current_view returns %TRUE are shown first,
+ * each batch right after the redraws.  The others follow when nothing
+ * else is pending.  Within both groups the queued order is kept.
+ */
+HDAppletQueue *hd_applet_queue_new        (gint64                   budget,
+                                           HDAppletQueueShowFunc    show,
+                                           HDAppletQueueFilterFunc  on_current_view,
+                                           gpointer                 data);
+void           hd_applet_queue_free       (HDAppletQueue           *queue);
+
+void           hd_applet_queue_push       (HDAppletQueue           *queue,
+                                           gpointer                 applet);
+void           hd_applet_queue_remove     (HDAppletQueue           *queue,
+                                           gpointer                 applet);
+guint          hd_applet_queue_get_length (HDAppletQueue           *queue);
+
+void           hd_applet_queue_start      (HDAppletQueue           *queue);
+void           hd_applet_queue_stop       (HDAppletQueue           *queue);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,510 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <malloc.h>
+#include <string.h>
+
+#include <glib-object.h>
+
+#include "hd-applet-stats.h"
+#include "hd-metrics.h"
+
+struct _HDAppletStats
+{
+  gchar              *plugin_id;
+
+  gint64              realize_time;
+  gint64              expose_time;
+  guint               exposes;
+  gint64              event_time;
+  guint               events;
+  gint64              max_time;
+  gint64              heap_growth;
+
+  /* The phase being measured */
+  guint               depth;
+  HDAppletStatsPhase  phase;
+  gint64              start;
+  gint64              start_heap;
+  gboolean            warned;
+};
+
+HDAppletStats *
+hd_applet_stats_new (const gchar *plugin_id)
+{
+  HDAppletStats *stats;
+
+  stats = g_slice_new0 (HDAppletStats);
+  stats->plugin_id = g_strdup (plugin_id);
+
+  return stats;
+}
+
+void
+hd_applet_stats_free (HDAppletStats *stats)
+{
+  g_free (stats->plugin_id);
+  g_slice_free (HDAppletStats, stats);
+}
+
+const gchar *
+hd_applet_stats_get_plugin_id (HDAppletStats *stats)
+{
+  return stats->plugin_id;
+}
+
+/* Heap in use including mmap ()ed blocks.  mallinfo () is too slow to
+ * be called for every event so it is only sampled around realizing
+ * and exposes. */
+static gint64
+heap_in_use (void)
+{
+#ifdef HAVE_MALLINFO2
+  struct mallinfo2 info = mallinfo2 ();
+#else
+  struct mallinfo info = mallinfo ();
+#endif
+
+  return (gint64) info.uordblks + info.hblkhd;
+}
+
+static gboolean
+samples_heap (HDAppletStatsPhase phase)
+{
+  return phase != HD_APPLET_STATS_EVENT;
+}
+
+/**
+ * hd_applet_stats_begin:
+ * @stats: a #HDAppletStats
+ * @phase: what the applet is about to do
+ *
+ * Starts measuring the applet.  Nested calls, like an expose handled
+ * from an event handler, are accounted to the outermost phase.
+ */
+void
+hd_applet_stats_begin (HDAppletStats      *stats,
+                       HDAppletStatsPhase  phase)
+{
+  if (stats->depth++)
+    return;
+
+  stats->phase = phase;
+  stats->start = g_get_monotonic_time ();
+  stats->start_heap = samples_heap (phase) ? heap_in_use () : 0;
+}
+
+/**
+ * hd_applet_stats_end:
+ * @stats: a #HDAppletStats
+ *
+ * Accounts the time spent since the matching hd_applet_stats_begin ().
+ * Applets over budget are counted as slow and reported the first time.
+ */
+void
+hd_applet_stats_end (HDAppletStats *stats)
+{
+  const gchar *what;
+  gint64 elapsed, budget;
+
+  /* An earlier ::event handler may have stopped the emission */
+  if (!stats->depth || --stats->depth)
+    return;
+
+  elapsed = g_get_monotonic_time () - stats->start;
+  if (samples_heap (stats->phase))
+    stats->heap_growth += heap_in_use () - stats->start_heap;
+  stats->max_time = MAX (stats->max_time, elapsed);
+
+  switch (stats->phase)
+    {
+    case HD_APPLET_STATS_REALIZE:
+      stats->realize_time += elapsed;
+      budget = HD_APPLET_STATS_SLOW_REALIZE_US;
+      what = "realize";
+      break;
+    case HD_APPLET_STATS_EXPOSE:
+      stats->expose_time += elapsed;
+      stats->exposes++;
+      budget = HD_APPLET_STATS_SLOW_HANDLER_US;
+      what = "expose";
+      break;
+    default:
+      stats->event_time += elapsed;
+      stats->events++;
+      budget = HD_APPLET_STATS_SLOW_HANDLER_US;
+      what = "an event handler";
+      break;
+    }
+
+  if (elapsed > budget)
+    {
+      hd_metrics_add (HD_METRICS_SLOW_APPLET_HANDLERS, 1);
+
+      if (!stats->warned)
+        {
+          stats->warned = TRUE;
+          g_warning ("%s. Applet %s spent %" G_GINT64_FORMAT " ms in %s.",
+                     __FUNCTION__,
+                     stats->plugin_id,
+                     elapsed / 1000,
+                     what);
+        }
+    }
+}
+
+/**
+ * hd_applet_stats_abort:
+ * @stats: a #HDAppletStats
+ *
+ * Drops the phase being measured without accounting it.  An applet
+ * unrealized from one of its handlers gets no matching
+ * hd_applet_stats_end (), and every later phase would be taken as
+ * nested in the stale one.
+ */
+void
+hd_applet_stats_abort (HDAppletStats *stats)
+{
+  stats->depth = 0;
+}
+
+static void
+value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_slice_free (GValue, value);
+}
+
+static void
+insert_int64 (GHashTable  *map,
+              const gchar *name,
+              gint64       number)
+{
+  GValue *value = g_slice_new0 (GValue);
+
+  g_value_init (value, G_TYPE_INT64);
+  g_value_set_int64 (value, number);
+  g_hash_table_insert (map, (gpointer) name, value);
+}
+
+/**
+ * hd_applet_stats_collect:
+ * @stats: a #HDAppletStats
+ *
+ * Returns a new map of the accounting, suitable to be sent as a{sv}.
+ * Times are in microseconds, "heap-growth" is in bytes and may be
+ * negative.
+ *
+ * Returns: the map, free with g_hash_table_destroy()
+ */
+GHashTable *
+hd_applet_stats_collect (HDAppletStats *stats)
+{
+  GHashTable *map;
+
+  map = g_hash_table_new_full (g_str_hash,
+                               g_str_equal,
+                               NULL,
+                               (GDestroyNotify) value_free);
+
+  insert_int64 (map, "realize-time", stats->realize_time);
+  insert_int64 (map, "expose-time", stats->expose_time);
+  insert_int64 (map, "exposes", stats->exposes);
+  insert_int64 (map, "event-time", stats->event_time);
+  insert_int64 (map, "events", stats->events);
+  insert_int64 (map, "max-time", stats->max_time);
+  insert_int64 (map, "heap-growth", stats->heap_growth);
+
+  return map;
+}
+
+#ifdef COMPILE_FOR_TEST
+
+/* Reads a counter of the linked hd-metrics */
+static gint
+test_counter (const gchar *name)
+{
+  GHashTable *metrics = hd_metrics_collect ();
+  gint value;
+
+  value = g_value_get_int (g_hash_table_lookup (metrics, name));
+  g_hash_table_destroy (metrics);
+
+  return value;
+}
+
+#define TEST_BLOCK_SIZE 16384
+
+/* A fake applet burning a known amount of CPU in its handlers, the
+ * way the applet manager instruments it */
+typedef struct
+{
+  HDAppletStats *stats;
+  GSList        *blocks;
+} TestApplet;
+
+static void
+burn (gint64 usec)
+{
+  gint64 end = g_get_monotonic_time () + usec;
+
+  while (g_get_monotonic_time () < end)
+    ;
+}
+
+static void
+test_applet_init (TestApplet  *applet,
+                  const gchar *plugin_id,
+                  gint64       realize_cost)
+{
+  applet->stats = hd_applet_stats_new (plugin_id);
+  applet->blocks = NULL;
+
+  hd_applet_stats_begin (applet->stats, HD_APPLET_STATS_REALIZE);
+  burn (realize_cost);
+  hd_applet_stats_end (applet->stats);
+}
+
+static void
+test_applet_clear (TestApplet *applet)
+{
+  g_slist_foreach (applet->blocks, (GFunc) g_free, NULL);
+  g_slist_free (applet->blocks);
+  hd_applet_stats_free (applet->stats);
+}
+
+/* Keeps @n_blocks more blocks allocated, or frees them if negative */
+static void
+test_applet_expose (TestApplet *applet,
+                    gint64      cost,
+                    gint        n_blocks)
+{
+  hd_applet_stats_begin (applet->stats, HD_APPLET_STATS_EXPOSE);
+  burn (cost);
+  for (; n_blocks > 0; n_blocks--)
+    {
+      gchar *block = g_malloc (TEST_BLOCK_SIZE);
+
+      memset (block, 1, TEST_BLOCK_SIZE);
+      applet->blocks = g_slist_prepend (applet->blocks, block);
+    }
+  for (; n_blocks < 0 && applet->blocks; n_blocks++)
+    {
+      g_free (applet->blocks->data);
+      applet->blocks = g_slist_delete_link (applet->blocks, applet->blocks);
+    }
+  hd_applet_stats_end (applet->stats);
+}
+
+static void
+test_applet_event (TestApplet *applet,
+                   gint64      cost,
+                   gboolean    expose)
+{
+  hd_applet_stats_begin (applet->stats, HD_APPLET_STATS_EVENT);
+  burn (cost);
+  /* Like gdk_window_process_updates () from a button press */
+  if (expose)
+    test_applet_expose (applet, cost, 0);
+  hd_applet_stats_end (applet->stats);
+}
+
+static gint64
+test_lookup (HDAppletStats *stats,
+             const gchar   *name)
+{
+  GHashTable *map;
+  GValue *value;
+  gint64 number;
+
+  map = hd_applet_stats_collect (stats);
+  value = g_hash_table_lookup (map, name);
+  g_assert (value != NULL);
+  number = g_value_get_int64 (value);
+  g_hash_table_destroy (map);
+
+  return number;
+}
+
+/* Times are wall clock time, allow for being scheduled out */
+#define assert_time(stats, name, usec) G_STMT_START {      \
+    gint64 __t = test_lookup ((stats), (name));            \
+    g_assert_cmpint (__t, >=, (usec));                     \
+    g_assert_cmpint (__t, <, (usec) * 3 / 2 + 5000);       \
+  } G_STMT_END
+
+static void
+test_accounting (void)
+{
+  TestApplet busy, idle;
+  gint slow = test_counter ("slow-applet-handlers");
+  guint i;
+
+  test_applet_init (&busy, "busy.desktop-0", 20000);
+  test_applet_init (&idle, "idle.desktop-0", 0);
+
+  for (i = 0; i < 5; i++)
+    {
+      test_applet_expose (&busy, 4000, 0);
+      test_applet_expose (&idle, 0, 0);
+    }
+  for (i = 0; i < 10; i++)
+    test_applet_event (&busy, 1000, FALSE);
+
+  assert_time (busy.stats, "realize-time", 20000);
+  assert_time (busy.stats, "expose-time", 20000);
+  assert_time (busy.stats, "event-time", 10000);
+  assert_time (busy.stats, "max-time", 20000);
+  g_assert_cmpint (test_lookup (busy.stats, "exposes"), ==, 5);
+  g_assert_cmpint (test_lookup (busy.stats, "events"), ==, 10);
+
+  /* Nothing of the busy applet is accounted to the other */
+  g_assert_cmpint (test_lookup (idle.stats, "expose-time"), <, 5000);
+  g_assert_cmpint (test_lookup (idle.stats, "exposes"), ==, 5);
+  g_assert_cmpint (test_lookup (idle.stats, "events"), ==, 0);
+
+  g_assert_cmpint (test_counter ("slow-applet-handlers"), ==, slow);
+
+  test_applet_clear (&busy);
+  test_applet_clear (&idle);
+}
+
+static void
+test_nested (void)
+{
+  TestApplet applet;
+
+  test_applet_init (&applet, "clock.desktop-0", 0);
+
+  test_applet_event (&applet, 5000, TRUE);
+  assert_time (applet.stats, "event-time", 10000);
+  g_assert_cmpint (test_lookup (applet.stats, "events"), ==, 1);
+  g_assert_cmpint (test_lookup (applet.stats, "exposes"), ==, 0);
+
+  /* An end without a begin, the emission was stopped */
+  hd_applet_stats_end (applet.stats);
+  test_applet_expose (&applet, 0, 0);
+  g_assert_cmpint (test_lookup (applet.stats, "exposes"), ==, 1);
+
+  test_applet_clear (&applet);
+}
+
+/* The handler never ends when the applet is unrealized from it */
+static void
+test_abort (void)
+{
+  TestApplet applet;
+
+  test_applet_init (&applet, "clock.desktop-0", 0);
+
+  hd_applet_stats_begin (applet.stats, HD_APPLET_STATS_EVENT);
+  hd_applet_stats_abort (applet.stats);
+  g_assert_cmpint (test_lookup (applet.stats, "events"), ==, 0);
+
+  /* Not nested in the dropped event */
+  test_applet_expose (&applet, 0, 0);
+  test_applet_event (&applet, 0, FALSE);
+  g_assert_cmpint (test_lookup (applet.stats, "exposes"), ==, 1);
+  g_assert_cmpint (test_lookup (applet.stats, "events"), ==, 1);
+
+  /* A late end of the dropped phase is ignored */
+  hd_applet_stats_begin (applet.stats, HD_APPLET_STATS_EXPOSE);
+  hd_applet_stats_abort (applet.stats);
+  hd_applet_stats_end (applet.stats);
+  g_assert_cmpint (test_lookup (applet.stats, "exposes"), ==, 1);
+
+  test_applet_clear (&applet);
+}
+
+static void
+test_slow (void)
+{
+  TestApplet applet;
+  gint slow = test_counter ("slow-applet-handlers");
+
+  test_applet_init (&applet, "slow.desktop-0", 0);
+
+  test_applet_event (&applet, HD_APPLET_STATS_SLOW_HANDLER_US / 2, FALSE);
+  g_assert_cmpint (test_counter ("slow-applet-handlers"), ==, slow);
+
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+                         "*slow.desktop-0 spent * ms in expose*");
+  test_applet_expose (&applet, HD_APPLET_STATS_SLOW_HANDLER_US + 10000, 0);
+  g_test_assert_expected_messages ();
+  g_assert_cmpint (test_counter ("slow-applet-handlers"), ==, slow + 1);
+
+  /* Counted again but reported only once */
+  test_applet_event (&applet, HD_APPLET_STATS_SLOW_HANDLER_US + 10000, FALSE);
+  g_assert_cmpint (test_counter ("slow-applet-handlers"), ==, slow + 2);
+  assert_time (applet.stats, "max-time", HD_APPLET_STATS_SLOW_HANDLER_US + 10000);
+
+  test_applet_clear (&applet);
+}
+
+static void
+test_heap (void)
+{
+  TestApplet applet;
+  gint64 growth;
+
+  test_applet_init (&applet, "notes.desktop-0", 0);
+
+  /* 1 MiB kept by the applet */
+  test_applet_expose (&applet, 0, 64);
+  growth = test_lookup (applet.stats, "heap-growth");
+  g_assert_cmpint (growth, >=, 64 * TEST_BLOCK_SIZE);
+  g_assert_cmpint (growth, <, 64 * TEST_BLOCK_SIZE + 65536);
+
+  /* Released again */
+  test_applet_expose (&applet, 0, -64);
+  growth = test_lookup (applet.stats, "heap-growth");
+  g_assert_cmpint (ABS (growth), <, 65536);
+
+  /* Large blocks are mmap ()ed by malloc, they count as well */
+  hd_applet_stats_begin (applet.stats, HD_APPLET_STATS_EXPOSE);
+  applet.blocks = g_slist_prepend (applet.blocks, g_malloc0 (4 << 20));
+  hd_applet_stats_end (applet.stats);
+  growth = test_lookup (applet.stats, "heap-growth");
+  g_assert_cmpint (growth, >=, 4 << 20);
+
+  test_applet_clear (&applet);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/applet-stats/accounting", test_accounting);
+  g_test_add_func ("/applet-stats/nested", test_nested);
+  g_test_add_func ("/applet-stats/abort", test_abort);
+  g_test_add_func ("/applet-stats/slow", test_slow);
+  g_test_add_func ("/applet-stats/heap", test_heap);
+
+  return g_test_run ();
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_APPLET_STATS_H__
+#define __HD_APPLET_STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Applets taking longer than this are reported, once per applet */
+#define HD_APPLET_STATS_SLOW_REALIZE_US 200000
+#define HD_APPLET_STATS_SLOW_HANDLER_US 50000
+
+/* Time spent in and heap grown by one applet instance.  Times are in
+ * microseconds of wall clock time in the main thread. */
+typedef struct _HDAppletStats HDAppletStats;
+
+typedef enum
+{
+  HD_APPLET_STATS_REALIZE,
+  HD_APPLET_STATS_EXPOSE,
+  HD_APPLET_STATS_EVENT
+} HDAppletStatsPhase;
+
+HDAppletStats *hd_applet_stats_new           (const gchar        *plugin_id);
+void           hd_applet_stats_free          (HDAppletStats      *stats);
+
+const gchar   *hd_applet_stats_get_plugin_id (HDAppletStats      *stats);
+
+void           hd_applet_stats_begin         (HDAppletStats      *stats,
+                                              HDAppletStatsPhase  phase);
+void           hd_applet_stats_end           (HDAppletStats      *stats);
+void           hd_applet_stats_abort         (HDAppletStats      *stats);
+
+GHashTable    *hd_applet_stats_collect       (HDAppletStats      *stats);
+
+G_END_DECLS
+
+#endif
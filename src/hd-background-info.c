@@ -35,6 +35,7 @@
 #define BACKGROUND_INFO_KEY_VERSION "Version"
 #define BACKGROUND_INFO_KEY_FILE_FMT "File-%u"
 #define BACKGROUND_INFO_KEY_ETAG_FMT "Etag-%u"
+#define BACKGROUND_INFO_KEY_CHECKSUM_FMT "Checksum-%u"
 
 #define HD_BACKGROUND_INFO_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_BACKGROUND_INFO, HDBackgroundInfoPrivate))
@@ -43,6 +44,10 @@ struct _HDBackgroundInfoPrivate
 {
   GPtrArray *etags;
   HDObjectVector *files;
+
+  /* Checksums of the cached images' pixels, views with the same
+   * checksum share one file. */
+  GPtrArray *checksums;
 };
 
 static void hd_background_info_dispose (GObject *object);
@@ -64,8 +69,9 @@ static void load_background_from_key_file (HDBackgroundInfo *info,
                                            guint             desktop);
 static GFile *get_file_from_key_file (GKeyFile *key_file,
                                       guint     i);
-static char *get_etag_from_key_file (GKeyFile *key_file,
-                                     guint     i);
+static char *get_string_from_key_file (GKeyFile   *key_file,
+                                       const char *key_format,
+                                       guint       i);
 static void load_background_info_legacy (HDBackgroundInfo *info,
                                          char             *file_contents,
                                          gsize             file_size);
@@ -97,6 +103,9 @@ hd_background_info_init (HDBackgroundInfo *info)
   g_ptr_array_set_size (priv->etags, max);
 
   priv->files = hd_object_vector_new_at_size (max, NULL);
+
+  priv->checksums = g_ptr_array_sized_new (max);
+  g_ptr_array_set_size (priv->checksums, max);
 }
 
 HDBackgroundInfo *
@@ -284,14 +293,19 @@ load_background_from_key_file (HDBackgroundInfo *info,
 
   file = get_file_from_key_file (key_file,
                                  desktop);
-  etag = get_etag_from_key_file (key_file,
-                                 desktop);
+  etag = get_string_from_key_file (key_file,
+                                   BACKGROUND_INFO_KEY_ETAG_FMT,
+                                   desktop);
 
   hd_object_vector_set_at (priv->files,
                            desktop,
                            file);
   g_object_unref (file);
   g_ptr_array_index (priv->etags, desktop) = etag;
+  g_ptr_array_index (priv->checksums, desktop) =
+    get_string_from_key_file (key_file,
+                              BACKGROUND_INFO_KEY_CHECKSUM_FMT,
+                              desktop);
 }
 
 static GFile*
@@ -318,21 +332,22 @@ get_file_from_key_file (GKeyFile *key_file,
 }
 
 static char*
-get_etag_from_key_file (GKeyFile *key_file,
-                        guint     i)
+get_string_from_key_file (GKeyFile   *key_file,
+                          const char *key_format,
+                          guint       i)
 {
   char *key;
-  char *etag;
+  char *value;
 
-  key = g_strdup_printf (BACKGROUND_INFO_KEY_ETAG_FMT, i);
-  etag = g_key_file_get_string (key_file,
-                                BACKGROUND_INFO_GROUP,
-                                key,
-                                NULL);
+  key = g_strdup_printf (key_format, i);
+  value = g_key_file_get_string (key_file,
+                                 BACKGROUND_INFO_GROUP,
+                                 key,
+                                 NULL);
 
   g_free (key);
 
-  return etag;
+  return value;
 }
 
 static void
@@ -392,6 +407,13 @@ hd_background_info_dispose (GObject *object)
 
   if (priv->files)
     priv->files = (g_object_unref (priv->files), NULL);
+
+  if (priv->checksums)
+    {
+      g_ptr_array_foreach (priv->checksums, (GFunc) g_free, NULL);
+      g_ptr_array_free (priv->checksums, TRUE);
+      priv->checksums = NULL;
+    }
   
   G_OBJECT_CLASS (hd_background_info_parent_class)->dispose (object);
 }
@@ -424,11 +446,26 @@ hd_background_info_get_etag (HDBackgroundInfo *info,
                             desktop);
 }
 
+const char *
+hd_background_info_get_checksum (HDBackgroundInfo *info,
+                                 guint             desktop)
+{
+  HDBackgroundInfoPrivate *priv;
+
+  g_return_val_if_fail (HD_IS_BACKGROUND_INFO (info), NULL);
+
+  priv = HD_BACKGROUND_INFO (info)->priv;
+
+  return g_ptr_array_index (priv->checksums,
+                            desktop);
+}
+
 void
 hd_background_info_set (HDBackgroundInfo *info,
                         guint             desktop,
                         GFile            *file,
-                        const char       *etag)
+                        const char       *etag,
+                        const char       *checksum)
 {
   HDBackgroundInfoPrivate *priv;
 
@@ -441,6 +478,9 @@ hd_background_info_set (HDBackgroundInfo *info,
                            file);
   g_ptr_array_index (priv->etags,
                      desktop) = g_strdup (etag);
+  g_free (g_ptr_array_index (priv->checksums, desktop));
+  g_ptr_array_index (priv->checksums,
+                     desktop) = g_strdup (checksum);
 
   save_background_info_file (info);
 }
@@ -468,7 +508,7 @@ save_background_info_file (HDBackgroundInfo *info)
   for (desktop = 0; desktop < max; ++desktop)
     {
       GFile *file;
-      const char *etag;
+      const char *etag, *checksum;
 
       file = hd_object_vector_at (priv->files, desktop);
 
@@ -502,6 +542,21 @@ save_background_info_file (HDBackgroundInfo *info)
 
           g_free (key);
         }
+
+      checksum = g_ptr_array_index (priv->checksums, desktop);
+      if (checksum)
+        {
+          char *key;
+
+          key = g_strdup_printf (BACKGROUND_INFO_KEY_CHECKSUM_FMT, desktop);
+
+          g_key_file_set_string (key_file,
+                                 BACKGROUND_INFO_GROUP,
+                                 key,
+                                 checksum);
+
+          g_free (key);
+        }
     }
 
   contents = g_key_file_to_data (key_file,
@@ -66,11 +66,14 @@ GFile            *hd_background_info_get_file (HDBackgroundInfo *info,
                                                guint             desktop);
 const char       *hd_background_info_get_etag (HDBackgroundInfo *info,
                                                guint             desktop);
+const char       *hd_background_info_get_checksum (HDBackgroundInfo *info,
+                                                   guint             desktop);
 
 void              hd_background_info_set      (HDBackgroundInfo *info,
                                                guint             desktop,
                                                GFile            *file,
-                                               const char       *etag);
+                                               const char       *etag,
+                                               const char       *checksum);
 
 
 
@@ -36,6 +36,7 @@
 
 #include <gconf/gconf-client.h>
 
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -44,6 +45,7 @@
 #include "hd-desktop.h"
 #include "hd-file-background.h"
 #include "hd-pixbuf-utils.h"
+#include "hd-trace.h"
 
 #include "hd-backgrounds.h"
 
@@ -51,6 +53,11 @@
 #define BACKGROUND_CACHED_PNG CACHED_DIR "/background-%u.png"
 #define BACKGROUND_CACHED_PNG_PORTRAIT CACHED_DIR "/background_portrait-%u.png"
 
+/* Identical cached images are stored once, named after the checksum
+ * of their pixels, and the views' files are hard links to them. */
+#define BACKGROUND_CACHED_SHARED CACHED_DIR "/%s.png"
+#define BACKGROUND_CHECKSUM_TYPE G_CHECKSUM_SHA1
+
 #define GCONF_KEY_PORTRAIT_WALLPAPER "/apps/osso/hildon-desktop/portrait_wallpaper"
 
 /* Background GConf key */
@@ -352,6 +359,8 @@ background_info_loaded (HDBackgroundInfo *info,
   GFile *bg_image;
   GError *error = NULL;
 
+  HD_TRACE_INSTANT ("background-info-loaded");
+
   hd_background_info_init_finish (info,
                                   result,
                                   &error);
@@ -743,6 +752,7 @@ hd_backgrounds_startup (HDBackgrounds *backgrounds)
       }
 
   /* Load cache info file */
+  HD_TRACE_INSTANT ("background-info-load");
   priv->info = hd_background_info_new ();
   hd_background_info_init_async (priv->info,
                                  NULL,
@@ -1010,6 +1020,7 @@ typedef struct
   guint view;
   GFile *file;
   char *etag;
+  char *checksum;
 } UpdateCacheInfoData;
 
 static gboolean
@@ -1021,10 +1032,12 @@ update_cache_info_file_idle (UpdateCacheInfoData *data)
   hd_background_info_set (priv->info,
                           data->view,
                           data->file,
-                          data->etag);
+                          data->etag,
+                          data->checksum);
 
   g_object_unref (data->file);
   g_free (data->etag);
+  g_free (data->checksum);
 
   g_slice_free (UpdateCacheInfoData, data);
 
@@ -1035,7 +1048,8 @@ static void
 update_cache_info_file (HDBackgrounds *backgrounds,
                         guint          view,
                         GFile         *file,
-                        const char    *etag)
+                        const char    *etag,
+                        const char    *checksum)
 {
   UpdateCacheInfoData *data = g_slice_new0 (UpdateCacheInfoData);
 
@@ -1043,6 +1057,7 @@ update_cache_info_file (HDBackgrounds *backgrounds,
   data->view = view;
   data->file = g_object_ref (file);
   data->etag = g_strdup (etag);
+  data->checksum = g_strdup (checksum);
 
   gdk_threads_add_idle_full (G_PRIORITY_HIGH_IDLE,
                              (GSourceFunc) update_cache_info_file_idle,
@@ -1050,6 +1065,170 @@ update_cache_info_file (HDBackgrounds *backgrounds,
                              NULL);
 }
 
+/* Returns the checksum of the pixels of @pixbuf, the padding at the
+ * end of the rows left out. */
+static gchar *
+pixbuf_checksum (GdkPixbuf *pixbuf)
+{
+  GChecksum *checksum;
+  const guchar *pixels;
+  gint width, height, rowstride, n_channels, y;
+  gsize row_length;
+  gchar *result;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  row_length = width * ((n_channels * gdk_pixbuf_get_bits_per_sample (pixbuf) + 7) / 8);
+
+  checksum = g_checksum_new (BACKGROUND_CHECKSUM_TYPE);
+
+  g_checksum_update (checksum, (const guchar *) &width, sizeof (width));
+  g_checksum_update (checksum, (const guchar *) &height, sizeof (height));
+  g_checksum_update (checksum, (const guchar *) &n_channels, sizeof (n_channels));
+  for (y = 0; y < height; y++)
+    g_checksum_update (checksum, pixels + y * rowstride, row_length);
+
+  result = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return result;
+}
+
+/* Removes the shared cached images no view links to anymore. */
+static void
+remove_unused_cached_images (void)
+{
+  gchar *cached_dir;
+  GDir *dir;
+  const gchar *name;
+  gsize checksum_length;
+
+  cached_dir = g_build_filename (g_get_home_dir (), CACHED_DIR, NULL);
+  dir = g_dir_open (cached_dir, 0, NULL);
+  if (!dir)
+    {
+      g_free (cached_dir);
+      return;
+    }
+
+  checksum_length = 2 * g_checksum_type_get_length (BACKGROUND_CHECKSUM_TYPE);
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *path;
+      struct stat buf;
+
+      if (strlen (name) != checksum_length + strlen (".png") ||
+          !g_str_has_suffix (name, ".png"))
+        continue;
+
+      path = g_build_filename (cached_dir, name, NULL);
+      if (!g_lstat (path, &buf) && buf.st_nlink == 1)
+        g_unlink (path);
+      g_free (path);
+    }
+
+  g_dir_close (dir);
+  g_free (cached_dir);
+}
+
+/* Makes @dest_filename a hard link to the shared copy of @pixbuf, which
+ * is only written if no other view has the same image.  Returns %FALSE
+ * with @error unset if hard links are not supported, the caller should
+ * save @dest_filename itself then. */
+static gboolean
+save_shared_cached_image (const gchar   *dest_filename,
+                          GdkPixbuf     *pixbuf,
+                          const gchar   *checksum,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  gchar *shared_filename, *tmp_filename;
+  gboolean result = FALSE;
+
+  shared_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_SHARED,
+                                     g_get_home_dir (),
+                                     checksum);
+  tmp_filename = g_strconcat (dest_filename, ".tmp", NULL);
+
+  if (!g_file_test (shared_filename, G_FILE_TEST_EXISTS))
+    {
+      GFile *shared_file = g_file_new_for_path (shared_filename);
+
+      result = hd_pixbuf_utils_save (shared_file,
+                                     pixbuf,
+                                     "png",
+                                     cancellable,
+                                     error);
+      g_object_unref (shared_file);
+
+      if (!result)
+        goto cleanup;
+    }
+  else
+    g_debug ("%s. Sharing %s", __FUNCTION__, shared_filename);
+
+  /* Replace the old file atomically, the compositor may be reading it. */
+  g_unlink (tmp_filename);
+  result = link (shared_filename, tmp_filename) == 0 &&
+           g_rename (tmp_filename, dest_filename) == 0;
+  if (!result)
+    {
+      g_debug ("%s. Could not link %s to %s. %s",
+               __FUNCTION__,
+               dest_filename,
+               shared_filename,
+               g_strerror (errno));
+      g_unlink (tmp_filename);
+    }
+
+cleanup:
+  g_free (shared_filename);
+  g_free (tmp_filename);
+
+  return result;
+}
+
+/* Saves @pixbuf to @dest_filename, shared with the views which have the
+ * same image if hard links are supported, and removes the shared images
+ * no view uses anymore. */
+static gboolean
+save_cached_image (const gchar   *dest_filename,
+                   GdkPixbuf     *pixbuf,
+                   const gchar   *checksum,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  GError *local_error = NULL;
+  gboolean result;
+
+  result = save_shared_cached_image (dest_filename,
+                                     pixbuf,
+                                     checksum,
+                                     cancellable,
+                                     &local_error);
+  if (!result && local_error)
+    g_propagate_error (error, local_error);
+  else if (!result)
+    {
+      GFile *dest_file = g_file_new_for_path (dest_filename);
+
+      result = hd_pixbuf_utils_save (dest_file,
+                                     pixbuf,
+                                     "png",
+                                     cancellable,
+                                     error);
+      g_object_unref (dest_file);
+    }
+
+  if (result)
+    remove_unused_cached_images ();
+
+  return result;
+}
+
 gboolean
 hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                   GdkPixbuf      *pixbuf,
@@ -1062,10 +1241,13 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                   GError        **error)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
-  char *dest_filename;
-  GFile *dest_file;
+  char *dest_filename, *checksum;
   GError *local_error = NULL;
 
+  HD_TRACE_BEGIN ("save-cached-image");
+
+  checksum = pixbuf_checksum (pixbuf);
+
   /* Create the file objects for the cached background image */
   if(view >= HD_DESKTOP_VIEWS)
     dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
@@ -1075,14 +1257,13 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
     dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG,
                                      g_get_home_dir (),
                                      view + 1);
-  dest_file = g_file_new_for_path (dest_filename);
 
   /* Create the cached background image */
-  if (!hd_pixbuf_utils_save (dest_file,
-                             pixbuf,
-                             "png",
-                             cancellable,
-                             &local_error))
+  if (!save_cached_image (dest_filename,
+                          pixbuf,
+                          checksum,
+                          cancellable,
+                          &local_error))
     {
       /* Display not enough space notification banner */
       if (error_dialogs &&
@@ -1099,16 +1280,20 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
       g_propagate_error (error,
                          local_error);
 
+      g_free (dest_filename);
+      g_free (checksum);
+      HD_TRACE_END ("save-cached-image");
       return FALSE;
     }
 
   g_free (dest_filename);
-  g_object_unref (dest_file);
 
   update_cache_info_file (backgrounds,
                           view,
                           source_file,
-                          source_etag);
+                          source_etag,
+                          checksum);
+  g_free (checksum);
 
   /* Update GConf if requested */
   if (update_gconf)
@@ -1137,6 +1322,8 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
       g_free (path);
     }
 
+  HD_TRACE_END ("save-cached-image");
+
   return TRUE;
 }
 
@@ -1230,3 +1417,406 @@ hd_backgrounds_is_portrait_wallpaper_enabled (HDBackgrounds *backgrounds)
 
   return priv->portrait_wallpaper;
 }
+
+#ifdef COMPILE_FOR_TEST
+#include <sys/stat.h>
+
+/* The size of the test backgrounds, a view is 800x480 */
+#define TEST_WIDTH  800
+#define TEST_HEIGHT 480
+
+/* The background info is not used by the cache */
+HDBackgroundInfo *
+hd_background_info_new (void)
+{
+  return NULL;
+}
+
+void
+hd_background_info_init_async (HDBackgroundInfo    *info,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+}
+
+gboolean
+hd_background_info_init_finish (HDBackgroundInfo  *info,
+                                GAsyncResult      *result,
+                                GError           **error)
+{
+  return FALSE;
+}
+
+GFile *
+hd_background_info_get_file (HDBackgroundInfo *info,
+                             guint             desktop)
+{
+  return NULL;
+}
+
+const char *
+hd_background_info_get_etag (HDBackgroundInfo *info,
+                             guint             desktop)
+{
+  return NULL;
+}
+
+void
+hd_background_info_set (HDBackgroundInfo *info,
+                        guint             desktop,
+                        GFile            *file,
+                        const char       *etag,
+                        const char       *checksum)
+{
+}
+
+HDCommandThreadPool *
+hd_command_thread_pool_new (void)
+{
+  return NULL;
+}
+
+void
+hd_command_thread_pool_push (HDCommandThreadPool *pool,
+                             HDCommandCallback    command,
+                             gpointer             data,
+                             GDestroyNotify       destroy_data)
+{
+}
+
+void
+hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
+                                  gint                 priority,
+                                  GSourceFunc          function,
+                                  gpointer             data,
+                                  GDestroyNotify       destroy_data)
+{
+}
+
+GType
+hd_file_background_get_type (void)
+{
+  return G_TYPE_OBJECT;
+}
+
+HDBackground *
+hd_file_background_new (GFile *image_file)
+{
+  return NULL;
+}
+
+void
+hd_file_background_set_for_view_full (HDFileBackground *background,
+                                      guint             current_view,
+                                      GCancellable     *cancellable,
+                                      gboolean          error_dialogs,
+                                      gboolean          update_gconf)
+{
+}
+
+/* Counts the PNG files written */
+static guint n_writes;
+
+gboolean
+hd_pixbuf_utils_save (GFile         *file,
+                      GdkPixbuf     *pixbuf,
+                      const gchar   *type,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  gchar *path = g_file_get_path (file);
+  gboolean result;
+
+  n_writes++;
+  result = gdk_pixbuf_save (pixbuf, path, type, error, NULL);
+  g_free (path);
+
+  return result;
+}
+
+static GdkPixbuf *
+new_background (guint32 color)
+{
+  GdkPixbuf *pixbuf;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
+                           TEST_WIDTH, TEST_HEIGHT);
+  gdk_pixbuf_fill (pixbuf, color);
+
+  return pixbuf;
+}
+
+static gchar *
+view_filename (guint view)
+{
+  return g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG,
+                          g_get_home_dir (),
+                          view + 1);
+}
+
+/* Saves @pixbuf for @view as hd_backgrounds_save_cached_image() does */
+static void
+save_view (guint      view,
+           GdkPixbuf *pixbuf)
+{
+  gchar *filename = view_filename (view);
+  gchar *checksum = pixbuf_checksum (pixbuf);
+
+  g_assert (save_cached_image (filename, pixbuf, checksum, NULL, NULL));
+
+  g_free (checksum);
+  g_free (filename);
+}
+
+static struct stat
+view_stat (guint view)
+{
+  gchar *filename = view_filename (view);
+  struct stat buf;
+
+  g_assert_cmpint (g_stat (filename, &buf), ==, 0);
+  g_free (filename);
+
+  return buf;
+}
+
+/* Returns the bytes the cache takes on disk, the files sharing an inode
+ * counted once, and sets @n_files and @n_inodes */
+static goffset
+cache_footprint (guint *n_files,
+                 guint *n_inodes)
+{
+  gchar *cached_dir;
+  GDir *dir;
+  GHashTable *inodes;
+  const gchar *name;
+  goffset size = 0;
+
+  cached_dir = g_build_filename (g_get_home_dir (), CACHED_DIR, NULL);
+  dir = g_dir_open (cached_dir, 0, NULL);
+  g_assert (dir);
+  inodes = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+
+  *n_files = 0;
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *path = g_build_filename (cached_dir, name, NULL);
+      struct stat buf;
+
+      g_assert_cmpint (g_lstat (path, &buf), ==, 0);
+      if (S_ISREG (buf.st_mode))
+        {
+          gint64 inode = buf.st_ino;
+
+          (*n_files)++;
+          if (!g_hash_table_lookup (inodes, &inode))
+            {
+              g_hash_table_insert (inodes,
+                                   g_memdup (&inode, sizeof (inode)),
+                                   GINT_TO_POINTER (TRUE));
+              size += buf.st_size;
+            }
+        }
+      g_free (path);
+    }
+  *n_inodes = g_hash_table_size (inodes);
+
+  g_hash_table_destroy (inodes);
+  g_dir_close (dir);
+  g_free (cached_dir);
+
+  return size;
+}
+
+static void
+clear_cache (void)
+{
+  gchar *cached_dir;
+  GDir *dir;
+  const gchar *name;
+
+  cached_dir = g_build_filename (g_get_home_dir (), CACHED_DIR, NULL);
+  dir = g_dir_open (cached_dir, 0, NULL);
+  g_assert (dir);
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *path = g_build_filename (cached_dir, name, NULL);
+
+      g_unlink (path);
+      g_free (path);
+    }
+
+  g_dir_close (dir);
+  g_free (cached_dir);
+}
+
+static void
+test_checksum (void)
+{
+  GdkPixbuf *narrow, *wide, *sub;
+  gchar *a, *b;
+
+  /* The row padding is left out: 5 RGB pixels are 15 bytes in rows
+   * of 16, and 32 in the wider pixbuf */
+  narrow = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 5, 4);
+  wide = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 10, 4);
+  gdk_pixbuf_fill (narrow, 0x336699ff);
+  gdk_pixbuf_fill (wide, 0x336699ff);
+  sub = gdk_pixbuf_new_subpixbuf (wide, 5, 0, 5, 4);
+  g_assert_cmpint (gdk_pixbuf_get_rowstride (narrow), !=,
+                   gdk_pixbuf_get_rowstride (sub));
+
+  a = pixbuf_checksum (narrow);
+  b = pixbuf_checksum (sub);
+  g_assert_cmpstr (a, ==, b);
+  g_free (b);
+
+  /* Same pixels, other size */
+  b = pixbuf_checksum (wide);
+  g_assert_cmpstr (a, !=, b);
+  g_free (b);
+
+  gdk_pixbuf_fill (sub, 0x336698ff);
+  b = pixbuf_checksum (sub);
+  g_assert_cmpstr (a, !=, b);
+  g_free (b);
+
+  g_free (a);
+  g_object_unref (sub);
+  g_object_unref (wide);
+  g_object_unref (narrow);
+}
+
+static void
+test_share (void)
+{
+  GdkPixbuf *red, *blue;
+  struct stat first, buf;
+  guint n_files, n_inodes, view;
+  goffset size;
+
+  red = new_background (0xff0000ff);
+  blue = new_background (0x0000ffff);
+  n_writes = 0;
+
+  /* One wallpaper on all the views is written once */
+  for (view = 0; view < HD_DESKTOP_VIEWS; view++)
+    save_view (view, red);
+  g_assert_cmpuint (n_writes, ==, 1);
+
+  first = view_stat (0);
+  for (view = 1; view < HD_DESKTOP_VIEWS; view++)
+    g_assert_cmpuint (view_stat (view).st_ino, ==, first.st_ino);
+  g_assert_cmpuint (first.st_nlink, ==, HD_DESKTOP_VIEWS + 1);
+
+  size = cache_footprint (&n_files, &n_inodes);
+  g_assert_cmpuint (n_files, ==, HD_DESKTOP_VIEWS + 1);
+  g_assert_cmpuint (n_inodes, ==, 1);
+  g_assert_cmpint (size, ==, first.st_size);
+
+  /* Changing a view only replaces its link */
+  save_view (3, blue);
+  g_assert_cmpuint (n_writes, ==, 2);
+  buf = view_stat (3);
+  g_assert_cmpuint (buf.st_ino, !=, first.st_ino);
+  g_assert_cmpuint (buf.st_nlink, ==, 2);
+  g_assert_cmpuint (view_stat (0).st_nlink, ==, HD_DESKTOP_VIEWS);
+  cache_footprint (&n_files, &n_inodes);
+  g_assert_cmpuint (n_files, ==, HD_DESKTOP_VIEWS + 2);
+  g_assert_cmpuint (n_inodes, ==, 2);
+
+  /* Going back shares the existing image and drops the unused one */
+  save_view (3, red);
+  g_assert_cmpuint (n_writes, ==, 2);
+  g_assert_cmpuint (view_stat (3).st_ino, ==, first.st_ino);
+  g_assert_cmpuint (view_stat (3).st_nlink, ==, HD_DESKTOP_VIEWS + 1);
+  cache_footprint (&n_files, &n_inodes);
+  g_assert_cmpuint (n_files, ==, HD_DESKTOP_VIEWS + 1);
+  g_assert_cmpuint (n_inodes, ==, 1);
+
+  /* A new wallpaper everywhere replaces the old one */
+  for (view = 0; view < HD_DESKTOP_VIEWS; view++)
+    save_view (view, blue);
+  g_assert_cmpuint (n_writes, ==, 3);
+  g_assert_cmpuint (view_stat (0).st_ino, !=, first.st_ino);
+  cache_footprint (&n_files, &n_inodes);
+  g_assert_cmpuint (n_files, ==, HD_DESKTOP_VIEWS + 1);
+  g_assert_cmpuint (n_inodes, ==, 1);
+
+  clear_cache ();
+  g_object_unref (blue);
+  g_object_unref (red);
+}
+
+static void
+test_fallback (void)
+{
+  GdkPixbuf *red;
+  gchar *filename, *tmp_filename;
+  guint n_files, n_inodes;
+
+  red = new_background (0xff0000ff);
+  n_writes = 0;
+
+  /* link() fails with a directory in the way, as it does on a file
+   * system without hard links, and the view gets a copy of its own */
+  filename = view_filename (0);
+  tmp_filename = g_strconcat (filename, ".tmp", NULL);
+  g_assert_cmpint (g_mkdir (tmp_filename, 0700), ==, 0);
+
+  save_view (0, red);
+  g_assert_cmpuint (n_writes, ==, 2);
+  g_assert_cmpuint (view_stat (0).st_nlink, ==, 1);
+
+  /* The shared image nobody links to is removed */
+  g_assert_cmpint (g_rmdir (tmp_filename), ==, 0);
+  cache_footprint (&n_files, &n_inodes);
+  g_assert_cmpuint (n_files, ==, 1);
+
+  /* Once links work again the view is shared */
+  save_view (1, red);
+  save_view (0, red);
+  g_assert_cmpuint (n_writes, ==, 3);
+  g_assert_cmpuint (view_stat (0).st_ino, ==, view_stat (1).st_ino);
+  cache_footprint (&n_files, &n_inodes);
+  g_assert_cmpuint (n_files, ==, 3);
+  g_assert_cmpuint (n_inodes, ==, 1);
+
+  clear_cache ();
+  g_free (tmp_filename);
+  g_free (filename);
+  g_object_unref (red);
+}
+
+int main (int argc, char **argv)
+{
+  gchar *home, *cached_dir;
+  gint result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  /* The cache is made in a scratch home */
+  home = g_dir_make_tmp ("test-backgrounds-XXXXXX", NULL);
+  g_assert (home);
+  g_setenv ("HOME", home, TRUE);
+  cached_dir = g_build_filename (home, CACHED_DIR, NULL);
+  g_assert_cmpint (g_mkdir (cached_dir, 0700), ==, 0);
+
+  g_test_add_func ("/backgrounds/checksum", test_checksum);
+  g_test_add_func ("/backgrounds/share", test_share);
+  g_test_add_func ("/backgrounds/fallback", test_fallback);
+
+  result = g_test_run ();
+
+  clear_cache ();
+  g_rmdir (cached_dir);
+  g_rmdir (home);
+  g_free (cached_dir);
+  g_free (home);
+
+  return result;
+}
+
+#endif
@@ -34,6 +34,7 @@
 #include "hd-cairo-surface-cache.h"
 #include "hd-bookmark-shortcut.h"
 #include "hd-dbus-utils.h"
+#include "hd-memory-pressure.h"
 
 /* Size from Home layout guide 1.2 */
 #define SHORTCUT_WIDTH 176
@@ -80,6 +81,7 @@ struct _HDBookmarkShortcutPrivate
 
   cairo_surface_t *thumbnail_icon;
   cairo_surface_t *default_thumbnail_icon;
+  guint            shrinker_id;
 
   cairo_surface_t *bg_image;
   cairo_surface_t *bg_active;
@@ -280,6 +282,9 @@ hd_bookmark_shortcut_dispose (GObject *object)
   if (priv->gconf_client)
     priv->gconf_client = (g_object_unref (priv->gconf_client), NULL);
 
+  if (priv->shrinker_id)
+    priv->shrinker_id = (hd_memory_pressure_remove_shrinker (priv->shrinker_id), 0);
+
   if (priv->bg_image)
     priv->bg_image = (cairo_surface_destroy (priv->bg_image), NULL);
 
@@ -619,6 +624,21 @@ delete_event_cb (GtkWidget          *widget,
   return FALSE;
 }
 
+/* The default thumbnail is painted again on the next expose */
+static gsize
+shrink (HDMemoryPressureLevel  level,
+        HDBookmarkShortcut    *shortcut)
+{
+  HDBookmarkShortcutPrivate *priv = shortcut->priv;
+
+  if (!priv->default_thumbnail_icon)
+    return 0;
+
+  priv->default_thumbnail_icon = (cairo_surface_destroy (priv->default_thumbnail_icon), NULL);
+
+  return THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT * 4;
+}
+
 static void
 hd_bookmark_shortcut_init (HDBookmarkShortcut *applet)
 {
@@ -666,4 +686,9 @@ hd_bookmark_shortcut_init (HDBookmarkShortcut *applet)
                                                          THUMBNAIL_MASK_FILE);
 
   priv->gconf_client = gconf_client_get_default ();
+
+  priv->shrinker_id = hd_memory_pressure_add_shrinker ("bookmark-thumbnail",
+                                                       HD_MEMORY_PRESSURE_PRIORITY_THUMBNAILS,
+                                                       (HDMemoryPressureShrinkFunc) shrink,
+                                                       applet);
 }
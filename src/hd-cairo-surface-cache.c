@@ -25,6 +25,8 @@
 #endif
 
 #include "hd-cairo-surface-cache.h"
+#include "hd-memory-pressure.h"
+#include "hd-metrics.h"
 
 #include <gio/gio.h>
 
@@ -34,8 +36,15 @@
 struct _HDCairoSurfaceCachePrivate
 {
   GHashTable *table;
+  guint       shrinker_id;
 };
 
+typedef struct
+{
+  cairo_surface_t *surface;
+  gsize            size;
+} CachedSurface;
+
 G_DEFINE_TYPE (HDCairoSurfaceCache, hd_cairo_surface_cache, G_TYPE_OBJECT);
 
 static void
@@ -43,6 +52,9 @@ hd_cairo_surface_cache_dispose (GObject *object)
 {
   HDCairoSurfaceCachePrivate *priv = HD_CAIRO_SURFACE_CACHE (object)->priv;
 
+  if (priv->shrinker_id)
+    priv->shrinker_id = (hd_memory_pressure_remove_shrinker (priv->shrinker_id), 0);
+
   if (priv->table)
     priv->table = (g_hash_table_destroy (priv->table), NULL);
 
@@ -59,6 +71,41 @@ hd_cairo_surface_cache_class_init (HDCairoSurfaceCacheClass *klass)
   g_type_class_add_private (klass, sizeof (HDCairoSurfaceCachePrivate));
 }
 
+static void
+cached_surface_free (CachedSurface *cached)
+{
+  cairo_surface_destroy (cached->surface);
+  g_slice_free (CachedSurface, cached);
+}
+
+/* Drops the surfaces nobody else uses, they are loaded again
+ * from the theme when needed. */
+static gboolean
+remove_unused_surface (gpointer       key,
+                       CachedSurface *cached,
+                       gsize         *released)
+{
+  if (cairo_surface_get_reference_count (cached->surface) > 1)
+    return FALSE;
+
+  *released += cached->size;
+
+  return TRUE;
+}
+
+static gsize
+shrink (HDMemoryPressureLevel  level,
+        HDCairoSurfaceCache   *cache)
+{
+  gsize released = 0;
+
+  g_hash_table_foreach_remove (cache->priv->table,
+                               (GHRFunc) remove_unused_surface,
+                               &released);
+
+  return released;
+}
+
 static void
 hd_cairo_surface_cache_init (HDCairoSurfaceCache *cache)
 {
@@ -68,7 +115,12 @@ hd_cairo_surface_cache_init (HDCairoSurfaceCache *cache)
 
   priv->table = g_hash_table_new_full (g_str_hash, g_str_equal,
                                        g_free,
-                                       (GDestroyNotify) cairo_surface_destroy);
+                                       (GDestroyNotify) cached_surface_free);
+
+  priv->shrinker_id = hd_memory_pressure_add_shrinker ("surface-cache",
+                                                       HD_MEMORY_PRESSURE_PRIORITY_SURFACES,
+                                                       (HDMemoryPressureShrinkFunc) shrink,
+                                                       cache);
 }
 
 HDCairoSurfaceCache *
@@ -88,12 +140,18 @@ hd_cairo_surface_cache_get_surface (HDCairoSurfaceCache *cache,
                                     const gchar         *filename)
 {
   HDCairoSurfaceCachePrivate *priv = cache->priv;
+  CachedSurface *cached;
   cairo_surface_t *surface;
 
-  surface = g_hash_table_lookup (priv->table,
-                                 filename);
+  cached = g_hash_table_lookup (priv->table,
+                                filename);
 
-  if (!surface)
+  hd_metrics_add (cached ? HD_METRICS_SURFACE_CACHE_HITS
+                         : HD_METRICS_SURFACE_CACHE_MISSES, 1);
+
+  if (cached)
+    surface = cached->surface;
+  else
     {
       cairo_surface_t *image_surface;
       cairo_t *cr;
@@ -112,11 +170,16 @@ hd_cairo_surface_cache_get_surface (HDCairoSurfaceCache *cache,
 
       cairo_paint (cr);
       cairo_destroy (cr);
+
+      cached = g_slice_new (CachedSurface);
+      cached->surface = surface;
+      cached->size = cairo_image_surface_get_stride (image_surface) *
+                     cairo_image_surface_get_height (image_surface);
       cairo_surface_destroy (image_surface);
 
       g_hash_table_insert (priv->table,
                            g_strdup (filename),
-                           surface);
+                           cached);
     }
 
   return cairo_surface_reference (surface);
@@ -26,6 +26,7 @@
 #include <gdk/gdk.h>
 
 #include "hd-command-thread-pool.h"
+#include "hd-metrics.h"
 
 #define HD_COMMAND_THREAD_POOL_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_COMMAND_THREAD_POOL, HDCommandThreadPoolPrivate))
@@ -111,8 +112,15 @@ static void
 thread_command_execute (ThreadCommand *thread_command,
                         gpointer       data)
 {
+  gint64 start = g_get_monotonic_time ();
+
+  hd_metrics_add (HD_METRICS_BACKGROUND_JOBS_QUEUED, -1);
+
   thread_command->command (thread_command->data);
   thread_command_free (thread_command);
+
+  hd_metrics_add (HD_METRICS_BACKGROUND_JOBS, 1);
+  hd_metrics_observe_since (HD_METRICS_BACKGROUND_JOB_DURATION, start);
 }
 
 static ThreadCommand *
@@ -163,6 +171,7 @@ hd_command_thread_pool_push (HDCommandThreadPool *pool,
   ThreadCommand *thread_command = thread_command_new (command,
                                                       data,
                                                       destroy_data);
+  hd_metrics_add (HD_METRICS_BACKGROUND_JOBS_QUEUED, 1);
   g_thread_pool_push (priv->thread_pool,
                       thread_command,
                       &error);
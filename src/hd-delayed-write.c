@@ -0,0 +1,259 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gdk/gdk.h>
+
+#include "hd-delayed-write.h"
+
+struct _HDDelayedWrite
+{
+  guint              delay;
+  HDDelayedWriteFunc write;
+  gpointer           data;
+
+  guint              timeout_id;
+};
+
+HDDelayedWrite *
+hd_delayed_write_new (guint              delay,
+                      HDDelayedWriteFunc write,
+                      gpointer           data)
+{
+  HDDelayedWrite *dw;
+
+  dw = g_slice_new0 (HDDelayedWrite);
+  dw->delay = delay;
+  dw->write = write;
+  dw->data = data;
+
+  return dw;
+}
+
+/**
+ * hd_delayed_write_free:
+ * @dw: a #HDDelayedWrite
+ *
+ * Frees @dw, pending changes are written first so they are not lost.
+ */
+void
+hd_delayed_write_free (HDDelayedWrite *dw)
+{
+  hd_delayed_write_flush (dw);
+  g_slice_free (HDDelayedWrite, dw);
+}
+
+static gboolean
+write_timeout (HDDelayedWrite *dw)
+{
+  dw->timeout_id = 0;
+
+  dw->write (dw->data);
+
+  return FALSE;
+}
+
+/**
+ * hd_delayed_write_schedule:
+ * @dw: a #HDDelayedWrite
+ *
+ * Notes a change, it is written together with all others made until
+ * the delay expires.
+ */
+void
+hd_delayed_write_schedule (HDDelayedWrite *dw)
+{
+  if (!dw->timeout_id)
+    dw->timeout_id = gdk_threads_add_timeout (dw->delay,
+                                              (GSourceFunc) write_timeout,
+                                              dw);
+}
+
+/**
+ * hd_delayed_write_flush:
+ * @dw: a #HDDelayedWrite
+ *
+ * Writes pending changes right away.
+ *
+ * Returns: %TRUE if there were changes to write
+ */
+gboolean
+hd_delayed_write_flush (HDDelayedWrite *dw)
+{
+  if (!dw->timeout_id)
+    return FALSE;
+
+  g_source_remove (dw->timeout_id);
+  write_timeout (dw);
+
+  return TRUE;
+}
+
+#ifdef COMPILE_FOR_TEST
+
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#define TEST_DELAY 50
+
+typedef struct
+{
+  GKeyFile *key_file;
+  gchar    *filename;
+  guint     n_writes;
+} TestConfig;
+
+static void
+test_write (TestConfig *config)
+{
+  gchar *data;
+  gsize length;
+
+  data = g_key_file_to_data (config->key_file, &length, NULL);
+  g_assert (g_file_set_contents (config->filename, data, length, NULL));
+  g_free (data);
+
+  config->n_writes++;
+}
+
+static void
+test_config_init (TestConfig *config)
+{
+  gint fd;
+
+  config->key_file = g_key_file_new ();
+  fd = g_file_open_tmp ("hd-delayed-write-XXXXXX", &config->filename, NULL);
+  g_assert (fd >= 0);
+  close (fd);
+  config->n_writes = 0;
+}
+
+static void
+test_config_clear (TestConfig *config)
+{
+  g_unlink (config->filename);
+  g_free (config->filename);
+  g_key_file_free (config->key_file);
+}
+
+/* Runs the main loop until no more writes are scheduled */
+static void
+test_wait (void)
+{
+  gint64 end = g_get_monotonic_time () + 3 * TEST_DELAY * 1000;
+
+  while (g_get_monotonic_time () < end)
+    g_main_context_iteration (NULL, FALSE);
+}
+
+static void
+test_add_applets (void)
+{
+  TestConfig config;
+  HDDelayedWrite *dw;
+  GKeyFile *stored;
+  gchar **groups;
+  gsize n_groups;
+  guint i;
+
+  test_config_init (&config);
+  dw = hd_delayed_write_new (TEST_DELAY, (HDDelayedWriteFunc) test_write, &config);
+
+  /* Restoring a backup, one applet after the other */
+  for (i = 0; i < 100; i++)
+    {
+      gchar *id = g_strdup_printf ("clock.desktop-%u", i);
+
+      g_key_file_set_string (config.key_file, id, "X-Desktop-File",
+                             "/usr/share/applications/hildon-home/clock.desktop");
+      hd_delayed_write_schedule (dw);
+      g_free (id);
+
+      g_main_context_iteration (NULL, FALSE);
+    }
+  g_assert_cmpuint (config.n_writes, ==, 0);
+
+  test_wait ();
+  g_assert_cmpuint (config.n_writes, ==, 1);
+
+  stored = g_key_file_new ();
+  g_assert (g_key_file_load_from_file (stored, config.filename, 0, NULL));
+  groups = g_key_file_get_groups (stored, &n_groups);
+  g_assert_cmpuint (n_groups, ==, 100);
+  g_strfreev (groups);
+  g_key_file_free (stored);
+
+  /* A later change is written on its own */
+  g_key_file_remove_group (config.key_file, "clock.desktop-0", NULL);
+  hd_delayed_write_schedule (dw);
+  test_wait ();
+  g_assert_cmpuint (config.n_writes, ==, 2);
+
+  hd_delayed_write_free (dw);
+  g_assert_cmpuint (config.n_writes, ==, 2);
+  test_config_clear (&config);
+}
+
+static void
+test_flush (void)
+{
+  TestConfig config;
+  HDDelayedWrite *dw;
+
+  test_config_init (&config);
+  dw = hd_delayed_write_new (TEST_DELAY, (HDDelayedWriteFunc) test_write, &config);
+
+  g_assert (!hd_delayed_write_flush (dw));
+  g_assert_cmpuint (config.n_writes, ==, 0);
+
+  hd_delayed_write_schedule (dw);
+  g_assert (hd_delayed_write_flush (dw));
+  g_assert_cmpuint (config.n_writes, ==, 1);
+
+  /* The flushed change is not written again */
+  test_wait ();
+  g_assert_cmpuint (config.n_writes, ==, 1);
+
+  /* Nor lost when shutting down before the delay */
+  hd_delayed_write_schedule (dw);
+  hd_delayed_write_free (dw);
+  g_assert_cmpuint (config.n_writes, ==, 2);
+
+  test_config_clear (&config);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/delayed-write/add-applets", test_add_applets);
+  g_test_add_func ("/delayed-write/flush", test_flush);
+
+  return g_test_run ();
+}
+
+#endif
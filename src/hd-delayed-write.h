@@ -0,0 +1,47 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_DELAYED_WRITE_H__
+#define __HD_DELAYED_WRITE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Coalesces changes to a file.  @write is called @delay ms after the
+ * first change scheduled since the last write, so a burst of changes
+ * results in a single write. */
+typedef struct _HDDelayedWrite HDDelayedWrite;
+
+typedef void (*HDDelayedWriteFunc) (gpointer data);
+
+HDDelayedWrite *hd_delayed_write_new      (guint               delay,
+                                           HDDelayedWriteFunc  write,
+                                           gpointer            data);
+void            hd_delayed_write_free     (HDDelayedWrite     *dw);
+
+void            hd_delayed_write_schedule (HDDelayedWrite     *dw);
+gboolean        hd_delayed_write_flush    (HDDelayedWrite     *dw);
+
+G_END_DECLS
+
+#endif
@@ -30,6 +30,7 @@
 #include "hd-desktop.h"
 #include "hd-object-vector.h"
 #include "hd-pixbuf-utils.h"
+#include "hd-trace.h"
 
 #include "hd-file-background.h"
 
@@ -160,6 +161,8 @@ create_cached_image_command (CommandData *data)
   char *etag = NULL;
   GError *error = NULL;
 
+  HD_TRACE_BEGIN ("create-cached-image");
+
   if (g_cancellable_is_cancelled (data->cancellable))
     goto cleanup;
 
@@ -208,6 +211,8 @@ cleanup:
   if (pixbuf)
     g_object_unref (pixbuf);
   g_free (etag);
+
+  HD_TRACE_END ("create-cached-image");
 }
 
 static void
@@ -35,8 +35,10 @@
 
 #include <libosso.h>
 
+#include "hd-applet-manager.h"
 #include "hd-backgrounds.h"
 #include "hd-edit-mode-menu.h"
+#include "hd-metrics.h"
 
 #include "hd-hildon-home-dbus.h"
 #include "hd-hildon-home-dbus-glue.h"
@@ -228,3 +230,23 @@ hd_hildon_home_dbus_set_background_image (HDHildonHomeDBus      *dbus,
                                          uri);
   dbus_g_method_return (context);
 }
+
+gboolean
+hd_hildon_home_dbus_get_metrics (HDHildonHomeDBus  *dbus,
+                                 GHashTable       **metrics,
+                                 GError           **error)
+{
+  *metrics = hd_metrics_collect ();
+
+  return TRUE;
+}
+
+gboolean
+hd_hildon_home_dbus_get_applet_stats (HDHildonHomeDBus  *dbus,
+                                      GHashTable       **applets,
+                                      GError           **error)
+{
+  *applets = hd_applet_manager_collect_stats (HD_APPLET_MANAGER (hd_applet_manager_get ()));
+
+  return TRUE;
+}
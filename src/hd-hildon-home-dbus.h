@@ -60,6 +60,12 @@ void              hd_hildon_home_dbus_show_edit_menu (HDHildonHomeDBus      *hom
 void              hd_hildon_home_dbus_set_background_image (HDHildonHomeDBus      *dbus,
                                                             const char            *uri,
                                                             DBusGMethodInvocation *context);
+gboolean          hd_hildon_home_dbus_get_metrics    (HDHildonHomeDBus      *dbus,
+                                                      GHashTable           **metrics,
+                                                      GError               **error);
+gboolean          hd_hildon_home_dbus_get_applet_stats (HDHildonHomeDBus    *dbus,
+                                                        GHashTable         **applets,
+                                                        GError             **error);
 
 G_END_DECLS
 
@@ -0,0 +1,535 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hd-idle-detector.h"
+
+#define PROC_STAT             "/proc/stat"
+#define PROC_PRESSURE_CPU     "/proc/pressure/cpu"
+#define PROC_PRESSURE_IO      "/proc/pressure/io"
+
+/* Sampling periods in ms.  The stall totals are cheap to read and
+ * precise so the pressure source is sampled much more often, the
+ * coarse jiffies read along with them even out over the window. */
+#define STAT_PERIOD           1000
+#define PRESSURE_PERIOD       250
+
+/* Tracking window of the pressure triggers in us.  Unprivileged
+ * processes may only use multiples of 2 s. */
+#define TRIGGER_WINDOW        2000000
+
+enum
+{
+  SAMPLE,
+  IDLE,
+  LAST_SIGNAL
+};
+
+struct _HDIdleDetectorPrivate
+{
+  HDIdlePolicy *policy;
+  HDIdleDetectorSource source;
+
+  int stat_fd;
+  int cpu_fd;
+  int io_fd;
+
+  int cpu_trigger_fd;
+  int io_trigger_fd;
+  guint cpu_trigger_id;
+  guint io_trigger_id;
+
+  guint timeout_id;
+  gboolean running;
+  gboolean quiet;
+  gboolean idle;
+
+  /* Previous reading */
+  gint64 time;
+  guint64 total;
+  guint64 cpu_idle;
+  guint64 cpu_stall;
+  guint64 io_stall;
+};
+
+static guint signals [LAST_SIGNAL] = { 0 };
+
+static gboolean sample_timeout (HDIdleDetector *detector);
+
+G_DEFINE_TYPE_WITH_PRIVATE (HDIdleDetector, hd_idle_detector, G_TYPE_OBJECT);
+
+static void
+close_fd (int *fd)
+{
+  if (*fd >= 0)
+    {
+      close (*fd);
+      *fd = -1;
+    }
+}
+
+static void
+hd_idle_detector_dispose (GObject *object)
+{
+  HDIdleDetectorPrivate *priv = HD_IDLE_DETECTOR (object)->priv;
+
+  hd_idle_detector_stop (HD_IDLE_DETECTOR (object));
+
+  if (priv->policy)
+    priv->policy = (hd_idle_policy_free (priv->policy), NULL);
+
+  G_OBJECT_CLASS (hd_idle_detector_parent_class)->dispose (object);
+}
+
+static void
+hd_idle_detector_class_init (HDIdleDetectorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = hd_idle_detector_dispose;
+
+  signals [SAMPLE] = g_signal_new ("sample",
+                                   G_TYPE_FROM_CLASS (klass),
+                                   G_SIGNAL_RUN_FIRST,
+                                   0,
+                                   NULL, NULL,
+                                   g_cclosure_marshal_VOID__DOUBLE,
+                                   G_TYPE_NONE, 1,
+                                   G_TYPE_DOUBLE);
+  signals [IDLE] = g_signal_new ("idle",
+                                 G_TYPE_FROM_CLASS (klass),
+                                 G_SIGNAL_RUN_FIRST,
+                                 0,
+                                 NULL, NULL,
+                                 g_cclosure_marshal_VOID__VOID,
+                                 G_TYPE_NONE, 0);
+}
+
+static void
+hd_idle_detector_init (HDIdleDetector *detector)
+{
+  HDIdleDetectorPrivate *priv = hd_idle_detector_get_instance_private (detector);
+
+  detector->priv = priv;
+
+  priv->stat_fd = -1;
+  priv->cpu_fd = -1;
+  priv->io_fd = -1;
+  priv->cpu_trigger_fd = -1;
+  priv->io_trigger_fd = -1;
+}
+
+/* @policy is owned by the detector afterwards. */
+HDIdleDetector *
+hd_idle_detector_new (HDIdlePolicy         *policy,
+                      HDIdleDetectorSource  source)
+{
+  HDIdleDetector *detector;
+
+  g_return_val_if_fail (policy, NULL);
+
+  detector = g_object_new (HD_TYPE_IDLE_DETECTOR, NULL);
+  detector->priv->policy = policy;
+  detector->priv->source = source;
+
+  return detector;
+}
+
+static gint64
+get_monotonic_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* Rereads the whole of @fd into @buffer. */
+static gboolean
+read_proc_file (int    fd,
+                gchar *buffer,
+                gsize  size)
+{
+  ssize_t n;
+
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    return FALSE;
+
+  n = read (fd, buffer, size - 1);
+  if (n <= 0)
+    return FALSE;
+
+  buffer[n] = '\0';
+
+  return TRUE;
+}
+
+/* Takes a reading of the jiffies and, with the pressure source, of the
+ * stall totals.  Returns FALSE if it could not be read, in which case
+ * the previous reading is kept. */
+static gboolean
+take_reading (HDIdleDetector *detector,
+              guint64        *total,
+              guint64        *cpu_idle,
+              guint64        *cpu_stall,
+              guint64        *io_stall)
+{
+  HDIdleDetectorPrivate *priv = detector->priv;
+  gchar buffer[512];
+
+  if (!read_proc_file (priv->stat_fd, buffer, sizeof (buffer)) ||
+      !hd_idle_policy_parse_stat (buffer, total, cpu_idle))
+    return FALSE;
+
+  if (priv->source == HD_IDLE_DETECTOR_SOURCE_STAT)
+    return TRUE;
+
+  if (!read_proc_file (priv->cpu_fd, buffer, sizeof (buffer)) ||
+      !hd_idle_policy_parse_pressure (buffer, cpu_stall))
+    return FALSE;
+
+  *io_stall = 0;
+  if (priv->io_fd >= 0 &&
+      (!read_proc_file (priv->io_fd, buffer, sizeof (buffer)) ||
+       !hd_idle_policy_parse_pressure (buffer, io_stall)))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+trigger_cb (GIOChannel     *channel,
+            GIOCondition    condition,
+            HDIdleDetector *detector)
+{
+  HDIdleDetectorPrivate *priv = detector->priv;
+
+  if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+    {
+      g_warning ("%s. Pressure trigger failed, polling instead.", __FUNCTION__);
+
+      if (priv->cpu_trigger_id)
+        priv->cpu_trigger_id = (g_source_remove (priv->cpu_trigger_id), 0);
+      if (priv->io_trigger_id)
+        priv->io_trigger_id = (g_source_remove (priv->io_trigger_id), 0);
+      close_fd (&priv->cpu_trigger_fd);
+      close_fd (&priv->io_trigger_fd);
+
+      return FALSE;
+    }
+
+  /* The system got busy while we were waiting quietly for the window
+   * to pass, take a sample now and resume polling. */
+  if (priv->quiet && priv->timeout_id)
+    {
+      g_source_remove (priv->timeout_id);
+      priv->timeout_id = 0;
+      sample_timeout (detector);
+    }
+
+  return TRUE;
+}
+
+/* Arms a pressure trigger on @path which fires when tasks are stalled
+ * for more than @stall of the time.  Requires a kernel which supports
+ * PSI triggers, and CAP_SYS_RESOURCE before Linux 6.5. */
+static int
+arm_trigger (HDIdleDetector *detector,
+             const gchar    *path,
+             gdouble         stall,
+             guint          *source_id)
+{
+  GIOChannel *channel;
+  gchar *trigger;
+  int fd;
+
+  fd = open (path, O_RDWR | O_NONBLOCK);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        g_warning ("%s. Could not open %s. %s",
+                   __FUNCTION__, path, g_strerror (errno));
+      return -1;
+    }
+
+  trigger = g_strdup_printf ("some %u %u",
+                             (guint) CLAMP (stall * TRIGGER_WINDOW,
+                                            TRIGGER_WINDOW / 20,
+                                            TRIGGER_WINDOW - TRIGGER_WINDOW / 20),
+                             TRIGGER_WINDOW);
+  if (write (fd, trigger, strlen (trigger) + 1) < 0)
+    {
+      g_warning ("%s. Could not arm trigger on %s. %s",
+                 __FUNCTION__, path, g_strerror (errno));
+      g_free (trigger);
+      close (fd);
+      return -1;
+    }
+  g_free (trigger);
+
+  channel = g_io_channel_unix_new (fd);
+  *source_id = g_io_add_watch (channel,
+                               G_IO_PRI | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                               (GIOFunc) trigger_cb,
+                               detector);
+  g_io_channel_unref (channel);
+
+  return fd;
+}
+
+static gboolean
+open_pressure (HDIdleDetector *detector)
+{
+  HDIdleDetectorPrivate *priv = detector->priv;
+  HDIdlePolicy *policy = priv->policy;
+
+  priv->cpu_fd = open (PROC_PRESSURE_CPU, O_RDONLY);
+  if (priv->cpu_fd < 0)
+    return FALSE;
+
+  /* The I/O pressure is optional */
+  priv->io_fd = open (PROC_PRESSURE_IO, O_RDONLY);
+
+  if (policy->pressure_threshold > 0)
+    priv->cpu_trigger_fd = arm_trigger (detector,
+                                        PROC_PRESSURE_CPU,
+                                        policy->pressure_threshold,
+                                        &priv->cpu_trigger_id);
+  if (priv->cpu_trigger_fd >= 0 && priv->io_fd >= 0 && policy->io_threshold > 0)
+    priv->io_trigger_fd = arm_trigger (detector,
+                                       PROC_PRESSURE_IO,
+                                       policy->io_threshold,
+                                       &priv->io_trigger_id);
+
+  return TRUE;
+}
+
+static guint
+get_period (HDIdleDetector *detector)
+{
+  HDIdleDetectorPrivate *priv = detector->priv;
+
+  if (priv->source == HD_IDLE_DETECTOR_SOURCE_STAT)
+    return STAT_PERIOD;
+
+  /* If the triggers tell us when the system gets busy we can sleep
+   * through the window once the system looks idle. */
+  if (priv->quiet)
+    return MAX (priv->policy->window, PRESSURE_PERIOD);
+
+  return PRESSURE_PERIOD;
+}
+
+static gboolean
+sample_timeout (HDIdleDetector *detector)
+{
+  HDIdleDetectorPrivate *priv = detector->priv;
+  HDIdlePolicy *policy = priv->policy;
+  HDIdleSample sample;
+  guint64 total = 0, cpu_idle = 0, cpu_stall = 0, io_stall = 0;
+  gint64 now;
+  gboolean idle;
+
+  now = get_monotonic_time ();
+
+  if (!take_reading (detector, &total, &cpu_idle, &cpu_stall, &io_stall))
+    {
+      g_warning ("%s. Could not read the system load.", __FUNCTION__);
+      priv->timeout_id = 0;
+      hd_idle_detector_stop (detector);
+      return FALSE;
+    }
+
+  sample.duration = (now - priv->time) / 1000;
+  sample.cpu_idle = total - priv->total
+                    ? (gdouble) (cpu_idle - priv->cpu_idle) / (total - priv->total)
+                    : 0;
+
+  if (priv->source == HD_IDLE_DETECTOR_SOURCE_STAT)
+    {
+      sample.cpu_stall = -1;
+      sample.io_stall = -1;
+    }
+  else
+    {
+      gdouble time_diff = MAX (now - priv->time, 1);
+
+      sample.cpu_stall = CLAMP ((cpu_stall - priv->cpu_stall) / time_diff,
+                                0.0, 1.0);
+      sample.io_stall = priv->io_fd >= 0
+                        ? CLAMP ((io_stall - priv->io_stall) / time_diff, 0.0, 1.0)
+                        : -1;
+    }
+
+  priv->time = now;
+  priv->total = total;
+  priv->cpu_idle = cpu_idle;
+  priv->cpu_stall = cpu_stall;
+  priv->io_stall = io_stall;
+
+  idle = hd_idle_policy_feed (policy, &sample);
+
+  /* The handlers may stop and drop us. */
+  g_object_ref (detector);
+
+  g_signal_emit (detector, signals[SAMPLE], 0, policy->cpu_idle);
+
+  if (idle && !priv->idle)
+    {
+      priv->idle = TRUE;
+      g_signal_emit (detector, signals[IDLE], 0);
+    }
+
+  if (!priv->running)
+    {
+      g_object_unref (detector);
+      return FALSE;
+    }
+
+  /* Sleep until the window is over if the last sample was quiet and
+   * the triggers wake us up if this changes. */
+  priv->quiet = priv->cpu_trigger_fd >= 0 &&
+                sample.cpu_idle >= policy->threshold &&
+                sample.cpu_stall <= policy->pressure_threshold &&
+                (sample.io_stall < 0 || policy->io_threshold <= 0 ||
+                 sample.io_stall <= policy->io_threshold);
+
+  priv->timeout_id = g_timeout_add (get_period (detector),
+                                    (GSourceFunc) sample_timeout,
+                                    detector);
+
+  g_object_unref (detector);
+
+  return FALSE;
+}
+
+gboolean
+hd_idle_detector_start (HDIdleDetector *detector)
+{
+  HDIdleDetectorPrivate *priv;
+  guint64 total = 0, cpu_idle = 0, cpu_stall = 0, io_stall = 0;
+
+  g_return_val_if_fail (HD_IS_IDLE_DETECTOR (detector), FALSE);
+
+  priv = detector->priv;
+
+  if (priv->running)
+    return TRUE;
+
+  if (priv->source != HD_IDLE_DETECTOR_SOURCE_STAT)
+    {
+      if (open_pressure (detector))
+        priv->source = HD_IDLE_DETECTOR_SOURCE_PRESSURE;
+      else if (priv->source == HD_IDLE_DETECTOR_SOURCE_PRESSURE)
+        {
+          g_warning ("%s: %s", PROC_PRESSURE_CPU, g_strerror (errno));
+          return FALSE;
+        }
+      else
+        priv->source = HD_IDLE_DETECTOR_SOURCE_STAT;
+    }
+
+  /* The jiffies tell the idle ratio with either source */
+  priv->stat_fd = open (PROC_STAT, O_RDONLY);
+  if (priv->stat_fd < 0)
+    {
+      g_warning ("%s: %s", PROC_STAT, g_strerror (errno));
+      hd_idle_detector_stop (detector);
+      return FALSE;
+    }
+
+  /* We need two consecutive readings to calculate a sample. */
+  priv->time = get_monotonic_time ();
+  if (!take_reading (detector, &total, &cpu_idle, &cpu_stall, &io_stall))
+    {
+      g_warning ("%s. Could not read the system load.", __FUNCTION__);
+      hd_idle_detector_stop (detector);
+      return FALSE;
+    }
+
+  priv->total = total;
+  priv->cpu_idle = cpu_idle;
+  priv->cpu_stall = cpu_stall;
+  priv->io_stall = io_stall;
+  priv->running = TRUE;
+  priv->quiet = FALSE;
+  priv->idle = FALSE;
+
+  hd_idle_policy_reset (priv->policy);
+
+  priv->timeout_id = g_timeout_add (get_period (detector),
+                                    (GSourceFunc) sample_timeout,
+                                    detector);
+
+  return TRUE;
+}
+
+void
+hd_idle_detector_stop (HDIdleDetector *detector)
+{
+  HDIdleDetectorPrivate *priv;
+
+  g_return_if_fail (HD_IS_IDLE_DETECTOR (detector));
+
+  priv = detector->priv;
+
+  priv->running = FALSE;
+
+  if (priv->timeout_id)
+    priv->timeout_id = (g_source_remove (priv->timeout_id), 0);
+  if (priv->cpu_trigger_id)
+    priv->cpu_trigger_id = (g_source_remove (priv->cpu_trigger_id), 0);
+  if (priv->io_trigger_id)
+    priv->io_trigger_id = (g_source_remove (priv->io_trigger_id), 0);
+
+  close_fd (&priv->cpu_trigger_fd);
+  close_fd (&priv->io_trigger_fd);
+  close_fd (&priv->stat_fd);
+  close_fd (&priv->cpu_fd);
+  close_fd (&priv->io_fd);
+}
+
+HDIdleDetectorSource
+hd_idle_detector_get_source (HDIdleDetector *detector)
+{
+  g_return_val_if_fail (HD_IS_IDLE_DETECTOR (detector), HD_IDLE_DETECTOR_SOURCE_AUTO);
+
+  return detector->priv->source;
+}
+
+HDIdlePolicy *
+hd_idle_detector_get_policy (HDIdleDetector *detector)
+{
+  g_return_val_if_fail (HD_IS_IDLE_DETECTOR (detector), NULL);
+
+  return detector->priv->policy;
+}
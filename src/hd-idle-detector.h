@@ -0,0 +1,79 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_IDLE_DETECTOR_H__
+#define __HD_IDLE_DETECTOR_H__
+
+#include <glib-object.h>
+
+#include "hd-idle-policy.h"
+
+G_BEGIN_DECLS
+
+#define HD_TYPE_IDLE_DETECTOR            (hd_idle_detector_get_type ())
+#define HD_IDLE_DETECTOR(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), HD_TYPE_IDLE_DETECTOR, HDIdleDetector))
+#define HD_IDLE_DETECTOR_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass),  HD_TYPE_IDLE_DETECTOR, HDIdleDetectorClass))
+#define HD_IS_IDLE_DETECTOR(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), HD_TYPE_IDLE_DETECTOR))
+#define HD_IS_IDLE_DETECTOR_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass),  HD_TYPE_IDLE_DETECTOR))
+#define HD_IDLE_DETECTOR_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj),  HD_TYPE_IDLE_DETECTOR, HDIdleDetectorClass))
+
+typedef struct _HDIdleDetector        HDIdleDetector;
+typedef struct _HDIdleDetectorClass   HDIdleDetectorClass;
+typedef struct _HDIdleDetectorPrivate HDIdleDetectorPrivate;
+
+typedef enum
+{
+  HD_IDLE_DETECTOR_SOURCE_AUTO,
+  HD_IDLE_DETECTOR_SOURCE_PRESSURE,
+  HD_IDLE_DETECTOR_SOURCE_STAT
+} HDIdleDetectorSource;
+
+/** HDIdleDetector:
+ *
+ * Watches the system load and emits "idle" when the #HDIdlePolicy
+ * considers the system idle enough.
+ */
+struct _HDIdleDetector
+{
+  GObject parent;
+
+  HDIdleDetectorPrivate *priv;
+};
+
+struct _HDIdleDetectorClass
+{
+  GObjectClass parent;
+};
+
+GType                 hd_idle_detector_get_type   (void);
+
+HDIdleDetector       *hd_idle_detector_new        (HDIdlePolicy         *policy,
+                                                   HDIdleDetectorSource  source);
+
+gboolean              hd_idle_detector_start      (HDIdleDetector       *detector);
+void                  hd_idle_detector_stop       (HDIdleDetector       *detector);
+
+HDIdleDetectorSource  hd_idle_detector_get_source (HDIdleDetector       *detector);
+HDIdlePolicy         *hd_idle_detector_get_policy (HDIdleDetector       *detector);
+
+G_END_DECLS
+
+#endif
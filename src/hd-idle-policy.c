@@ -0,0 +1,647 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hd-idle-policy.h"
+
+static void update_averages (HDIdlePolicy *policy);
+
+HDIdlePolicy *
+hd_idle_policy_new (guint   window,
+                    gdouble threshold,
+                    gdouble pressure_threshold,
+                    gdouble io_threshold)
+{
+  HDIdlePolicy *policy = g_slice_new0 (HDIdlePolicy);
+
+  policy->decide = hd_idle_policy_decide_average;
+  policy->window = window;
+  policy->threshold = threshold;
+  policy->pressure_threshold = pressure_threshold;
+  policy->io_threshold = io_threshold;
+  policy->cpu_stall = -1;
+  policy->io_stall = -1;
+  g_queue_init (&policy->samples);
+
+  return policy;
+}
+
+void
+hd_idle_policy_free (HDIdlePolicy *policy)
+{
+  if (!policy)
+    return;
+
+  hd_idle_policy_reset (policy);
+
+  g_slice_free (HDIdlePolicy, policy);
+}
+
+void
+hd_idle_policy_set_decide_func (HDIdlePolicy           *policy,
+                                HDIdlePolicyDecideFunc  decide)
+{
+  g_return_if_fail (policy);
+
+  policy->decide = decide ? decide : hd_idle_policy_decide_average;
+}
+
+void
+hd_idle_policy_reset (HDIdlePolicy *policy)
+{
+  HDIdleSample *sample;
+
+  g_return_if_fail (policy);
+
+  while ((sample = g_queue_pop_head (&policy->samples)))
+    g_slice_free (HDIdleSample, sample);
+
+  policy->covered = 0;
+  policy->cpu_idle = 0;
+  policy->cpu_stall = -1;
+  policy->io_stall = -1;
+}
+
+/* Add @sample to the window and returns whether the policy considers
+ * the system idle now.  Samples falling out of the window are dropped. */
+gboolean
+hd_idle_policy_feed (HDIdlePolicy       *policy,
+                     const HDIdleSample *sample)
+{
+  HDIdleSample *head;
+
+  g_return_val_if_fail (policy, FALSE);
+  g_return_val_if_fail (sample, FALSE);
+
+  if (!sample->duration)
+    return FALSE;
+
+  g_queue_push_tail (&policy->samples,
+                     g_slice_dup (HDIdleSample, sample));
+  policy->covered += sample->duration;
+
+  /* Keep the shortest tail which still covers the window. */
+  while ((head = g_queue_peek_head (&policy->samples)) &&
+         policy->covered - head->duration >= policy->window)
+    {
+      policy->covered -= head->duration;
+      g_slice_free (HDIdleSample, g_queue_pop_head (&policy->samples));
+    }
+
+  update_averages (policy);
+
+  if (policy->covered < policy->window)
+    return FALSE;
+
+  return policy->decide (policy);
+}
+
+static void
+update_averages (HDIdlePolicy *policy)
+{
+  GList *l;
+  gdouble cpu_idle = 0, cpu_stall = 0, io_stall = 0;
+  guint cpu_covered = 0, io_covered = 0;
+
+  for (l = policy->samples.head; l; l = l->next)
+    {
+      HDIdleSample *sample = l->data;
+
+      cpu_idle += sample->cpu_idle * sample->duration;
+
+      if (sample->cpu_stall >= 0)
+        {
+          cpu_stall += sample->cpu_stall * sample->duration;
+          cpu_covered += sample->duration;
+        }
+
+      if (sample->io_stall >= 0)
+        {
+          io_stall += sample->io_stall * sample->duration;
+          io_covered += sample->duration;
+        }
+    }
+
+  policy->cpu_idle = policy->covered ? cpu_idle / policy->covered : 0;
+  policy->cpu_stall = cpu_covered ? cpu_stall / cpu_covered : -1;
+  policy->io_stall = io_covered ? io_stall / io_covered : -1;
+}
+
+/* The default policy: the average CPU idle ratio over the window has
+ * reached the threshold and tasks were not stalled on the CPU or I/O
+ * too much.  The stall ratios only show contention, a single CPU bound
+ * task does not stall anybody, so they cannot replace the idle ratio. */
+gboolean
+hd_idle_policy_decide_average (HDIdlePolicy *policy)
+{
+  if (policy->cpu_idle < policy->threshold)
+    return FALSE;
+
+  if (policy->cpu_stall >= 0 && policy->pressure_threshold > 0 &&
+      policy->cpu_stall > policy->pressure_threshold)
+    return FALSE;
+
+  if (policy->io_stall >= 0 && policy->io_threshold > 0 &&
+      policy->io_stall > policy->io_threshold)
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Parses the aggregate "cpu" line of /proc/stat. */
+gboolean
+hd_idle_policy_parse_stat (const gchar *text,
+                           guint64     *total,
+                           guint64     *idle)
+{
+  guint64 usr, nic, sys, idl, iowait, irq, softirq, steal;
+
+  g_return_val_if_fail (text, FALSE);
+
+  if (sscanf (text, "cpu  "
+              "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+              " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+              " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+              " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+              &usr, &nic, &sys, &idl, &iowait, &irq,
+              &softirq, &steal) < 8)
+    return FALSE;
+
+  if (total)
+    *total = usr + nic + sys + idl + iowait + irq + softirq + steal;
+  if (idle)
+    *idle = idl;
+
+  return TRUE;
+}
+
+/* Parses the total stall time in microseconds from the "some" line
+ * of a /proc/pressure file. */
+gboolean
+hd_idle_policy_parse_pressure (const gchar *text,
+                               guint64     *some_total)
+{
+  const gchar *total;
+
+  g_return_val_if_fail (text, FALSE);
+
+  if (!g_str_has_prefix (text, "some "))
+    return FALSE;
+
+  total = strstr (text, "total=");
+  if (!total)
+    return FALSE;
+
+  if (some_total)
+    *some_total = g_ascii_strtoull (total + strlen ("total="), NULL, 10);
+
+  return TRUE;
+}
+
+#ifdef COMPILE_FOR_TEST
+typedef struct
+{
+  guint        time;    /* ms */
+  const gchar *stat;
+  const gchar *cpu;
+  const gchar *io;
+} TestReading;
+
+typedef enum
+{
+  REPLAY_STAT,
+  REPLAY_PRESSURE,
+  /* Idle as 1 - CPU stall, how the pressure source first worked */
+  REPLAY_STALL_AS_IDLE
+} ReplayMode;
+
+/* Recorded on a single CPU system every 250 ms: idle for a second,
+ * three CPU bound tasks competing for 5 s like at startup, then idle. */
+static const TestReading startup_trace[] =
+{
+  {     0, "cpu  69915 0 18332 326704 490 0 8 585 0 0",
+           "some avg10=0.57 avg60=1.36 avg300=1.49 total=164365585",
+           "some avg10=0.00 avg60=0.06 avg300=0.02 total=5457968" },
+  {   250, "cpu  69915 0 18332 326728 490 0 8 585 0 0",
+           "some avg10=0.57 avg60=1.36 avg300=1.49 total=164365585",
+           "some avg10=0.00 avg60=0.06 avg300=0.02 total=5457968" },
+  {   500, "cpu  69915 0 18332 326753 490 0 8 585 0 0",
+           "some avg10=0.57 avg60=1.36 avg300=1.49 total=164365585",
+           "some avg10=0.00 avg60=0.06 avg300=0.02 total=5457968" },
+  {   751, "cpu  69916 0 18332 326778 490 0 8 585 0 0",
+           "some avg10=1.19 avg60=1.45 avg300=1.51 total=164365585",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  1016, "cpu  69917 0 18333 326803 490 0 8 585 0 0",
+           "some avg10=1.19 avg60=1.45 avg300=1.51 total=164380172",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  1267, "cpu  69940 0 18334 326803 490 0 8 586 0 0",
+           "some avg10=1.19 avg60=1.45 avg300=1.51 total=164630689",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  1517, "cpu  69965 0 18334 326803 490 0 8 586 0 0",
+           "some avg10=1.19 avg60=1.45 avg300=1.51 total=164881110",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  1768, "cpu  69990 0 18334 326803 490 0 8 586 0 0",
+           "some avg10=1.19 avg60=1.45 avg300=1.51 total=165131555",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  2018, "cpu  70015 0 18334 326803 490 0 8 586 0 0",
+           "some avg10=1.19 avg60=1.45 avg300=1.51 total=165381989",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  2272, "cpu  70040 0 18335 326803 490 0 8 586 0 0",
+           "some avg10=1.19 avg60=1.45 avg300=1.51 total=165636002",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  2524, "cpu  70065 0 18335 326803 490 0 8 586 0 0",
+           "some avg10=1.19 avg60=1.45 avg300=1.51 total=165887909",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  2775, "cpu  70090 0 18335 326803 490 0 8 586 0 0",
+           "some avg10=16.73 avg60=4.25 avg300=2.09 total=166138275",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  3028, "cpu  70115 0 18335 326803 490 0 8 586 0 0",
+           "some avg10=16.73 avg60=4.25 avg300=2.09 total=166391850",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  3279, "cpu  70140 0 18335 326803 490 0 8 586 0 0",
+           "some avg10=16.73 avg60=4.25 avg300=2.09 total=166642193",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  3532, "cpu  70166 0 18335 326803 490 0 8 586 0 0",
+           "some avg10=16.73 avg60=4.25 avg300=2.09 total=166895809",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5457968" },
+  {  3783, "cpu  70190 0 18335 326803 490 0 8 586 0 0",
+           "some avg10=16.73 avg60=4.25 avg300=2.09 total=167146243",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  4033, "cpu  70215 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=16.73 avg60=4.25 avg300=2.09 total=167396623",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  4284, "cpu  70240 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=16.73 avg60=4.25 avg300=2.09 total=167647008",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  4534, "cpu  70265 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=16.73 avg60=4.25 avg300=2.09 total=167897624",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  4788, "cpu  70290 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=31.63 avg60=7.35 avg300=2.76 total=168151645",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  5039, "cpu  70315 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=31.63 avg60=7.35 avg300=2.76 total=168402024",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  5292, "cpu  70341 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=31.63 avg60=7.35 avg300=2.76 total=168655632",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  5543, "cpu  70366 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=31.63 avg60=7.35 avg300=2.76 total=168906074",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  5793, "cpu  70391 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=31.63 avg60=7.35 avg300=2.76 total=169156511",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  6048, "cpu  70416 0 18336 326803 490 0 8 586 0 0",
+           "some avg10=31.63 avg60=7.35 avg300=2.76 total=169411803",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  6299, "cpu  70416 0 18336 326827 490 0 8 586 0 0",
+           "some avg10=31.63 avg60=7.35 avg300=2.76 total=169411803",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  6549, "cpu  70416 0 18336 326852 490 0 8 586 0 0",
+           "some avg10=31.63 avg60=7.35 avg300=2.76 total=169411803",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  6800, "cpu  70417 0 18336 326877 490 0 8 586 0 0",
+           "some avg10=38.04 avg60=9.30 avg300=3.20 total=169411803",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  7051, "cpu  70417 0 18336 326901 490 0 8 586 0 0",
+           "some avg10=38.04 avg60=9.30 avg300=3.20 total=169415363",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  7301, "cpu  70417 0 18336 326926 490 0 8 586 0 0",
+           "some avg10=38.04 avg60=9.30 avg300=3.20 total=169415363",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  7552, "cpu  70417 0 18336 326950 490 0 8 586 0 0",
+           "some avg10=38.04 avg60=9.30 avg300=3.20 total=169415363",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  7802, "cpu  70417 0 18336 326975 490 0 8 586 0 0",
+           "some avg10=38.04 avg60=9.30 avg300=3.20 total=169415363",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  8053, "cpu  70418 0 18336 327000 490 0 8 586 0 0",
+           "some avg10=38.04 avg60=9.30 avg300=3.20 total=169417060",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  8303, "cpu  70418 0 18336 327025 490 0 8 586 0 0",
+           "some avg10=38.04 avg60=9.30 avg300=3.20 total=169417060",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  8554, "cpu  70418 0 18336 327049 490 0 8 586 0 0",
+           "some avg10=38.04 avg60=9.30 avg300=3.20 total=169417060",
+           "some avg10=0.00 avg60=0.05 avg300=0.02 total=5458433" },
+  {  8804, "cpu  70418 0 18336 327074 490 0 8 586 0 0",
+           "some avg10=31.15 avg60=8.99 avg300=3.17 total=169417060",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  9055, "cpu  70419 0 18336 327099 490 0 8 586 0 0",
+           "some avg10=31.15 avg60=8.99 avg300=3.17 total=169419177",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  9306, "cpu  70419 0 18336 327124 490 0 8 586 0 0",
+           "some avg10=31.15 avg60=8.99 avg300=3.17 total=169419177",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  9556, "cpu  70419 0 18336 327148 490 0 8 586 0 0",
+           "some avg10=31.15 avg60=8.99 avg300=3.17 total=169419177",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  9807, "cpu  70419 0 18336 327173 490 0 8 586 0 0",
+           "some avg10=31.15 avg60=8.99 avg300=3.17 total=169419177",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+};
+
+/* Recorded on the same system: a single CPU bound task for 8 s. */
+static const TestReading cpu_bound_trace[] =
+{
+  {     0, "cpu  70420 0 18336 327197 490 0 8 586 0 0",
+           "some avg10=31.15 avg60=8.99 avg300=3.17 total=169422920",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {   254, "cpu  70445 0 18337 327197 490 0 8 586 0 0",
+           "some avg10=31.15 avg60=8.99 avg300=3.17 total=169444243",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {   505, "cpu  70470 0 18337 327197 490 0 8 586 0 0",
+           "some avg10=31.15 avg60=8.99 avg300=3.17 total=169449611",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {   755, "cpu  70495 0 18337 327197 490 0 8 586 0 0",
+           "some avg10=25.87 avg60=8.76 avg300=3.16 total=169459902",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  1006, "cpu  70519 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=25.87 avg60=8.76 avg300=3.16 total=169470910",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  1256, "cpu  70544 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=25.87 avg60=8.76 avg300=3.16 total=169474622",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  1507, "cpu  70569 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=25.87 avg60=8.76 avg300=3.16 total=169475899",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  1757, "cpu  70594 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=25.87 avg60=8.76 avg300=3.16 total=169478522",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  2008, "cpu  70619 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=25.87 avg60=8.76 avg300=3.16 total=169488222",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  2258, "cpu  70645 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=25.87 avg60=8.76 avg300=3.16 total=169499114",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  2508, "cpu  70669 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=25.87 avg60=8.76 avg300=3.16 total=169500200",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  2759, "cpu  70694 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=21.54 avg60=8.54 avg300=3.16 total=169506570",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  3009, "cpu  70719 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=21.54 avg60=8.54 avg300=3.16 total=169515819",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  3260, "cpu  70744 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=21.54 avg60=8.54 avg300=3.16 total=169516908",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  3510, "cpu  70769 0 18338 327197 490 0 8 586 0 0",
+           "some avg10=21.54 avg60=8.54 avg300=3.16 total=169522601",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  3760, "cpu  70793 0 18339 327197 490 0 8 586 0 0",
+           "some avg10=21.54 avg60=8.54 avg300=3.16 total=169529662",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  4011, "cpu  70819 0 18339 327197 490 0 8 586 0 0",
+           "some avg10=21.54 avg60=8.54 avg300=3.16 total=169536591",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  4261, "cpu  70843 0 18339 327197 490 0 8 586 0 0",
+           "some avg10=21.54 avg60=8.54 avg300=3.16 total=169538069",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  4512, "cpu  70868 0 18339 327197 490 0 8 586 0 0",
+           "some avg10=21.54 avg60=8.54 avg300=3.16 total=169540426",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  4766, "cpu  70894 0 18339 327197 490 0 8 586 0 0",
+           "some avg10=18.00 avg60=8.33 avg300=3.15 total=169563653",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  5016, "cpu  70919 0 18339 327197 490 0 8 586 0 0",
+           "some avg10=18.00 avg60=8.33 avg300=3.15 total=169571817",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  5267, "cpu  70943 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=18.00 avg60=8.33 avg300=3.15 total=169575945",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  5517, "cpu  70968 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=18.00 avg60=8.33 avg300=3.15 total=169577152",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  5768, "cpu  70993 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=18.00 avg60=8.33 avg300=3.15 total=169584274",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  6018, "cpu  71019 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=18.00 avg60=8.33 avg300=3.15 total=169595215",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  6269, "cpu  71043 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=18.00 avg60=8.33 avg300=3.15 total=169596281",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  6519, "cpu  71069 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=18.00 avg60=8.33 avg300=3.15 total=169598006",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  6769, "cpu  71093 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=15.10 avg60=8.12 avg300=3.14 total=169601934",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  7020, "cpu  71119 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=15.10 avg60=8.12 avg300=3.14 total=169612570",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  7270, "cpu  71144 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=15.10 avg60=8.12 avg300=3.14 total=169613671",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  7520, "cpu  71169 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=15.10 avg60=8.12 avg300=3.14 total=169617485",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+  {  7771, "cpu  71194 0 18340 327197 490 0 8 586 0 0",
+           "some avg10=15.10 avg60=8.12 avg300=3.14 total=169621848",
+           "some avg10=0.00 avg60=0.04 avg300=0.02 total=5458433" },
+};
+
+/* The defaults of the [Waitidle] group of home.conf */
+static HDIdlePolicy *
+test_policy_new (void)
+{
+  return hd_idle_policy_new (3000, 0.1, 0.05, 0.3);
+}
+
+/* Feeds @trace through @policy like HDIdleDetector computes the
+ * samples and returns the time of the first idle decision in ms, or
+ * -1 if the system never looked idle. */
+static gint
+replay (HDIdlePolicy      *policy,
+        const TestReading *trace,
+        guint              n_readings,
+        ReplayMode         mode)
+{
+  guint64 prev_total = 0, prev_idle = 0, prev_cpu = 0, prev_io = 0;
+  guint i;
+
+  for (i = 0; i < n_readings; i++)
+    {
+      guint64 total, idle, cpu, io;
+      HDIdleSample sample;
+      gdouble time_diff;
+
+      g_assert (hd_idle_policy_parse_stat (trace[i].stat, &total, &idle));
+      g_assert (hd_idle_policy_parse_pressure (trace[i].cpu, &cpu));
+      g_assert (hd_idle_policy_parse_pressure (trace[i].io, &io));
+
+      if (i > 0)
+        {
+          sample.duration = trace[i].time - trace[i - 1].time;
+          time_diff = sample.duration * 1000.0;
+
+          sample.cpu_idle = total - prev_total
+                            ? (gdouble) (idle - prev_idle) / (total - prev_total)
+                            : 0;
+          sample.cpu_stall = CLAMP ((cpu - prev_cpu) / time_diff, 0.0, 1.0);
+          sample.io_stall = CLAMP ((io - prev_io) / time_diff, 0.0, 1.0);
+
+          if (mode == REPLAY_STAT)
+            sample.cpu_stall = sample.io_stall = -1;
+          else if (mode == REPLAY_STALL_AS_IDLE)
+            {
+              sample.cpu_idle = 1.0 - sample.cpu_stall;
+              sample.cpu_stall = -1;
+            }
+
+          if (hd_idle_policy_feed (policy, &sample))
+            return trace[i].time;
+        }
+
+      prev_total = total;
+      prev_idle = idle;
+      prev_cpu = cpu;
+      prev_io = io;
+    }
+
+  return -1;
+}
+
+static void
+test_parse (void)
+{
+  guint64 total, idle, stall;
+
+  g_assert (hd_idle_policy_parse_stat ("cpu  1 2 3 4 5 6 7 8 9 10\n"
+                                       "cpu0 1 2 3 4 5 6 7 8 9 10\n",
+                                       &total, &idle));
+  g_assert_cmpuint (total, ==, 36);
+  g_assert_cmpuint (idle, ==, 4);
+  g_assert (!hd_idle_policy_parse_stat ("cpu  1 2 3\n", &total, &idle));
+  g_assert (!hd_idle_policy_parse_stat ("intr 1 2 3 4 5 6 7 8\n", &total, &idle));
+
+  g_assert (hd_idle_policy_parse_pressure ("some avg10=0.57 avg60=1.36 avg300=1.49 total=164365585\n"
+                                           "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n",
+                                           &stall));
+  g_assert_cmpuint (stall, ==, 164365585);
+  g_assert (!hd_idle_policy_parse_pressure ("full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n",
+                                            &stall));
+}
+
+/* No decision before the samples cover the window, then the duration
+ * weighted average counts. */
+static void
+test_window (void)
+{
+  HDIdlePolicy *policy = test_policy_new ();
+  HDIdleSample idle = { 1000, 1.0, 0.0, 0.0 };
+  HDIdleSample busy = { 1000, 0.0, 1.0, 0.0 };
+  HDIdleSample short_busy = { 250, 0.0, 1.0, 0.0 };
+
+  g_assert (!hd_idle_policy_feed (policy, &idle));
+  g_assert (!hd_idle_policy_feed (policy, &idle));
+  g_assert (hd_idle_policy_feed (policy, &idle));
+
+  /* A third of the window was stalled on the CPU */
+  g_assert (!hd_idle_policy_feed (policy, &busy));
+  g_assert_cmpfloat (policy->cpu_idle, >=, 0.6);
+  g_assert_cmpfloat (policy->cpu_stall, >=, 0.3);
+
+  g_assert (!hd_idle_policy_feed (policy, &idle));
+  g_assert (!hd_idle_policy_feed (policy, &idle));
+  g_assert (hd_idle_policy_feed (policy, &idle));
+  g_assert (!hd_idle_policy_feed (policy, &short_busy));
+
+  hd_idle_policy_reset (policy);
+  g_assert_cmpuint (policy->covered, ==, 0);
+  g_assert (!hd_idle_policy_feed (policy, &idle));
+
+  hd_idle_policy_free (policy);
+}
+
+/* The widgets must not come up while the startup load lasts, the time
+ * they do is the time to desktop the sources give.  With the jiffies
+ * alone the idle second before the load is enough to reach the default
+ * threshold over the window, the stalls show the load. */
+static void
+test_startup (void)
+{
+  HDIdlePolicy *policy = test_policy_new ();
+  guint busy_until = 6048;
+  gint stat_time, pressure_time;
+
+  stat_time = replay (policy, startup_trace,
+                      G_N_ELEMENTS (startup_trace), REPLAY_STAT);
+  hd_idle_policy_reset (policy);
+  pressure_time = replay (policy, startup_trace,
+                          G_N_ELEMENTS (startup_trace), REPLAY_PRESSURE);
+
+  g_test_message ("Time to desktop: stat %d ms, pressure %d ms, "
+                  "the load ends at %u ms",
+                  stat_time, pressure_time, busy_until);
+
+  g_assert_cmpint (stat_time, !=, -1);
+  g_assert_cmpint (pressure_time, >, busy_until);
+
+  /* Runnable tasks waited for the CPU until the window, give or take
+   * a sample, had passed without load. */
+  g_assert_cmpint (pressure_time, <=, busy_until + 3000 + 250);
+
+  hd_idle_policy_free (policy);
+}
+
+/* A single CPU bound task stalls nobody, only the idle time shows it. */
+static void
+test_cpu_bound (void)
+{
+  HDIdlePolicy *policy = test_policy_new ();
+
+  g_assert_cmpint (replay (policy, cpu_bound_trace,
+                           G_N_ELEMENTS (cpu_bound_trace),
+                           REPLAY_STAT), ==, -1);
+  hd_idle_policy_reset (policy);
+  g_assert_cmpint (replay (policy, cpu_bound_trace,
+                           G_N_ELEMENTS (cpu_bound_trace),
+                           REPLAY_PRESSURE), ==, -1);
+
+  hd_idle_policy_reset (policy);
+  g_assert_cmpint (replay (policy, cpu_bound_trace,
+                           G_N_ELEMENTS (cpu_bound_trace),
+                           REPLAY_STALL_AS_IDLE), !=, -1);
+
+  hd_idle_policy_free (policy);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/idle-policy/parse", test_parse);
+  g_test_add_func ("/idle-policy/window", test_window);
+  g_test_add_func ("/idle-policy/startup", test_startup);
+  g_test_add_func ("/idle-policy/cpu-bound", test_cpu_bound);
+
+  return g_test_run ();
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_IDLE_POLICY_H__
+#define __HD_IDLE_POLICY_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* One measurement of the system load covering @duration milliseconds.
+ * @cpu_idle is the share of the CPU time spent idle, @cpu_stall and
+ * @io_stall the share of the time runnable tasks waited for a CPU or
+ * for I/O.  The stalls are negative if the source cannot tell
+ * (/proc/stat only). */
+typedef struct
+{
+  guint   duration;
+  gdouble cpu_idle;
+  gdouble cpu_stall;
+  gdouble io_stall;
+} HDIdleSample;
+
+typedef struct _HDIdlePolicy HDIdlePolicy;
+
+/* Decides whether the system is idle enough, given @policy which
+ * already contains the samples of the last window. */
+typedef gboolean (*HDIdlePolicyDecideFunc) (HDIdlePolicy *policy);
+
+struct _HDIdlePolicy
+{
+  HDIdlePolicyDecideFunc decide;
+
+  /* Configuration */
+  guint   window;
+  gdouble threshold;
+  gdouble pressure_threshold;
+  gdouble io_threshold;
+
+  /* Ring of the samples which cover at least the last @window ms */
+  GQueue  samples;
+  guint   covered;
+
+  /* Duration weighted averages over the ring */
+  gdouble cpu_idle;
+  gdouble cpu_stall;
+  gdouble io_stall;
+};
+
+HDIdlePolicy *hd_idle_policy_new              (guint                   window,
+                                               gdouble                 threshold,
+                                               gdouble                 pressure_threshold,
+                                               gdouble                 io_threshold);
+void          hd_idle_policy_free             (HDIdlePolicy           *policy);
+
+void          hd_idle_policy_set_decide_func  (HDIdlePolicy           *policy,
+                                               HDIdlePolicyDecideFunc  decide);
+
+gboolean      hd_idle_policy_feed             (HDIdlePolicy           *policy,
+                                               const HDIdleSample     *sample);
+void          hd_idle_policy_reset            (HDIdlePolicy           *policy);
+
+gboolean      hd_idle_policy_decide_average   (HDIdlePolicy           *policy);
+
+gboolean      hd_idle_policy_parse_stat       (const gchar            *text,
+                                               guint64                *total,
+                                               guint64                *idle);
+gboolean      hd_idle_policy_parse_pressure   (const gchar            *text,
+                                               guint64                *some_total);
+
+G_END_DECLS
+
+#endif
@@ -31,6 +31,7 @@
 #include "hd-desktop.h"
 #include "hd-object-vector.h"
 #include "hd-pixbuf-utils.h"
+#include "hd-trace.h"
 
 #include "hd-imageset-background.h"
 
@@ -165,6 +166,8 @@ create_cached_image_command (CommandData *data)
 
   gboolean error_dialogs = TRUE, update_gconf = TRUE;
 
+  HD_TRACE_BEGIN ("create-cached-image");
+
   if (g_cancellable_is_cancelled (data->cancellable))
     goto cleanup;
 
@@ -213,6 +216,8 @@ cleanup:
   if (pixbuf)
     g_object_unref (pixbuf);
   g_free (etag);
+
+  HD_TRACE_END ("create-cached-image");
 }
 
 static GFile *
@@ -35,6 +35,7 @@
 #include "hd-cairo-surface-cache.h"
 #include "hd-incoming-event-window.h"
 #include "hd-incoming-events.h"
+#include "hd-metrics.h"
 #include "hd-time-difference.h"
 
 /* Pixel sizes */
@@ -222,7 +223,7 @@ hd_incoming_event_window_update_time (HDIncomingEventWindow *window)
   time_t current_time, difference, timeout;
   gchar *time_text;
 
-  time (&current_time);
+  current_time = hd_time_difference_now ();
 
   difference = current_time - priv->time;
 
@@ -386,6 +387,8 @@ hd_incoming_event_window_finalize (GObject *object)
 
   priv->destination = (g_free (priv->destination), NULL);
 
+  hd_metrics_add (HD_METRICS_NOTIFICATION_WINDOWS, -1);
+
   G_OBJECT_CLASS (hd_incoming_event_window_parent_class)->finalize (object);
 }
 
@@ -635,6 +638,8 @@ hd_incoming_event_window_init (HDIncomingEventWindow *window)
 
   window->priv = priv;
 
+  hd_metrics_add (HD_METRICS_NOTIFICATION_WINDOWS, 1);
+
   main_table = gtk_table_new (2, 2, FALSE);
   gtk_table_set_col_spacings (GTK_TABLE (main_table), ICON_SPACING);
   gtk_container_set_border_width (GTK_CONTAINER (main_table), WINDOW_MARGIN);
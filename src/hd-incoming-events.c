@@ -35,8 +35,6 @@
 #include <mce/dbus-names.h>
 #include <mce/mode-names.h>
 
-#include <osso-mem.h>
-
 #include <gdk/gdkx.h>
 
 #include <X11/X.h>
@@ -45,7 +43,12 @@
 #include "hd-incoming-event-window.h"
 #include "hd-notification-manager.h"
 #include "hd-led-pattern.h"
+#include "hd-memory-pressure.h"
+#include "hd-rate-limiter.h"
 #include "hd-multi-map.h"
+#include "hd-notification-plugin-queue.h"
+#include "hd-sv-event-queue.h"
+#include "hd-sv-plugin.h"
 
 #include "hd-incoming-events.h"
 
@@ -70,6 +73,17 @@
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_NAME  "com.nokia.HildonSVNotificationDaemon" 
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_PATH  "/com/nokia/HildonSVNotificationDaemon"
 
+/* Selects whether the sound/vibra plugin is called through the daemon
+ * or loaded into hildon-home, see notification.conf */
+#define HD_SV_FEEDBACK_CONFIG_FILE  HD_DESKTOP_CONFIG_PATH "/notification.conf"
+#define HD_SV_FEEDBACK_GROUP        "SV-Feedback"
+#define HD_SV_FEEDBACK_KEY_MODE     "Mode"
+
+/* Default limit of sound, vibra and LED feedback per sender and
+ * category, see notification.conf */
+#define FEEDBACK_RATE  1
+#define FEEDBACK_BURST 3
+
 typedef struct _Notifications Notifications;
 
 
@@ -136,18 +150,27 @@ struct _HDIncomingEventsPrivate
 
   GHashTable      *switcher_groups;
 
+  /* HDNotificationPluginQueues of the notification plugins */
   GPtrArray       *plugins;
 
   HDPluginManager *plugin_manager;
 
   DBusGProxy      *mce_proxy;
   DBusGProxy      *sv_daemon_proxy;
+  HDSVPlugin      *sv_plugin;
+  HDSVEventQueue  *sv_queue;
+
+  HDRateLimiter   *feedback_limiter;
 
   gboolean         device_locked : 1;
   gboolean         display_on : 1;
   gboolean         task_switcher_shown : 1;
 
   HDMultiMap      *unperceived_notifications;
+
+  /* Set of Notifications to update after a bulk close, %NULL
+   * if none is in progress. */
+  GHashTable      *deferred_updates;
 };
 
 enum
@@ -187,6 +210,8 @@ static void
 notification_closed_cb (HDNotification *n,
                         Notifications  *ns)
 {
+  HDIncomingEventsPrivate *priv = hd_incoming_events_get ()->priv;
+
   g_ptr_array_remove (ns->notifications,
                       n);
   g_signal_handlers_disconnect_by_func (n,
@@ -194,7 +219,12 @@ notification_closed_cb (HDNotification *n,
                                         ns);
   g_object_unref (n);
 
-  if (ns->cb)
+  if (!ns->cb)
+    return;
+
+  if (priv->deferred_updates)
+    g_hash_table_insert (priv->deferred_updates, ns, ns);
+  else
     ns->cb (ns, ns->cb_data);
 }
 
@@ -343,13 +373,21 @@ repack_ptr_array (GPtrArray *array)
                             array->len - dest_id);
 }
 
-/* Close all notifications and call the update cb */
+/* Close all notifications in one go and call the update cb.  Other
+ * Notifications containing some of them are updated once at the end. */
 static void
 notifications_close_all (Notifications *ns,
                          gboolean       close_sticky)
 {
+  HDIncomingEventsPrivate *priv = hd_incoming_events_get ()->priv;
+  GPtrArray *closed;
+  GArray *ids;
+  GHashTable *deferred_updates = NULL;
   guint i;
 
+  closed = g_ptr_array_new ();
+  ids = g_array_new (FALSE, FALSE, sizeof (guint));
+
   for (i = 0; i < ns->notifications->len; i++)
     {
       HDNotification *n = g_ptr_array_index (ns->notifications,
@@ -358,19 +396,50 @@ notifications_close_all (Notifications *ns,
 
       if (close_sticky || !sticky)
         {
+          guint id = hd_notification_get_id (n);
+
           g_signal_handlers_disconnect_by_func (n,
                                                 notification_closed_cb,
                                                 ns);
-          hd_notification_manager_close_notification (hd_notification_manager_get (),
-                                                      hd_notification_get_id (n),
-                                                      NULL);
-          g_object_unref (n);
+          g_array_append_val (ids, id);
+          g_ptr_array_add (closed, n);
           g_ptr_array_index (ns->notifications, i) = NULL;
         }
     }
  
   repack_ptr_array (ns->notifications);
 
+  if (!priv->deferred_updates)
+    deferred_updates = priv->deferred_updates = g_hash_table_new (NULL, NULL);
+
+  hd_notification_manager_close_notifications (hd_notification_manager_get (),
+                                               ids,
+                                               NULL);
+
+  g_ptr_array_foreach (closed, (GFunc) g_object_unref, NULL);
+  g_ptr_array_free (closed, TRUE);
+  g_array_free (ids, TRUE);
+
+  /* The callbacks only free their own Notifications */
+  if (deferred_updates)
+    {
+      GHashTableIter iter;
+      gpointer key;
+
+      priv->deferred_updates = NULL;
+
+      g_hash_table_iter_init (&iter, deferred_updates);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          Notifications *other = key;
+
+          if (other != ns)
+            other->cb (other, other->cb_data);
+        }
+
+      g_hash_table_destroy (deferred_updates);
+    }
+
   if (ns->cb)
     ns->cb (ns, ns->cb_data);
 }
@@ -477,7 +546,7 @@ notifications_activate (Notifications *ns)
   if (notifications_is_empty (ns))
     return;
 
-  if (osso_mem_in_lowmem_state ())
+  if (hd_memory_pressure_is_low ())
     {
       g_debug ("%s. Do not activate notification in low mem state.",
                __FUNCTION__);
@@ -936,11 +1005,14 @@ notification_closed_sv_cb (HDNotification   *notification,
                                              quark_id));
   if (id)
     {
-      dbus_g_proxy_call_no_reply (priv->sv_daemon_proxy,
-                                  "StopEvent",
-                                  G_TYPE_INT,
-                                  id,
-                                  G_TYPE_INVALID);
+      if (priv->sv_queue)
+        hd_sv_event_queue_stop (priv->sv_queue, id);
+      else
+        dbus_g_proxy_call_no_reply (priv->sv_daemon_proxy,
+                                    "StopEvent",
+                                    G_TYPE_INT,
+                                    id,
+                                    G_TYPE_INVALID);
     }
   else
     {
@@ -1006,6 +1078,18 @@ unperceived_notification_closed (HDNotification *notification,
                        G_OBJECT (notification));
 }
 
+static void
+notify_plugins (HDIncomingEvents *ie,
+                HDNotification   *notification)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  guint i;
+
+  for (i = 0; i < priv->plugins->len; i++)
+    hd_notification_plugin_queue_notify (g_ptr_array_index (priv->plugins, i),
+                                         notification);
+}
+
 static void
 hd_incoming_events_notified (HDNotificationManager  *nm,
                              HDNotification         *notification,
@@ -1014,11 +1098,11 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
 {
   HDIncomingEventsPrivate *priv = ie->priv;
   const gchar *category;
-/*  guint i; */
   GValue *p;
   const gchar *pattern = NULL;
   Notifications *ns;
   CategoryInfo *info;
+  gboolean feedback = TRUE;
 
   g_return_if_fail (HD_IS_INCOMING_EVENTS (ie));
 
@@ -1028,14 +1112,7 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
   /* Do nothing for system.note.* notifications */
   if (category && g_str_has_prefix (category, "system.note."))
     {
-      /*
-      for (i = 0; i < priv->plugins->len; i++)
-        {
-          HDNotificationPlugin *plugin = g_ptr_array_index (priv->plugins, i);
-
-          hd_notification_plugin_notify (plugin, notification);
-        }
-      */
+      notify_plugins (ie, notification);
       return;
     }
 
@@ -1050,8 +1127,36 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
       return;
     }
 
+  /* Skip the feedback of a flooding sender, the windows are still updated */
+  if (priv->feedback_limiter)
+    {
+      const gchar *sender = hd_notification_get_sender (notification);
+      gchar *key;
+
+      key = g_strconcat (sender ? sender : "", "/",
+                         category ? category : "", NULL);
+      feedback = hd_rate_limiter_consume (priv->feedback_limiter, key);
+      g_free (key);
+    }
+
+  /* Queue for the sound/vibra plugin in-process, like the daemon does */
+  if (feedback && priv->sv_queue)
+    {
+      gint id;
+
+      g_signal_connect (notification, "closed",
+                        G_CALLBACK (notification_closed_sv_cb), ie);
+
+      id = hd_sv_event_queue_play (priv->sv_queue,
+                                   hd_notification_get_hints (notification),
+                                   hd_notification_get_sender (notification));
+      if (id > 0)
+        g_object_set_qdata (G_OBJECT (notification),
+                            g_quark_from_static_string ("hd-sv-notification-id"),
+                            GINT_TO_POINTER (id));
+    }
   /* Call sound/vibra daemon */
-  if (priv->sv_daemon_proxy)
+  else if (feedback && priv->sv_daemon_proxy)
     {
       GHashTable *hints;
       const gchar *sender;
@@ -1074,13 +1179,8 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
                                G_TYPE_INVALID);
     }
 
-  /* Call plugins */
-/*  for (i = 0; i < priv->plugins->len; i++)
-    {
-      HDNotificationPlugin *plugin = g_ptr_array_index (priv->plugins, i);
-
-      hd_notification_plugin_notify (plugin, notification);
-    }*/
+  /* Call plugins, they are queued so this returns immediately */
+  notify_plugins (ie, notification);
 
   /* Lets see if we have any led event for this category */
   p = hd_notification_get_hint (notification, "led-pattern");
@@ -1089,7 +1189,7 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
   if (!pattern && info)
     pattern = info->pattern;
 
-  if (pattern && !(priv->display_on && priv->task_switcher_shown))
+  if (feedback && pattern && !(priv->display_on && priv->task_switcher_shown))
     {
       HDLedPattern *led_pattern = hd_led_pattern_get (pattern);
       hd_multi_map_insert (priv->unperceived_notifications,
@@ -1160,6 +1260,14 @@ hd_incoming_events_dispose (GObject *object)
 {
   HDIncomingEventsPrivate *priv = HD_INCOMING_EVENTS (object)->priv;
 
+  if (priv->plugins)
+    {
+      g_ptr_array_foreach (priv->plugins,
+                           (GFunc) hd_notification_plugin_queue_free,
+                           NULL);
+      g_ptr_array_set_size (priv->plugins, 0);
+    }
+
   if (priv->plugin_manager)
     priv->plugin_manager = (g_object_unref (priv->plugin_manager), NULL);
 
@@ -1169,6 +1277,11 @@ hd_incoming_events_dispose (GObject *object)
   if (priv->sv_daemon_proxy)
     priv->sv_daemon_proxy = (g_object_unref (priv->sv_daemon_proxy), NULL);
 
+  if (priv->sv_queue)
+    priv->sv_queue = (hd_sv_event_queue_free (priv->sv_queue), NULL);
+  if (priv->sv_plugin)
+    priv->sv_plugin = (hd_sv_plugin_unload (priv->sv_plugin), NULL);
+
   if (priv->unperceived_notifications)
     priv->unperceived_notifications = (g_object_unref (priv->unperceived_notifications), NULL);
 
@@ -1189,6 +1302,8 @@ hd_incoming_events_finalize (GObject *object)
   if (priv->plugins)
     priv->plugins = (g_ptr_array_free (priv->plugins, TRUE), NULL);
 
+  priv->feedback_limiter = (hd_rate_limiter_free (priv->feedback_limiter), NULL);
+
   G_OBJECT_CLASS (hd_incoming_events_parent_class)->finalize (object);
 }
 
@@ -1410,7 +1525,8 @@ hd_incoming_events_plugin_added (HDPluginManager  *pm,
                                  HDIncomingEvents *ie)
 {
   if (HD_IS_NOTIFICATION_PLUGIN (plugin))
-    g_ptr_array_add (ie->priv->plugins, plugin);
+    g_ptr_array_add (ie->priv->plugins,
+                     hd_notification_plugin_queue_new (HD_NOTIFICATION_PLUGIN (plugin)));
   else
     g_warning ("Plugin from type %s is no HDNotificationPlugin", G_OBJECT_TYPE_NAME (plugin));
 }
@@ -1420,8 +1536,23 @@ hd_incoming_events_plugin_removed (HDPluginManager  *pm,
                                    GObject          *plugin,
                                    HDIncomingEvents *ie)
 {
+  HDIncomingEventsPrivate *priv = ie->priv;
+  guint i;
+
   if (HD_IS_NOTIFICATION_PLUGIN (plugin))
-    g_ptr_array_remove_fast (ie->priv->plugins, plugin);
+    {
+      for (i = 0; i < priv->plugins->len; i++)
+        {
+          HDNotificationPluginQueue *queue = g_ptr_array_index (priv->plugins, i);
+
+          if (hd_notification_plugin_queue_get_plugin (queue) == HD_NOTIFICATION_PLUGIN (plugin))
+            {
+              g_ptr_array_remove_index_fast (priv->plugins, i);
+              hd_notification_plugin_queue_free (queue);
+              break;
+            }
+        }
+    }
   else
     g_warning ("Plugin from type %s is no HDNotificationPlugin", G_OBJECT_TYPE_NAME (plugin));
 }
@@ -1625,6 +1756,56 @@ initialize_filter_current_window_changes (void)
                          root_win);
 }
 
+static gboolean
+sv_feedback_in_process (void)
+{
+  GKeyFile *key_file;
+  gchar *mode = NULL;
+  gboolean in_process;
+
+  key_file = g_key_file_new ();
+  if (g_key_file_load_from_file (key_file,
+                                 HD_SV_FEEDBACK_CONFIG_FILE,
+                                 G_KEY_FILE_NONE,
+                                 NULL))
+    mode = g_key_file_get_string (key_file,
+                                  HD_SV_FEEDBACK_GROUP,
+                                  HD_SV_FEEDBACK_KEY_MODE,
+                                  NULL);
+
+  in_process = !g_strcmp0 (mode, "in-process");
+
+  g_free (mode);
+  g_key_file_free (key_file);
+
+  return in_process;
+}
+
+static HDRateLimiter *
+load_feedback_limiter (void)
+{
+  GKeyFile *key_file;
+  HDRateLimiter *limiter;
+
+  key_file = g_key_file_new ();
+  if (!g_key_file_load_from_file (key_file,
+                                  HD_FLOOD_CONTROL_CONFIG_FILE,
+                                  G_KEY_FILE_NONE,
+                                  NULL))
+    key_file = (g_key_file_free (key_file), NULL);
+
+  limiter = hd_rate_limiter_new_from_key_file (key_file,
+                                               HD_FLOOD_CONTROL_GROUP,
+                                               "Feedback-",
+                                               FEEDBACK_RATE,
+                                               FEEDBACK_BURST);
+
+  if (key_file)
+    g_key_file_free (key_file);
+
+  return limiter;
+}
+
 static void
 hd_incoming_events_init (HDIncomingEvents *ie)
 {
@@ -1710,21 +1891,34 @@ hd_incoming_events_init (HDIncomingEvents *ie)
       g_debug ("%s. Got mce Proxy", __FUNCTION__);
     }
 
-  session_connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
+  /* Load the sound/vibra plugin if configured so,
+   * fall back to the daemon if it cannot be loaded. */
+  if (sv_feedback_in_process ())
+    priv->sv_plugin = hd_sv_plugin_load (HD_SV_PLUGIN_PATH);
+  if (priv->sv_plugin)
+    priv->sv_queue = hd_sv_event_queue_new (priv->sv_plugin,
+                                            HD_SV_EVENT_QUEUE_WINDOW);
 
-  if (error)
+  if (!priv->sv_plugin)
     {
-      g_warning ("Could not connect to System D-Bus. %s", error->message);
-      g_clear_error (&error);
-    }
-  else
-    {
-      priv->sv_daemon_proxy = dbus_g_proxy_new_for_name (session_connection,
-                                                         HD_SV_NOTIFICATION_DAEMON_DBUS_NAME,
-                                                         HD_SV_NOTIFICATION_DAEMON_DBUS_PATH,
-                                                         HD_SV_NOTIFICATION_DAEMON_DBUS_NAME);
+      session_connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
+
+      if (error)
+        {
+          g_warning ("Could not connect to System D-Bus. %s", error->message);
+          g_clear_error (&error);
+        }
+      else
+        {
+          priv->sv_daemon_proxy = dbus_g_proxy_new_for_name (session_connection,
+                                                             HD_SV_NOTIFICATION_DAEMON_DBUS_NAME,
+                                                             HD_SV_NOTIFICATION_DAEMON_DBUS_PATH,
+                                                             HD_SV_NOTIFICATION_DAEMON_DBUS_NAME);
+        }
     }
 
+  priv->feedback_limiter = load_feedback_limiter ();
+
   priv->unperceived_notifications = hd_multi_map_new ();
 
   initialize_filter_current_window_changes ();
@@ -56,12 +56,24 @@ static void hd_led_pattern_set_property (GObject      *object,
                                          GParamSpec   *pspec);
 static void hd_led_pattern_constructed  (GObject *object);
 
-static void            activate_pattern   (HDLedPattern *pattern);
-static void            deactivate_pattern (HDLedPattern *pattern);
+static void            request_pattern_state (const gchar *name,
+                                              gboolean     active);
 
 static GHashTable      *get_pattern_map            (void);
 static DBusGProxy      *get_mce_proxy              (void);
 
+/* What MCE was told about the patterns, see request_pattern_state () */
+enum
+{
+  STATE_UNKNOWN,
+  STATE_ACTIVE,
+  STATE_INACTIVE
+};
+
+static GHashTable      *mce_states = NULL;
+static GHashTable      *pending_states = NULL;
+static guint            flush_id = 0;
+
 G_DEFINE_TYPE (HDLedPattern, hd_led_pattern, G_TYPE_INITIALLY_UNOWNED);
 
 HDLedPattern *
@@ -136,60 +148,128 @@ hd_led_pattern_constructed (GObject *object)
   if (G_OBJECT_CLASS (hd_led_pattern_parent_class)->constructed)
     G_OBJECT_CLASS (hd_led_pattern_parent_class)->constructed (object);
 
-  activate_pattern (pattern);
+  request_pattern_state (pattern->priv->name, TRUE);
 }
 
 static void
-activate_pattern (HDLedPattern *pattern)
+activate_pattern_notify (DBusGProxy     *proxy,
+                         DBusGProxyCall *call,
+                         gchar          *name)
 {
-  HDLedPatternPrivate *priv = pattern->priv;
-  DBusGProxy *mce_proxy;
-
-  mce_proxy = get_mce_proxy ();
+  GError *error = NULL;
 
-  if (mce_proxy)
+  if (dbus_g_proxy_end_call (proxy, call, &error, G_TYPE_INVALID))
     {
-      GError *error = NULL;
-
-      dbus_g_proxy_call (mce_proxy,
-                         MCE_ACTIVATE_LED_PATTERN,
-                         &error,
-                         G_TYPE_STRING,
-                         priv->name,
-                         G_TYPE_INVALID,
-                         G_TYPE_INVALID);
+      g_debug ("%s. Activated LED pattern: %s", __FUNCTION__, name);
+    }
+  else
+    {
+      g_debug ("%s. Could not activate LED pattern: %s. %s", __FUNCTION__, name, error->message);
+      g_error_free (error);
 
-      if (error)
-        {
-          g_debug ("%s. Could not activate LED pattern: %s. %s", __FUNCTION__, priv->name, error->message);
-          g_error_free (error);
-        }
-      else
-        g_debug ("%s. Activated LED pattern: %s", __FUNCTION__, priv->name);
+      /* Send it again on the next request */
+      if (GPOINTER_TO_INT (g_hash_table_lookup (mce_states, name)) == STATE_ACTIVE)
+        g_hash_table_remove (mce_states, name);
     }
 }
 
 static void
-deactivate_pattern (HDLedPattern *pattern)
+send_pattern_state (DBusGProxy  *mce_proxy,
+                    const gchar *name,
+                    gboolean     active)
 {
-  HDLedPatternPrivate *priv = pattern->priv;
-  DBusGProxy *mce_proxy;
-
-  mce_proxy = get_mce_proxy ();
-
-  if (mce_proxy)
+  if (active)
     {
-      g_debug ("%s. Dectivate LED pattern: %s", __FUNCTION__, priv->name);
+      dbus_g_proxy_begin_call (mce_proxy,
+                               MCE_ACTIVATE_LED_PATTERN,
+                               (DBusGProxyCallNotify) activate_pattern_notify,
+                               g_strdup (name),
+                               (GDestroyNotify) g_free,
+                               G_TYPE_STRING,
+                               name,
+                               G_TYPE_INVALID);
+    }
+  else
+    {
+      g_debug ("%s. Dectivate LED pattern: %s", __FUNCTION__, name);
 
       dbus_g_proxy_call_no_reply (mce_proxy,
                                   MCE_DEACTIVATE_LED_PATTERN,
                                   G_TYPE_STRING,
-                                  priv->name,
+                                  name,
                                   G_TYPE_INVALID,
                                   G_TYPE_INVALID);
     }
 }
 
+/* Sends the changes requested since the last flush to MCE.  Patterns
+ * switched off and on again meanwhile are not sent at all. */
+static gboolean
+flush_pattern_states (gpointer data)
+{
+  DBusGProxy *mce_proxy;
+  GHashTableIter iter;
+  gpointer name, state;
+
+  flush_id = 0;
+
+  mce_proxy = get_mce_proxy ();
+
+  g_hash_table_iter_init (&iter, pending_states);
+  while (g_hash_table_iter_next (&iter, &name, &state))
+    {
+      gint current = GPOINTER_TO_INT (g_hash_table_lookup (mce_states, name));
+
+      /* Patterns never sent are considered off */
+      if (current == STATE_UNKNOWN)
+        current = STATE_INACTIVE;
+
+      if (current == GPOINTER_TO_INT (state))
+        continue;
+
+      if (mce_proxy)
+        send_pattern_state (mce_proxy,
+                            name,
+                            GPOINTER_TO_INT (state) == STATE_ACTIVE);
+
+      g_hash_table_insert (mce_states, g_strdup (name), state);
+    }
+
+  g_hash_table_remove_all (pending_states);
+
+  return FALSE;
+}
+
+static void
+init_pattern_states (void)
+{
+  if (G_UNLIKELY (!pending_states))
+    {
+      mce_states = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          (GDestroyNotify) g_free,
+                                          NULL);
+      pending_states = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              (GDestroyNotify) g_free,
+                                              NULL);
+    }
+}
+
+/* Requests the pattern @name to be switched on or off.  The changes are
+ * collected and sent without waiting for MCE when the main loop is idle. */
+static void
+request_pattern_state (const gchar *name,
+                       gboolean     active)
+{
+  init_pattern_states ();
+
+  g_hash_table_insert (pending_states,
+                       g_strdup (name),
+                       GINT_TO_POINTER (active ? STATE_ACTIVE : STATE_INACTIVE));
+
+  if (!flush_id)
+    flush_id = g_idle_add (flush_pattern_states, NULL);
+}
+
 static DBusGProxy *
 get_mce_proxy (void)
 {
@@ -224,7 +304,7 @@ hd_led_pattern_dispose (GObject *object)
       g_hash_table_remove (pattern_map,
                            priv->name);
 
-      deactivate_pattern (pattern);
+      request_pattern_state (priv->name, FALSE);
 
       priv->name = (g_free (priv->name), NULL);
     }
@@ -270,28 +350,365 @@ const static char *default_notification_pattern[] =
   NULL
 };
 
+/* Switches off the notification patterns.  Patterns which were never
+ * sent are switched off once as well, they may have been left on by an
+ * earlier instance. */
 void
 hd_led_pattern_deactivate_all (void)
 {
-  DBusGProxy *mce_proxy;
   guint i;
 
-  mce_proxy = get_mce_proxy ();
+  init_pattern_states ();
 
-  if (mce_proxy)
+  for (i = 0; default_notification_pattern[i]; i++)
     {
-      for (i = 0; default_notification_pattern[i]; i++)
+      if (!g_hash_table_lookup (mce_states, default_notification_pattern[i]))
+        g_hash_table_insert (mce_states,
+                             g_strdup (default_notification_pattern[i]),
+                             GINT_TO_POINTER (STATE_ACTIVE));
+
+      request_pattern_state (default_notification_pattern[i], FALSE);
+    }
+}
+
+#ifdef COMPILE_FOR_TEST
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* How long the mock MCE takes to activate a pattern */
+#define MCE_LATENCY_MS     20
+#define TEST_NOTIFICATIONS 100
+#define TEST_INTERVAL_MS   10
+#define TEST_SYNC          "test_sync"
+
+/* The mock MCE writes the calls it gets here, one per line */
+static gint mce_calls[2];
+static FILE *mce_log;
+
+static GPid
+start_bus (void)
+{
+  gchar *argv[] = { "dbus-daemon", "--session", "--nofork", "--print-address", NULL };
+  GString *address;
+  GPid pid;
+  gint out;
+  gchar c;
+
+  if (!g_spawn_async_with_pipes (NULL, argv, NULL,
+                                 G_SPAWN_SEARCH_PATH,
+                                 NULL, NULL,
+                                 &pid,
+                                 NULL, &out, NULL,
+                                 NULL))
+    return 0;
+
+  address = g_string_new (NULL);
+  while (read (out, &c, 1) == 1 && c != '\n')
+    g_string_append_c (address, c);
+  close (out);
+
+  /* hd_get_system_dbus_connection () connects here */
+  g_setenv ("DBUS_SYSTEM_BUS_ADDRESS", address->str, TRUE);
+  g_string_free (address, TRUE);
+
+  return pid;
+}
+
+/* A mock MCE in a child process.  It logs each request and delays the
+ * replies to activations. */
+static void
+run_mce (void)
+{
+  DBusConnection *connection = dbus_bus_get_private (DBUS_BUS_SYSTEM, NULL);
+
+  if (!connection ||
+      dbus_bus_request_name (connection, MCE_SERVICE,
+                             DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _exit (1);
+
+  while (dbus_connection_read_write (connection, -1))
+    {
+      DBusMessage *message;
+
+      while ((message = dbus_connection_pop_message (connection)))
         {
-          g_debug ("%s. Dectivate LED pattern: %s",
-                   __FUNCTION__,
-                   default_notification_pattern[i]);
-
-          dbus_g_proxy_call_no_reply (mce_proxy,
-                                      MCE_DEACTIVATE_LED_PATTERN,
-                                      G_TYPE_STRING,
-                                      default_notification_pattern[i],
-                                      G_TYPE_INVALID,
-                                      G_TYPE_INVALID);
+          const gchar *name = "";
+          gchar *line;
+
+          if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL ||
+              g_strcmp0 (dbus_message_get_interface (message), MCE_REQUEST_IF))
+            {
+              dbus_message_unref (message);
+              continue;
+            }
+
+          dbus_message_get_args (message, NULL,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID);
+          line = g_strdup_printf ("%s %s\n", dbus_message_get_member (message), name);
+          if (write (mce_calls[1], line, strlen (line)) < 0)
+            _exit (1);
+          g_free (line);
+
+          if (dbus_message_is_method_call (message, MCE_REQUEST_IF,
+                                           MCE_ACTIVATE_LED_PATTERN))
+            g_usleep (MCE_LATENCY_MS * 1000);
+
+          if (!dbus_message_get_no_reply (message))
+            {
+              DBusMessage *reply = dbus_message_new_method_return (message);
+
+              dbus_connection_send (connection, reply, NULL);
+              dbus_message_unref (reply);
+            }
+          dbus_message_unref (message);
         }
     }
+
+  _exit (0);
+}
+
+static gint
+compare_lines (gconstpointer a,
+               gconstpointer b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Runs the pending flush and returns the sorted calls MCE got since the
+ * last time */
+static gchar *
+sync_mce (void)
+{
+  GPtrArray *calls = g_ptr_array_new ();
+  gchar line[256];
+  gchar *joined;
+
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_assert (dbus_g_proxy_call (get_mce_proxy (), TEST_SYNC, NULL,
+                               G_TYPE_INVALID, G_TYPE_INVALID));
+
+  while (fgets (line, sizeof (line), mce_log) &&
+         !g_str_has_prefix (line, TEST_SYNC))
+    g_ptr_array_add (calls, g_strdup (line));
+
+  g_ptr_array_sort (calls, compare_lines);
+  g_ptr_array_add (calls, NULL);
+  joined = g_strjoinv ("", (gchar **) calls->pdata);
+  g_strfreev ((gchar **) g_ptr_array_free (calls, FALSE));
+
+  return joined;
+}
+
+static void
+assert_calls (const gchar *expected)
+{
+  gchar *calls = sync_mce ();
+
+  g_assert_cmpstr (calls, ==, expected);
+  g_free (calls);
+}
+
+static void
+test_batch (void)
+{
+  HDLedPattern *sms, *email;
+
+  /* Everything is switched off once at startup */
+  hd_led_pattern_deactivate_all ();
+  assert_calls ("req_led_pattern_deactivate PatternCommonNotification\n"
+                "req_led_pattern_deactivate PatternCommunicationCall\n"
+                "req_led_pattern_deactivate PatternCommunicationEmail\n"
+                "req_led_pattern_deactivate PatternCommunicationIM\n"
+                "req_led_pattern_deactivate PatternCommunicationSMS\n");
+  hd_led_pattern_deactivate_all ();
+  assert_calls ("");
+
+  /* Switched on and off in one iteration */
+  sms = hd_led_pattern_get ("PatternCommunicationSMS");
+  email = hd_led_pattern_get ("PatternCommunicationEmail");
+  g_object_unref (email);
+  assert_calls ("req_led_pattern_activate PatternCommunicationSMS\n");
+
+  /* Off and on again, or asked for twice */
+  g_object_unref (sms);
+  sms = hd_led_pattern_get ("PatternCommunicationSMS");
+  g_assert (hd_led_pattern_get ("PatternCommunicationSMS") == sms);
+  g_object_unref (sms);
+  assert_calls ("");
+
+  g_object_unref (sms);
+  hd_led_pattern_deactivate_all ();
+  assert_calls ("req_led_pattern_deactivate PatternCommunicationSMS\n");
+}
+
+/* Notifications come in TEST_INTERVAL_MS apart, each switching on a
+ * pattern and closing the one two before it.  A 1 ms timeout measures
+ * how long the main loop is kept from running. */
+typedef struct
+{
+  GMainLoop    *loop;
+  gboolean      sync;
+  guint         count;
+  HDLedPattern *patterns[TEST_NOTIFICATIONS];
+  gint64        last_tick;
+  gint64        max_stall;
+  gint64        total_stall;
+} Burst;
+
+static const gchar *
+burst_pattern (guint i)
+{
+  return default_notification_pattern[i % (G_N_ELEMENTS (default_notification_pattern) - 1)];
+}
+
+static gboolean
+burst_tick (Burst *burst)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 stall = now - burst->last_tick - 1000;
+
+  if (stall > 0)
+    {
+      burst->max_stall = MAX (burst->max_stall, stall);
+      burst->total_stall += stall;
+    }
+  burst->last_tick = now;
+
+  return TRUE;
 }
+
+static gboolean
+burst_notification (Burst *burst)
+{
+  guint i = burst->count++;
+
+  if (burst->sync)
+    {
+      /* As hildon-home did before, blocking on MCE */
+      dbus_g_proxy_call (get_mce_proxy (), MCE_ACTIVATE_LED_PATTERN, NULL,
+                         G_TYPE_STRING, burst_pattern (i),
+                         G_TYPE_INVALID,
+                         G_TYPE_INVALID);
+      if (i >= 2)
+        dbus_g_proxy_call_no_reply (get_mce_proxy (), MCE_DEACTIVATE_LED_PATTERN,
+                                    G_TYPE_STRING, burst_pattern (i - 2),
+                                    G_TYPE_INVALID,
+                                    G_TYPE_INVALID);
+    }
+  else
+    {
+      burst->patterns[i] = hd_led_pattern_get (burst_pattern (i));
+      if (i >= 2)
+        g_object_unref (burst->patterns[i - 2]);
+    }
+
+  if (burst->count < TEST_NOTIFICATIONS)
+    return TRUE;
+
+  g_main_loop_quit (burst->loop);
+
+  return FALSE;
+}
+
+static void
+run_burst (gboolean sync)
+{
+  Burst burst = { 0, };
+  guint tick_id, i;
+  gchar *calls, **lines;
+
+  burst.loop = g_main_loop_new (NULL, FALSE);
+  burst.sync = sync;
+  burst.last_tick = g_get_monotonic_time ();
+
+  tick_id = g_timeout_add (1, (GSourceFunc) burst_tick, &burst);
+  g_timeout_add (TEST_INTERVAL_MS, (GSourceFunc) burst_notification, &burst);
+  g_main_loop_run (burst.loop);
+  g_source_remove (tick_id);
+
+  for (i = TEST_NOTIFICATIONS - 2; i < TEST_NOTIFICATIONS; i++)
+    {
+      if (sync)
+        dbus_g_proxy_call_no_reply (get_mce_proxy (), MCE_DEACTIVATE_LED_PATTERN,
+                                    G_TYPE_STRING, burst_pattern (i),
+                                    G_TYPE_INVALID,
+                                    G_TYPE_INVALID);
+      else
+        g_object_unref (burst.patterns[i]);
+    }
+
+  calls = sync_mce ();
+  lines = g_strsplit (calls, "\n", -1);
+
+  g_test_minimized_result (burst.max_stall / 1e6,
+                           "%s: %d notifications, %u MCE calls, "
+                           "main loop stall max %.1f ms, total %.1f ms",
+                           sync ? "synchronous" : "batched",
+                           TEST_NOTIFICATIONS,
+                           g_strv_length (lines) - 1,
+                           burst.max_stall / 1e3,
+                           burst.total_stall / 1e3);
+
+  g_strfreev (lines);
+  g_free (calls);
+  g_main_loop_unref (burst.loop);
+}
+
+static void
+test_stall (void)
+{
+  run_burst (TRUE);
+  run_burst (FALSE);
+}
+
+int main (int argc, char **argv)
+{
+  GPid bus;
+  pid_t child;
+  gchar line[256];
+  gint result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  bus = start_bus ();
+  if (!bus)
+    {
+      g_printerr ("Could not start dbus-daemon, skipping\n");
+      return 77;
+    }
+
+  g_assert (!pipe (mce_calls));
+  child = fork ();
+  g_assert_cmpint (child, >=, 0);
+  if (!child)
+    run_mce ();
+  close (mce_calls[1]);
+  mce_log = fdopen (mce_calls[0], "r");
+
+  /* Wait for the mock to own its name */
+  while (!dbus_g_proxy_call (get_mce_proxy (), TEST_SYNC, NULL,
+                             G_TYPE_INVALID, G_TYPE_INVALID))
+    g_usleep (10 * 1000);
+  g_assert (fgets (line, sizeof (line), mce_log));
+
+  g_test_add_func ("/led-pattern/batch", test_batch);
+  if (g_test_perf ())
+    g_test_add_func ("/led-pattern/stall", test_stall);
+
+  result = g_test_run ();
+
+  kill (child, SIGTERM);
+  waitpid (child, NULL, 0);
+  kill (bus, SIGTERM);
+  g_spawn_close_pid (bus);
+
+  return result;
+}
+
+#endif
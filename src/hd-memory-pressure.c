@@ -0,0 +1,736 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <osso-mem.h>
+
+#include "hd-metrics.h"
+
+#include "hd-memory-pressure.h"
+
+/*
+ * The memory pressure is watched with PSI triggers where the kernel
+ * supports them.  Otherwise the memory.events of our cgroup are
+ * watched, which only report the limits of the cgroup, so the osso
+ * lowmem state of the device is polled along with them.
+ */
+#define PROC_PRESSURE_MEMORY "/proc/pressure/memory"
+#define PROC_SELF_CGROUP     "/proc/self/cgroup"
+#define CGROUP_ROOT          "/sys/fs/cgroup"
+
+/* PSI triggers: stall time in a window, in us.  Unprivileged
+ * processes may only use windows of multiples of 2 s. */
+#define LOW_TRIGGER          "some 300000 2000000"
+#define CRITICAL_TRIGGER     "full 200000 2000000"
+
+#define LOWMEM_POLL_INTERVAL 10        /* s */
+
+/* How long the pressure is considered to last after an event */
+#define PRESSURE_HOLD        5000000   /* us */
+
+/* Enough to be released on low pressure */
+#define LOW_RECLAIM_TARGET   (512 * 1024)
+
+typedef struct
+{
+  guint                      id;
+  gchar                     *name;
+  gint                       priority;
+  HDMemoryPressureShrinkFunc func;
+  gpointer                   data;
+} Shrinker;
+
+static GList *shrinkers;
+static guint last_shrinker_id;
+
+static HDMemoryPressureLevel pressure_level;
+static gint64 pressure_time;
+
+/* cgroup memory.events counters seen last */
+static guint64 cgroup_high, cgroup_max;
+
+static gboolean lowmem_state;
+static gboolean started;
+
+static gint
+compare_shrinkers (const Shrinker *a,
+                   const Shrinker *b)
+{
+  return a->priority - b->priority;
+}
+
+guint
+hd_memory_pressure_add_shrinker (const gchar                *name,
+                                 gint                        priority,
+                                 HDMemoryPressureShrinkFunc  func,
+                                 gpointer                    data)
+{
+  Shrinker *shrinker;
+
+  g_return_val_if_fail (func != NULL, 0);
+
+  shrinker = g_slice_new (Shrinker);
+  shrinker->id = ++last_shrinker_id;
+  shrinker->name = g_strdup (name);
+  shrinker->priority = priority;
+  shrinker->func = func;
+  shrinker->data = data;
+
+  shrinkers = g_list_insert_sorted (shrinkers,
+                                    shrinker,
+                                    (GCompareFunc) compare_shrinkers);
+
+  return shrinker->id;
+}
+
+void
+hd_memory_pressure_remove_shrinker (guint id)
+{
+  GList *l;
+
+  for (l = shrinkers; l; l = l->next)
+    {
+      Shrinker *shrinker = l->data;
+
+      if (shrinker->id == id)
+        {
+          shrinkers = g_list_delete_link (shrinkers, l);
+          g_free (shrinker->name);
+          g_slice_free (Shrinker, shrinker);
+          return;
+        }
+    }
+}
+
+/**
+ * hd_memory_pressure_shed:
+ * @level: the memory pressure
+ *
+ * Asks the registered caches to release memory, as if the kernel
+ * reported @level pressure.  Returns the number of bytes released.
+ */
+gsize
+hd_memory_pressure_shed (HDMemoryPressureLevel level)
+{
+  GList *l;
+  gsize reclaimed = 0;
+
+  if (level == HD_MEMORY_PRESSURE_NONE)
+    return 0;
+
+  if (g_get_monotonic_time () - pressure_time >= PRESSURE_HOLD)
+    pressure_level = HD_MEMORY_PRESSURE_NONE;
+  pressure_level = MAX (pressure_level, level);
+  pressure_time = g_get_monotonic_time ();
+
+  for (l = shrinkers; l; l = l->next)
+    {
+      Shrinker *shrinker = l->data;
+      gsize released;
+
+      if (level == HD_MEMORY_PRESSURE_LOW && reclaimed >= LOW_RECLAIM_TARGET)
+        break;
+
+      released = shrinker->func (level, shrinker->data);
+      reclaimed += released;
+
+      g_debug ("%s. %s released %" G_GSIZE_FORMAT " bytes",
+               __FUNCTION__, shrinker->name, released);
+    }
+
+  g_debug ("%s. Released %" G_GSIZE_FORMAT " bytes on %s pressure",
+           __FUNCTION__, reclaimed,
+           level == HD_MEMORY_PRESSURE_CRITICAL ? "critical" : "low");
+
+  hd_metrics_add (HD_METRICS_MEMORY_PRESSURE_EVENTS, 1);
+  hd_metrics_add (HD_METRICS_MEMORY_RECLAIMED_KB, reclaimed / 1024);
+
+  return reclaimed;
+}
+
+/* Returns %TRUE if there was memory pressure recently or the device
+ * is in the osso lowmem state. */
+gboolean
+hd_memory_pressure_is_low (void)
+{
+  if (pressure_level != HD_MEMORY_PRESSURE_NONE &&
+      g_get_monotonic_time () - pressure_time < PRESSURE_HOLD)
+    return TRUE;
+
+  pressure_level = HD_MEMORY_PRESSURE_NONE;
+
+  return osso_mem_in_lowmem_state ();
+}
+
+static gboolean
+trigger_cb (GIOChannel   *channel,
+            GIOCondition  condition,
+            gpointer      data)
+{
+  if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+    {
+      g_warning ("%s. Memory pressure trigger failed", __FUNCTION__);
+      close (g_io_channel_unix_get_fd (channel));
+      return FALSE;
+    }
+
+  hd_memory_pressure_shed (GPOINTER_TO_INT (data));
+
+  return TRUE;
+}
+
+static gboolean
+arm_trigger (const gchar           *trigger,
+             HDMemoryPressureLevel  level)
+{
+  GIOChannel *channel;
+  int fd;
+
+  fd = open (PROC_PRESSURE_MEMORY, O_RDWR | O_NONBLOCK);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        g_warning ("%s. Could not open %s. %s",
+                   __FUNCTION__, PROC_PRESSURE_MEMORY, g_strerror (errno));
+      return FALSE;
+    }
+
+  if (write (fd, trigger, strlen (trigger) + 1) < 0)
+    {
+      g_warning ("%s. Could not arm trigger %s. %s",
+                 __FUNCTION__, trigger, g_strerror (errno));
+      close (fd);
+      return FALSE;
+    }
+
+  channel = g_io_channel_unix_new (fd);
+  g_io_add_watch (channel,
+                  G_IO_PRI | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                  trigger_cb,
+                  GINT_TO_POINTER (level));
+  g_io_channel_unref (channel);
+
+  return TRUE;
+}
+
+static guint64
+get_memory_event (const gchar *events,
+                  const gchar *name)
+{
+  const gchar *p;
+  gsize length = strlen (name);
+
+  for (p = events; p && *p; p = strchr (p, '\n'), p = p ? p + 1 : NULL)
+    if (!strncmp (p, name, length) && p[length] == ' ')
+      return g_ascii_strtoull (p + length + 1, NULL, 10);
+
+  return 0;
+}
+
+/* memory.events is modified: "high" means the cgroup is throttled,
+ * "max" and "oom" that the limit was hit. */
+static gboolean
+cgroup_events_cb (GIOChannel   *channel,
+                  GIOCondition  condition,
+                  gpointer      data)
+{
+  gchar buffer[512];
+  gssize length;
+  guint64 high, max;
+  int fd = g_io_channel_unix_get_fd (channel);
+
+  if (condition & G_IO_NVAL)
+    return FALSE;
+
+  length = pread (fd, buffer, sizeof (buffer) - 1, 0);
+  if (length < 0)
+    {
+      g_warning ("%s. Could not read memory events. %s",
+                 __FUNCTION__, g_strerror (errno));
+      close (fd);
+      return FALSE;
+    }
+  buffer[length] = '\0';
+
+  high = get_memory_event (buffer, "high");
+  max = get_memory_event (buffer, "max") + get_memory_event (buffer, "oom");
+
+  /* The first read, without a @condition, only takes the counts */
+  if (condition)
+    {
+      if (max > cgroup_max)
+        hd_memory_pressure_shed (HD_MEMORY_PRESSURE_CRITICAL);
+      else if (high > cgroup_high)
+        hd_memory_pressure_shed (HD_MEMORY_PRESSURE_LOW);
+    }
+
+  cgroup_high = high;
+  cgroup_max = max;
+
+  return TRUE;
+}
+
+static gboolean
+watch_cgroup (void)
+{
+  gchar *contents, *path = NULL, **lines;
+  GIOChannel *channel;
+  guint i;
+  int fd;
+
+  if (!g_file_get_contents (PROC_SELF_CGROUP, &contents, NULL, NULL))
+    return FALSE;
+
+  /* The cgroup v2 hierarchy is "0::/path" */
+  lines = g_strsplit (contents, "\n", 0);
+  for (i = 0; lines[i] && !path; i++)
+    if (g_str_has_prefix (lines[i], "0::"))
+      path = g_build_filename (CGROUP_ROOT, lines[i] + 3,
+                               "memory.events", NULL);
+  g_strfreev (lines);
+  g_free (contents);
+
+  if (!path)
+    return FALSE;
+
+  fd = open (path, O_RDONLY);
+  g_free (path);
+  if (fd < 0)
+    return FALSE;
+
+  channel = g_io_channel_unix_new (fd);
+
+  /* Read the current counts */
+  cgroup_events_cb (channel, 0, NULL);
+
+  g_io_add_watch (channel,
+                  G_IO_PRI | G_IO_ERR | G_IO_NVAL,
+                  cgroup_events_cb,
+                  NULL);
+  g_io_channel_unref (channel);
+
+  return TRUE;
+}
+
+static gboolean
+lowmem_poll_cb (gpointer data)
+{
+  gboolean state = osso_mem_in_lowmem_state ();
+
+  if (state && !lowmem_state)
+    hd_memory_pressure_shed (HD_MEMORY_PRESSURE_LOW);
+  lowmem_state = state;
+
+  return TRUE;
+}
+
+/**
+ * hd_memory_pressure_start:
+ *
+ * Starts watching the memory pressure and calling the shrinkers
+ * when there is some.
+ */
+void
+hd_memory_pressure_start (void)
+{
+  if (started)
+    return;
+  started = TRUE;
+
+  if (arm_trigger (LOW_TRIGGER, HD_MEMORY_PRESSURE_LOW))
+    {
+      arm_trigger (CRITICAL_TRIGGER, HD_MEMORY_PRESSURE_CRITICAL);
+      g_debug ("%s. Using PSI triggers", __FUNCTION__);
+    }
+  else
+    {
+      if (watch_cgroup ())
+        g_debug ("%s. Using cgroup memory events", __FUNCTION__);
+
+      g_debug ("%s. Polling the lowmem state", __FUNCTION__);
+      g_timeout_add_seconds (LOWMEM_POLL_INTERVAL, lowmem_poll_cb, NULL);
+    }
+}
+
+#ifdef COMPILE_FOR_TEST
+#include <glib/gstdio.h>
+
+#include "hd-cairo-surface-cache.h"
+
+/* The osso lowmem state is set by the tests */
+static gboolean test_lowmem;
+
+int
+osso_mem_in_lowmem_state (void)
+{
+  return test_lowmem;
+}
+
+/* Reads a counter of the linked hd-metrics */
+static gint
+test_counter (const gchar *name)
+{
+  GHashTable *metrics = hd_metrics_collect ();
+  gint value;
+
+  value = g_value_get_int (g_hash_table_lookup (metrics, name));
+  g_hash_table_destroy (metrics);
+
+  return value;
+}
+
+/* A cache releasing a fixed amount, logging its calls */
+typedef struct
+{
+  const gchar           *name;
+  gsize                  size;
+  HDMemoryPressureLevel  level;
+  GString               *log;
+} TestCache;
+
+static gsize
+test_cache_shrink (HDMemoryPressureLevel  level,
+                   TestCache             *cache)
+{
+  g_string_append_printf (cache->log, "%s%s",
+                          cache->log->len ? " " : "", cache->name);
+  cache->level = level;
+
+  return cache->size;
+}
+
+/* Sheds @level and reports what each cache released */
+static gsize
+test_shed (HDMemoryPressureLevel level)
+{
+  gsize reclaimed;
+
+  reclaimed = hd_memory_pressure_shed (level);
+  g_test_message ("%s pressure: %" G_GSIZE_FORMAT " bytes reclaimed",
+                  level == HD_MEMORY_PRESSURE_CRITICAL ? "critical" : "low",
+                  reclaimed);
+
+  return reclaimed;
+}
+
+/* All caches shed on critical pressure, in priority order */
+static void
+test_critical (void)
+{
+  GString *log = g_string_new (NULL);
+  TestCache caches[] =
+  {
+    { "thumbnails", 3000, 0, log },
+    { "preload", 1000, 0, log },
+    { "surfaces", 2000, 0, log },
+  };
+  gint priorities[] =
+  {
+    HD_MEMORY_PRESSURE_PRIORITY_THUMBNAILS,
+    HD_MEMORY_PRESSURE_PRIORITY_PRELOAD,
+    HD_MEMORY_PRESSURE_PRIORITY_SURFACES
+  };
+  guint ids[G_N_ELEMENTS (caches)];
+  gint events = test_counter ("memory-pressure-events");
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (caches); i++)
+    ids[i] = hd_memory_pressure_add_shrinker (caches[i].name,
+                                              priorities[i],
+                                              (HDMemoryPressureShrinkFunc) test_cache_shrink,
+                                              &caches[i]);
+
+  g_assert_cmpuint (test_shed (HD_MEMORY_PRESSURE_CRITICAL), ==, 6000);
+  g_assert_cmpstr (log->str, ==, "preload surfaces thumbnails");
+  for (i = 0; i < G_N_ELEMENTS (caches); i++)
+    g_assert_cmpint (caches[i].level, ==, HD_MEMORY_PRESSURE_CRITICAL);
+  g_assert_cmpint (test_counter ("memory-pressure-events"), ==, events + 1);
+
+  /* Removed shrinkers are not called */
+  hd_memory_pressure_remove_shrinker (ids[1]);
+  g_string_truncate (log, 0);
+  g_assert_cmpuint (test_shed (HD_MEMORY_PRESSURE_CRITICAL), ==, 5000);
+  g_assert_cmpstr (log->str, ==, "surfaces thumbnails");
+
+  hd_memory_pressure_remove_shrinker (ids[0]);
+  hd_memory_pressure_remove_shrinker (ids[2]);
+  g_string_free (log, TRUE);
+}
+
+/* On low pressure the shedding stops once enough was released */
+static void
+test_low (void)
+{
+  GString *log = g_string_new (NULL);
+  TestCache caches[] =
+  {
+    { "a", 300 * 1024, 0, log },
+    { "b", 300 * 1024, 0, log },
+    { "c", 300 * 1024, 0, log },
+  };
+  guint ids[G_N_ELEMENTS (caches)];
+  gint events = test_counter ("memory-pressure-events");
+  gint reclaimed = test_counter ("memory-reclaimed-kb");
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (caches); i++)
+    ids[i] = hd_memory_pressure_add_shrinker (caches[i].name,
+                                              i,
+                                              (HDMemoryPressureShrinkFunc) test_cache_shrink,
+                                              &caches[i]);
+
+  g_assert_cmpuint (test_shed (HD_MEMORY_PRESSURE_LOW), ==, 600 * 1024);
+  g_assert_cmpstr (log->str, ==, "a b");
+  g_assert_cmpint (caches[0].level, ==, HD_MEMORY_PRESSURE_LOW);
+  g_assert_cmpint (test_counter ("memory-pressure-events"), ==, events + 1);
+  g_assert_cmpint (test_counter ("memory-reclaimed-kb"), ==, reclaimed + 600);
+
+  /* Without pressure nothing is released */
+  g_string_truncate (log, 0);
+  g_assert_cmpuint (hd_memory_pressure_shed (HD_MEMORY_PRESSURE_NONE), ==, 0);
+  g_assert_cmpstr (log->str, ==, "");
+
+  for (i = 0; i < G_N_ELEMENTS (caches); i++)
+    hd_memory_pressure_remove_shrinker (ids[i]);
+  g_string_free (log, TRUE);
+}
+
+/* The pressure is reported for a while after an event, and the osso
+ * lowmem state always */
+static void
+test_is_low (void)
+{
+  pressure_level = HD_MEMORY_PRESSURE_NONE;
+  test_lowmem = FALSE;
+  g_assert (!hd_memory_pressure_is_low ());
+
+  test_lowmem = TRUE;
+  g_assert (hd_memory_pressure_is_low ());
+  test_lowmem = FALSE;
+
+  hd_memory_pressure_shed (HD_MEMORY_PRESSURE_LOW);
+  g_assert (hd_memory_pressure_is_low ());
+
+  /* As if the event was long ago */
+  pressure_time -= PRESSURE_HOLD;
+  g_assert (!hd_memory_pressure_is_low ());
+}
+
+/* Overwrites @filename in place, the watch keeps it open */
+static void
+write_memory_events (const gchar *filename,
+                     guint        high,
+                     guint        max,
+                     guint        oom)
+{
+  gchar *events;
+  int fd;
+
+  events = g_strdup_printf ("low 0\nhigh %u\nmax %u\noom %u\noom_kill 0\n",
+                            high, max, oom);
+  fd = open (filename, O_WRONLY | O_TRUNC);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (write (fd, events, strlen (events)), ==, strlen (events));
+  close (fd);
+  g_free (events);
+}
+
+/* New "high" events in memory.events shed on low pressure, new "max"
+ * and "oom" events on critical pressure */
+static void
+test_cgroup_events (void)
+{
+  GString *log = g_string_new (NULL);
+  TestCache cache = { "cache", 1024, 0, log };
+  GIOChannel *channel;
+  gchar *dir, *filename;
+  guint id;
+  int fd;
+
+  dir = g_dir_make_tmp ("test-memory-pressure-XXXXXX", NULL);
+  g_assert (dir);
+  filename = g_build_filename (dir, "memory.events", NULL);
+  g_assert (g_file_set_contents (filename, "", 0, NULL));
+  write_memory_events (filename, 2, 0, 0);
+
+  id = hd_memory_pressure_add_shrinker ("cache",
+                                        0,
+                                        (HDMemoryPressureShrinkFunc) test_cache_shrink,
+                                        &cache);
+
+  fd = open (filename, O_RDONLY);
+  g_assert_cmpint (fd, >=, 0);
+  channel = g_io_channel_unix_new (fd);
+
+  /* The events counted before are not pressure */
+  cgroup_events_cb (channel, 0, NULL);
+  g_assert_cmpstr (log->str, ==, "");
+
+  write_memory_events (filename, 3, 0, 0);
+  cgroup_events_cb (channel, G_IO_PRI, NULL);
+  g_assert_cmpstr (log->str, ==, "cache");
+  g_assert_cmpint (cache.level, ==, HD_MEMORY_PRESSURE_LOW);
+
+  /* Nothing new */
+  cgroup_events_cb (channel, G_IO_PRI, NULL);
+  g_assert_cmpstr (log->str, ==, "cache");
+
+  write_memory_events (filename, 4, 1, 0);
+  cgroup_events_cb (channel, G_IO_PRI, NULL);
+  g_assert_cmpstr (log->str, ==, "cache cache");
+  g_assert_cmpint (cache.level, ==, HD_MEMORY_PRESSURE_CRITICAL);
+
+  write_memory_events (filename, 4, 1, 1);
+  cgroup_events_cb (channel, G_IO_PRI, NULL);
+  g_assert_cmpstr (log->str, ==, "cache cache cache");
+  g_assert_cmpint (cache.level, ==, HD_MEMORY_PRESSURE_CRITICAL);
+
+  g_io_channel_unref (channel);
+  close (fd);
+  hd_memory_pressure_remove_shrinker (id);
+  g_unlink (filename);
+  g_rmdir (dir);
+  g_free (filename);
+  g_free (dir);
+  g_string_free (log, TRUE);
+}
+
+/* Entering the osso lowmem state sheds on low pressure once, the
+ * poll runs along with the cgroup events */
+static void
+test_lowmem_poll (void)
+{
+  GString *log = g_string_new (NULL);
+  TestCache cache = { "cache", 1024, 0, log };
+  guint id;
+
+  id = hd_memory_pressure_add_shrinker ("cache",
+                                        0,
+                                        (HDMemoryPressureShrinkFunc) test_cache_shrink,
+                                        &cache);
+
+  test_lowmem = FALSE;
+  lowmem_poll_cb (NULL);
+  g_assert_cmpstr (log->str, ==, "");
+
+  test_lowmem = TRUE;
+  lowmem_poll_cb (NULL);
+  g_assert_cmpstr (log->str, ==, "cache");
+  g_assert_cmpint (cache.level, ==, HD_MEMORY_PRESSURE_LOW);
+
+  /* Still in the lowmem state */
+  lowmem_poll_cb (NULL);
+  g_assert_cmpstr (log->str, ==, "cache");
+
+  test_lowmem = FALSE;
+  lowmem_poll_cb (NULL);
+  test_lowmem = TRUE;
+  lowmem_poll_cb (NULL);
+  g_assert_cmpstr (log->str, ==, "cache cache");
+
+  test_lowmem = FALSE;
+  lowmem_poll_cb (NULL);
+  hd_memory_pressure_remove_shrinker (id);
+  g_string_free (log, TRUE);
+}
+
+/* The surface cache drops the surfaces only it holds */
+static void
+test_surface_cache (void)
+{
+  HDCairoSurfaceCache *cache;
+  cairo_surface_t *image, *used, *unused;
+  gchar *dir, *used_file, *unused_file;
+  gint hits, misses;
+
+  dir = g_dir_make_tmp ("test-memory-pressure-XXXXXX", NULL);
+  g_assert (dir);
+  used_file = g_build_filename (dir, "used.png", NULL);
+  unused_file = g_build_filename (dir, "unused.png", NULL);
+
+  image = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 32, 32);
+  g_assert_cmpint (cairo_surface_write_to_png (image, used_file), ==,
+                   CAIRO_STATUS_SUCCESS);
+  cairo_surface_destroy (image);
+  image = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 64, 32);
+  g_assert_cmpint (cairo_surface_write_to_png (image, unused_file), ==,
+                   CAIRO_STATUS_SUCCESS);
+  cairo_surface_destroy (image);
+
+  cache = g_object_new (HD_TYPE_CAIRO_SURFACE_CACHE, NULL);
+  used = hd_cairo_surface_cache_get_surface (cache, used_file);
+  unused = hd_cairo_surface_cache_get_surface (cache, unused_file);
+  cairo_surface_destroy (unused);
+
+  g_assert_cmpuint (test_shed (HD_MEMORY_PRESSURE_CRITICAL), ==, 64 * 4 * 32);
+
+  /* The surface in use is still cached, the other loaded again */
+  hits = test_counter ("surface-cache-hits");
+  misses = test_counter ("surface-cache-misses");
+  image = hd_cairo_surface_cache_get_surface (cache, used_file);
+  g_assert (image == used);
+  cairo_surface_destroy (image);
+  unused = hd_cairo_surface_cache_get_surface (cache, unused_file);
+  cairo_surface_destroy (unused);
+  g_assert_cmpint (test_counter ("surface-cache-hits"), ==, hits + 1);
+  g_assert_cmpint (test_counter ("surface-cache-misses"), ==, misses + 1);
+
+  cairo_surface_destroy (used);
+  g_assert_cmpuint (test_shed (HD_MEMORY_PRESSURE_CRITICAL), ==,
+                    32 * 4 * 32 + 64 * 4 * 32);
+  g_assert_cmpuint (test_shed (HD_MEMORY_PRESSURE_CRITICAL), ==, 0);
+
+  /* Disposing the cache removes its shrinker */
+  g_object_unref (cache);
+  g_assert (!shrinkers);
+
+  g_unlink (used_file);
+  g_unlink (unused_file);
+  g_rmdir (dir);
+  g_free (used_file);
+  g_free (unused_file);
+  g_free (dir);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/memory-pressure/critical", test_critical);
+  g_test_add_func ("/memory-pressure/low", test_low);
+  g_test_add_func ("/memory-pressure/is-low", test_is_low);
+  g_test_add_func ("/memory-pressure/cgroup-events", test_cgroup_events);
+  g_test_add_func ("/memory-pressure/lowmem-poll", test_lowmem_poll);
+  g_test_add_func ("/memory-pressure/surface-cache", test_surface_cache);
+
+  return g_test_run ();
+}
+
+#endif
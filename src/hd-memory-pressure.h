@@ -0,0 +1,67 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_MEMORY_PRESSURE_H__
+#define __HD_MEMORY_PRESSURE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  HD_MEMORY_PRESSURE_NONE,
+  HD_MEMORY_PRESSURE_LOW,
+  HD_MEMORY_PRESSURE_CRITICAL
+} HDMemoryPressureLevel;
+
+/* Shrinkers are called in increasing priority order, the caches which
+ * are the cheapest to fill again should come first.  On low pressure
+ * only as many are called as needed to release a few hundred kB. */
+enum
+{
+  HD_MEMORY_PRESSURE_PRIORITY_PRELOAD    = 0,
+  HD_MEMORY_PRESSURE_PRIORITY_SURFACES   = 10,
+  HD_MEMORY_PRESSURE_PRIORITY_ICONS      = 15,
+  HD_MEMORY_PRESSURE_PRIORITY_THUMBNAILS = 20
+};
+
+/* Releases what the cache can, more if @level is critical, and returns
+ * the number of bytes released, an estimate is fine.  Called in the
+ * main thread. */
+typedef gsize (*HDMemoryPressureShrinkFunc) (HDMemoryPressureLevel  level,
+                                             gpointer               data);
+
+void                  hd_memory_pressure_start           (void);
+
+guint                 hd_memory_pressure_add_shrinker    (const gchar                *name,
+                                                          gint                        priority,
+                                                          HDMemoryPressureShrinkFunc  func,
+                                                          gpointer                    data);
+void                  hd_memory_pressure_remove_shrinker (guint                       id);
+
+gsize                 hd_memory_pressure_shed            (HDMemoryPressureLevel       level);
+
+gboolean              hd_memory_pressure_is_low          (void);
+
+G_END_DECLS
+
+#endif
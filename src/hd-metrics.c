@@ -0,0 +1,602 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <dbus/dbus-glib.h>
+
+#include "hd-metrics.h"
+
+/* The last bucket starts at 2^22 us, about four seconds. */
+#define N_BUCKETS 24
+
+typedef struct
+{
+  HDMetricsGaugeFunc func;
+  gpointer           data;
+} Gauge;
+
+static const gchar *counter_names[HD_METRICS_N_COUNTERS] =
+{
+  "notify-calls",
+  "notification-windows",
+  "db-commits",
+  "background-jobs",
+  "background-jobs-queued",
+  "surface-cache-hits",
+  "surface-cache-misses",
+  "applets",
+  "memory-pressure-events",
+  "memory-reclaimed-kb",
+  "slow-applet-handlers",
+  "plugin-notifications-dropped"
+};
+
+static const gchar *histogram_names[HD_METRICS_N_HISTOGRAMS] =
+{
+  "notify-latency",
+  "db-commit-latency",
+  "db-commit-batch",
+  "background-job-duration",
+  "notify-ingress-delay"
+};
+
+static const gchar *gauge_names[HD_METRICS_N_GAUGES] =
+{
+  "notifications",
+  "throttled-applets"
+};
+
+/* Plain arrays updated with atomic operations only, so recording
+ * never locks nor allocates. */
+static volatile gint counters[HD_METRICS_N_COUNTERS];
+static volatile gint histograms[HD_METRICS_N_HISTOGRAMS][N_BUCKETS];
+static Gauge gauges[HD_METRICS_N_GAUGES];
+
+void
+hd_metrics_add (HDMetricsCounter counter,
+                gint             delta)
+{
+  g_return_if_fail (counter < HD_METRICS_N_COUNTERS);
+
+  g_atomic_int_add (&counters[counter], delta);
+}
+
+void
+hd_metrics_observe (HDMetricsHistogram histogram,
+                    guint              value)
+{
+  guint bucket;
+
+  g_return_if_fail (histogram < HD_METRICS_N_HISTOGRAMS);
+
+  bucket = value ? MIN (g_bit_storage (value), N_BUCKETS - 1) : 0;
+
+  g_atomic_int_inc (&histograms[histogram][bucket]);
+}
+
+/* Observes the time passed since @start, a g_get_monotonic_time ()
+ * timestamp. */
+void
+hd_metrics_observe_since (HDMetricsHistogram histogram,
+                          gint64             start)
+{
+  gint64 elapsed = g_get_monotonic_time () - start;
+
+  hd_metrics_observe (histogram, CLAMP (elapsed, 0, G_MAXUINT));
+}
+
+void
+hd_metrics_set_gauge_func (HDMetricsGauge     gauge,
+                           HDMetricsGaugeFunc func,
+                           gpointer           data)
+{
+  g_return_if_fail (gauge < HD_METRICS_N_GAUGES);
+
+  gauges[gauge].func = func;
+  gauges[gauge].data = data;
+}
+
+static GValue *
+value_new (GType type)
+{
+  GValue *value = g_slice_new0 (GValue);
+
+  g_value_init (value, type);
+
+  return value;
+}
+
+static void
+value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_slice_free (GValue, value);
+}
+
+/* Returns a new map of metric names to #GValue<!-- -->s, suitable to be
+ * sent as a{sv}.  Counters and gauges are integers, histograms are
+ * arrays of bucket counts.  "time" is the monotonic time in microseconds
+ * so rates can be calculated from two snapshots. */
+GHashTable *
+hd_metrics_collect (void)
+{
+  GHashTable *metrics;
+  GValue *value;
+  guint i, j;
+
+  metrics = g_hash_table_new_full (g_str_hash,
+                                   g_str_equal,
+                                   NULL,
+                                   (GDestroyNotify) value_free);
+
+  value = value_new (G_TYPE_INT64);
+  g_value_set_int64 (value, g_get_monotonic_time ());
+  g_hash_table_insert (metrics, "time", value);
+
+  for (i = 0; i < HD_METRICS_N_COUNTERS; i++)
+    {
+      value = value_new (G_TYPE_INT);
+      g_value_set_int (value, g_atomic_int_get (&counters[i]));
+      g_hash_table_insert (metrics, (gpointer) counter_names[i], value);
+    }
+
+  for (i = 0; i < HD_METRICS_N_GAUGES; i++)
+    {
+      if (!gauges[i].func)
+        continue;
+
+      value = value_new (G_TYPE_INT);
+      g_value_set_int (value, gauges[i].func (gauges[i].data));
+      g_hash_table_insert (metrics, (gpointer) gauge_names[i], value);
+    }
+
+  for (i = 0; i < HD_METRICS_N_HISTOGRAMS; i++)
+    {
+      GArray *buckets;
+
+      buckets = g_array_sized_new (FALSE, FALSE, sizeof (guint), N_BUCKETS);
+      for (j = 0; j < N_BUCKETS; j++)
+        {
+          guint count = g_atomic_int_get (&histograms[i][j]);
+
+          g_array_append_val (buckets, count);
+        }
+
+      value = value_new (dbus_g_type_get_collection ("GArray", G_TYPE_UINT));
+      g_value_take_boxed (value, buckets);
+      g_hash_table_insert (metrics, (gpointer) histogram_names[i], value);
+    }
+
+  return metrics;
+}
+
+#ifdef COMPILE_FOR_TEST
+#include <signal.h>
+#include <unistd.h>
+#include <dbus/dbus.h>
+
+#include "hd-hildon-home-dbus.h"
+
+#define TEST_THREADS 4
+#define TEST_ADDS    10000
+#define TEST_PATH    "/com/nokia/HildonHome"
+#define TEST_IFACE   "com.nokia.HildonHome.Metrics"
+
+/* The rest of HDHildonHomeDBus is not linked, it is replaced by these
+ * and a plain object with the same D-Bus glue */
+void
+hd_hildon_home_dbus_show_edit_menu (HDHildonHomeDBus      *dbus,
+                                    guint                  current_view,
+                                    DBusGMethodInvocation *context)
+{
+  dbus_g_method_return (context);
+}
+
+void
+hd_hildon_home_dbus_set_background_image (HDHildonHomeDBus      *dbus,
+                                          const char            *uri,
+                                          DBusGMethodInvocation *context)
+{
+  dbus_g_method_return (context);
+}
+
+gboolean
+hd_hildon_home_dbus_get_applet_stats (HDHildonHomeDBus  *dbus,
+                                      GHashTable       **applets,
+                                      GError           **error)
+{
+  *applets = g_hash_table_new (g_str_hash, g_str_equal);
+
+  return TRUE;
+}
+
+/* As in hd-hildon-home-dbus.c */
+gboolean
+hd_hildon_home_dbus_get_metrics (HDHildonHomeDBus  *dbus,
+                                 GHashTable       **metrics,
+                                 GError           **error)
+{
+  *metrics = hd_metrics_collect ();
+
+  return TRUE;
+}
+
+#include "hd-hildon-home-dbus-glue.h"
+
+typedef GObject      TestHome;
+typedef GObjectClass TestHomeClass;
+
+GType test_home_get_type (void);
+
+G_DEFINE_TYPE (TestHome, test_home, G_TYPE_OBJECT);
+
+static void
+test_home_class_init (TestHomeClass *klass)
+{
+}
+
+static void
+test_home_init (TestHome *home)
+{
+}
+
+static const gchar *home_name;
+
+/* The integers and the histograms of a GetMetrics reply, as read by a
+ * client */
+typedef struct
+{
+  GMainLoop  *loop;
+  GHashTable *integers;
+  GHashTable *histograms;
+} Snapshot;
+
+static gint64 *
+int64_new (gint64 value)
+{
+  return g_memdup (&value, sizeof (value));
+}
+
+static void
+read_reply (Snapshot    *snapshot,
+            DBusMessage *reply)
+{
+  DBusMessageIter args, array;
+
+  g_assert (dbus_message_has_signature (reply, "a{sv}"));
+
+  dbus_message_iter_init (reply, &args);
+  for (dbus_message_iter_recurse (&args, &array);
+       dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_DICT_ENTRY;
+       dbus_message_iter_next (&array))
+    {
+      DBusMessageIter entry, variant, buckets;
+      const gchar *name;
+      dbus_int32_t i;
+      dbus_int64_t x;
+      GArray *counts;
+
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &name);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &variant);
+
+      switch (dbus_message_iter_get_arg_type (&variant))
+        {
+        case DBUS_TYPE_INT32:
+          dbus_message_iter_get_basic (&variant, &i);
+          g_hash_table_insert (snapshot->integers, g_strdup (name), int64_new (i));
+          break;
+        case DBUS_TYPE_INT64:
+          dbus_message_iter_get_basic (&variant, &x);
+          g_hash_table_insert (snapshot->integers, g_strdup (name), int64_new (x));
+          break;
+        case DBUS_TYPE_ARRAY:
+          g_assert_cmpint (dbus_message_iter_get_element_type (&variant), ==, DBUS_TYPE_UINT32);
+          counts = g_array_new (FALSE, FALSE, sizeof (dbus_uint32_t));
+          for (dbus_message_iter_recurse (&variant, &buckets);
+               dbus_message_iter_get_arg_type (&buckets) == DBUS_TYPE_UINT32;
+               dbus_message_iter_next (&buckets))
+            {
+              dbus_uint32_t count;
+
+              dbus_message_iter_get_basic (&buckets, &count);
+              g_array_append_val (counts, count);
+            }
+          g_hash_table_insert (snapshot->histograms, g_strdup (name), counts);
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+}
+
+static gboolean
+quit_loop (GMainLoop *loop)
+{
+  g_main_loop_quit (loop);
+
+  return FALSE;
+}
+
+/* A client with its own connection, the main loop keeps serving the
+ * object meanwhile */
+static gpointer
+get_metrics_thread (Snapshot *snapshot)
+{
+  DBusConnection *connection = dbus_bus_get_private (DBUS_BUS_SESSION, NULL);
+  DBusMessage *message, *reply;
+
+  g_assert (connection);
+
+  message = dbus_message_new_method_call (home_name, TEST_PATH,
+                                          TEST_IFACE, "GetMetrics");
+  reply = dbus_connection_send_with_reply_and_block (connection, message,
+                                                     -1, NULL);
+  g_assert (reply);
+  read_reply (snapshot, reply);
+
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+
+  g_idle_add ((GSourceFunc) quit_loop, snapshot->loop);
+
+  return NULL;
+}
+
+static Snapshot *
+snapshot_get (void)
+{
+  Snapshot *snapshot = g_new0 (Snapshot, 1);
+  GThread *thread;
+
+  snapshot->loop = g_main_loop_new (NULL, FALSE);
+  snapshot->integers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+  snapshot->histograms = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free,
+                                                (GDestroyNotify) g_array_unref);
+
+  thread = g_thread_new ("get-metrics",
+                         (GThreadFunc) get_metrics_thread,
+                         snapshot);
+  g_main_loop_run (snapshot->loop);
+  g_thread_join (thread);
+
+  return snapshot;
+}
+
+static void
+snapshot_free (Snapshot *snapshot)
+{
+  g_main_loop_unref (snapshot->loop);
+  g_hash_table_destroy (snapshot->integers);
+  g_hash_table_destroy (snapshot->histograms);
+  g_free (snapshot);
+}
+
+static gint64
+snapshot_integer (Snapshot    *snapshot,
+                  const gchar *name)
+{
+  gint64 *value = g_hash_table_lookup (snapshot->integers, name);
+
+  g_assert (value);
+
+  return *value;
+}
+
+static guint
+snapshot_bucket (Snapshot    *snapshot,
+                 const gchar *name,
+                 guint        bucket)
+{
+  GArray *counts = g_hash_table_lookup (snapshot->histograms, name);
+
+  g_assert (counts);
+  g_assert_cmpuint (counts->len, ==, N_BUCKETS);
+
+  return g_array_index (counts, dbus_uint32_t, bucket);
+}
+
+static gpointer
+add_thread (gpointer data)
+{
+  guint i;
+
+  for (i = 0; i < TEST_ADDS; i++)
+    {
+      hd_metrics_add (HD_METRICS_NOTIFY_CALLS, 1);
+      hd_metrics_add (HD_METRICS_NOTIFICATION_WINDOWS, 1);
+      if (i)
+        hd_metrics_add (HD_METRICS_NOTIFICATION_WINDOWS, -1);
+    }
+
+  return NULL;
+}
+
+static gint
+get_notifications (gpointer data)
+{
+  return GPOINTER_TO_INT (data);
+}
+
+static void
+test_get_metrics (void)
+{
+  GThread *threads[TEST_THREADS];
+  Snapshot *before, *after;
+  guint i;
+
+  before = snapshot_get ();
+  g_assert_cmpint (snapshot_integer (before, "notify-calls"), ==, 0);
+  g_assert_cmpint (snapshot_bucket (before, "notify-latency", 0), ==, 0);
+  g_assert (!g_hash_table_lookup (before->integers, "notifications"));
+
+  /* Counters are changed from several threads at once */
+  for (i = 0; i < TEST_THREADS; i++)
+    threads[i] = g_thread_new ("add", add_thread, NULL);
+  for (i = 0; i < TEST_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  hd_metrics_observe (HD_METRICS_NOTIFY_LATENCY, 0);
+  hd_metrics_observe (HD_METRICS_NOTIFY_LATENCY, 1);
+  hd_metrics_observe (HD_METRICS_NOTIFY_LATENCY, 2);
+  hd_metrics_observe (HD_METRICS_NOTIFY_LATENCY, 3);
+  hd_metrics_observe (HD_METRICS_NOTIFY_LATENCY, 1000);
+  hd_metrics_observe (HD_METRICS_NOTIFY_LATENCY, G_MAXUINT);
+  hd_metrics_observe_since (HD_METRICS_DB_COMMIT_LATENCY,
+                            g_get_monotonic_time () + G_USEC_PER_SEC);
+
+  hd_metrics_set_gauge_func (HD_METRICS_NOTIFICATIONS,
+                             get_notifications,
+                             GINT_TO_POINTER (7));
+
+  after = snapshot_get ();
+
+  g_assert_cmpint (snapshot_integer (after, "time"), >, snapshot_integer (before, "time"));
+  g_assert_cmpint (snapshot_integer (after, "notify-calls"), ==, TEST_THREADS * TEST_ADDS);
+  g_assert_cmpint (snapshot_integer (after, "notification-windows"), ==, TEST_THREADS);
+  g_assert_cmpint (snapshot_integer (after, "db-commits"), ==, 0);
+  g_assert_cmpint (snapshot_integer (after, "notifications"), ==, 7);
+  g_assert (!g_hash_table_lookup (after->integers, "throttled-applets"));
+
+  g_assert_cmpuint (snapshot_bucket (after, "notify-latency", 0), ==, 1);
+  g_assert_cmpuint (snapshot_bucket (after, "notify-latency", 1), ==, 1);
+  g_assert_cmpuint (snapshot_bucket (after, "notify-latency", 2), ==, 2);
+  g_assert_cmpuint (snapshot_bucket (after, "notify-latency", 10), ==, 1);
+  g_assert_cmpuint (snapshot_bucket (after, "notify-latency", N_BUCKETS - 1), ==, 1);
+  /* A start in the future counts as no time */
+  g_assert_cmpuint (snapshot_bucket (after, "db-commit-latency", 0), ==, 1);
+  g_assert_cmpuint (snapshot_bucket (after, "db-commit-batch", 0), ==, 0);
+
+  hd_metrics_set_gauge_func (HD_METRICS_NOTIFICATIONS, NULL, NULL);
+  snapshot_free (before);
+  snapshot_free (after);
+}
+
+static gpointer
+observe_thread (gpointer data)
+{
+  guint i;
+
+  for (i = 0; i < TEST_ADDS * 100; i++)
+    hd_metrics_observe (HD_METRICS_NOTIFY_LATENCY, i);
+
+  return NULL;
+}
+
+/* The cost of recording, with all the threads on the same histogram */
+static void
+test_record_performance (void)
+{
+  GThread *threads[TEST_THREADS];
+  gdouble elapsed;
+  guint i;
+
+  g_test_timer_start ();
+  for (i = 0; i < TEST_THREADS; i++)
+    threads[i] = g_thread_new ("observe", observe_thread, NULL);
+  for (i = 0; i < TEST_THREADS; i++)
+    g_thread_join (threads[i]);
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_minimized_result (elapsed / (TEST_ADDS * 100) * 1e9,
+                           "%d threads, %.1f ns per observation",
+                           TEST_THREADS, elapsed / (TEST_ADDS * 100) * 1e9);
+}
+
+static GPid
+start_bus (void)
+{
+  gchar *argv[] = { "dbus-daemon", "--session", "--nofork", "--print-address", NULL };
+  GString *address;
+  GPid pid;
+  gint out;
+  gchar c;
+
+  if (!g_spawn_async_with_pipes (NULL, argv, NULL,
+                                 G_SPAWN_SEARCH_PATH,
+                                 NULL, NULL,
+                                 &pid,
+                                 NULL, &out, NULL,
+                                 NULL))
+    return 0;
+
+  address = g_string_new (NULL);
+  while (read (out, &c, 1) == 1 && c != '\n')
+    g_string_append_c (address, c);
+  close (out);
+
+  g_setenv ("DBUS_SESSION_BUS_ADDRESS", address->str, TRUE);
+  g_string_free (address, TRUE);
+
+  return pid;
+}
+
+int main (int argc, char **argv)
+{
+  DBusGConnection *connection;
+  GObject *home;
+  GPid bus;
+  gint result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  dbus_threads_init_default ();
+
+  bus = start_bus ();
+  if (!bus)
+    {
+      g_printerr ("Could not start dbus-daemon, skipping\n");
+      return 77;
+    }
+
+  connection = dbus_g_bus_get (DBUS_BUS_SESSION, NULL);
+  g_assert (connection);
+  dbus_connection_set_exit_on_disconnect (dbus_g_connection_get_connection (connection),
+                                          FALSE);
+  home_name = dbus_bus_get_unique_name (dbus_g_connection_get_connection (connection));
+
+  home = g_object_new (test_home_get_type (), NULL);
+  dbus_g_object_type_install_info (test_home_get_type (),
+                                   &dbus_glib_hd_hildon_home_dbus_object_info);
+  dbus_g_connection_register_g_object (connection, TEST_PATH, home);
+
+  g_test_add_func ("/metrics/get-metrics", test_get_metrics);
+  if (g_test_perf ())
+    g_test_add_func ("/metrics/record-performance", test_record_performance);
+
+  result = g_test_run ();
+
+  g_object_unref (home);
+  kill (bus, SIGTERM);
+  g_spawn_close_pid (bus);
+
+  return result;
+}
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_METRICS_H__
+#define __HD_METRICS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Counters may be changed from any thread.  Those which can go down
+ * again (live windows, queued jobs) are changed with negative deltas. */
+typedef enum
+{
+  HD_METRICS_NOTIFY_CALLS,
+  HD_METRICS_NOTIFICATION_WINDOWS,
+  HD_METRICS_DB_COMMITS,
+  HD_METRICS_BACKGROUND_JOBS,
+  HD_METRICS_BACKGROUND_JOBS_QUEUED,
+  HD_METRICS_SURFACE_CACHE_HITS,
+  HD_METRICS_SURFACE_CACHE_MISSES,
+  HD_METRICS_APPLETS,
+  HD_METRICS_MEMORY_PRESSURE_EVENTS,
+  HD_METRICS_MEMORY_RECLAIMED_KB,
+  HD_METRICS_SLOW_APPLET_HANDLERS,
+  HD_METRICS_PLUGIN_NOTIFICATIONS_DROPPED,
+  HD_METRICS_N_COUNTERS
+} HDMetricsCounter;
+
+/* Histograms have power of two buckets, bucket 0 counts the zero
+ * values and bucket n the values in [2^(n-1), 2^n).  The last bucket
+ * counts all the larger values too.  Times are in microseconds. */
+typedef enum
+{
+  HD_METRICS_NOTIFY_LATENCY,
+  HD_METRICS_DB_COMMIT_LATENCY,
+  HD_METRICS_DB_COMMIT_BATCH,
+  HD_METRICS_BACKGROUND_JOB_DURATION,
+  HD_METRICS_NOTIFY_INGRESS_DELAY,
+  HD_METRICS_N_HISTOGRAMS
+} HDMetricsHistogram;
+
+/* Gauges are read from callbacks when the metrics are queried,
+ * always in the main thread. */
+typedef enum
+{
+  HD_METRICS_NOTIFICATIONS,
+  HD_METRICS_THROTTLED_APPLETS,
+  HD_METRICS_N_GAUGES
+} HDMetricsGauge;
+
+typedef gint (*HDMetricsGaugeFunc) (gpointer data);
+
+void        hd_metrics_add            (HDMetricsCounter    counter,
+                                       gint                delta);
+void        hd_metrics_observe        (HDMetricsHistogram  histogram,
+                                       guint               value);
+void        hd_metrics_observe_since  (HDMetricsHistogram  histogram,
+                                       gint64              start);
+
+void        hd_metrics_set_gauge_func (HDMetricsGauge      gauge,
+                                       HDMetricsGaugeFunc  func,
+                                       gpointer            data);
+
+GHashTable *hd_metrics_collect        (void);
+
+G_END_DECLS
+
+#endif
@@ -29,18 +29,30 @@
 #define HD_MULTI_MAP_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_MULTI_MAP, HDMultiMapPrivate))
 
+/* The values of one key.  The queue keeps the insertion order,
+ * the index maps each value to its link in the queue. */
+typedef struct
+{
+  GObject    *key;
+  GQueue      values;
+  GHashTable *index;
+
+  /* Link in HDMultiMapPrivate.keys */
+  GList      *link;
+} HDMultiMapValues;
+
 struct _HDMultiMapPrivate
 {
+  /* Maps the keys to their HDMultiMapValues */
   GHashTable *map;
+
+  /* HDMultiMapValues in key insertion order */
+  GQueue      keys;
 };
 
 static void hd_multi_map_dispose     (GObject *object);
 
-static GList *remove_value_from_list (GList   *list,
-                                      GObject *value);
-
-static void remove_and_free_all_keys_and_values (GHashTable *map);
-static void free_values_list (GList *list);
+static void values_free (HDMultiMapValues *values);
 
 G_DEFINE_TYPE (HDMultiMap, hd_multi_map, G_TYPE_INITIALLY_UNOWNED);
 
@@ -72,10 +84,9 @@ hd_multi_map_init (HDMultiMap *multi_map)
 
   priv = multi_map->priv = HD_MULTI_MAP_GET_PRIVATE (multi_map);
 
-  priv->map = g_hash_table_new_full (g_direct_hash,
-                                     g_direct_equal,
-                                     (GDestroyNotify) g_object_unref,
-                                     NULL);
+  priv->map = g_hash_table_new (g_direct_hash,
+                                g_direct_equal);
+  g_queue_init (&priv->keys);
 }
 
 static void
@@ -93,22 +104,47 @@ hd_multi_map_dispose (GObject *object)
   G_OBJECT_CLASS (hd_multi_map_parent_class)->dispose (object);
 }
 
+/* Adds @value to the values of @key, unless it is there already.
+ * The map holds one reference on @key as long as it has values and
+ * one reference on each value. */
 void
 hd_multi_map_insert (HDMultiMap *multi_map,
                      GObject    *key,
                      GObject    *value)
 {
-  HDMultiMapPrivate *priv = multi_map->priv;
-  GList *values;
+  HDMultiMapPrivate *priv;
+  HDMultiMapValues *values;
 
   g_return_if_fail (HD_IS_MULTI_MAP (multi_map));
+  g_return_if_fail (G_IS_OBJECT (key));
+  g_return_if_fail (G_IS_OBJECT (value));
+
+  priv = multi_map->priv;
 
   values = g_hash_table_lookup (priv->map,
                                 key);
-  values = g_list_append (values, g_object_ref (value));
-  g_hash_table_insert (priv->map,
-                       g_object_ref (key),
-                       values);
+  if (!values)
+    {
+      values = g_slice_new0 (HDMultiMapValues);
+      values->key = g_object_ref (key);
+      g_queue_init (&values->values);
+      values->index = g_hash_table_new (g_direct_hash,
+                                        g_direct_equal);
+
+      g_queue_push_tail (&priv->keys, values);
+      values->link = priv->keys.tail;
+
+      g_hash_table_insert (priv->map,
+                           key,
+                           values);
+    }
+  else if (g_hash_table_lookup (values->index, value))
+    return;
+
+  g_queue_push_tail (&values->values, g_object_ref (value));
+  g_hash_table_insert (values->index,
+                       value,
+                       values->values.tail);
 }
 
 void
@@ -116,68 +152,281 @@ hd_multi_map_remove (HDMultiMap *multi_map,
                      GObject    *key,
                      GObject    *value)
 {
-  HDMultiMapPrivate *priv = multi_map->priv;
-  GList *values;
+  HDMultiMapPrivate *priv;
+  HDMultiMapValues *values;
+  GList *link;
 
   g_return_if_fail (HD_IS_MULTI_MAP (multi_map));
 
+  priv = multi_map->priv;
+
   values = g_hash_table_lookup (priv->map,
                                 key);
-  values = remove_value_from_list (values,
-                                   value);
-  if (values)
-    g_hash_table_insert (priv->map,
-                         g_object_ref (key),
-                         values);
-  else
-    g_hash_table_remove (priv->map,
-                         key);
-}
+  if (!values)
+    return;
 
-static GList *
-remove_value_from_list (GList   *list,
-                        GObject *value)
-{
-  GList *link;
+  link = g_hash_table_lookup (values->index,
+                              value);
+  if (!link)
+    return;
+
+  g_hash_table_remove (values->index,
+                       value);
+  g_queue_delete_link (&values->values,
+                       link);
 
-  link = g_list_find (list, value);
-  if (link)
+  /* Drop the key with its last value */
+  if (g_queue_is_empty (&values->values))
     {
-      g_object_unref (link->data);
-      list = g_list_delete_link (list, link);
+      g_hash_table_remove (priv->map,
+                           key);
+      g_queue_delete_link (&priv->keys,
+                           values->link);
+      values_free (values);
     }
 
-  return list;
+  /* Released last, its finalizer may use the map again */
+  g_object_unref (value);
 }
 
+/* Removes all keys and values.  The references are released in
+ * insertion order once the map is already empty, so the map can be
+ * used again from the finalizers. */
 void
 hd_multi_map_remove_all (HDMultiMap *multi_map)
 {
-  HDMultiMapPrivate *priv = multi_map->priv;
+  HDMultiMapPrivate *priv;
+  GQueue keys;
+  HDMultiMapValues *values;
 
   g_return_if_fail (HD_IS_MULTI_MAP (multi_map));
 
-  remove_and_free_all_keys_and_values (priv->map);
+  priv = multi_map->priv;
+
+  keys = priv->keys;
+  g_queue_init (&priv->keys);
+  g_hash_table_remove_all (priv->map);
+
+  while ((values = g_queue_pop_head (&keys)))
+    {
+      GObject *value;
+
+      while ((value = g_queue_pop_head (&values->values)))
+        g_object_unref (value);
+
+      values_free (values);
+    }
+}
+
+static void
+values_free (HDMultiMapValues *values)
+{
+  g_hash_table_destroy (values->index);
+  g_queue_clear (&values->values);
+  g_object_unref (values->key);
+
+  g_slice_free (HDMultiMapValues, values);
 }
 
+#ifdef COMPILE_FOR_TEST
+#define TEST_VALUES 10000
+
+/* Finalization order of the test objects, by name */
+static GString *finalized;
+
 static void
-remove_and_free_all_keys_and_values (GHashTable *map)
+record_finalize (gpointer  name,
+                 GObject  *object)
+{
+  g_string_append (finalized, name);
+}
+
+static GObject *
+test_object_new (const gchar *name)
 {
-  GHashTableIter iter;
-  gpointer key, values;
+  GObject *object = g_object_new (G_TYPE_OBJECT, NULL);
+
+  g_object_weak_ref (object, record_finalize, (gpointer) name);
 
-  g_hash_table_iter_init (&iter, map);
-  while (g_hash_table_iter_next (&iter, &key, &values)) 
+  return object;
+}
+
+static void
+test_insert_remove (void)
+{
+  HDMultiMap *map = g_object_ref_sink (hd_multi_map_new ());
+  GObject *key = test_object_new ("k");
+  GObject *a = test_object_new ("a");
+  GObject *b = test_object_new ("b");
+
+  g_string_truncate (finalized, 0);
+
+  hd_multi_map_insert (map, key, a);
+  g_assert_cmpuint (key->ref_count, ==, 2);
+  g_assert_cmpuint (a->ref_count, ==, 2);
+
+  /* The key is referenced once, whatever the number of values */
+  hd_multi_map_insert (map, key, b);
+  g_assert_cmpuint (key->ref_count, ==, 2);
+  g_assert_cmpuint (b->ref_count, ==, 2);
+
+  /* Values are a set */
+  hd_multi_map_insert (map, key, a);
+  g_assert_cmpuint (a->ref_count, ==, 2);
+
+  /* Not there */
+  hd_multi_map_remove (map, key, key);
+  hd_multi_map_remove (map, a, b);
+  g_assert_cmpuint (key->ref_count, ==, 2);
+
+  hd_multi_map_remove (map, key, a);
+  g_assert_cmpuint (a->ref_count, ==, 1);
+  g_assert_cmpuint (key->ref_count, ==, 2);
+
+  /* Released with the last value */
+  hd_multi_map_remove (map, key, b);
+  g_assert_cmpuint (b->ref_count, ==, 1);
+  g_assert_cmpuint (key->ref_count, ==, 1);
+
+  /* And taken again */
+  hd_multi_map_insert (map, key, a);
+  g_assert_cmpuint (key->ref_count, ==, 2);
+
+  g_object_unref (map);
+  g_assert_cmpuint (key->ref_count, ==, 1);
+  g_assert_cmpuint (a->ref_count, ==, 1);
+
+  g_object_unref (key);
+  g_object_unref (a);
+  g_object_unref (b);
+  g_assert_cmpstr (finalized->str, ==, "kab");
+}
+
+/* Keys and values are released in insertion order */
+static void
+test_order (void)
+{
+  HDMultiMap *map = g_object_ref_sink (hd_multi_map_new ());
+  GObject *k1 = test_object_new ("1");
+  GObject *k2 = test_object_new ("2");
+  static const gchar *names[] = { "a", "b", "c", "d", "e" };
+  guint i;
+
+  g_string_truncate (finalized, 0);
+
+  for (i = 0; i < G_N_ELEMENTS (names); i++)
     {
-      free_values_list (values);
-      g_hash_table_iter_remove (&iter);
+      GObject *value = test_object_new (names[i]);
+
+      hd_multi_map_insert (map, i % 2 ? k1 : k2, value);
+      g_object_unref (value);
     }
+
+  g_object_unref (k1);
+  g_object_unref (k2);
+  g_assert_cmpstr (finalized->str, ==, "");
+
+  hd_multi_map_remove_all (map);
+  g_assert_cmpstr (finalized->str, ==, "ace2bd1");
+
+  g_object_unref (map);
+}
+
+static HDMultiMap *reentry_map;
+
+static void
+reinsert_finalize (gpointer  key,
+                   GObject  *object)
+{
+  GObject *value = test_object_new ("r");
+
+  g_string_append (finalized, "v");
+  hd_multi_map_insert (reentry_map, key, value);
+  g_object_unref (value);
+}
+
+/* The map is already empty when the finalizers run */
+static void
+test_reentry (void)
+{
+  GObject *key = test_object_new ("k");
+  GObject *value = g_object_new (G_TYPE_OBJECT, NULL);
+
+  g_string_truncate (finalized, 0);
+
+  reentry_map = g_object_ref_sink (hd_multi_map_new ());
+
+  g_object_weak_ref (value, reinsert_finalize, key);
+  hd_multi_map_insert (reentry_map, key, value);
+  g_object_unref (value);
+
+  hd_multi_map_remove_all (reentry_map);
+  g_assert_cmpstr (finalized->str, ==, "v");
+  g_assert_cmpuint (key->ref_count, ==, 2);
+
+  g_object_unref (reentry_map);
+  g_object_unref (key);
+  g_assert_cmpstr (finalized->str, ==, "vrk");
 }
 
 static void
-free_values_list (GList *list)
+test_benchmark (void)
+{
+  HDMultiMap *map = g_object_ref_sink (hd_multi_map_new ());
+  GObject *key = g_object_new (G_TYPE_OBJECT, NULL);
+  GObject **values = g_new (GObject *, TEST_VALUES);
+  gdouble insert, remove;
+  guint i;
+
+  for (i = 0; i < TEST_VALUES; i++)
+    values[i] = g_object_new (G_TYPE_OBJECT, NULL);
+
+  g_test_timer_start ();
+  for (i = 0; i < TEST_VALUES; i++)
+    hd_multi_map_insert (map, key, values[i]);
+  insert = g_test_timer_elapsed ();
+
+  /* Closed in random order */
+  for (i = TEST_VALUES - 1; i > 0; i--)
+    {
+      guint j = g_test_rand_int_range (0, i + 1);
+      GObject *value = values[i];
+
+      values[i] = values[j];
+      values[j] = value;
+    }
+
+  g_test_timer_start ();
+  for (i = 0; i < TEST_VALUES; i++)
+    hd_multi_map_remove (map, key, values[i]);
+  remove = g_test_timer_elapsed ();
+
+  g_test_minimized_result (insert + remove,
+                           "%d values on one key: insert %.2f ms, remove %.2f ms",
+                           TEST_VALUES, insert * 1e3, remove * 1e3);
+
+  g_assert_cmpuint (key->ref_count, ==, 1);
+
+  for (i = 0; i < TEST_VALUES; i++)
+    g_object_unref (values[i]);
+  g_free (values);
+  g_object_unref (key);
+  g_object_unref (map);
+}
+
+int main (int argc, char **argv)
 {
-  g_list_foreach (list, (GFunc) g_object_unref, NULL);
-  g_list_free (list);
+  g_test_init (&argc, &argv, NULL);
+
+  finalized = g_string_new (NULL);
+
+  g_test_add_func ("/multi-map/insert-remove", test_insert_remove);
+  g_test_add_func ("/multi-map/order", test_order);
+  g_test_add_func ("/multi-map/reentry", test_reentry);
+  if (g_test_perf ())
+    g_test_add_func ("/multi-map/benchmark", test_benchmark);
+
+  return g_test_run ();
 }
 
+#endif
@@ -0,0 +1,327 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "hd-notification-flood.h"
+#include "hd-rate-limiter.h"
+
+/* @targets maps "app_name/category" to the ID of its target and
+ * @keys the IDs back to the keys, which @targets owns, so closing a
+ * notification does not have to search for it. */
+struct _HDNotificationFlood
+{
+  HDRateLimiter *limiter;
+  GHashTable    *targets;
+  GHashTable    *keys;
+};
+
+static gchar *
+flood_key (const gchar *app_name,
+           const gchar *category)
+{
+  return g_strconcat (app_name ? app_name : "", "/",
+                      category ? category : "", NULL);
+}
+
+/* Reads Rate and Burst from [Flood-Control] of @key_file, which can
+ * be %NULL.  Returns %NULL if the rate is 0, which disables it. */
+HDNotificationFlood *
+hd_notification_flood_new_from_key_file (GKeyFile *key_file,
+                                         gdouble   default_rate,
+                                         guint     default_burst)
+{
+  HDNotificationFlood *flood;
+  HDRateLimiter *limiter;
+
+  limiter = hd_rate_limiter_new_from_key_file (key_file,
+                                               HD_FLOOD_CONTROL_GROUP,
+                                               "",
+                                               default_rate,
+                                               default_burst);
+  if (!limiter)
+    return NULL;
+
+  flood = g_slice_new (HDNotificationFlood);
+  flood->limiter = limiter;
+  flood->targets = g_hash_table_new_full (g_str_hash,
+                                          g_str_equal,
+                                          g_free,
+                                          NULL);
+  flood->keys = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  return flood;
+}
+
+void
+hd_notification_flood_free (HDNotificationFlood *flood)
+{
+  if (!flood)
+    return;
+
+  hd_rate_limiter_free (flood->limiter);
+  g_hash_table_destroy (flood->keys);
+  g_hash_table_destroy (flood->targets);
+
+  g_slice_free (HDNotificationFlood, flood);
+}
+
+/* Takes a token for a new notification of @app_name and @category.
+ * Returns the ID of the target to merge it into if it is over the
+ * limit, or 0 if it is let through and must be shown on its own. */
+guint
+hd_notification_flood_check (HDNotificationFlood *flood,
+                             const gchar         *app_name,
+                             const gchar         *category)
+{
+  gchar *key;
+  guint id = 0;
+
+  g_return_val_if_fail (flood, 0);
+
+  key = flood_key (app_name, category);
+
+  if (!hd_rate_limiter_consume (flood->limiter, key))
+    id = GPOINTER_TO_UINT (g_hash_table_lookup (flood->targets, key));
+
+  g_free (key);
+
+  return id;
+}
+
+/* Makes the new notification @id the target of the following ones
+ * of @app_name and @category. */
+void
+hd_notification_flood_add (HDNotificationFlood *flood,
+                           const gchar         *app_name,
+                           const gchar         *category,
+                           guint                id)
+{
+  gchar *key;
+  gpointer old_id;
+
+  g_return_if_fail (flood);
+  g_return_if_fail (id);
+
+  key = flood_key (app_name, category);
+
+  if (g_hash_table_lookup_extended (flood->targets, key, NULL, &old_id))
+    g_hash_table_remove (flood->keys, old_id);
+
+  g_hash_table_replace (flood->targets, key, GUINT_TO_POINTER (id));
+  g_hash_table_insert (flood->keys, GUINT_TO_POINTER (id), key);
+}
+
+/* Forgets @id when it is closed, nothing is merged into it after. */
+void
+hd_notification_flood_remove (HDNotificationFlood *flood,
+                              guint                id)
+{
+  const gchar *key;
+
+  g_return_if_fail (flood);
+
+  key = g_hash_table_lookup (flood->keys, GUINT_TO_POINTER (id));
+  if (!key)
+    return;
+
+  g_hash_table_remove (flood->keys, GUINT_TO_POINTER (id));
+  g_hash_table_remove (flood->targets, key);
+}
+
+#ifdef COMPILE_FOR_TEST
+
+#define TEST_FLOOD_COUNT 10000
+#define TEST_FLOOD_RATE  10000 /* per second */
+#define TEST_CLOSE_EVERY 1000
+
+static HDNotificationFlood *
+flood_new (const gchar *config)
+{
+  HDNotificationFlood *flood;
+  GKeyFile *key_file = g_key_file_new ();
+
+  g_assert (g_key_file_load_from_data (key_file, config, -1,
+                                       G_KEY_FILE_NONE, NULL));
+  flood = hd_notification_flood_new_from_key_file (key_file, 5, 20);
+  g_key_file_free (key_file);
+
+  return flood;
+}
+
+static void
+test_disabled (void)
+{
+  g_assert (!flood_new ("[Flood-Control]\nRate=0\n"));
+}
+
+static void
+test_merge (void)
+{
+  HDNotificationFlood *flood = flood_new ("[Flood-Control]\nRate=0.001\nBurst=2\n");
+
+  g_assert (flood);
+
+  /* The burst is let through, each one becomes the target */
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 0);
+  hd_notification_flood_add (flood, "app", "im", 1);
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 0);
+  hd_notification_flood_add (flood, "app", "im", 2);
+
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 2);
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 2);
+
+  /* Other pairs have buckets of their own */
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", NULL), ==, 0);
+  g_assert_cmpuint (hd_notification_flood_check (flood, "other", "im"), ==, 0);
+
+  /* The replaced target is no longer tracked */
+  g_assert_cmpuint (g_hash_table_size (flood->targets), ==, 1);
+  g_assert_cmpuint (g_hash_table_size (flood->keys), ==, 1);
+
+  hd_notification_flood_free (flood);
+}
+
+static void
+test_remove (void)
+{
+  HDNotificationFlood *flood = flood_new ("[Flood-Control]\nRate=0.001\nBurst=1\n");
+
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 0);
+  hd_notification_flood_add (flood, "app", "im", 1);
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 1);
+
+  /* Once closed, the next one over the limit is shown and becomes
+   * the target */
+  hd_notification_flood_remove (flood, 1);
+  g_assert_cmpuint (g_hash_table_size (flood->targets), ==, 0);
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 0);
+  hd_notification_flood_add (flood, "app", "im", 2);
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 2);
+
+  /* Closing a replaced target or an unknown ID keeps the target */
+  hd_notification_flood_add (flood, "app", "im", 3);
+  hd_notification_flood_remove (flood, 2);
+  hd_notification_flood_remove (flood, 42);
+  g_assert_cmpuint (hd_notification_flood_check (flood, "app", "im"), ==, 3);
+
+  hd_notification_flood_remove (flood, 3);
+  g_assert_cmpuint (g_hash_table_size (flood->targets), ==, 0);
+  g_assert_cmpuint (g_hash_table_size (flood->keys), ==, 0);
+
+  hd_notification_flood_free (flood);
+}
+
+/* One application sends TEST_FLOOD_COUNT notifications at
+ * TEST_FLOOD_RATE per second with the default limits, the way the
+ * manager handles them: those let through are shown, the others add
+ * to the amount of their target.  The user closes the target every
+ * TEST_CLOSE_EVERY notifications. */
+static void
+test_flood (void)
+{
+  HDNotificationFlood *flood = flood_new ("");
+  GHashTable *amounts = g_hash_table_new (g_direct_hash, g_direct_equal);
+  guint next_id = 1, shown = 0, closed_amount = 0, total = 0;
+  gint64 start, elapsed;
+  gdouble max_shown;
+  GHashTableIter iter;
+  gpointer id, amount;
+  guint i;
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < TEST_FLOOD_COUNT; i++)
+    {
+      gint64 due = start + (gint64) i * G_USEC_PER_SEC / TEST_FLOOD_RATE;
+      gint64 now = g_get_monotonic_time ();
+      guint target;
+
+      if (due > now)
+        g_usleep (due - now);
+
+      target = hd_notification_flood_check (flood, "flooder", "im.received");
+      if (target)
+        {
+          amount = g_hash_table_lookup (amounts, GUINT_TO_POINTER (target));
+          g_assert (amount);
+          g_hash_table_insert (amounts, GUINT_TO_POINTER (target),
+                               GUINT_TO_POINTER (GPOINTER_TO_UINT (amount) + 1));
+        }
+      else
+        {
+          g_hash_table_insert (amounts, GUINT_TO_POINTER (next_id),
+                               GUINT_TO_POINTER (1));
+          hd_notification_flood_add (flood, "flooder", "im.received", next_id);
+          next_id++;
+          shown++;
+        }
+
+      if (i % TEST_CLOSE_EVERY == TEST_CLOSE_EVERY - 1)
+        {
+          g_hash_table_iter_init (&iter, amounts);
+          while (g_hash_table_iter_next (&iter, &id, &amount))
+            {
+              closed_amount += GPOINTER_TO_UINT (amount);
+              hd_notification_flood_remove (flood, GPOINTER_TO_UINT (id));
+              g_hash_table_iter_remove (&iter);
+            }
+          g_assert_cmpuint (g_hash_table_size (flood->targets), ==, 0);
+          g_assert_cmpuint (g_hash_table_size (flood->keys), ==, 0);
+        }
+    }
+
+  elapsed = g_get_monotonic_time () - start;
+
+  g_hash_table_iter_init (&iter, amounts);
+  while (g_hash_table_iter_next (&iter, &id, &amount))
+    total += GPOINTER_TO_UINT (amount);
+
+  /* Nothing is lost, and no more than the burst, the rate and one
+   * new target per close are shown */
+  g_assert_cmpuint (total + closed_amount, ==, TEST_FLOOD_COUNT);
+  max_shown = 20 + 5.0 * elapsed / G_USEC_PER_SEC
+            + TEST_FLOOD_COUNT / TEST_CLOSE_EVERY + 1;
+  g_assert_cmpfloat (shown, <=, max_shown);
+
+  g_test_message ("%u notifications in %.3f s, %u shown",
+                  TEST_FLOOD_COUNT, (gdouble) elapsed / G_USEC_PER_SEC, shown);
+
+  g_hash_table_destroy (amounts);
+  hd_notification_flood_free (flood);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/notification-flood/disabled", test_disabled);
+  g_test_add_func ("/notification-flood/merge", test_merge);
+  g_test_add_func ("/notification-flood/remove", test_remove);
+  g_test_add_func ("/notification-flood/flood", test_flood);
+
+  return g_test_run ();
+}
+
+#endif
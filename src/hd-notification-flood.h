@@ -0,0 +1,52 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_NOTIFICATION_FLOOD_H__
+#define __HD_NOTIFICATION_FLOOD_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Flood control of new notifications.  Those over the rate limit of
+ * their application and category are merged into the last one let
+ * through for the pair, their target, as long as it is open. */
+typedef struct _HDNotificationFlood HDNotificationFlood;
+
+HDNotificationFlood *hd_notification_flood_new_from_key_file (GKeyFile            *key_file,
+                                                              gdouble              default_rate,
+                                                              guint                default_burst);
+void                 hd_notification_flood_free              (HDNotificationFlood *flood);
+
+guint                hd_notification_flood_check             (HDNotificationFlood *flood,
+                                                              const gchar         *app_name,
+                                                              const gchar         *category);
+void                 hd_notification_flood_add               (HDNotificationFlood *flood,
+                                                              const gchar         *app_name,
+                                                              const gchar         *category,
+                                                              guint                id);
+void                 hd_notification_flood_remove            (HDNotificationFlood *flood,
+                                                              guint                id);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,1636 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gdk/gdk.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include <string.h>
+
+#include "hd-notification-ingress.h"
+#include "hd-metrics.h"
+
+/* Types of the system note dialogs, see hd_notification_manager_system_note_dialog_from () */
+#define N_DIALOG_TYPES 5
+
+typedef enum
+{
+  REQUEST_NOTIFY,
+  REQUEST_CLOSE_NOTIFICATION,
+  REQUEST_CLOSE_NOTIFICATIONS,
+  REQUEST_SYSTEM_NOTE_INFOPRINT,
+  REQUEST_SYSTEM_NOTE_DIALOG
+} RequestType;
+
+typedef struct _Request Request;
+
+/* A parsed call.  The strings point into @message. */
+struct _Request
+{
+  Request         *next;
+
+  RequestType      type;
+  gint64           received;
+
+  DBusConnection  *connection;
+  DBusMessage     *message;
+
+  const gchar     *app_name;
+  guint            id;
+  const gchar     *icon;
+  const gchar     *summary;
+  const gchar     *body;
+  const gchar    **actions;
+  GHashTable      *hints;
+  gint             timeout;
+
+  GArray          *ids;
+
+  guint            dialog_type;
+  const gchar     *label;
+};
+
+/* What dbus-glib answered for hd-notification-manager.xml, plus the
+ * signals the manager sends */
+static const gchar introspect_xml[] =
+  DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  "<node>\n"
+  "  <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+  "    <method name=\"Introspect\">\n"
+  "      <arg name=\"data\" direction=\"out\" type=\"s\"/>\n"
+  "    </method>\n"
+  "  </interface>\n"
+  "  <interface name=\"" HD_NOTIFICATION_MANAGER_DBUS_NAME "\">\n"
+  "    <method name=\"Notify\">\n"
+  "      <arg name=\"app_name\" type=\"s\" direction=\"in\"/>\n"
+  "      <arg name=\"id\" type=\"u\" direction=\"in\"/>\n"
+  "      <arg name=\"icon\" type=\"s\" direction=\"in\"/>\n"
+  "      <arg name=\"summary\" type=\"s\" direction=\"in\"/>\n"
+  "      <arg name=\"body\" type=\"s\" direction=\"in\"/>\n"
+  "      <arg name=\"actions\" type=\"as\" direction=\"in\"/>\n"
+  "      <arg name=\"hints\" type=\"a{sv}\" direction=\"in\"/>\n"
+  "      <arg name=\"timeout\" type=\"i\" direction=\"in\"/>\n"
+  "      <arg name=\"return_id\" type=\"u\" direction=\"out\"/>\n"
+  "    </method>\n"
+  "    <method name=\"CloseNotification\">\n"
+  "      <arg name=\"id\" type=\"u\" direction=\"in\"/>\n"
+  "    </method>\n"
+  "    <method name=\"CloseNotifications\">\n"
+  "      <arg name=\"ids\" type=\"au\" direction=\"in\"/>\n"
+  "    </method>\n"
+  "    <method name=\"SystemNoteInfoprint\">\n"
+  "      <arg name=\"message\" type=\"s\" direction=\"in\"/>\n"
+  "      <arg name=\"return_id\" type=\"u\" direction=\"out\"/>\n"
+  "    </method>\n"
+  "    <method name=\"SystemNoteDialog\">\n"
+  "      <arg name=\"message\" type=\"s\" direction=\"in\"/>\n"
+  "      <arg name=\"type\" type=\"u\" direction=\"in\"/>\n"
+  "      <arg name=\"label\" type=\"s\" direction=\"in\"/>\n"
+  "      <arg name=\"return_id\" type=\"u\" direction=\"out\"/>\n"
+  "    </method>\n"
+  "    <method name=\"GetCapabilities\">\n"
+  "      <arg name=\"return_caps\" type=\"as\" direction=\"out\"/>\n"
+  "    </method>\n"
+  "    <method name=\"GetServerInformation\">\n"
+  "      <arg name=\"return_name\" type=\"s\" direction=\"out\"/>\n"
+  "      <arg name=\"return_vendor\" type=\"s\" direction=\"out\"/>\n"
+  "      <arg name=\"return_version\" type=\"s\" direction=\"out\"/>\n"
+  "    </method>\n"
+  "    <signal name=\"NotificationClosed\">\n"
+  "      <arg name=\"id\" type=\"u\"/>\n"
+  "    </signal>\n"
+  "    <signal name=\"ActionInvoked\">\n"
+  "      <arg name=\"id\" type=\"u\"/>\n"
+  "      <arg name=\"action_key\" type=\"s\"/>\n"
+  "    </signal>\n"
+  "  </interface>\n"
+  "</node>\n";
+
+static HDNotificationManager *manager;
+static GMainContext          *context;
+static GThread               *thread;
+static volatile gint          stopping;
+static DBusConnection        *connections[DBUS_BUS_SYSTEM + 1];
+
+/* Requests not yet taken by the main thread, newest first.  Only the
+ * ingress thread pushes and the main thread only takes the whole list,
+ * so a compare and swap is enough. */
+static Request * volatile     pending;
+
+static void
+hint_value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_free (value);
+}
+
+static void
+request_free (Request *request)
+{
+  dbus_connection_unref (request->connection);
+  dbus_message_unref (request->message);
+
+  g_free (request->actions);
+  if (request->hints)
+    g_hash_table_destroy (request->hints);
+  if (request->ids)
+    g_array_free (request->ids, TRUE);
+
+  g_slice_free (Request, request);
+}
+
+static void
+send_reply (Request     *request,
+            DBusMessage *reply)
+{
+  if (!dbus_message_get_no_reply (request->message))
+    dbus_connection_send (request->connection, reply, NULL);
+
+  dbus_message_unref (reply);
+}
+
+static void
+reply_id (Request *request,
+          guint    id)
+{
+  DBusMessage *reply = dbus_message_new_method_return (request->message);
+
+  dbus_message_append_args (reply,
+                            DBUS_TYPE_UINT32, &id,
+                            DBUS_TYPE_INVALID);
+  send_reply (request, reply);
+}
+
+/* Runs in the main thread */
+static void
+handle_request (Request *request)
+{
+  const gchar *sender = dbus_message_get_sender (request->message);
+
+  switch (request->type)
+    {
+    case REQUEST_NOTIFY:
+      hd_metrics_observe_since (HD_METRICS_NOTIFY_INGRESS_DELAY,
+                                request->received);
+      reply_id (request,
+                hd_notification_manager_notify_from (manager,
+                                                     sender,
+                                                     request->app_name,
+                                                     request->id,
+                                                     request->icon,
+                                                     request->summary,
+                                                     request->body,
+                                                     (gchar **) request->actions,
+                                                     request->hints,
+                                                     request->timeout));
+      break;
+
+    case REQUEST_CLOSE_NOTIFICATION:
+      hd_notification_manager_close_notification (manager,
+                                                  request->id,
+                                                  NULL);
+      send_reply (request,
+                  dbus_message_new_method_return (request->message));
+      break;
+
+    case REQUEST_CLOSE_NOTIFICATIONS:
+      hd_notification_manager_close_notifications (manager,
+                                                   request->ids,
+                                                   NULL);
+      send_reply (request,
+                  dbus_message_new_method_return (request->message));
+      break;
+
+    case REQUEST_SYSTEM_NOTE_INFOPRINT:
+      reply_id (request,
+                hd_notification_manager_system_note_infoprint_from (manager,
+                                                                    sender,
+                                                                    request->body));
+      break;
+
+    case REQUEST_SYSTEM_NOTE_DIALOG:
+      reply_id (request,
+                hd_notification_manager_system_note_dialog_from (manager,
+                                                                 sender,
+                                                                 request->body,
+                                                                 request->dialog_type,
+                                                                 request->label));
+      break;
+    }
+}
+
+static gboolean
+dispatch_requests (gpointer data)
+{
+  Request *list, *request = NULL;
+
+  do
+    list = g_atomic_pointer_get (&pending);
+  while (!g_atomic_pointer_compare_and_exchange (&pending, list, NULL));
+
+  /* Restore the order the calls arrived in */
+  while (list)
+    {
+      Request *next = list->next;
+
+      list->next = request;
+      request = list;
+      list = next;
+    }
+
+  while (request)
+    {
+      Request *next = request->next;
+
+      handle_request (request);
+      request_free (request);
+      request = next;
+    }
+
+  return FALSE;
+}
+
+/* Runs in the ingress thread */
+static void
+push_request (Request *request)
+{
+  Request *head;
+
+  do
+    {
+      head = g_atomic_pointer_get (&pending);
+      request->next = head;
+    }
+  while (!g_atomic_pointer_compare_and_exchange (&pending, head, request));
+
+  /* The main thread is woken up once for all requests queued until it
+   * takes them */
+  if (!head)
+    gdk_threads_add_idle_full (G_PRIORITY_DEFAULT,
+                               dispatch_requests,
+                               NULL,
+                               NULL);
+}
+
+static gboolean iter_to_value (DBusMessageIter *iter,
+                               GValue          *value);
+
+static gboolean
+array_to_value (DBusMessageIter *iter,
+                GValue          *value)
+{
+  DBusMessageIter array;
+  gconstpointer elements;
+  gint n_elements;
+  GArray *garray;
+  GType type;
+  gsize size;
+
+  dbus_message_iter_recurse (iter, &array);
+
+  switch (dbus_message_iter_get_element_type (iter))
+    {
+    case DBUS_TYPE_STRING:
+        {
+          GPtrArray *strv = g_ptr_array_new ();
+
+          while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRING)
+            {
+              const gchar *v;
+
+              dbus_message_iter_get_basic (&array, &v);
+              g_ptr_array_add (strv, g_strdup (v));
+              dbus_message_iter_next (&array);
+            }
+          g_ptr_array_add (strv, NULL);
+
+          g_value_init (value, G_TYPE_STRV);
+          g_value_take_boxed (value, g_ptr_array_free (strv, FALSE));
+        }
+      return TRUE;
+    case DBUS_TYPE_BYTE:
+      type = G_TYPE_UCHAR;
+      size = sizeof (guchar);
+      break;
+    case DBUS_TYPE_BOOLEAN:
+      type = G_TYPE_BOOLEAN;
+      size = sizeof (dbus_bool_t);
+      break;
+    case DBUS_TYPE_INT32:
+      type = G_TYPE_INT;
+      size = sizeof (dbus_int32_t);
+      break;
+    case DBUS_TYPE_UINT32:
+      type = G_TYPE_UINT;
+      size = sizeof (dbus_uint32_t);
+      break;
+    case DBUS_TYPE_INT64:
+      type = G_TYPE_INT64;
+      size = sizeof (dbus_int64_t);
+      break;
+    case DBUS_TYPE_UINT64:
+      type = G_TYPE_UINT64;
+      size = sizeof (dbus_uint64_t);
+      break;
+    case DBUS_TYPE_DOUBLE:
+      type = G_TYPE_DOUBLE;
+      size = sizeof (gdouble);
+      break;
+    default:
+      return FALSE;
+    }
+
+  /* Image data is copied once, straight from the message */
+  dbus_message_iter_get_fixed_array (&array, &elements, &n_elements);
+  garray = g_array_sized_new (FALSE, FALSE, size, n_elements);
+  g_array_append_vals (garray, elements, n_elements);
+
+  g_value_init (value, dbus_g_type_get_collection ("GArray", type));
+  g_value_take_boxed (value, garray);
+
+  return TRUE;
+}
+
+/* dbus-glib hands out structs as GValueArray, which GLib deprecated */
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+
+static gboolean
+struct_to_value (DBusMessageIter *iter,
+                 GValue          *value)
+{
+  DBusMessageIter member;
+  GValueArray *members;
+  GType *types;
+  guint i;
+
+  members = g_value_array_new (0);
+
+  dbus_message_iter_recurse (iter, &member);
+  while (dbus_message_iter_get_arg_type (&member) != DBUS_TYPE_INVALID)
+    {
+      g_value_array_append (members, NULL);
+      if (!iter_to_value (&member,
+                          g_value_array_get_nth (members, members->n_values - 1)))
+        {
+          g_value_array_free (members);
+          return FALSE;
+        }
+
+      dbus_message_iter_next (&member);
+    }
+
+  types = g_new (GType, members->n_values);
+  for (i = 0; i < members->n_values; i++)
+    types[i] = G_VALUE_TYPE (g_value_array_get_nth (members, i));
+
+  g_value_init (value, dbus_g_type_get_structv ("GValueArray",
+                                                members->n_values,
+                                                types));
+  g_value_take_boxed (value, members);
+  g_free (types);
+
+  return TRUE;
+}
+
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+/* Converts the value at @iter to the GType dbus-glib gives it, so
+ * hints look the same as when the calls came through dbus-glib.
+ * Returns %FALSE for types that have no conversion here: dictionaries
+ * and arrays of containers. */
+static gboolean
+iter_to_value (DBusMessageIter *iter,
+               GValue          *value)
+{
+  switch (dbus_message_iter_get_arg_type (iter))
+    {
+    case DBUS_TYPE_STRING:
+        {
+          const gchar *v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_STRING);
+          g_value_set_string (value, v);
+        }
+      break;
+    case DBUS_TYPE_OBJECT_PATH:
+        {
+          const gchar *v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, DBUS_TYPE_G_OBJECT_PATH);
+          g_value_set_boxed (value, v);
+        }
+      break;
+    case DBUS_TYPE_BOOLEAN:
+        {
+          dbus_bool_t v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_BOOLEAN);
+          g_value_set_boolean (value, v);
+        }
+      break;
+    case DBUS_TYPE_BYTE:
+        {
+          guchar v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_UCHAR);
+          g_value_set_uchar (value, v);
+        }
+      break;
+    case DBUS_TYPE_INT16:
+        {
+          dbus_int16_t v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_INT);
+          g_value_set_int (value, v);
+        }
+      break;
+    case DBUS_TYPE_UINT16:
+        {
+          dbus_uint16_t v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_UINT);
+          g_value_set_uint (value, v);
+        }
+      break;
+    case DBUS_TYPE_INT32:
+        {
+          dbus_int32_t v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_INT);
+          g_value_set_int (value, v);
+        }
+      break;
+    case DBUS_TYPE_UINT32:
+        {
+          dbus_uint32_t v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_UINT);
+          g_value_set_uint (value, v);
+        }
+      break;
+    case DBUS_TYPE_INT64:
+        {
+          dbus_int64_t v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_INT64);
+          g_value_set_int64 (value, v);
+        }
+      break;
+    case DBUS_TYPE_UINT64:
+        {
+          dbus_uint64_t v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_UINT64);
+          g_value_set_uint64 (value, v);
+        }
+      break;
+    case DBUS_TYPE_DOUBLE:
+        {
+          gdouble v;
+
+          dbus_message_iter_get_basic (iter, &v);
+          g_value_init (value, G_TYPE_DOUBLE);
+          g_value_set_double (value, v);
+        }
+      break;
+    case DBUS_TYPE_VARIANT:
+        {
+          DBusMessageIter variant;
+          GValue *v = g_new0 (GValue, 1);
+
+          dbus_message_iter_recurse (iter, &variant);
+          if (!iter_to_value (&variant, v))
+            {
+              g_free (v);
+              return FALSE;
+            }
+
+          g_value_init (value, G_TYPE_VALUE);
+          g_value_take_boxed (value, v);
+        }
+      break;
+    case DBUS_TYPE_ARRAY:
+      return array_to_value (iter, value);
+    case DBUS_TYPE_STRUCT:
+      return struct_to_value (iter, value);
+    default:
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Rejects the whole call if a hint cannot be converted, rather than
+ * showing the notification without it */
+static GHashTable *
+parse_hints (DBusMessageIter *iter,
+             DBusError       *error)
+{
+  DBusMessageIter dict;
+  GHashTable *hints;
+
+  hints = g_hash_table_new_full (g_str_hash,
+                                 g_str_equal,
+                                 NULL,
+                                 (GDestroyNotify) hint_value_free);
+
+  dbus_message_iter_recurse (iter, &dict);
+  while (dbus_message_iter_get_arg_type (&dict) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry, variant;
+      const gchar *key;
+      GValue *value;
+
+      dbus_message_iter_recurse (&dict, &entry);
+      dbus_message_iter_get_basic (&entry, &key);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &variant);
+
+      value = g_new0 (GValue, 1);
+      if (!iter_to_value (&variant, value))
+        {
+          gchar *signature = dbus_message_iter_get_signature (&variant);
+
+          dbus_set_error (error,
+                          DBUS_ERROR_INVALID_ARGS,
+                          "Hint %s of type %s is not supported",
+                          key,
+                          signature);
+          dbus_free (signature);
+          g_free (value);
+          g_hash_table_destroy (hints);
+
+          return NULL;
+        }
+      g_hash_table_insert (hints, (gpointer) key, value);
+
+      dbus_message_iter_next (&dict);
+    }
+
+  return hints;
+}
+
+static gboolean
+parse_notify (Request   *request,
+              DBusError *error)
+{
+  DBusMessageIter iter, array;
+  GPtrArray *actions;
+
+  if (!dbus_message_has_signature (request->message, "susssasa{sv}i"))
+    return FALSE;
+
+  dbus_message_iter_init (request->message, &iter);
+  dbus_message_iter_get_basic (&iter, &request->app_name);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_get_basic (&iter, &request->id);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_get_basic (&iter, &request->icon);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_get_basic (&iter, &request->summary);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_get_basic (&iter, &request->body);
+  dbus_message_iter_next (&iter);
+
+  actions = g_ptr_array_new ();
+  dbus_message_iter_recurse (&iter, &array);
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRING)
+    {
+      const gchar *action;
+
+      dbus_message_iter_get_basic (&array, &action);
+      g_ptr_array_add (actions, (gpointer) action);
+      dbus_message_iter_next (&array);
+    }
+  g_ptr_array_add (actions, NULL);
+  request->actions = (const gchar **) g_ptr_array_free (actions, FALSE);
+  dbus_message_iter_next (&iter);
+
+  request->hints = parse_hints (&iter, error);
+  if (!request->hints)
+    return FALSE;
+  dbus_message_iter_next (&iter);
+
+  dbus_message_iter_get_basic (&iter, &request->timeout);
+
+  return TRUE;
+}
+
+static gboolean
+parse_request (Request   *request,
+               DBusError *error)
+{
+  DBusMessage *message = request->message;
+  const gchar *member = dbus_message_get_member (message);
+
+  if (!g_strcmp0 (member, "Notify"))
+    {
+      request->type = REQUEST_NOTIFY;
+      return parse_notify (request, error);
+    }
+  else if (!g_strcmp0 (member, "CloseNotification"))
+    {
+      request->type = REQUEST_CLOSE_NOTIFICATION;
+      return dbus_message_get_args (message, error,
+                                    DBUS_TYPE_UINT32, &request->id,
+                                    DBUS_TYPE_INVALID);
+    }
+  else if (!g_strcmp0 (member, "CloseNotifications"))
+    {
+      dbus_uint32_t *ids;
+      gint n_ids;
+
+      request->type = REQUEST_CLOSE_NOTIFICATIONS;
+      if (!dbus_message_get_args (message, error,
+                                  DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &ids, &n_ids,
+                                  DBUS_TYPE_INVALID))
+        return FALSE;
+
+      request->ids = g_array_sized_new (FALSE, FALSE, sizeof (guint), n_ids);
+      g_array_append_vals (request->ids, ids, n_ids);
+
+      return TRUE;
+    }
+  else if (!g_strcmp0 (member, "SystemNoteInfoprint"))
+    {
+      request->type = REQUEST_SYSTEM_NOTE_INFOPRINT;
+      return dbus_message_get_args (message, error,
+                                    DBUS_TYPE_STRING, &request->body,
+                                    DBUS_TYPE_INVALID);
+    }
+  else if (!g_strcmp0 (member, "SystemNoteDialog"))
+    {
+      request->type = REQUEST_SYSTEM_NOTE_DIALOG;
+      return dbus_message_get_args (message, error,
+                                    DBUS_TYPE_STRING, &request->body,
+                                    DBUS_TYPE_UINT32, &request->dialog_type,
+                                    DBUS_TYPE_STRING, &request->label,
+                                    DBUS_TYPE_INVALID) &&
+             request->dialog_type < N_DIALOG_TYPES;
+    }
+
+  dbus_set_error (error,
+                  DBUS_ERROR_UNKNOWN_METHOD,
+                  "No method %s in interface %s",
+                  member,
+                  HD_NOTIFICATION_MANAGER_DBUS_NAME);
+
+  return FALSE;
+}
+
+/* Answered right away, they do not touch the store */
+static gboolean
+handle_constant_request (DBusConnection *connection,
+                         DBusMessage    *message)
+{
+  const gchar *interface = dbus_message_get_interface (message);
+  const gchar *member = dbus_message_get_member (message);
+  DBusMessage *reply;
+
+  if (!dbus_message_has_path (message, HD_NOTIFICATION_MANAGER_DBUS_PATH))
+    return FALSE;
+
+  if (dbus_message_is_method_call (message,
+                                   DBUS_INTERFACE_INTROSPECTABLE,
+                                   "Introspect"))
+    {
+      const gchar *xml = introspect_xml;
+
+      reply = dbus_message_new_method_return (message);
+      dbus_message_append_args (reply,
+                                DBUS_TYPE_STRING, &xml,
+                                DBUS_TYPE_INVALID);
+    }
+  else if (interface && strcmp (interface, HD_NOTIFICATION_MANAGER_DBUS_NAME))
+    return FALSE;
+  else if (!g_strcmp0 (member, "GetCapabilities"))
+    {
+      gchar **caps;
+
+      hd_notification_manager_get_capabilities (manager, &caps);
+
+      reply = dbus_message_new_method_return (message);
+      dbus_message_append_args (reply,
+                                DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &caps, g_strv_length (caps),
+                                DBUS_TYPE_INVALID);
+      g_strfreev (caps);
+    }
+  else if (!g_strcmp0 (member, "GetServerInformation"))
+    {
+      gchar *name, *vendor, *version;
+
+      hd_notification_manager_get_server_info (manager, &name, &vendor, &version);
+
+      reply = dbus_message_new_method_return (message);
+      dbus_message_append_args (reply,
+                                DBUS_TYPE_STRING, &name,
+                                DBUS_TYPE_STRING, &vendor,
+                                DBUS_TYPE_STRING, &version,
+                                DBUS_TYPE_INVALID);
+      g_free (name);
+      g_free (vendor);
+      g_free (version);
+    }
+  else
+    return FALSE;
+
+  dbus_connection_send (connection, reply, NULL);
+  dbus_message_unref (reply);
+
+  return TRUE;
+}
+
+/* Runs in the ingress thread */
+static DBusHandlerResult
+message_cb (DBusConnection *connection,
+            DBusMessage    *message,
+            gpointer        data)
+{
+  const gchar *interface = dbus_message_get_interface (message);
+  Request *request;
+  DBusError error;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (handle_constant_request (connection, message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  if (interface && strcmp (interface, HD_NOTIFICATION_MANAGER_DBUS_NAME))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  dbus_error_init (&error);
+
+  request = g_slice_new0 (Request);
+  request->received = g_get_monotonic_time ();
+  request->connection = dbus_connection_ref (connection);
+  request->message = dbus_message_ref (message);
+
+  if (!parse_request (request, &error))
+    {
+      DBusMessage *reply;
+
+      if (dbus_error_is_set (&error))
+        reply = dbus_message_new_error (message, error.name, error.message);
+      else
+        reply = dbus_message_new_error_printf (message,
+                                               DBUS_ERROR_INVALID_ARGS,
+                                               "Invalid call of %s with signature %s",
+                                               dbus_message_get_member (message),
+                                               dbus_message_get_signature (message));
+      dbus_error_free (&error);
+      send_reply (request, reply);
+      request_free (request);
+
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  push_request (request);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static gboolean
+open_connection (DBusBusType bus)
+{
+  static const DBusObjectPathVTable vtable = { NULL, message_cb };
+  DBusConnection *connection;
+  DBusError error;
+  gint result;
+
+  dbus_error_init (&error);
+
+  connection = dbus_bus_get_private (bus, &error);
+  if (!connection)
+    {
+      g_warning ("%s. Could not connect to the %s bus. %s",
+                 __FUNCTION__,
+                 bus == DBUS_BUS_SYSTEM ? "system" : "session",
+                 error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  result = dbus_bus_request_name (connection,
+                                  HD_NOTIFICATION_MANAGER_DBUS_NAME,
+                                  DBUS_NAME_FLAG_ALLOW_REPLACEMENT |
+                                  DBUS_NAME_FLAG_REPLACE_EXISTING |
+                                  DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                                  &error);
+  if (result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    {
+      g_warning ("%s. Could not register %s. %s",
+                 __FUNCTION__,
+                 HD_NOTIFICATION_MANAGER_DBUS_NAME,
+                 dbus_error_is_set (&error) ? error.message : "It already exists");
+      dbus_error_free (&error);
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+      return FALSE;
+    }
+
+  dbus_connection_register_object_path (connection,
+                                        HD_NOTIFICATION_MANAGER_DBUS_PATH,
+                                        &vtable,
+                                        NULL);
+  dbus_connection_setup_with_g_main (connection, context);
+
+  connections[bus] = connection;
+
+  return TRUE;
+}
+
+/* Runs until hd_notification_ingress_stop () */
+static gpointer
+ingress_thread (gpointer data)
+{
+  g_main_context_push_thread_default (context);
+
+  while (!g_atomic_int_get (&stopping))
+    g_main_context_iteration (context, TRUE);
+
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+static void
+close_connection (DBusBusType bus)
+{
+  if (!connections[bus])
+    return;
+
+  dbus_connection_close (connections[bus]);
+  connections[bus] = (dbus_connection_unref (connections[bus]), NULL);
+}
+
+gboolean
+hd_notification_ingress_start (HDNotificationManager *nm)
+{
+  GError *error = NULL;
+
+  g_return_val_if_fail (context == NULL, FALSE);
+
+  manager = nm;
+  context = g_main_context_new ();
+  stopping = FALSE;
+
+  if (!open_connection (DBUS_BUS_SESSION))
+    goto failed;
+
+  /* The system bus is optional, as it has been for dbus-glib */
+  open_connection (DBUS_BUS_SYSTEM);
+
+  thread = g_thread_try_new ("notification-ingress",
+                             ingress_thread,
+                             NULL,
+                             &error);
+  if (!thread)
+    {
+      g_warning ("%s. Could not create the ingress thread. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+      goto failed;
+    }
+
+  return TRUE;
+
+failed:
+  close_connection (DBUS_BUS_SESSION);
+  close_connection (DBUS_BUS_SYSTEM);
+  context = (g_main_context_unref (context), NULL);
+  manager = NULL;
+
+  return FALSE;
+}
+
+/* Calls not yet taken by the main thread are dropped, their callers
+ * get an error as the connections close */
+void
+hd_notification_ingress_stop (void)
+{
+  Request *request;
+
+  if (!context)
+    return;
+
+  g_atomic_int_set (&stopping, TRUE);
+  g_main_context_wakeup (context);
+  thread = (g_thread_join (thread), NULL);
+
+  close_connection (DBUS_BUS_SESSION);
+  close_connection (DBUS_BUS_SYSTEM);
+
+  do
+    request = g_atomic_pointer_get (&pending);
+  while (!g_atomic_pointer_compare_and_exchange (&pending, request, NULL));
+
+  while (request)
+    {
+      Request *next = request->next;
+
+      request_free (request);
+      request = next;
+    }
+
+  context = (g_main_context_unref (context), NULL);
+  manager = NULL;
+}
+
+DBusConnection *
+hd_notification_ingress_get_connection (DBusBusType bus)
+{
+  g_return_val_if_fail (bus == DBUS_BUS_SESSION || bus == DBUS_BUS_SYSTEM, NULL);
+
+  return connections[bus];
+}
+
+#ifdef COMPILE_FOR_TEST
+#include <signal.h>
+#include <unistd.h>
+
+/* Round trips in the benchmark */
+#define N_CALLS 1000
+
+static GThread        *main_thread;
+static DBusConnection *client;
+
+/* The manager is replaced by these, the hints of the last Notify are
+ * kept in @notified_hints */
+static GHashTable     *notified_hints;
+static guint           n_notified;
+
+static void
+copy_hint (const gchar *key,
+           GValue      *value,
+           GHashTable  *hints)
+{
+  GValue *value_copy = g_new0 (GValue, 1);
+
+  g_value_init (value_copy, G_VALUE_TYPE (value));
+  g_value_copy (value, value_copy);
+
+  g_hash_table_insert (hints, g_strdup (key), value_copy);
+}
+
+guint
+hd_notification_manager_notify_from (HDNotificationManager *nm,
+                                     const gchar           *sender,
+                                     const gchar           *app_name,
+                                     guint                  id,
+                                     const gchar           *icon,
+                                     const gchar           *summary,
+                                     const gchar           *body,
+                                     gchar                **actions,
+                                     GHashTable            *hints,
+                                     gint                   timeout)
+{
+  g_assert (g_thread_self () == main_thread);
+
+  if (notified_hints)
+    g_hash_table_destroy (notified_hints);
+  notified_hints = g_hash_table_new_full (g_str_hash,
+                                          g_str_equal,
+                                          (GDestroyNotify) g_free,
+                                          (GDestroyNotify) hint_value_free);
+  g_hash_table_foreach (hints, (GHFunc) copy_hint, notified_hints);
+
+  return ++n_notified;
+}
+
+gboolean
+hd_notification_manager_close_notification (HDNotificationManager *nm,
+                                            guint                  id,
+                                            GError               **error)
+{
+  return TRUE;
+}
+
+gboolean
+hd_notification_manager_close_notifications (HDNotificationManager *nm,
+                                             GArray                *ids,
+                                             GError               **error)
+{
+  return TRUE;
+}
+
+guint
+hd_notification_manager_system_note_infoprint_from (HDNotificationManager *nm,
+                                                    const gchar           *sender,
+                                                    const gchar           *message)
+{
+  return ++n_notified;
+}
+
+guint
+hd_notification_manager_system_note_dialog_from (HDNotificationManager *nm,
+                                                 const gchar           *sender,
+                                                 const gchar           *message,
+                                                 guint                  type,
+                                                 const gchar           *label)
+{
+  return ++n_notified;
+}
+
+gboolean
+hd_notification_manager_get_capabilities (HDNotificationManager *nm,
+                                          gchar               ***caps)
+{
+  *caps = g_strsplit ("body actions", " ", -1);
+
+  return TRUE;
+}
+
+gboolean
+hd_notification_manager_get_server_info (HDNotificationManager *nm,
+                                         gchar                **out_name,
+                                         gchar                **out_vendor,
+                                         gchar                **out_version)
+{
+  *out_name = g_strdup ("test");
+  *out_vendor = g_strdup ("test");
+  *out_version = g_strdup ("1.0");
+
+  return TRUE;
+}
+
+/* Starts a dbus-daemon for @variable, returns 0 if that failed */
+static GPid
+start_bus (const gchar *variable)
+{
+  gchar *argv[] = { "dbus-daemon", "--session", "--nofork", "--print-address", NULL };
+  GString *address;
+  GPid pid;
+  gint out;
+  gchar c;
+
+  if (!g_spawn_async_with_pipes (NULL, argv, NULL,
+                                 G_SPAWN_SEARCH_PATH,
+                                 NULL, NULL,
+                                 &pid,
+                                 NULL, &out, NULL,
+                                 NULL))
+    return 0;
+
+  address = g_string_new (NULL);
+  while (read (out, &c, 1) == 1 && c != '\n')
+    g_string_append_c (address, c);
+  close (out);
+
+  g_setenv (variable, address->str, TRUE);
+  g_string_free (address, TRUE);
+
+  return pid;
+}
+
+typedef struct
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusError    error;
+  gint         done;
+} Call;
+
+static gpointer
+call_thread (Call *call)
+{
+  call->reply = dbus_connection_send_with_reply_and_block (client,
+                                                           call->message,
+                                                           5000,
+                                                           &call->error);
+  g_atomic_int_set (&call->done, TRUE);
+  g_main_context_wakeup (NULL);
+
+  return NULL;
+}
+
+/* Sends @message from another thread while the main loop runs, and
+ * returns the reply or %NULL with @error set */
+static DBusMessage *
+call (DBusMessage *message,
+      DBusError   *error)
+{
+  Call call = { message, NULL };
+  GThread *thread;
+
+  dbus_error_init (&call.error);
+
+  thread = g_thread_new ("client", (GThreadFunc) call_thread, &call);
+  while (!g_atomic_int_get (&call.done))
+    g_main_context_iteration (NULL, TRUE);
+  g_thread_join (thread);
+
+  dbus_message_unref (message);
+  dbus_move_error (&call.error, error);
+
+  return call.reply;
+}
+
+static DBusMessage *
+new_call (const gchar *interface,
+          const gchar *member)
+{
+  return dbus_message_new_method_call (HD_NOTIFICATION_MANAGER_DBUS_NAME,
+                                       HD_NOTIFICATION_MANAGER_DBUS_PATH,
+                                       interface,
+                                       member);
+}
+
+typedef enum
+{
+  HINTS_BASIC       = 0,
+  HINTS_IMAGE       = 1 << 0,
+  HINTS_UNSUPPORTED = 1 << 1
+} Hints;
+
+#define IMAGE_SIZE 16
+
+static void
+append_hint (DBusMessageIter *dict,
+             const gchar     *key,
+             const gchar     *signature,
+             gint             type,
+             gconstpointer    v)
+{
+  DBusMessageIter entry, variant;
+
+  dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT, signature, &variant);
+  dbus_message_iter_append_basic (&variant, type, v);
+  dbus_message_iter_close_container (&entry, &variant);
+  dbus_message_iter_close_container (dict, &entry);
+}
+
+static void
+append_bytes (DBusMessageIter *iter,
+              const guchar    *bytes,
+              gint             n_bytes)
+{
+  DBusMessageIter array;
+
+  dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, "y", &array);
+  dbus_message_iter_append_fixed_array (&array, DBUS_TYPE_BYTE, &bytes, n_bytes);
+  dbus_message_iter_close_container (iter, &array);
+}
+
+/* A RGBA image of IMAGE_SIZE pixels square as in the notification
+ * spec, and its pixels again in "icon_data" */
+static void
+append_image_hints (DBusMessageIter *dict)
+{
+  static guchar pixels[IMAGE_SIZE * IMAGE_SIZE * 4];
+  dbus_int32_t ints[] = { IMAGE_SIZE, IMAGE_SIZE, IMAGE_SIZE * 4 };
+  dbus_int32_t bits = 8, channels = 4;
+  dbus_bool_t alpha = TRUE;
+  DBusMessageIter entry, variant, image;
+  const gchar *key = "image-data";
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (pixels); i++)
+    pixels[i] = i;
+
+  dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT, "(iiibiiay)", &variant);
+  dbus_message_iter_open_container (&variant, DBUS_TYPE_STRUCT, NULL, &image);
+  for (i = 0; i < G_N_ELEMENTS (ints); i++)
+    dbus_message_iter_append_basic (&image, DBUS_TYPE_INT32, &ints[i]);
+  dbus_message_iter_append_basic (&image, DBUS_TYPE_BOOLEAN, &alpha);
+  dbus_message_iter_append_basic (&image, DBUS_TYPE_INT32, &bits);
+  dbus_message_iter_append_basic (&image, DBUS_TYPE_INT32, &channels);
+  append_bytes (&image, pixels, sizeof (pixels));
+  dbus_message_iter_close_container (&variant, &image);
+  dbus_message_iter_close_container (&entry, &variant);
+  dbus_message_iter_close_container (dict, &entry);
+
+  key = "icon_data";
+  dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT, "ay", &variant);
+  append_bytes (&variant, pixels, sizeof (pixels));
+  dbus_message_iter_close_container (&entry, &variant);
+  dbus_message_iter_close_container (dict, &entry);
+}
+
+/* A hint of a type there is no conversion for */
+static void
+append_unsupported_hint (DBusMessageIter *dict)
+{
+  DBusMessageIter entry, variant, map, item;
+  const gchar *key = "x-map", *value = "value";
+
+  dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT, "a{ss}", &variant);
+  dbus_message_iter_open_container (&variant, DBUS_TYPE_ARRAY, "{ss}", &map);
+  dbus_message_iter_open_container (&map, DBUS_TYPE_DICT_ENTRY, NULL, &item);
+  dbus_message_iter_append_basic (&item, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_append_basic (&item, DBUS_TYPE_STRING, &value);
+  dbus_message_iter_close_container (&map, &item);
+  dbus_message_iter_close_container (&variant, &map);
+  dbus_message_iter_close_container (&entry, &variant);
+  dbus_message_iter_close_container (dict, &entry);
+}
+
+static DBusMessage *
+new_notify (Hints hints)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array;
+  const gchar *app_name = "test", *icon = "icon", *summary = "summary", *body = "body";
+  const gchar *action = "default", *category = "test";
+  dbus_uint32_t id = 0;
+  dbus_int32_t timeout = -1;
+  guchar urgency = 2;
+
+  message = new_call (HD_NOTIFICATION_MANAGER_DBUS_NAME, "Notify");
+
+  dbus_message_iter_init_append (message, &iter);
+  dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &app_name);
+  dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &id);
+  dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &icon);
+  dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &summary);
+  dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &body);
+
+  dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "s", &array);
+  dbus_message_iter_append_basic (&array, DBUS_TYPE_STRING, &action);
+  dbus_message_iter_append_basic (&array, DBUS_TYPE_STRING, &action);
+  dbus_message_iter_close_container (&iter, &array);
+
+  dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}", &array);
+  append_hint (&array, "category", "s", DBUS_TYPE_STRING, &category);
+  append_hint (&array, "urgency", "y", DBUS_TYPE_BYTE, &urgency);
+  if (hints & HINTS_IMAGE)
+    append_image_hints (&array);
+  if (hints & HINTS_UNSUPPORTED)
+    append_unsupported_hint (&array);
+  dbus_message_iter_close_container (&iter, &array);
+
+  dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32, &timeout);
+
+  return message;
+}
+
+static guint
+reply_get_id (DBusMessage *reply)
+{
+  dbus_uint32_t id = 0;
+
+  g_assert (reply);
+  g_assert (dbus_message_get_args (reply, NULL,
+                                   DBUS_TYPE_UINT32, &id,
+                                   DBUS_TYPE_INVALID));
+  dbus_message_unref (reply);
+
+  return id;
+}
+
+static void
+assert_pixels (GArray *bytes)
+{
+  guint i;
+
+  g_assert_cmpuint (bytes->len, ==, IMAGE_SIZE * IMAGE_SIZE * 4);
+  for (i = 0; i < bytes->len; i++)
+    g_assert_cmpuint (g_array_index (bytes, guchar, i), ==, i & 0xff);
+}
+
+static void
+test_notify (void)
+{
+  GValue *value;
+
+  g_assert_cmpuint (reply_get_id (call (new_notify (HINTS_BASIC), NULL)), ==, n_notified);
+
+  value = g_hash_table_lookup (notified_hints, "category");
+  g_assert (value && G_VALUE_HOLDS_STRING (value));
+  g_assert_cmpstr (g_value_get_string (value), ==, "test");
+  value = g_hash_table_lookup (notified_hints, "urgency");
+  g_assert (value && G_VALUE_HOLDS_UCHAR (value));
+  g_assert_cmpuint (g_value_get_uchar (value), ==, 2);
+}
+
+/* Image hints get the types dbus-glib gave them */
+static void
+test_image_hints (void)
+{
+  GValue *value;
+  GValueArray *image;
+  GType image_type;
+
+  g_assert_cmpuint (reply_get_id (call (new_notify (HINTS_IMAGE), NULL)), ==, n_notified);
+
+  image_type = dbus_g_type_get_struct ("GValueArray",
+                                       G_TYPE_INT,
+                                       G_TYPE_INT,
+                                       G_TYPE_INT,
+                                       G_TYPE_BOOLEAN,
+                                       G_TYPE_INT,
+                                       G_TYPE_INT,
+                                       DBUS_TYPE_G_UCHAR_ARRAY,
+                                       G_TYPE_INVALID);
+  value = g_hash_table_lookup (notified_hints, "image-data");
+  g_assert (value && G_VALUE_HOLDS (value, image_type));
+  image = g_value_get_boxed (value);
+  g_assert_cmpuint (image->n_values, ==, 7);
+  g_assert_cmpint (g_value_get_int (&image->values[0]), ==, IMAGE_SIZE);
+  g_assert_cmpint (g_value_get_int (&image->values[2]), ==, IMAGE_SIZE * 4);
+  g_assert (g_value_get_boolean (&image->values[3]));
+  g_assert_cmpint (g_value_get_int (&image->values[5]), ==, 4);
+  assert_pixels (g_value_get_boxed (&image->values[6]));
+
+  value = g_hash_table_lookup (notified_hints, "icon_data");
+  g_assert (value && G_VALUE_HOLDS (value, DBUS_TYPE_G_UCHAR_ARRAY));
+  assert_pixels (g_value_get_boxed (value));
+}
+
+/* Hints that cannot be converted fail the call instead of being lost */
+static void
+test_unsupported_hint (void)
+{
+  DBusError error;
+  guint n = n_notified;
+
+  dbus_error_init (&error);
+  g_assert (!call (new_notify (HINTS_UNSUPPORTED), &error));
+  g_assert_cmpstr (error.name, ==, DBUS_ERROR_INVALID_ARGS);
+  g_assert (strstr (error.message, "x-map"));
+  dbus_error_free (&error);
+
+  g_assert_cmpuint (n_notified, ==, n);
+}
+
+static void
+test_invalid_call (void)
+{
+  DBusMessage *message;
+  DBusError error;
+  const gchar *s = "1";
+
+  dbus_error_init (&error);
+
+  message = new_call (HD_NOTIFICATION_MANAGER_DBUS_NAME, "CloseNotification");
+  dbus_message_append_args (message, DBUS_TYPE_STRING, &s, DBUS_TYPE_INVALID);
+  g_assert (!call (message, &error));
+  g_assert_cmpstr (error.name, ==, DBUS_ERROR_INVALID_ARGS);
+  dbus_error_free (&error);
+
+  g_assert (!call (new_call (HD_NOTIFICATION_MANAGER_DBUS_NAME, "Unknown"), &error));
+  g_assert_cmpstr (error.name, ==, DBUS_ERROR_UNKNOWN_METHOD);
+  dbus_error_free (&error);
+}
+
+static void
+test_introspect (void)
+{
+  DBusMessage *reply;
+  const gchar *xml;
+
+  reply = call (new_call (DBUS_INTERFACE_INTROSPECTABLE, "Introspect"), NULL);
+  g_assert (reply);
+  g_assert (dbus_message_get_args (reply, NULL,
+                                   DBUS_TYPE_STRING, &xml,
+                                   DBUS_TYPE_INVALID));
+  g_assert (strstr (xml, "<interface name=\"" HD_NOTIFICATION_MANAGER_DBUS_NAME "\">"));
+  g_assert (strstr (xml, "<method name=\"Notify\">"));
+  g_assert (strstr (xml, "<signal name=\"NotificationClosed\">"));
+  dbus_message_unref (reply);
+}
+
+/* The constant calls are only answered on the path and interface of
+ * the manager, or without an interface */
+static void
+test_interface (void)
+{
+  DBusMessage *reply;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  reply = call (new_call (NULL, "GetCapabilities"), NULL);
+  g_assert (reply);
+  g_assert_cmpint (dbus_message_get_type (reply), ==, DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_unref (reply);
+
+  g_assert (!call (new_call ("org.example.Other", "GetCapabilities"), &error));
+  g_assert_cmpstr (error.name, ==, DBUS_ERROR_UNKNOWN_METHOD);
+  dbus_error_free (&error);
+
+  g_assert (!call (dbus_message_new_method_call (HD_NOTIFICATION_MANAGER_DBUS_NAME,
+                                                 "/org/example/Other",
+                                                 HD_NOTIFICATION_MANAGER_DBUS_NAME,
+                                                 "GetServerInformation"),
+                   &error));
+  g_assert (dbus_error_is_set (&error));
+  dbus_error_free (&error);
+}
+
+typedef struct
+{
+  GArray *round_trips;  /* in us */
+  gint    done;
+} Benchmark;
+
+static gpointer
+benchmark_thread (Benchmark *benchmark)
+{
+  guint i;
+
+  for (i = 0; i < N_CALLS; i++)
+    {
+      DBusMessage *message = new_notify (i % 10 ? HINTS_BASIC : HINTS_IMAGE);
+      DBusMessage *reply;
+      gint64 start = g_get_monotonic_time (), round_trip;
+
+      reply = dbus_connection_send_with_reply_and_block (client, message, 5000, NULL);
+      round_trip = g_get_monotonic_time () - start;
+
+      g_assert (reply);
+      dbus_message_unref (reply);
+      dbus_message_unref (message);
+
+      g_array_append_val (benchmark->round_trips, round_trip);
+
+      /* Calls back to back would bunch up in the idle gaps */
+      g_usleep (g_random_int_range (0, 5000));
+    }
+
+  g_atomic_int_set (&benchmark->done, TRUE);
+  g_main_context_wakeup (NULL);
+
+  return NULL;
+}
+
+/* Keeps the main thread busy for @data ms, as a redraw would */
+static gboolean
+busy_cb (gpointer data)
+{
+  gint64 end = g_get_monotonic_time () + GPOINTER_TO_UINT (data) * 1000;
+
+  while (g_get_monotonic_time () < end);
+
+  return TRUE;
+}
+
+static gint
+compare_int64 (gconstpointer a,
+               gconstpointer b)
+{
+  return *(const gint64 *) a < *(const gint64 *) b ? -1 : *(const gint64 *) a > *(const gint64 *) b;
+}
+
+/* Notify round trips while the main thread spends @busy_ms of every
+ * 20 ms on other work */
+static void
+run_round_trips (guint busy_ms)
+{
+  Benchmark benchmark = { g_array_sized_new (FALSE, FALSE, sizeof (gint64), N_CALLS), FALSE };
+  GThread *thread;
+  GArray *rt;
+  guint busy_id = 0;
+
+  if (busy_ms)
+    busy_id = g_timeout_add (20, busy_cb, GUINT_TO_POINTER (busy_ms));
+
+  thread = g_thread_new ("benchmark", (GThreadFunc) benchmark_thread, &benchmark);
+  while (!g_atomic_int_get (&benchmark.done))
+    g_main_context_iteration (NULL, TRUE);
+  g_thread_join (thread);
+
+  if (busy_id)
+    g_source_remove (busy_id);
+
+  rt = benchmark.round_trips;
+  g_array_sort (rt, compare_int64);
+  g_test_minimized_result (g_array_index (rt, gint64, rt->len * 95 / 100) / 1e6,
+                           "%u Notify calls, main loop busy %u ms of 20: "
+                           "round trip median %.2f ms, 95%% %.2f ms, max %.2f ms",
+                           rt->len, busy_ms,
+                           g_array_index (rt, gint64, rt->len / 2) / 1e3,
+                           g_array_index (rt, gint64, rt->len * 95 / 100) / 1e3,
+                           g_array_index (rt, gint64, rt->len - 1) / 1e3);
+
+  g_array_free (rt, TRUE);
+}
+
+static void
+test_round_trip_idle (void)
+{
+  run_round_trips (0);
+}
+
+static void
+test_round_trip_busy (void)
+{
+  run_round_trips (15);
+}
+
+/* Stopping releases the name and the connections, and the ingress
+ * can be started again */
+static void
+test_stop (void)
+{
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  hd_notification_ingress_stop ();
+  g_assert (!hd_notification_ingress_get_connection (DBUS_BUS_SESSION));
+  g_assert (!hd_notification_ingress_get_connection (DBUS_BUS_SYSTEM));
+
+  g_assert (!call (new_notify (HINTS_BASIC), &error));
+  g_assert (dbus_error_is_set (&error));
+  dbus_error_free (&error);
+
+  /* Stopping twice is harmless */
+  hd_notification_ingress_stop ();
+
+  g_assert (hd_notification_ingress_start (NULL));
+  g_assert (hd_notification_ingress_get_connection (DBUS_BUS_SESSION));
+  g_assert_cmpuint (reply_get_id (call (new_notify (HINTS_BASIC), NULL)), ==, n_notified);
+}
+
+int main (int argc, char **argv)
+{
+  GPid session_bus, system_bus;
+  gint result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  main_thread = g_thread_self ();
+  dbus_threads_init_default ();
+
+  /* Private buses, so the name is never taken from a running
+   * notification daemon */
+  session_bus = start_bus ("DBUS_SESSION_BUS_ADDRESS");
+  system_bus = start_bus ("DBUS_SYSTEM_BUS_ADDRESS");
+  if (!session_bus || !system_bus)
+    {
+      g_printerr ("Could not start dbus-daemon, skipping\n");
+      return 77;
+    }
+
+  g_assert (hd_notification_ingress_start (NULL));
+  client = dbus_bus_get_private (DBUS_BUS_SESSION, NULL);
+  g_assert (client);
+
+  g_test_add_func ("/notification-ingress/notify", test_notify);
+  g_test_add_func ("/notification-ingress/image-hints", test_image_hints);
+  g_test_add_func ("/notification-ingress/unsupported-hint", test_unsupported_hint);
+  g_test_add_func ("/notification-ingress/invalid-call", test_invalid_call);
+  g_test_add_func ("/notification-ingress/introspect", test_introspect);
+  g_test_add_func ("/notification-ingress/interface", test_interface);
+  if (g_test_perf ())
+    {
+      g_test_add_func ("/notification-ingress/round-trip-idle", test_round_trip_idle);
+      g_test_add_func ("/notification-ingress/round-trip-busy", test_round_trip_busy);
+    }
+  g_test_add_func ("/notification-ingress/stop", test_stop);
+
+  result = g_test_run ();
+
+  hd_notification_ingress_stop ();
+
+  /* Stopping the buses must not exit the test */
+  dbus_connection_set_exit_on_disconnect (client, FALSE);
+  kill (session_bus, SIGTERM);
+  kill (system_bus, SIGTERM);
+
+  return result;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_NOTIFICATION_INGRESS_H__
+#define __HD_NOTIFICATION_INGRESS_H__
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "hd-notification-manager.h"
+
+G_BEGIN_DECLS
+
+/** HDNotificationIngress:
+ *
+ * Receives the org.freedesktop.Notifications calls in a thread of its
+ * own, on private connections to the session and the system bus, so
+ * they are read, parsed and checked while the main thread is busy.
+ * Introspect, GetCapabilities and GetServerInformation are answered
+ * there.  The other requests are handed to @nm in the main thread,
+ * which sends the replies: the id of a Notify depends on the flood
+ * merging, the replaced notification and the database, which only the
+ * main thread may touch, so its round trip still waits for the main
+ * loop.  Returns %FALSE if the name could not be taken this way, the
+ * caller should register @nm with dbus-glib then.
+ */
+gboolean        hd_notification_ingress_start          (HDNotificationManager *nm);
+
+/* Stops the thread and releases the name, before @nm goes away */
+void            hd_notification_ingress_stop           (void);
+
+/* The connection owning the name on @bus, signals of @nm must be
+ * sent from it.  %NULL if the ingress is not running. */
+DBusConnection *hd_notification_ingress_get_connection (DBusBusType            bus);
+
+G_END_DECLS
+
+#endif
@@ -32,7 +32,12 @@
 
 #include "hd-notification-manager.h"
 #include "hd-notification-manager-glue.h"
+#include "hd-notification-flood.h"
+#include "hd-notification-ingress.h"
+#include "hd-notification-retention.h"
 #include "hd-marshal.h"
+#include "hd-metrics.h"
+#include "hd-trace.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -76,18 +81,70 @@ enum {
 
 static guint signals[N_SIGNALS];  
 
-#define HD_NOTIFICATION_MANAGER_DBUS_NAME  "org.freedesktop.Notifications" 
-#define HD_NOTIFICATION_MANAGER_DBUS_PATH  "/org/freedesktop/Notifications"
 
 #define HD_NOTIFICATION_MANAGER_ICON_SIZE  48
 
+#define HD_NOTIFICATION_CONFIG_FILE HD_DESKTOP_CONFIG_PATH "/notification.conf"
+
+/* Default flood control, per application and category */
+#define FLOOD_RATE  5
+#define FLOOD_BURST 20
+
+/* Pruning of the persistent notifications */
+#define RETENTION_INTERVAL       3600   /* s */
+
+/* Freed pages given back per step of the incremental vacuum */
+#define VACUUM_PAGES             32
+#define VACUUM_INTERVAL          500    /* ms */
+
+/* Delay of the conversion of an old database after the load */
+#define VACUUM_CONVERT_DELAY     120    /* s */
+
 struct _HDNotificationManagerPrivate
 {
   DBusGConnection *connection, *sys_conn;
-  GMutex          *mutex;
+
+  /*
+   * The store (@notifications, @current_id and the database) is
+   * owned by the thread which created the manager, the one running
+   * the default main context, where dbus-glib dispatches the calls.
+   * It is not locked: other threads must not touch it but post their
+   * work to @owner with hd_notification_manager_invoke().
+   */
+  GThread         *owner;
   guint            current_id;
   GHashTable      *notifications;
 
+  /*
+   * Other threads look notifications up in @snapshot, a map of the
+   * IDs to copies which are never changed.  The IDs in @changed are
+   * copied again by @snapshot_idle, which then replaces @snapshot.
+   * @snapshot_lock is only held to swap it and to take a reference.
+   */
+  GHashTable      *snapshot;
+  GMutex           snapshot_lock;
+  GHashTable      *changed;
+  guint            snapshot_idle;
+
+  /*
+   * Notifications over the rate limit of @flood are merged into the
+   * last one let through for the same application and category,
+   * adding to its "amount" hint.
+   */
+  HDNotificationFlood *flood;
+
+  /*
+   * Pruning by @retention runs at load and every %RETENTION_INTERVAL,
+   * the freed pages are given back by @vacuum_source.  @needs_vacuum
+   * is set when the database is not in incremental auto-vacuum mode
+   * yet, @vacuum_source converts it then, %VACUUM_CONVERT_DELAY after
+   * the load.
+   */
+  HDNotificationRetention *retention;
+  guint            prune_source;
+  guint            vacuum_source;
+  gboolean         needs_vacuum;
+
   /*
    * @prepared_statements is a map between SQL statement strings
    * and SQLite prepared statements.  Can be %NULL.  Destroying
@@ -103,11 +160,13 @@ struct _HDNotificationManagerPrivate
    * @commit_callback is the #GSource ID of the deferred committing
    * function.  If not 0 a transaction is open.  This case the
    * function must be called when hildon-home quits.
+   * @n_uncommitted is the number of units of work in it.
    */
   sqlite3         *db;
   GHashTable      *prepared_statements;
   time_t           commit_timeout;
   gulong           commit_callback;
+  guint            n_uncommitted;
 
 };
 
@@ -133,6 +192,11 @@ enum
   HD_NM_HINT_TYPE_INT64,
 };
 
+static void hd_notification_manager_db_prune (HDNotificationManager *nm);
+static gboolean hd_notification_manager_db_vacuum (HDNotificationManager *nm);
+static void hd_notification_manager_changed (HDNotificationManager *nm,
+                                             guint                  id);
+
 static void                            
 hint_value_free (GValue *value)
 {
@@ -149,8 +213,6 @@ hd_notification_manager_next_id (HDNotificationManager *nm)
   char **results;
   char *error;
 
-  g_mutex_lock (nm->priv->mutex);
-
   do
     {
       next_id = ++nm->priv->current_id;
@@ -178,8 +240,6 @@ hd_notification_manager_next_id (HDNotificationManager *nm)
   if (nm->priv->current_id == G_MAXUINT)
     nm->priv->current_id = 0;
 
-  g_mutex_unlock (nm->priv->mutex);
-
   return next_id;
 }
 
@@ -333,6 +393,7 @@ hd_notification_manager_load_row (void *data,
   g_hash_table_insert (nm->priv->notifications,
                        GUINT_TO_POINTER (id),
                        notification);
+  hd_notification_manager_changed (nm, id);
 
   g_signal_emit (nm, signals[NOTIFIED], 0, notification, TRUE);
 
@@ -344,8 +405,24 @@ hd_notification_manager_db_load (HDNotificationManager *nm)
 {
   gchar *error = NULL;
 
+  /* Not opened during the startup */
+  hd_notification_manager_db_open (nm);
+
   g_return_if_fail (nm->priv->db != NULL);
 
+  /* Pruned notifications are not even loaded */
+  hd_notification_manager_db_prune (nm);
+
+  /* Rewriting the whole file takes a while, it waits for the rest of
+   * the startup to be done */
+  if (nm->priv->needs_vacuum && !nm->priv->vacuum_source)
+    nm->priv->vacuum_source = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+                                                          VACUUM_CONVERT_DELAY,
+                                                          (GSourceFunc) hd_notification_manager_db_vacuum,
+                                                          nm,
+                                                          NULL);
+
+  HD_TRACE_BEGIN ("db-load");
   if (sqlite3_exec (nm->priv->db, 
                     "SELECT * FROM notifications",
                     hd_notification_manager_load_row,
@@ -355,6 +432,7 @@ hd_notification_manager_db_load (HDNotificationManager *nm)
       g_warning ("Unable to load notifications: %s", error);
       sqlite3_free (error);
     }
+  HD_TRACE_END ("db-load");
 }
 
 static gint 
@@ -380,6 +458,35 @@ hd_notification_manager_db_exec (HDNotificationManager *nm,
   return SQLITE_OK;
 }
 
+/* Returns the first column of the first row returned by @sql as an
+ * integer, or -1 on error.  The statement is not cached so this can
+ * be used while the database is being opened. */
+static gint64
+hd_notification_manager_db_get_int (HDNotificationManager *nm,
+                                    const gchar           *sql)
+{
+  sqlite3_stmt *stmt;
+  gint64 result = -1;
+
+  g_return_val_if_fail (nm->priv->db != NULL, -1);
+
+  if (sqlite3_prepare_v2 (nm->priv->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+      g_warning ("%s. Unable to prepare %s: %s",
+                 __FUNCTION__,
+                 sql,
+                 sqlite3_errmsg (nm->priv->db));
+      return -1;
+    }
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    result = sqlite3_column_int64 (stmt, 0);
+
+  sqlite3_finalize (stmt);
+
+  return result;
+}
+
 /*
  * Prepares and caches an SQL query.  You should not finalize the
  * returned statement.  Returns %NULL on error.  Prepared statements
@@ -489,19 +596,27 @@ hd_notification_manager_db_prepare_and_exec (HDNotificationManager *nm,
 static gboolean
 hd_notification_manager_db_commit (HDNotificationManager *nm)
 {
+  gint64 start;
+
   DBDBG(__FUNCTION__);
 
   if (nm->priv->commit_timeout > time(NULL))
     /* Not yet. */
     return TRUE;
 
+  start = g_get_monotonic_time ();
   if (hd_notification_manager_db_prepare_and_exec (nm, "COMMIT")
       != SQLITE_OK)
     /* We can lose more than one notification here but if COMMIT
      * fails something is very wrong anyway. */
     hd_notification_manager_db_prepare_and_exec (nm, "ROLLBACK");
 
+  hd_metrics_add (HD_METRICS_DB_COMMITS, 1);
+  hd_metrics_observe_since (HD_METRICS_DB_COMMIT_LATENCY, start);
+  hd_metrics_observe (HD_METRICS_DB_COMMIT_BATCH, nm->priv->n_uncommitted);
+
   nm->priv->commit_callback = 0;
+  nm->priv->n_uncommitted = 0;
   return FALSE;
 }
 
@@ -546,6 +661,7 @@ hd_notification_manager_db_finish (HDNotificationManager *nm)
 
   /* Commit in 8 seconds or so. */
   nm->priv->commit_timeout = time(NULL) + 8;
+  nm->priv->n_uncommitted++;
   return SQLITE_OK;
 }
 
@@ -820,6 +936,46 @@ rollback:
   return SQLITE_ERROR;
 }
 
+/* Deletes all the notifications with @ids in one unit of work. */
+static gint
+hd_notification_manager_db_delete_many (HDNotificationManager *nm,
+                                        GArray                *ids)
+{
+  sqlite3_stmt *delete;
+  guint i;
+
+  delete = hd_notification_manager_db_prepare (nm,
+             "DELETE FROM notifications WHERE id = ?");
+  if (!delete)
+    return SQLITE_ERROR;
+
+  if (hd_notification_manager_db_begin (nm) != SQLITE_OK)
+    return SQLITE_ERROR;
+
+  for (i = 0; i < ids->len; i++)
+    {
+      guint id = g_array_index (ids, guint, i);
+
+      if (hd_notification_manager_db_delete_actions_and_hints (nm, id)
+          != SQLITE_OK)
+        goto rollback;
+      if (hd_notification_manager_db_bind_params (delete,
+                 DB_BIND_INT (id), DB_BIND_END) != SQLITE_OK)
+        goto rollback;
+      if (hd_notification_manager_db_exec_prepared (delete)
+          != SQLITE_OK)
+        goto rollback;
+    }
+
+  /* Finish. */
+  if (hd_notification_manager_db_finish (nm) == SQLITE_OK)
+    return SQLITE_OK;
+
+rollback:
+  hd_notification_manager_db_revert (nm);
+  return SQLITE_ERROR;
+}
+
 static gint 
 hd_notification_manager_db_update (HDNotificationManager *nm,
                                    const gchar           *app_name,
@@ -881,6 +1037,77 @@ hd_notification_manager_db_commit_now (HDNotificationManager *nm)
     }
 }
 
+/* Opens the database and creates the tables if needed.  It does not
+ * touch anything else so it can be done in a thread while the rest
+ * of hildon-home is starting, as long as the notification manager is
+ * not used until it returns. */
+void
+hd_notification_manager_db_open (HDNotificationManager *nm)
+{
+  gchar *config_dir;
+  guint result;
+
+  g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
+
+  if (nm->priv->db)
+    return;
+
+  config_dir = g_build_filename (g_get_home_dir (),
+                                 ".config",
+                                 "hildon-desktop",
+                                 NULL);
+  if (!g_mkdir_with_parents (config_dir,
+                             S_IRWXU |
+                             S_IRGRP | S_IXGRP |
+                             S_IROTH | S_IXOTH))
+    {
+      gchar *notifications_db = NULL;
+
+      notifications_db = g_build_filename (g_get_home_dir (), 
+                                           ".config",
+                                           "hildon-desktop",
+                                           "notifications.db",
+                                           NULL); 
+
+      HD_TRACE_BEGIN ("db-open");
+      result = sqlite3_open (notifications_db, &nm->priv->db);
+
+      g_free (notifications_db);
+
+      if (result != SQLITE_OK)
+        {
+          g_warning ("Can't open database: %s", sqlite3_errmsg (nm->priv->db));
+          sqlite3_close (nm->priv->db);
+          nm->priv->db = NULL;
+        } else {
+            /* Only takes effect before the tables are created, older
+             * databases are converted by a VACUUM after the load. */
+            hd_notification_manager_db_exec (nm,
+                                             "PRAGMA auto_vacuum = INCREMENTAL");
+
+            result = hd_notification_manager_db_create (nm);
+
+            nm->priv->needs_vacuum =
+              hd_notification_manager_db_get_int (nm, "PRAGMA auto_vacuum") != 2;
+
+            if (result != SQLITE_OK)
+              {
+                g_warning ("Can't create database: %s", sqlite3_errmsg (nm->priv->db));
+              }
+        }
+      HD_TRACE_END ("db-open");
+    }
+  else
+    {
+      /* User config dir could not be created */
+      g_warning ("Could not mkdir '%s', %s",
+                 config_dir,
+                 strerror (errno));
+    }
+
+  g_free (config_dir);
+}
+
 static void
 hd_notification_manager_setup_interface (HDNotificationManager *nm,
                                          DBusGConnection *conn)
@@ -930,24 +1157,76 @@ hd_notification_manager_setup_interface (HDNotificationManager *nm,
                                        G_OBJECT (nm));
 }
 
+static void
+hd_notification_manager_load_config (HDNotificationManager *nm)
+{
+  HDNotificationManagerPrivate *priv = nm->priv;
+  GKeyFile *key_file;
+
+  key_file = g_key_file_new ();
+  if (!g_key_file_load_from_file (key_file,
+                                  HD_NOTIFICATION_CONFIG_FILE,
+                                  G_KEY_FILE_NONE,
+                                  NULL))
+    key_file = (g_key_file_free (key_file), NULL);
+
+  priv->flood = hd_notification_flood_new_from_key_file (key_file,
+                                                         FLOOD_RATE,
+                                                         FLOOD_BURST);
+  priv->retention = hd_notification_retention_new_from_key_file (key_file);
+
+  if (key_file)
+    g_key_file_free (key_file);
+}
+
+static gint
+notifications_gauge (GHashTable *notifications)
+{
+  return g_hash_table_size (notifications);
+}
+
 static void
 hd_notification_manager_init (HDNotificationManager *nm)
 {
   GError *error = NULL;
-  gchar *config_dir;
-  guint result;
 
   nm->priv = HD_NOTIFICATION_MANAGER_GET_PRIVATE (nm);
 
-  nm->priv->mutex = g_new (GMutex, 1);
-  g_mutex_init (nm->priv->mutex);
-
+  nm->priv->owner = g_thread_self ();
   nm->priv->current_id = 0;
 
   nm->priv->notifications = g_hash_table_new_full (g_direct_hash,
                                                    g_direct_equal,
                                                    NULL,
                                                    (GDestroyNotify) g_object_unref);
+  nm->priv->snapshot = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_mutex_init (&nm->priv->snapshot_lock);
+  nm->priv->changed = g_hash_table_new (g_direct_hash, g_direct_equal);
+  hd_metrics_set_gauge_func (HD_METRICS_NOTIFICATIONS,
+                             (HDMetricsGaugeFunc) notifications_gauge,
+                             nm->priv->notifications);
+
+  hd_notification_manager_load_config (nm);
+
+  /* The calls are received in a thread of their own if possible, the
+   * signals must come from the connections owning the name then */
+  if (hd_notification_ingress_start (nm))
+    {
+      DBusConnection *conn;
+
+      conn = hd_notification_ingress_get_connection (DBUS_BUS_SESSION);
+      nm->priv->connection = dbus_g_connection_ref (dbus_connection_get_g_connection (conn));
+
+      conn = hd_notification_ingress_get_connection (DBUS_BUS_SYSTEM);
+      if (conn)
+        nm->priv->sys_conn = dbus_g_connection_ref (dbus_connection_get_g_connection (conn));
+
+      g_debug ("%s registered to dbus at %s in the ingress thread",
+               HD_NOTIFICATION_MANAGER_DBUS_NAME,
+               HD_NOTIFICATION_MANAGER_DBUS_PATH);
+
+      return;
+    }
 
   nm->priv->connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
   if (error != NULL)
@@ -977,51 +1256,6 @@ hd_notification_manager_init (HDNotificationManager *nm)
            HD_NOTIFICATION_MANAGER_DBUS_PATH);
 
   nm->priv->db = NULL;
-
-  config_dir = g_build_filename (g_get_home_dir (),
-                                 ".config",
-                                 "hildon-desktop",
-                                 NULL);
-  if (!g_mkdir_with_parents (config_dir,
-                             S_IRWXU |
-                             S_IRGRP | S_IXGRP |
-                             S_IROTH | S_IXOTH))
-    {
-      gchar *notifications_db = NULL;
-
-      notifications_db = g_build_filename (g_get_home_dir (), 
-                                           ".config",
-                                           "hildon-desktop",
-                                           "notifications.db",
-                                           NULL); 
-
-      result = sqlite3_open (notifications_db, &nm->priv->db);
-
-      g_free (notifications_db);
-
-      if (result != SQLITE_OK)
-        {
-          g_warning ("Can't open database: %s", sqlite3_errmsg (nm->priv->db));
-          sqlite3_close (nm->priv->db);
-          nm->priv->db = NULL;
-        } else {
-            result = hd_notification_manager_db_create (nm);
-
-            if (result != SQLITE_OK)
-              {
-                g_warning ("Can't create database: %s", sqlite3_errmsg (nm->priv->db));
-              }
-        }
-    }
-  else
-    {
-      /* User config dir could not be created */
-      g_warning ("Could not mkdir '%s', %s",
-                 config_dir,
-                 strerror (errno));
-    }
-
-  g_free (config_dir);
 }
 
 static void 
@@ -1029,6 +1263,11 @@ hd_notification_manager_dispose (GObject *object)
 {
   HDNotificationManagerPrivate *priv = HD_NOTIFICATION_MANAGER (object)->priv;
 
+  /* No more calls may reach the store torn down in finalize */
+  hd_notification_ingress_stop ();
+
+  hd_metrics_set_gauge_func (HD_METRICS_NOTIFICATIONS, NULL, NULL);
+
   if (priv->connection)
     priv->connection = (dbus_g_connection_unref (priv->connection), NULL);
 
@@ -1040,12 +1279,10 @@ hd_notification_manager_finalize (GObject *object)
 {
   HDNotificationManagerPrivate *priv = HD_NOTIFICATION_MANAGER (object)->priv;
 
-  if (priv->mutex)
-    {
-      g_mutex_clear (priv->mutex);
-      g_free (priv->mutex);
-      priv->mutex = NULL;
-    }
+  if (priv->prune_source)
+    priv->prune_source = (g_source_remove (priv->prune_source), 0);
+  if (priv->vacuum_source)
+    priv->vacuum_source = (g_source_remove (priv->vacuum_source), 0);
 
   if (priv->db)
     {
@@ -1066,6 +1303,15 @@ hd_notification_manager_finalize (GObject *object)
   if (priv->notifications)
     priv->notifications = (g_hash_table_destroy (priv->notifications), NULL);
 
+  if (priv->snapshot_idle)
+    priv->snapshot_idle = (g_source_remove (priv->snapshot_idle), 0);
+  g_hash_table_unref (priv->snapshot);
+  g_mutex_clear (&priv->snapshot_lock);
+  g_hash_table_destroy (priv->changed);
+
+  priv->flood = (hd_notification_flood_free (priv->flood), NULL);
+  priv->retention = (hd_notification_retention_free (priv->retention), NULL);
+
   G_OBJECT_CLASS (hd_notification_manager_parent_class)->finalize (object);
 }
 
@@ -1149,10 +1395,38 @@ hd_notification_manager_timeout (guint id)
 
   g_hash_table_remove (nm->priv->notifications,
                        GUINT_TO_POINTER (id));
+  hd_notification_manager_changed (nm, id);
+  if (nm->priv->flood)
+    hd_notification_flood_remove (nm->priv->flood, id);
+
+  return FALSE;
+}
+
+/* An hd_notification_manager_invoke() call from another thread. */
+typedef struct
+{
+  GSourceFunc    func;
+  gpointer       data;
+  GDestroyNotify notify;
+} InvokeData;
+
+static gboolean
+invoke_idle (InvokeData *invoke)
+{
+  invoke->func (invoke->data);
 
   return FALSE;
 }
 
+static void
+invoke_free (InvokeData *invoke)
+{
+  if (invoke->notify)
+    invoke->notify (invoke->data);
+
+  g_slice_free (InvokeData, invoke);
+}
+
 /**
  * hd_notification_manager_get:
  *
@@ -1177,6 +1451,72 @@ hd_notification_manager_get (void)
   return nm;
 }
 
+/**
+ * hd_notification_manager_invoke:
+ * @nm: the #HDNotificationManager
+ * @func: the function to call in the owner thread
+ * @data: data to pass to @func
+ * @notify: called to free @data, or %NULL
+ *
+ * Calls @func in the thread owning @nm: right away if it is the calling
+ * thread, otherwise from an idle callback with the GDK lock held, in the
+ * order the calls were made.  @func is called once, its return value is
+ * ignored.  This is how the other threads can work with the notifications,
+ * they look them up with hd_notification_manager_ref_snapshot().
+ */
+void
+hd_notification_manager_invoke (HDNotificationManager *nm,
+                                GSourceFunc            func,
+                                gpointer               data,
+                                GDestroyNotify         notify)
+{
+  g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
+  g_return_if_fail (func != NULL);
+
+  if (nm->priv->owner == g_thread_self ())
+    {
+      func (data);
+      if (notify)
+        notify (data);
+    }
+  else
+    {
+      /* Run it once even if it returns TRUE. */
+      InvokeData *invoke = g_slice_new (InvokeData);
+
+      invoke->func = func;
+      invoke->data = data;
+      invoke->notify = notify;
+      gdk_threads_add_idle_full (G_PRIORITY_DEFAULT,
+                                 (GSourceFunc) invoke_idle,
+                                 invoke,
+                                 (GDestroyNotify) invoke_free);
+    }
+}
+
+/**
+ * hd_notification_manager_ref_snapshot:
+ * @nm: the #HDNotificationManager
+ *
+ * Can be called from any thread.  The snapshot is a copy of the
+ * notifications at the time the main loop was last idle, its
+ * #HDNotification<!-- -->s are never changed.
+ *
+ * Returns: a map of the notification IDs to the #HDNotification<!-- -->s,
+ * release it with g_hash_table_unref().
+ */
+GHashTable *
+hd_notification_manager_ref_snapshot (HDNotificationManager *nm)
+{
+  GHashTable *snapshot;
+
+  g_mutex_lock (&nm->priv->snapshot_lock);
+  snapshot = g_hash_table_ref (nm->priv->snapshot);
+  g_mutex_unlock (&nm->priv->snapshot_lock);
+
+  return snapshot;
+}
+
 static void 
 copy_hash_table_item (gchar *key, GValue *value, GHashTable *new_hash_table)
 {
@@ -1189,30 +1529,150 @@ copy_hash_table_item (gchar *key, GValue *value, GHashTable *new_hash_table)
   g_hash_table_insert (new_hash_table, g_strdup (key), value_copy);
 }
 
+/* A copy of @notification for @snapshot */
+static HDNotification *
+hd_notification_manager_copy_notification (HDNotification *notification)
+{
+  GHashTable *hints;
+  gint timeout = -1;
+
+  hints = g_hash_table_new_full (g_str_hash,
+                                 g_str_equal,
+                                 (GDestroyNotify) g_free,
+                                 (GDestroyNotify) hint_value_free);
+  if (hd_notification_get_hints (notification))
+    g_hash_table_foreach (hd_notification_get_hints (notification),
+                          (GHFunc) copy_hash_table_item,
+                          hints);
+
+  g_object_get (notification, "timeout", &timeout, NULL);
+
+  return hd_notification_new (hd_notification_get_id (notification),
+                              hd_notification_get_icon (notification),
+                              hd_notification_get_summary (notification),
+                              hd_notification_get_body (notification),
+                              g_strdupv (hd_notification_get_actions (notification)),
+                              hints,
+                              timeout,
+                              hd_notification_get_sender (notification));
+}
+
 static gboolean
-idle_emit (gpointer data)
+hd_notification_manager_publish_snapshot (HDNotificationManager *nm)
 {
-  HDNotificationManager *nm = hd_notification_manager_get ();
+  HDNotificationManagerPrivate *priv = nm->priv;
+  GHashTable *snapshot, *old;
+  GHashTableIter iter;
+  gpointer key, value;
 
-  if (nm)
-    g_signal_emit (nm, signals[NOTIFIED], 0, data, FALSE);
+  snapshot = g_hash_table_new_full (g_direct_hash,
+                                    g_direct_equal,
+                                    NULL,
+                                    (GDestroyNotify) g_object_unref);
 
-  g_object_unref (data);
+  /* Only the changed notifications are copied again */
+  g_hash_table_iter_init (&iter, priv->notifications);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      HDNotification *copy = NULL;
+
+      if (!g_hash_table_lookup (priv->changed, key))
+        copy = g_hash_table_lookup (priv->snapshot, key);
+
+      if (copy)
+        g_object_ref (copy);
+      else
+        copy = hd_notification_manager_copy_notification (value);
+
+      g_hash_table_insert (snapshot, key, copy);
+    }
+
+  g_mutex_lock (&priv->snapshot_lock);
+  old = priv->snapshot;
+  priv->snapshot = snapshot;
+  g_mutex_unlock (&priv->snapshot_lock);
+
+  g_hash_table_unref (old);
+  g_hash_table_remove_all (priv->changed);
+  priv->snapshot_idle = 0;
 
   return FALSE;
 }
 
-gboolean
-hd_notification_manager_notify (HDNotificationManager *nm,
-                                const gchar           *app_name,
-                                guint                  id,
-                                const gchar           *icon,
-                                const gchar           *summary,
-                                const gchar           *body,
-                                gchar                **actions,
-                                GHashTable            *hints,
-                                gint                   timeout, 
-                                DBusGMethodInvocation *context)
+/* Called whenever the notification of @id is added, changed or
+ * removed.  The snapshot is replaced once for all the changes made
+ * until the main loop is idle. */
+static void
+hd_notification_manager_changed (HDNotificationManager *nm,
+                                 guint                  id)
+{
+  HDNotificationManagerPrivate *priv = nm->priv;
+
+  g_hash_table_add (priv->changed, GUINT_TO_POINTER (id));
+
+  if (!priv->snapshot_idle)
+    priv->snapshot_idle = g_idle_add_full (G_PRIORITY_HIGH,
+                                           (GSourceFunc) hd_notification_manager_publish_snapshot,
+                                           nm,
+                                           NULL);
+}
+
+static guint
+hint_get_amount (GValue *value)
+{
+  if (value && G_VALUE_HOLDS_UINT (value))
+    return MAX (g_value_get_uint (value), 1);
+  else if (value && G_VALUE_HOLDS_INT (value))
+    return MAX (g_value_get_int (value), 1);
+  else
+    return 1;
+}
+
+/* Adds the amount of a notification merged by the flood control,
+ * from @hints, to the "amount" hint of its target @notification. */
+static void
+hd_notification_manager_merge_amount (HDNotification *notification,
+                                      GHashTable     *hints)
+{
+  GValue *value = g_new0 (GValue, 1);
+  guint amount;
+
+  amount = hint_get_amount (hd_notification_get_hint (notification, "amount")) +
+           hint_get_amount (g_hash_table_lookup (hints, "amount"));
+
+  g_value_init (value, G_TYPE_UINT);
+  g_value_set_uint (value, amount);
+  g_hash_table_insert (hd_notification_get_hints (notification),
+                       g_strdup ("amount"),
+                       value);
+}
+
+static gboolean
+idle_emit (gpointer data)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+
+  if (nm)
+    g_signal_emit (nm, signals[NOTIFIED], 0, data, FALSE);
+
+  g_object_unref (data);
+
+  return FALSE;
+}
+
+/* Adds or updates a notification as asked by @sender with a Notify
+ * call and returns its ID, the caller sends the reply. */
+guint
+hd_notification_manager_notify_from (HDNotificationManager *nm,
+                                     const gchar           *sender,
+                                     const gchar           *app_name,
+                                     guint                  id,
+                                     const gchar           *icon,
+                                     const gchar           *summary,
+                                     const gchar           *body,
+                                     gchar                **actions,
+                                     GHashTable            *hints,
+                                     gint                   timeout)
 {
   GHashTable *hints_copy;
   GValue *hint;
@@ -1222,7 +1682,11 @@ hd_notification_manager_notify (HDNotificationManager *nm,
   gint i;
   HDNotification *notification;
   gboolean replace = FALSE;
-  /* const gchar *category; */
+  gint64 start = g_get_monotonic_time ();
+  const gchar *category;
+  gboolean merged = FALSE;
+
+  g_return_val_if_fail (nm->priv->owner == g_thread_self (), 0);
 
 /*  g_return_val_if_fail (summary != '\0', FALSE);
   g_return_val_if_fail (body != '\0', FALSE);*/
@@ -1239,8 +1703,16 @@ hd_notification_manager_notify (HDNotificationManager *nm,
     persistent = FALSE;
 
   /* Get "category" hint */
-  /* hint = g_hash_table_lookup (hints, "category");
-  category = G_VALUE_HOLDS_STRING (hint) ? g_value_get_string (hint) : NULL; */
+  hint = g_hash_table_lookup (hints, "category");
+  category = G_VALUE_HOLDS_STRING (hint) ? g_value_get_string (hint) : NULL;
+
+  /* Merge new notifications over the rate limit into the last one
+   * let through for the same application and category */
+  if (!id && nm->priv->flood)
+    {
+      id = hd_notification_flood_check (nm->priv->flood, app_name, category);
+      merged = id != 0;
+    }
 
   /* Try to find an existing notification */
   if (id)
@@ -1253,8 +1725,6 @@ hd_notification_manager_notify (HDNotificationManager *nm,
 
   if (!replace)
     {
-      gchar *sender;
-
       /* Test if we have a valid list of actions */
       for (i = 0; actions && actions[i] != NULL; i += 2)
         {
@@ -1299,8 +1769,6 @@ hd_notification_manager_notify (HDNotificationManager *nm,
           g_hash_table_insert (hints_copy, g_strdup ("time"), value);
         }
 
-      sender = dbus_g_method_get_sender (context);
-
       id = hd_notification_manager_next_id (nm);
 
       notification = hd_notification_new (id,
@@ -1317,7 +1785,13 @@ hd_notification_manager_notify (HDNotificationManager *nm,
       g_hash_table_insert (nm->priv->notifications,
                            GUINT_TO_POINTER (id),
                            notification);
+      hd_notification_manager_changed (nm, id);
+
+      if (nm->priv->flood)
+        hd_notification_flood_add (nm->priv->flood, app_name, category, id);
 
+      /* Emitted after the D-Bus reply is sent, with the GDK lock
+       * held for the handlers creating windows. */
       gdk_threads_add_idle (idle_emit, g_object_ref (notification));
 
       if (persistent && nm->priv->db)
@@ -1336,16 +1810,23 @@ hd_notification_manager_notify (HDNotificationManager *nm,
 
       g_strfreev (actions_copy);
       g_object_unref (notification);
-      g_free (sender);
     }
   else 
     {
+      /* The windows show the amount set before they are updated */
+      if (merged)
+        {
+          hd_notification_manager_merge_amount (notification, hints);
+          hints = hd_notification_get_hints (notification);
+        }
+
       /* Update new data */
       g_object_set (notification,
                     "icon", icon,
                     "summary", summary,
                     "body", body,
                     NULL);
+      hd_notification_manager_changed (nm, id);
 
       if (persistent)
         {
@@ -1361,25 +1842,60 @@ hd_notification_manager_notify (HDNotificationManager *nm,
         }
     }
 
-  if (!persistent && timeout > 0)
+  /* Do not let a merged notification close its target */
+  if (!persistent && timeout > 0 && !merged)
     {
       g_timeout_add (timeout,
                      (GSourceFunc) hd_notification_manager_timeout,
                      GUINT_TO_POINTER (id));
     }
 
+  hd_metrics_add (HD_METRICS_NOTIFY_CALLS, 1);
+  hd_metrics_observe_since (HD_METRICS_NOTIFY_LATENCY, start);
+
+  return id;
+}
+
+gboolean
+hd_notification_manager_notify (HDNotificationManager *nm,
+                                const gchar           *app_name,
+                                guint                  id,
+                                const gchar           *icon,
+                                const gchar           *summary,
+                                const gchar           *body,
+                                gchar                **actions,
+                                GHashTable            *hints,
+                                gint                   timeout, 
+                                DBusGMethodInvocation *context)
+{
+  gchar *sender;
+
+  sender = dbus_g_method_get_sender (context);
+  id = hd_notification_manager_notify_from (nm,
+                                            sender,
+                                            app_name,
+                                            id,
+                                            icon,
+                                            summary,
+                                            body,
+                                            actions,
+                                            hints,
+                                            timeout);
+  g_free (sender);
+
   dbus_g_method_return (context, id);
 
   return TRUE;
 }
 
-gboolean
-hd_notification_manager_system_note_infoprint (HDNotificationManager *nm,
-                                               const gchar *message,
-                                               DBusGMethodInvocation *context)
+guint
+hd_notification_manager_system_note_infoprint_from (HDNotificationManager *nm,
+                                                    const gchar           *sender,
+                                                    const gchar           *message)
 {
   GHashTable *hints;
   GValue *hint;
+  guint id;
 
   hints = g_hash_table_new_full (g_str_hash, 
                                  g_str_equal,
@@ -1392,34 +1908,52 @@ hd_notification_manager_system_note_infoprint (HDNotificationManager *nm,
 
   g_hash_table_insert (hints, "category", hint);
 
-  hd_notification_manager_notify (nm,
-                                  "hildon-desktop",
-                                  0,
-                                  "qgn_note_infoprint",
-                                  "System Note Infoprint",
-                                  message,
-                                  NULL,
-                                  hints,
-                                  3000,
-                                  context);
+  id = hd_notification_manager_notify_from (nm,
+                                            sender,
+                                            "hildon-desktop",
+                                            0,
+                                            "qgn_note_infoprint",
+                                            "System Note Infoprint",
+                                            message,
+                                            NULL,
+                                            hints,
+                                            3000);
 
   g_hash_table_destroy (hints);
 
-  return TRUE;
+  return id;
 }
 
 gboolean
-hd_notification_manager_system_note_dialog (HDNotificationManager *nm,
-                                            const gchar *message,
-                                            guint type,
-                                            const gchar *label,
-                                            DBusGMethodInvocation *context)
+hd_notification_manager_system_note_infoprint (HDNotificationManager *nm,
+                                               const gchar *message,
+                                               DBusGMethodInvocation *context)
+{
+  gchar *sender;
+  guint id;
+
+  sender = dbus_g_method_get_sender (context);
+  id = hd_notification_manager_system_note_infoprint_from (nm, sender, message);
+  g_free (sender);
+
+  dbus_g_method_return (context, id);
+
+  return TRUE;
+}
+
+guint
+hd_notification_manager_system_note_dialog_from (HDNotificationManager *nm,
+                                                 const gchar           *sender,
+                                                 const gchar           *message,
+                                                 guint                  type,
+                                                 const gchar           *label)
 {
   GHashTable *hints;
   GValue *hint;
   gchar **actions;
+  guint id;
 
-  g_return_val_if_fail (type >= 0 && type < 5, FALSE);
+  g_return_val_if_fail (type < 5, 0);
 
   static const gchar *icon[5] = {
       "qgn_note_gene_syswarning", /* OSSO_GN_WARNING */
@@ -1466,20 +2000,43 @@ hd_notification_manager_system_note_dialog (HDNotificationManager *nm,
       actions = NULL;
     }
 
-  hd_notification_manager_notify (nm,
-                                  "hildon-desktop",
-                                  0,
-                                  icon[type],
-                                  "System Note Dialog",
-                                  message,
-                                  actions,
-                                  hints,
-                                  0,
-                                  context);
+  id = hd_notification_manager_notify_from (nm,
+                                            sender,
+                                            "hildon-desktop",
+                                            0,
+                                            icon[type],
+                                            "System Note Dialog",
+                                            message,
+                                            actions,
+                                            hints,
+                                            0);
 
   g_hash_table_destroy (hints);
   g_strfreev (actions);
 
+  return id;
+}
+
+gboolean
+hd_notification_manager_system_note_dialog (HDNotificationManager *nm,
+                                            const gchar *message,
+                                            guint type,
+                                            const gchar *label,
+                                            DBusGMethodInvocation *context)
+{
+  gchar *sender;
+  guint id;
+
+  sender = dbus_g_method_get_sender (context);
+  id = hd_notification_manager_system_note_dialog_from (nm,
+                                                        sender,
+                                                        message,
+                                                        type,
+                                                        label);
+  g_free (sender);
+
+  dbus_g_method_return (context, id);
+
   return TRUE;
 }
 
@@ -1518,6 +2075,8 @@ hd_notification_manager_close_notification (HDNotificationManager *nm,
 {
   HDNotification *notification;
 
+  g_return_val_if_fail (nm->priv->owner == g_thread_self (), FALSE);
+
   notification = g_hash_table_lookup (nm->priv->notifications,
                                       GUINT_TO_POINTER (id));
 
@@ -1542,6 +2101,9 @@ hd_notification_manager_close_notification (HDNotificationManager *nm,
 
       g_hash_table_remove (nm->priv->notifications,
                            GUINT_TO_POINTER (id));
+      hd_notification_manager_changed (nm, id);
+      if (nm->priv->flood)
+        hd_notification_flood_remove (nm->priv->flood, id);
       /*}*/
 
       return TRUE;    
@@ -1550,6 +2112,195 @@ hd_notification_manager_close_notification (HDNotificationManager *nm,
     return FALSE;
 }
 
+/* Queues a NotificationClosed signal for @id. */
+static void
+hd_notification_manager_send_closed (HDNotificationManager *nm,
+                                     guint                  id)
+{
+  DBusMessage *message;
+
+  message = hd_notification_manager_create_signal (nm,
+                                                   id,
+                                                   "NotificationClosed");
+  if (message == NULL)
+    return;
+
+  dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection),
+                        message,
+                        NULL);
+  dbus_message_unref (message);
+}
+
+/* Closes the notifications with @ids at once.  Their database rows are
+ * deleted in one unit of work and the NotificationClosed signals are
+ * queued back to back, so closing a large group costs about as much
+ * as closing one notification.  Unknown IDs are ignored. */
+gboolean
+hd_notification_manager_close_notifications (HDNotificationManager *nm,
+                                             GArray                *ids,
+                                             GError               **error)
+{
+  GPtrArray *closed;
+  GArray *persistent;
+  guint i;
+
+  g_return_val_if_fail (nm->priv->owner == g_thread_self (), FALSE);
+
+  closed = g_ptr_array_sized_new (ids->len);
+  persistent = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  /* Take them out first, so duplicate IDs are closed once. */
+  for (i = 0; i < ids->len; i++)
+    {
+      guint id = g_array_index (ids, guint, i);
+      HDNotification *notification;
+
+      notification = g_hash_table_lookup (nm->priv->notifications,
+                                          GUINT_TO_POINTER (id));
+      if (!notification)
+        continue;
+
+      g_ptr_array_add (closed, g_object_ref (notification));
+      g_hash_table_remove (nm->priv->notifications,
+                           GUINT_TO_POINTER (id));
+      hd_notification_manager_changed (nm, id);
+      if (nm->priv->flood)
+        hd_notification_flood_remove (nm->priv->flood, id);
+
+      if (hd_notification_get_persistent (notification))
+        g_array_append_val (persistent, id);
+    }
+
+  if (persistent->len && nm->priv->db)
+    hd_notification_manager_db_delete_many (nm, persistent);
+
+  /* Notify the clients */
+  for (i = 0; i < closed->len; i++)
+    hd_notification_manager_send_closed (nm,
+                                         hd_notification_get_id (g_ptr_array_index (closed, i)));
+
+  for (i = 0; i < closed->len; i++)
+    {
+      HDNotification *notification = g_ptr_array_index (closed, i);
+
+      hd_notification_closed (notification);
+      g_object_unref (notification);
+    }
+
+  g_array_free (persistent, TRUE);
+  g_ptr_array_free (closed, TRUE);
+
+  return TRUE;
+}
+
+/* #GSourceFunc giving the freed pages of the database back to the file
+ * system in small steps.  Waits for the open transaction to be
+ * committed first.  An old database is switched to incremental
+ * auto-vacuum instead, which rewrites the whole file once. */
+static gboolean
+hd_notification_manager_db_vacuum (HDNotificationManager *nm)
+{
+  HDNotificationManagerPrivate *priv = nm->priv;
+
+  if (priv->commit_callback)
+    return TRUE;
+
+  if (priv->needs_vacuum)
+    {
+      HD_TRACE_BEGIN ("db-vacuum");
+      hd_notification_manager_db_exec (nm, "VACUUM");
+      HD_TRACE_END ("db-vacuum");
+
+      /* Tried again at the next start if it failed */
+      priv->needs_vacuum =
+        hd_notification_manager_db_get_int (nm, "PRAGMA auto_vacuum") != 2;
+    }
+  else if (hd_notification_manager_db_get_int (nm, "PRAGMA freelist_count") > 0)
+    {
+      hd_notification_manager_db_exec (nm,
+                                       "PRAGMA incremental_vacuum("
+                                       G_STRINGIFY (VACUUM_PAGES) ")");
+      return TRUE;
+    }
+
+  priv->vacuum_source = 0;
+
+  return FALSE;
+}
+
+static gboolean
+hd_notification_manager_db_prune_timeout (HDNotificationManager *nm)
+{
+  hd_notification_manager_db_prune (nm);
+
+  return TRUE;
+}
+
+/* Closes the persistent notifications selected by the retention
+ * rules.  Notifications not loaded yet are just deleted, but the
+ * clients are told about all of them. */
+static void
+hd_notification_manager_db_prune (HDNotificationManager *nm)
+{
+  HDNotificationManagerPrivate *priv = nm->priv;
+  GArray *pruned, *loaded, *unloaded;
+  guint i;
+
+  if (!priv->db)
+    return;
+
+  HD_TRACE_BEGIN ("db-prune");
+
+  pruned = hd_notification_retention_select (priv->retention,
+                                             priv->db,
+                                             time (NULL));
+  loaded = g_array_new (FALSE, FALSE, sizeof (guint));
+  unloaded = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (i = 0; i < pruned->len; i++)
+    {
+      guint id = g_array_index (pruned, guint, i);
+
+      if (g_hash_table_lookup (priv->notifications, GUINT_TO_POINTER (id)))
+        g_array_append_val (loaded, id);
+      else
+        g_array_append_val (unloaded, id);
+    }
+
+  if (loaded->len)
+    hd_notification_manager_close_notifications (nm, loaded, NULL);
+
+  if (unloaded->len &&
+      hd_notification_manager_db_delete_many (nm, unloaded) == SQLITE_OK)
+    for (i = 0; i < unloaded->len; i++)
+      hd_notification_manager_send_closed (nm, g_array_index (unloaded, guint, i));
+
+  if (pruned->len)
+    g_debug ("%s. Pruned %u notifications",
+             __FUNCTION__,
+             pruned->len);
+
+  if (pruned->len && !priv->needs_vacuum && !priv->vacuum_source)
+    priv->vacuum_source = g_timeout_add_full (G_PRIORITY_LOW,
+                                              VACUUM_INTERVAL,
+                                              (GSourceFunc) hd_notification_manager_db_vacuum,
+                                              nm,
+                                              NULL);
+
+  if (!priv->prune_source)
+    priv->prune_source = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+                                                     RETENTION_INTERVAL,
+                                                     (GSourceFunc) hd_notification_manager_db_prune_timeout,
+                                                     nm,
+                                                     NULL);
+
+  g_array_free (pruned, TRUE);
+  g_array_free (loaded, TRUE);
+  g_array_free (unloaded, TRUE);
+
+  HD_TRACE_END ("db-prune");
+}
+
 static guint
 parse_parameter (GScanner *scanner, DBusMessage *message)
 {
@@ -1730,20 +2481,25 @@ void
 hd_notification_manager_close_all (HDNotificationManager *nm)
 { ACTION(__FUNCTION__);
   GHashTableIter iter;
-  gpointer key, value;
+  gpointer key;
+  GArray *ids;
 
-  g_hash_table_iter_init (&iter, nm->priv->notifications);
+  g_return_if_fail (nm->priv->owner == g_thread_self ());
 
-  while (g_hash_table_iter_next (&iter, &key, &value))
+  ids = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+                           g_hash_table_size (nm->priv->notifications));
+
+  g_hash_table_iter_init (&iter, nm->priv->notifications);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
     {
-      HDNotification *notification = value;
+      guint id = GPOINTER_TO_UINT (key);
 
-      hd_notification_manager_notification_closed (nm, 
-                                                   notification);
-      hd_notification_closed (notification);
+      g_array_append_val (ids, id);
+    }
 
-      g_hash_table_iter_remove (&iter);
-    }	  
+  hd_notification_manager_close_notifications (nm, ids, NULL);
+
+  g_array_free (ids, TRUE);
 }
 
 void
@@ -1801,3 +2557,637 @@ hd_notification_manager_call_message (HDNotificationManager *nm,
                           message, 
                           NULL);
 } 
+
+#ifdef COMPILE_FOR_TEST
+#include <signal.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+/* Notifications in the group the benchmark closes */
+#define TEST_GROUP 1000
+
+/* Client threads posting notifications and the calls of each */
+#define TEST_CLIENTS 8
+#define TEST_CALLS 250
+
+/* The calls are taken in the main thread, as without an ingress */
+gboolean
+hd_notification_ingress_start (HDNotificationManager *nm)
+{
+  return FALSE;
+}
+
+DBusConnection *
+hd_notification_ingress_get_connection (DBusBusType bus)
+{
+  return NULL;
+}
+
+void
+hd_notification_ingress_stop (void)
+{
+}
+
+HDNotificationFlood *
+hd_notification_flood_new_from_key_file (GKeyFile *key_file,
+                                         gdouble   default_rate,
+                                         guint     default_burst)
+{
+  return NULL;
+}
+
+void
+hd_notification_flood_free (HDNotificationFlood *flood)
+{
+}
+
+guint
+hd_notification_flood_check (HDNotificationFlood *flood,
+                             const gchar         *app_name,
+                             const gchar         *category)
+{
+  return 0;
+}
+
+void
+hd_notification_flood_add (HDNotificationFlood *flood,
+                           const gchar         *app_name,
+                           const gchar         *category,
+                           guint                id)
+{
+}
+
+void
+hd_notification_flood_remove (HDNotificationFlood *flood,
+                              guint                id)
+{
+}
+
+HDNotificationRetention *
+hd_notification_retention_new_from_key_file (GKeyFile *key_file)
+{
+  return NULL;
+}
+
+void
+hd_notification_retention_free (HDNotificationRetention *retention)
+{
+}
+
+GArray *
+hd_notification_retention_select (HDNotificationRetention *retention,
+                                  sqlite3                 *db,
+                                  time_t                   now)
+{
+  return g_array_new (FALSE, FALSE, sizeof (guint));
+}
+
+/* Receives the NotificationClosed signals */
+static DBusConnection *listener;
+static guint           n_closed;
+
+static void
+count_closed (HDNotification *notification)
+{
+  n_closed++;
+}
+
+static void
+notified (HDNotificationManager *nm,
+          HDNotification        *notification,
+          gboolean               replayed)
+{
+  g_signal_connect (notification, "closed",
+                    G_CALLBACK (count_closed), NULL);
+}
+
+/* Sends @n persistent notifications of one conversation and commits
+ * them, their IDs are appended to @ids */
+static void
+notify_group (HDNotificationManager *nm,
+              guint                  n,
+              GArray                *ids)
+{
+  GHashTable *hints;
+  GValue persistent = G_VALUE_INIT, category = G_VALUE_INIT;
+  gchar *actions[] = { NULL };
+  guint i;
+
+  g_value_init (&persistent, G_TYPE_UCHAR);
+  g_value_set_uchar (&persistent, TRUE);
+  g_value_init (&category, G_TYPE_STRING);
+  g_value_set_static_string (&category, "im.received");
+
+  hints = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (hints, "persistent", &persistent);
+  g_hash_table_insert (hints, "category", &category);
+
+  for (i = 0; i < n; i++)
+    {
+      guint id;
+
+      id = hd_notification_manager_notify_from (nm, ":test", "test", 0,
+                                                "general_chat",
+                                                "Somebody",
+                                                "A message in the thread",
+                                                actions, hints, 0);
+      g_array_append_val (ids, id);
+    }
+
+  hd_notification_manager_db_commit_now (nm);
+
+  /* The "notified" signals */
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_hash_table_destroy (hints);
+  g_value_unset (&category);
+}
+
+static gint64
+count_rows (HDNotificationManager *nm)
+{
+  return hd_notification_manager_db_get_int (nm, "SELECT COUNT(*) FROM notifications");
+}
+
+/* Waits for @n NotificationClosed signals, returns how many came.  The
+ * manager flushes what it could not write at once from the main loop. */
+static guint
+wait_closed_signals (guint n)
+{
+  gint64 deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  guint received = 0;
+
+  while (received < n &&
+         g_get_monotonic_time () < deadline)
+    {
+      DBusMessage *message;
+
+      while (g_main_context_iteration (NULL, FALSE));
+      if (!dbus_connection_read_write (listener, 10))
+        break;
+
+      while ((message = dbus_connection_pop_message (listener)))
+        {
+          if (dbus_message_is_signal (message,
+                                      "org.freedesktop.Notifications",
+                                      "NotificationClosed"))
+            received++;
+          dbus_message_unref (message);
+        }
+    }
+
+  return received;
+}
+
+static void
+test_close_notifications (void)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  GArray *ids = g_array_new (FALSE, FALSE, sizeof (guint));
+  GArray *closing = g_array_new (FALSE, FALSE, sizeof (guint));
+  guint unknown = G_MAXINT, i;
+
+  n_closed = 0;
+  notify_group (nm, 10, ids);
+  g_assert_cmpint (count_rows (nm), ==, 10);
+
+  /* Duplicate and unknown IDs are ignored */
+  g_array_append_vals (closing, ids->data, 5);
+  g_array_append_vals (closing, ids->data, 1);
+  g_array_append_val (closing, unknown);
+
+  g_assert (hd_notification_manager_close_notifications (nm, closing, NULL));
+  hd_notification_manager_db_commit_now (nm);
+  g_assert_cmpuint (n_closed, ==, 5);
+  g_assert_cmpint (count_rows (nm), ==, 5);
+  g_assert_cmpuint (wait_closed_signals (5), ==, 5);
+
+  /* Once closed they are gone */
+  g_assert (hd_notification_manager_close_notifications (nm, closing, NULL));
+  g_assert_cmpuint (n_closed, ==, 5);
+
+  for (i = 5; i < ids->len; i++)
+    g_assert (hd_notification_manager_close_notification (nm, g_array_index (ids, guint, i), NULL));
+  hd_notification_manager_db_commit_now (nm);
+  g_assert_cmpuint (n_closed, ==, 10);
+  g_assert_cmpint (count_rows (nm), ==, 0);
+  g_assert_cmpuint (wait_closed_signals (5), ==, 5);
+
+  g_array_free (closing, TRUE);
+  g_array_free (ids, TRUE);
+}
+
+/* Snapshots are replaced once the main loop is idle, a snapshot taken
+ * does not change */
+static void
+test_snapshot (void)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  GHashTable *hints, *before, *after;
+  gchar *actions[] = { NULL };
+  HDNotification *copy;
+  guint id;
+
+  hints = g_hash_table_new (g_str_hash, g_str_equal);
+  id = hd_notification_manager_notify_from (nm, ":test", "test", 0,
+                                            "general_chat", "Somebody",
+                                            "First", actions, hints, 0);
+
+  before = hd_notification_manager_ref_snapshot (nm);
+  g_assert (!g_hash_table_lookup (before, GUINT_TO_POINTER (id)));
+  g_hash_table_unref (before);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  before = hd_notification_manager_ref_snapshot (nm);
+  copy = g_hash_table_lookup (before, GUINT_TO_POINTER (id));
+  g_assert (copy);
+  g_assert (copy != g_hash_table_lookup (nm->priv->notifications,
+                                         GUINT_TO_POINTER (id)));
+  g_assert_cmpstr (hd_notification_get_summary (copy), ==, "Somebody");
+
+  hd_notification_manager_notify_from (nm, ":test", "test", id,
+                                       "general_chat", "Somebody else",
+                                       "Second", actions, hints, 0);
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpstr (hd_notification_get_summary (copy), ==, "Somebody");
+
+  after = hd_notification_manager_ref_snapshot (nm);
+  copy = g_hash_table_lookup (after, GUINT_TO_POINTER (id));
+  g_assert_cmpstr (hd_notification_get_summary (copy), ==, "Somebody else");
+  g_hash_table_unref (after);
+
+  g_assert (hd_notification_manager_close_notification (nm, id, NULL));
+  while (g_main_context_iteration (NULL, FALSE));
+  after = hd_notification_manager_ref_snapshot (nm);
+  g_assert (!g_hash_table_lookup (after, GUINT_TO_POINTER (id)));
+  g_assert (g_hash_table_lookup (before, GUINT_TO_POINTER (id)));
+  g_hash_table_unref (after);
+
+  g_hash_table_unref (before);
+  g_hash_table_destroy (hints);
+  g_assert_cmpuint (wait_closed_signals (1), ==, 1);
+}
+
+/* A database from before incremental auto-vacuum is converted by the
+ * vacuum source, not at exit */
+static void
+test_convert (void)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  GArray *ids = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  notify_group (nm, 10, ids);
+
+  hd_notification_manager_db_exec (nm, "PRAGMA auto_vacuum = NONE");
+  hd_notification_manager_db_exec (nm, "VACUUM");
+  g_assert_cmpint (hd_notification_manager_db_get_int (nm, "PRAGMA auto_vacuum"), ==, 0);
+  nm->priv->needs_vacuum = TRUE;
+
+  hd_notification_manager_db_exec (nm, "PRAGMA auto_vacuum = INCREMENTAL");
+  g_assert (!hd_notification_manager_db_vacuum (nm));
+  g_assert (!nm->priv->needs_vacuum);
+  g_assert_cmpint (hd_notification_manager_db_get_int (nm, "PRAGMA auto_vacuum"), ==, 2);
+  g_assert_cmpint (count_rows (nm), ==, 10);
+
+  hd_notification_manager_close_notifications (nm, ids, NULL);
+  hd_notification_manager_db_commit_now (nm);
+  g_assert_cmpuint (wait_closed_signals (10), ==, 10);
+
+  g_array_free (ids, TRUE);
+}
+
+/* Closes a group with one call per notification, as incoming events
+ * did, and in bulk.  The times include the database commit. */
+static gdouble
+close_group (gboolean bulk)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  GArray *ids = g_array_new (FALSE, FALSE, sizeof (guint));
+  gdouble elapsed;
+  guint i;
+
+  notify_group (nm, TEST_GROUP, ids);
+  g_assert_cmpint (count_rows (nm), ==, TEST_GROUP);
+
+  g_test_timer_start ();
+  if (bulk)
+    hd_notification_manager_close_notifications (nm, ids, NULL);
+  else
+    for (i = 0; i < ids->len; i++)
+      hd_notification_manager_close_notification (nm, g_array_index (ids, guint, i), NULL);
+  hd_notification_manager_db_commit_now (nm);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_cmpint (count_rows (nm), ==, 0);
+  g_assert_cmpuint (wait_closed_signals (TEST_GROUP), ==, TEST_GROUP);
+
+  g_array_free (ids, TRUE);
+
+  return elapsed;
+}
+
+static void
+test_close_group (void)
+{
+  gdouble single, bulk;
+
+  single = close_group (FALSE);
+  bulk = close_group (TRUE);
+
+  g_test_minimized_result (bulk,
+                           "%d notifications: one by one %.1f ms, in bulk %.1f ms",
+                           TEST_GROUP, single * 1e3, bulk * 1e3);
+}
+
+/* A Notify posted by one of the client threads */
+typedef struct
+{
+  guint client;
+  guint seq;
+} ClientCall;
+
+/* Touched in the owner thread only */
+static guint   client_next[TEST_CLIENTS];
+static GArray *client_ids;
+
+static gboolean
+client_notify (ClientCall *call)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  GHashTable *hints;
+  gchar *actions[] = { NULL };
+  gchar *app_name;
+  guint id;
+
+  /* The calls of a client arrive in order */
+  g_assert_cmpuint (call->seq, ==, client_next[call->client]);
+  client_next[call->client]++;
+
+  hints = g_hash_table_new (g_str_hash, g_str_equal);
+  app_name = g_strdup_printf ("client-%u", call->client);
+  id = hd_notification_manager_notify_from (nm, ":test", app_name, 0,
+                                            "general_chat",
+                                            "Somebody",
+                                            "A message from a client thread",
+                                            actions, hints, 0);
+  g_assert_cmpuint (id, !=, 0);
+  g_array_append_val (client_ids, id);
+  g_free (app_name);
+  g_hash_table_destroy (hints);
+
+  return FALSE;
+}
+
+static gpointer
+client_thread (gpointer data)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  guint client = GPOINTER_TO_UINT (data), seq;
+
+  for (seq = 0; seq < TEST_CALLS; seq++)
+    {
+      ClientCall *call = g_new (ClientCall, 1);
+
+      call->client = client;
+      call->seq = seq;
+      hd_notification_manager_invoke (nm, (GSourceFunc) client_notify,
+                                      call, g_free);
+    }
+
+  return NULL;
+}
+
+/* Reads the snapshots while the clients post, until @snapshot_reading
+ * is cleared.  Returns the largest snapshot it saw. */
+static volatile gint snapshot_reading;
+
+static gpointer
+snapshot_thread (gpointer data)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  guint largest = 0;
+
+  while (g_atomic_int_get (&snapshot_reading))
+    {
+      GHashTable *snapshot = hd_notification_manager_ref_snapshot (nm);
+      GHashTableIter iter;
+      gpointer key, value;
+
+      g_hash_table_iter_init (&iter, snapshot);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          g_assert_cmpuint (hd_notification_get_id (value), ==,
+                            GPOINTER_TO_UINT (key));
+          g_assert (hd_notification_get_summary (value));
+        }
+
+      largest = MAX (largest, g_hash_table_size (snapshot));
+      g_hash_table_unref (snapshot);
+    }
+
+  return GUINT_TO_POINTER (largest);
+}
+
+static gint
+compare_ids (gconstpointer a,
+             gconstpointer b)
+{
+  guint x = *(const guint *) a, y = *(const guint *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Posts TEST_CALLS notifications from each of TEST_CLIENTS threads
+ * while the owner thread serves them, returns the time it took */
+static gdouble
+run_clients (void)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  GThread *threads[TEST_CLIENTS], *reader;
+  GHashTable *snapshot;
+  guint total = TEST_CLIENTS * TEST_CALLS, stored, i;
+  gdouble elapsed;
+
+  memset (client_next, 0, sizeof (client_next));
+  client_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+  stored = g_hash_table_size (nm->priv->notifications);
+  n_closed = 0;
+
+  g_atomic_int_set (&snapshot_reading, 1);
+  reader = g_thread_new ("snapshot", snapshot_thread, NULL);
+
+  g_test_timer_start ();
+  for (i = 0; i < TEST_CLIENTS; i++)
+    threads[i] = g_thread_new ("client", client_thread, GUINT_TO_POINTER (i));
+  while (client_ids->len < total)
+    g_main_context_iteration (NULL, TRUE);
+  elapsed = g_test_timer_elapsed ();
+
+  /* The last snapshot has all of them */
+  while (g_main_context_iteration (NULL, FALSE));
+  g_atomic_int_set (&snapshot_reading, 0);
+  g_assert_cmpuint (GPOINTER_TO_UINT (g_thread_join (reader)), <=,
+                    stored + total);
+  snapshot = hd_notification_manager_ref_snapshot (nm);
+  g_assert_cmpuint (g_hash_table_size (snapshot), ==, stored + total);
+  g_hash_table_unref (snapshot);
+
+  for (i = 0; i < TEST_CLIENTS; i++)
+    g_thread_join (threads[i]);
+  for (i = 0; i < TEST_CLIENTS; i++)
+    g_assert_cmpuint (client_next[i], ==, TEST_CALLS);
+
+  /* Every call got a notification of its own */
+  g_array_sort (client_ids, compare_ids);
+  for (i = 1; i < client_ids->len; i++)
+    g_assert_cmpuint (g_array_index (client_ids, guint, i - 1), <,
+                      g_array_index (client_ids, guint, i));
+  g_assert_cmpuint (g_hash_table_size (nm->priv->notifications), ==,
+                    stored + total);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert (hd_notification_manager_close_notifications (nm, client_ids, NULL));
+  g_assert_cmpuint (n_closed, ==, total);
+  g_assert_cmpuint (g_hash_table_size (nm->priv->notifications), ==, stored);
+  g_assert_cmpuint (wait_closed_signals (total), ==, total);
+
+  g_array_free (client_ids, TRUE);
+
+  return elapsed;
+}
+
+static void
+test_clients (void)
+{
+  run_clients ();
+}
+
+/* Throughput of the clients, against the same notifications sent from
+ * the owner thread */
+static void
+test_clients_throughput (void)
+{
+  HDNotificationManager *nm = hd_notification_manager_get ();
+  guint total = TEST_CLIENTS * TEST_CALLS, i;
+  gdouble threads, owner;
+
+  threads = run_clients ();
+
+  client_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+  g_test_timer_start ();
+  for (i = 0; i < total; i++)
+    {
+      ClientCall call = { 0, i };
+
+      client_next[0] = i;
+      client_notify (&call);
+    }
+  owner = g_test_timer_elapsed ();
+
+  while (g_main_context_iteration (NULL, FALSE));
+  hd_notification_manager_close_notifications (nm, client_ids, NULL);
+  g_assert_cmpuint (wait_closed_signals (total), ==, total);
+  g_array_free (client_ids, TRUE);
+
+  g_test_maximized_result (total / threads,
+                           "%d clients: %.0f notifications/s, "
+                           "%.0f/s from the owner thread",
+                           TEST_CLIENTS, total / threads, total / owner);
+}
+
+/* Starts a dbus-daemon for @variable, returns 0 if that failed */
+static GPid
+start_bus (const gchar *variable)
+{
+  gchar *argv[] = { "dbus-daemon", "--session", "--nofork", "--print-address", NULL };
+  GString *address;
+  GPid pid;
+  gint out;
+  gchar c;
+
+  if (!g_spawn_async_with_pipes (NULL, argv, NULL,
+                                 G_SPAWN_SEARCH_PATH,
+                                 NULL, NULL,
+                                 &pid,
+                                 NULL, &out, NULL,
+                                 NULL))
+    return 0;
+
+  address = g_string_new (NULL);
+  while (read (out, &c, 1) == 1 && c != '\n')
+    g_string_append_c (address, c);
+  close (out);
+
+  g_setenv (variable, address->str, TRUE);
+  g_string_free (address, TRUE);
+
+  return pid;
+}
+
+int main (int argc, char **argv)
+{
+  HDNotificationManager *nm;
+  GPid session_bus, system_bus;
+  gchar *home, *db;
+  gint result;
+
+  g_test_init (&argc, &argv, NULL);
+
+  /* notifications.db is created in a scratch home */
+  home = g_dir_make_tmp ("test-notification-manager-XXXXXX", NULL);
+  g_assert (home);
+  g_setenv ("HOME", home, TRUE);
+
+  session_bus = start_bus ("DBUS_SESSION_BUS_ADDRESS");
+  system_bus = start_bus ("DBUS_SYSTEM_BUS_ADDRESS");
+  if (!session_bus || !system_bus)
+    {
+      g_printerr ("Could not start dbus-daemon, skipping\n");
+      return 77;
+    }
+
+  listener = dbus_bus_get_private (DBUS_BUS_SESSION, NULL);
+  g_assert (listener);
+  dbus_connection_set_exit_on_disconnect (listener, FALSE);
+  dbus_bus_add_match (listener,
+                      "type='signal',interface='org.freedesktop.Notifications',"
+                      "member='NotificationClosed'",
+                      NULL);
+
+  nm = hd_notification_manager_get ();
+  hd_notification_manager_db_open (nm);
+  g_assert (nm->priv->db);
+  dbus_connection_set_exit_on_disconnect (dbus_g_connection_get_connection (nm->priv->connection),
+                                          FALSE);
+  g_signal_connect (nm, "notified", G_CALLBACK (notified), NULL);
+
+  g_test_add_func ("/notification-manager/close-notifications", test_close_notifications);
+  g_test_add_func ("/notification-manager/clients", test_clients);
+  g_test_add_func ("/notification-manager/snapshot", test_snapshot);
+  g_test_add_func ("/notification-manager/convert", test_convert);
+  if (g_test_perf ())
+    {
+      g_test_add_func ("/notification-manager/close-group", test_close_group);
+      g_test_add_func ("/notification-manager/clients-throughput",
+                       test_clients_throughput);
+    }
+
+  result = g_test_run ();
+
+  kill (session_bus, SIGTERM);
+  kill (system_bus, SIGTERM);
+
+  db = g_build_filename (home, ".config", "hildon-desktop", "notifications.db", NULL);
+  g_unlink (db);
+  while (strcmp (db, home))
+    {
+      *strrchr (db, G_DIR_SEPARATOR) = '\0';
+      g_rmdir (db);
+    }
+  g_free (db);
+  g_free (home);
+
+  return result;
+}
+
+#endif
@@ -38,6 +38,9 @@
 
 G_BEGIN_DECLS
 
+#define HD_NOTIFICATION_MANAGER_DBUS_NAME  "org.freedesktop.Notifications"
+#define HD_NOTIFICATION_MANAGER_DBUS_PATH  "/org/freedesktop/Notifications"
+
 typedef struct _HDNotificationManager        HDNotificationManager;
 typedef struct _HDNotificationManagerClass   HDNotificationManagerClass;
 typedef struct _HDNotificationManagerPrivate HDNotificationManagerPrivate;
@@ -68,6 +71,7 @@ GType                  hd_notification_manager_get_type              (void);
 
 HDNotificationManager *hd_notification_manager_get                   (void);
 
+void                  hd_notification_manager_db_open                (HDNotificationManager *nm);
 void                  hd_notification_manager_db_load                (HDNotificationManager *nm);
 void                  hd_notification_manager_db_commit_now          (HDNotificationManager *nm);
 
@@ -82,6 +86,17 @@ gboolean               hd_notification_manager_notify                (HDNotifica
                                                                       gint                   timeout, 
                                                                       DBusGMethodInvocation *context);
 
+guint                  hd_notification_manager_notify_from           (HDNotificationManager *nm,
+                                                                      const gchar           *sender,
+                                                                      const gchar           *app_name,
+                                                                      guint                  id,
+                                                                      const gchar           *icon,
+                                                                      const gchar           *summary,
+                                                                      const gchar           *body,
+                                                                      gchar                **actions,
+                                                                      GHashTable            *hints,
+                                                                      gint                   timeout);
+
 gboolean               hd_notification_manager_system_note_infoprint (HDNotificationManager *nm,
                                                                       const gchar           *message,
                                                                       DBusGMethodInvocation *context);
@@ -92,6 +107,15 @@ gboolean               hd_notification_manager_system_note_dialog    (HDNotifica
                                                                       const gchar           *label,
                                                                       DBusGMethodInvocation *context);
 
+guint                  hd_notification_manager_system_note_infoprint_from (HDNotificationManager *nm,
+                                                                           const gchar           *sender,
+                                                                           const gchar           *message);
+guint                  hd_notification_manager_system_note_dialog_from (HDNotificationManager *nm,
+                                                                        const gchar           *sender,
+                                                                        const gchar           *message,
+                                                                        guint                  type,
+                                                                        const gchar           *label);
+
 gboolean               hd_notification_manager_get_capabilities      (HDNotificationManager *nm, 
                                                                       gchar               ***caps);
 
@@ -103,6 +127,9 @@ gboolean               hd_notification_manager_get_server_info       (HDNotifica
 gboolean               hd_notification_manager_close_notification    (HDNotificationManager *nm,
                                                                       guint id, 
                                                                       GError **error);
+gboolean               hd_notification_manager_close_notifications   (HDNotificationManager *nm,
+                                                                      GArray                *ids,
+                                                                      GError               **error);
 
 void                   hd_notification_manager_close_all             (HDNotificationManager *nm);
 
@@ -118,6 +145,13 @@ void                   hd_notification_manager_call_dbus_callback_with_arg (HDNo
 void                   hd_notification_manager_call_message          (HDNotificationManager *nm,
                                                                       DBusMessage           *message);
 
+void                   hd_notification_manager_invoke                (HDNotificationManager *nm,
+                                                                      GSourceFunc            func,
+                                                                      gpointer               data,
+                                                                      GDestroyNotify         notify);
+
+GHashTable            *hd_notification_manager_ref_snapshot          (HDNotificationManager *nm);
+
 G_END_DECLS
 
 #endif /* __HD_NOTIFICATION_MANAGER_H__ */
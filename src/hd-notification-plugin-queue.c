@@ -0,0 +1,998 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gdk/gdk.h>
+
+#include "hd-notification-plugin-queue.h"
+#include "hd-metrics.h"
+
+/* Notifications waiting for one plugin at most */
+#define MAX_QUEUED      32
+
+/* A plugin busy with one notification for longer is considered hung */
+#ifndef COMPILE_FOR_TEST
+#define HUNG_TIMEOUT_US (5 * G_USEC_PER_SEC)
+#else
+#define HUNG_TIMEOUT_US (G_USEC_PER_SEC / 2)
+#endif
+
+struct _HDNotificationPluginQueue
+{
+  /* One reference for the owner and one for each queued job and
+   * running call, so a hung thread never blocks freeing the queue */
+  volatile gint         ref_count;
+
+  HDNotificationPlugin *plugin;
+
+  /* Only for plugins declaring "thread-safe", the others are called
+   * from @pending in the main loop */
+  GThreadPool          *pool;
+  GQueue                pending;
+  guint                 idle_id;
+
+  volatile gint         n_queued;
+  volatile gint         cancelled;
+
+  /* Start of the running call, 0 if none */
+  GMutex                mutex;
+  gint64                busy_since;
+
+  /* Main thread only */
+  gboolean              hung;
+  /* Notifications copied for the thread, to their "closed" handler */
+  GHashTable           *watched;
+
+  /* Thread only. The copies handed to the plugin for each notification,
+   * which get "closed" once it closes */
+  GHashTable           *copies;
+};
+
+/* A job for the thread of a "thread-safe" plugin */
+typedef struct
+{
+  /* Only a key for @copies, the thread never reads it */
+  HDNotification *notification;
+
+  /* The copy to notify, or %NULL if @notification is gone */
+  HDNotification *copy;
+  gboolean        closed;
+} Job;
+
+static gboolean
+unref_idle (gpointer object)
+{
+  g_object_unref (object);
+
+  return FALSE;
+}
+
+/* Objects are released in the main thread as they may be connected
+ * to widgets there */
+static void
+unref_in_main_thread (gpointer object)
+{
+  gdk_threads_add_idle (unref_idle, object);
+}
+
+static void
+copies_free (GSList *copies)
+{
+  g_slist_free_full (copies, unref_in_main_thread);
+}
+
+static void
+queue_unref (HDNotificationPluginQueue *queue)
+{
+  if (!g_atomic_int_dec_and_test (&queue->ref_count))
+    return;
+
+  unref_in_main_thread (queue->plugin);
+  if (queue->copies)
+    g_hash_table_destroy (queue->copies);
+  g_mutex_clear (&queue->mutex);
+
+  g_slice_free (HDNotificationPluginQueue, queue);
+}
+
+static void
+set_busy (HDNotificationPluginQueue *queue,
+          gboolean                   busy)
+{
+  g_mutex_lock (&queue->mutex);
+  queue->busy_since = busy ? g_get_monotonic_time () : 0;
+  g_mutex_unlock (&queue->mutex);
+}
+
+static void
+notify_in_thread (Job                       *job,
+                  HDNotificationPluginQueue *queue)
+{
+  gboolean cancelled = g_atomic_int_get (&queue->cancelled);
+  GSList *copies, *c;
+
+  copies = g_hash_table_lookup (queue->copies, job->notification);
+  g_hash_table_steal (queue->copies, job->notification);
+
+  if (job->copy)
+    {
+      g_atomic_int_add (&queue->n_queued, -1);
+
+      if (!cancelled)
+        {
+          set_busy (queue, TRUE);
+          hd_notification_plugin_notify (queue->plugin, job->copy);
+          set_busy (queue, FALSE);
+        }
+
+      /* Kept until the notification closes, for the handlers the
+       * plugin may have connected to it */
+      g_hash_table_insert (queue->copies,
+                           job->notification,
+                           g_slist_prepend (copies, job->copy));
+    }
+  else
+    {
+      if (job->closed && !cancelled)
+        {
+          set_busy (queue, TRUE);
+          for (c = copies; c; c = c->next)
+            hd_notification_closed (c->data);
+          set_busy (queue, FALSE);
+        }
+
+      copies_free (copies);
+    }
+
+  g_slice_free (Job, job);
+  queue_unref (queue);
+}
+
+static void
+push_job (HDNotificationPluginQueue *queue,
+          HDNotification            *notification,
+          HDNotification            *copy,
+          gboolean                   closed)
+{
+  Job *job = g_slice_new (Job);
+  GError *error = NULL;
+
+  job->notification = notification;
+  job->copy = copy;
+  job->closed = closed;
+
+  g_atomic_int_inc (&queue->ref_count);
+
+  g_thread_pool_push (queue->pool, job, &error);
+  if (error)
+    {
+      g_debug ("%s. Error: %s", __FUNCTION__, error->message);
+      g_error_free (error);
+    }
+}
+
+static void notification_finalized (HDNotificationPluginQueue *queue,
+                                    GObject                   *where_the_object_was);
+
+static void
+unwatch (HDNotificationPluginQueue *queue,
+         HDNotification            *notification,
+         gulong                     handler_id)
+{
+  g_signal_handler_disconnect (notification, handler_id);
+  g_object_weak_unref (G_OBJECT (notification),
+                       (GWeakNotify) notification_finalized,
+                       queue);
+}
+
+/* The close follows the notify calls queued before it */
+static void
+notification_closed (HDNotification            *notification,
+                     HDNotificationPluginQueue *queue)
+{
+  unwatch (queue,
+           notification,
+           GPOINTER_TO_SIZE (g_hash_table_lookup (queue->watched, notification)));
+  g_hash_table_remove (queue->watched, notification);
+
+  push_job (queue, notification, NULL, TRUE);
+}
+
+/* Dropped without being closed, the copies are only released */
+static void
+notification_finalized (HDNotificationPluginQueue *queue,
+                        GObject                   *where_the_object_was)
+{
+  g_hash_table_remove (queue->watched, where_the_object_was);
+
+  push_job (queue, (HDNotification *) where_the_object_was, NULL, FALSE);
+}
+
+static void
+watch (HDNotificationPluginQueue *queue,
+       HDNotification            *notification)
+{
+  gulong handler_id;
+
+  if (g_hash_table_lookup (queue->watched, notification))
+    return;
+
+  handler_id = g_signal_connect (notification, "closed",
+                                 G_CALLBACK (notification_closed), queue);
+  g_object_weak_ref (G_OBJECT (notification),
+                     (GWeakNotify) notification_finalized,
+                     queue);
+
+  g_hash_table_insert (queue->watched,
+                       notification,
+                       GSIZE_TO_POINTER (handler_id));
+}
+
+/* One notification per main loop iteration, so the windows are
+ * updated between the calls */
+static gboolean
+notify_idle (gpointer data)
+{
+  HDNotificationPluginQueue *queue = data;
+  HDNotification *notification;
+  gboolean cancelled;
+
+  notification = g_queue_pop_head (&queue->pending);
+  queue->n_queued--;
+
+  /* The plugin may run a main loop of its own, e.g. for a dialog,
+   * and free the queue or get more notifications meanwhile */
+  g_atomic_int_inc (&queue->ref_count);
+
+  set_busy (queue, TRUE);
+  hd_notification_plugin_notify (queue->plugin, notification);
+  set_busy (queue, FALSE);
+  g_object_unref (notification);
+
+  cancelled = g_atomic_int_get (&queue->cancelled);
+  queue_unref (queue);
+
+  if (cancelled)
+    return FALSE;
+
+  if (g_queue_is_empty (&queue->pending))
+    {
+      queue->idle_id = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+plugin_is_thread_safe (HDNotificationPlugin *plugin)
+{
+  GParamSpec *pspec;
+  gboolean thread_safe = FALSE;
+
+  pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (plugin),
+                                        "thread-safe");
+  if (pspec &&
+      pspec->value_type == G_TYPE_BOOLEAN &&
+      (pspec->flags & G_PARAM_READABLE))
+    g_object_get (plugin, "thread-safe", &thread_safe, NULL);
+
+  return thread_safe;
+}
+
+static void
+copy_hint (gchar      *key,
+           GValue     *value,
+           GHashTable *hints)
+{
+  GValue *value_copy = g_new0 (GValue, 1);
+
+  g_value_init (value_copy, G_VALUE_TYPE (value));
+  g_value_copy (value, value_copy);
+
+  g_hash_table_insert (hints, g_strdup (key), value_copy);
+}
+
+static void
+hint_value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_free (value);
+}
+
+/* A copy the main thread does not change while the plugin reads it */
+static HDNotification *
+notification_snapshot (HDNotification *notification)
+{
+  GHashTable *hints;
+  gchar **actions;
+  gint timeout = -1;
+
+  hints = g_hash_table_new_full (g_str_hash,
+                                 g_str_equal,
+                                 (GDestroyNotify) g_free,
+                                 (GDestroyNotify) hint_value_free);
+  if (hd_notification_get_hints (notification))
+    g_hash_table_foreach (hd_notification_get_hints (notification),
+                          (GHFunc) copy_hint,
+                          hints);
+
+  actions = g_strdupv (hd_notification_get_actions (notification));
+  g_object_get (notification, "timeout", &timeout, NULL);
+
+  return hd_notification_new (hd_notification_get_id (notification),
+                              hd_notification_get_icon (notification),
+                              hd_notification_get_summary (notification),
+                              hd_notification_get_body (notification),
+                              actions,
+                              hints,
+                              timeout,
+                              hd_notification_get_sender (notification));
+}
+
+HDNotificationPluginQueue *
+hd_notification_plugin_queue_new (HDNotificationPlugin *plugin)
+{
+  HDNotificationPluginQueue *queue;
+  GError *error = NULL;
+
+  queue = g_slice_new0 (HDNotificationPluginQueue);
+
+  queue->ref_count = 1;
+  queue->plugin = g_object_ref (plugin);
+  g_queue_init (&queue->pending);
+  g_mutex_init (&queue->mutex);
+
+  if (!plugin_is_thread_safe (plugin))
+    return queue;
+
+  queue->watched = g_hash_table_new (NULL, NULL);
+  queue->copies = g_hash_table_new_full (NULL,
+                                         NULL,
+                                         NULL,
+                                         (GDestroyNotify) copies_free);
+
+  queue->pool = g_thread_pool_new ((GFunc) notify_in_thread,
+                                   queue,
+                                   1,
+                                   FALSE,
+                                   &error);
+  if (error)
+    {
+      g_warning ("%s. Could not create thread for plugin %s, calling it in the main loop. %s",
+                 __FUNCTION__,
+                 G_OBJECT_TYPE_NAME (plugin),
+                 error->message);
+      g_error_free (error);
+    }
+
+  return queue;
+}
+
+/* Returns immediately, notifications still waiting are dropped and
+ * a running call is left to finish on its own */
+void
+hd_notification_plugin_queue_free (HDNotificationPluginQueue *queue)
+{
+  if (!queue)
+    return;
+
+  g_atomic_int_set (&queue->cancelled, 1);
+
+  if (queue->watched)
+    {
+      GHashTableIter iter;
+      gpointer notification, handler_id;
+
+      g_hash_table_iter_init (&iter, queue->watched);
+      while (g_hash_table_iter_next (&iter, &notification, &handler_id))
+        unwatch (queue, notification, GPOINTER_TO_SIZE (handler_id));
+      g_hash_table_destroy (queue->watched);
+    }
+
+  if (queue->pool)
+    g_thread_pool_free (queue->pool, FALSE, FALSE);
+
+  if (queue->idle_id)
+    g_source_remove (queue->idle_id);
+  g_queue_foreach (&queue->pending, (GFunc) g_object_unref, NULL);
+  g_queue_clear (&queue->pending);
+
+  queue_unref (queue);
+}
+
+HDNotificationPlugin *
+hd_notification_plugin_queue_get_plugin (HDNotificationPluginQueue *queue)
+{
+  return queue->plugin;
+}
+
+/* Returns %FALSE if @notification was dropped */
+gboolean
+hd_notification_plugin_queue_notify (HDNotificationPluginQueue *queue,
+                                     HDNotification            *notification)
+{
+  gint64 busy_since;
+
+  g_mutex_lock (&queue->mutex);
+  busy_since = queue->busy_since;
+  g_mutex_unlock (&queue->mutex);
+
+  if (busy_since && g_get_monotonic_time () - busy_since > HUNG_TIMEOUT_US)
+    {
+      if (!queue->hung)
+        g_warning ("%s. Plugin %s did not return in %d ms, dropping notifications.",
+                   __FUNCTION__,
+                   G_OBJECT_TYPE_NAME (queue->plugin),
+                   (gint) (HUNG_TIMEOUT_US / 1000));
+      queue->hung = TRUE;
+
+      hd_metrics_add (HD_METRICS_PLUGIN_NOTIFICATIONS_DROPPED, 1);
+      return FALSE;
+    }
+  queue->hung = FALSE;
+
+  if (g_atomic_int_get (&queue->n_queued) >= MAX_QUEUED)
+    {
+      g_debug ("%s. Plugin %s is behind, dropping notification.",
+               __FUNCTION__,
+               G_OBJECT_TYPE_NAME (queue->plugin));
+
+      hd_metrics_add (HD_METRICS_PLUGIN_NOTIFICATIONS_DROPPED, 1);
+      return FALSE;
+    }
+
+  g_atomic_int_inc (&queue->n_queued);
+
+  if (!queue->pool)
+    {
+      g_queue_push_tail (&queue->pending, g_object_ref (notification));
+
+      if (!queue->idle_id)
+        queue->idle_id = gdk_threads_add_idle (notify_idle, queue);
+
+      return TRUE;
+    }
+
+  watch (queue, notification);
+  push_job (queue, notification, notification_snapshot (notification), FALSE);
+
+  /* Closed before it was queued, as on a replay */
+  if (hd_notification_is_closed (notification))
+    notification_closed (notification, queue);
+
+  return TRUE;
+}
+
+#ifdef COMPILE_FOR_TEST
+/* A plugin which records the calls and the closes, takes @delay_us
+ * for each call and blocks while @blocked is set, running a main loop
+ * of its own if called in the main loop */
+typedef struct
+{
+  GObject         parent;
+
+  gboolean        thread_safe;
+
+  GMutex          mutex;
+  GCond           cond;
+  gboolean        blocked;
+  gint64          delay_us;
+  guint           n_calls;
+  guint           n_closed;
+  GThread        *thread;
+  GThread        *closed_thread;
+  HDNotification *last;
+} TestPlugin;
+
+typedef struct
+{
+  GObjectClass parent;
+} TestPluginClass;
+
+enum
+{
+  PROP_0,
+  PROP_THREAD_SAFE
+};
+
+GType test_plugin_get_type (void);
+
+static void test_plugin_iface_init (HDNotificationPluginIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (TestPlugin, test_plugin, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (HD_TYPE_NOTIFICATION_PLUGIN,
+                                                test_plugin_iface_init));
+
+static void
+test_plugin_closed (HDNotification *notification,
+                    TestPlugin     *test)
+{
+  g_mutex_lock (&test->mutex);
+  test->n_closed++;
+  test->closed_thread = g_thread_self ();
+  g_cond_broadcast (&test->cond);
+  g_mutex_unlock (&test->mutex);
+}
+
+static void
+test_plugin_notify (HDNotificationPlugin *plugin,
+                    HDNotification       *notification)
+{
+  TestPlugin *test = (TestPlugin *) plugin;
+
+  if (!g_signal_handler_find (notification,
+                              G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA,
+                              0, 0, NULL,
+                              test_plugin_closed, test))
+    g_signal_connect (notification, "closed",
+                      G_CALLBACK (test_plugin_closed), test);
+
+  g_mutex_lock (&test->mutex);
+  test->n_calls++;
+  test->thread = g_thread_self ();
+  if (test->last)
+    g_object_unref (test->last);
+  test->last = g_object_ref (notification);
+  g_cond_broadcast (&test->cond);
+
+  if (test->delay_us)
+    g_usleep (test->delay_us);
+
+  if (test->thread_safe)
+    while (test->blocked)
+      g_cond_wait (&test->cond, &test->mutex);
+  else
+    while (test->blocked)
+      {
+        g_mutex_unlock (&test->mutex);
+        g_main_context_iteration (NULL, TRUE);
+        g_mutex_lock (&test->mutex);
+      }
+  g_mutex_unlock (&test->mutex);
+}
+
+static void
+test_plugin_iface_init (HDNotificationPluginIface *iface)
+{
+  iface->notify = test_plugin_notify;
+}
+
+static void
+test_plugin_get_property (GObject    *object,
+                          guint       prop_id,
+                          GValue     *value,
+                          GParamSpec *pspec)
+{
+  g_value_set_boolean (value, ((TestPlugin *) object)->thread_safe);
+}
+
+static void
+test_plugin_set_property (GObject      *object,
+                          guint         prop_id,
+                          const GValue *value,
+                          GParamSpec   *pspec)
+{
+  ((TestPlugin *) object)->thread_safe = g_value_get_boolean (value);
+}
+
+static void
+test_plugin_finalize (GObject *object)
+{
+  TestPlugin *test = (TestPlugin *) object;
+
+  if (test->last)
+    g_object_unref (test->last);
+  g_mutex_clear (&test->mutex);
+  g_cond_clear (&test->cond);
+
+  G_OBJECT_CLASS (test_plugin_parent_class)->finalize (object);
+}
+
+static void
+test_plugin_class_init (TestPluginClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = test_plugin_get_property;
+  object_class->set_property = test_plugin_set_property;
+  object_class->finalize = test_plugin_finalize;
+
+  g_object_class_install_property (object_class,
+                                   PROP_THREAD_SAFE,
+                                   g_param_spec_boolean ("thread-safe",
+                                                         "Thread safe",
+                                                         "Whether to call the plugin in a thread",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY));
+}
+
+static void
+test_plugin_init (TestPlugin *test)
+{
+  g_mutex_init (&test->mutex);
+  g_cond_init (&test->cond);
+}
+
+static void
+test_plugin_set_blocked (TestPlugin *test,
+                         gboolean    blocked)
+{
+  g_mutex_lock (&test->mutex);
+  test->blocked = blocked;
+  g_cond_broadcast (&test->cond);
+  g_mutex_unlock (&test->mutex);
+}
+
+/* Waits until the plugin was called @n_calls times */
+static void
+test_plugin_wait (TestPlugin *test,
+                  guint       n_calls)
+{
+  gint64 end_time = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+
+  g_mutex_lock (&test->mutex);
+  while (test->n_calls < n_calls)
+    if (!g_cond_wait_until (&test->cond, &test->mutex, end_time))
+      g_error ("Plugin was called %u times, expected %u", test->n_calls, n_calls);
+  g_mutex_unlock (&test->mutex);
+}
+
+/* Waits until the plugin saw @n_closed closes */
+static void
+test_plugin_wait_closed (TestPlugin *test,
+                         guint       n_closed)
+{
+  gint64 end_time = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+
+  g_mutex_lock (&test->mutex);
+  while (test->n_closed < n_closed)
+    if (!g_cond_wait_until (&test->cond, &test->mutex, end_time))
+      g_error ("Plugin saw %u closes, expected %u", test->n_closed, n_closed);
+  g_mutex_unlock (&test->mutex);
+}
+
+/* Reads a counter of the linked hd-metrics */
+static gint
+test_counter (const gchar *name)
+{
+  GHashTable *metrics = hd_metrics_collect ();
+  gint value;
+
+  value = g_value_get_int (g_hash_table_lookup (metrics, name));
+  g_hash_table_destroy (metrics);
+
+  return value;
+}
+
+typedef struct
+{
+  TestPlugin                *plugin;
+  HDNotificationPluginQueue *queue;
+  HDNotification            *notification;
+} Fixture;
+
+static void
+fixture_setup (Fixture       *fixture,
+               gconstpointer  data)
+{
+  GHashTable *hints;
+  GValue *value;
+
+  fixture->plugin = g_object_new (test_plugin_get_type (),
+                                  "thread-safe", GPOINTER_TO_INT (data),
+                                  NULL);
+  fixture->queue = hd_notification_plugin_queue_new (HD_NOTIFICATION_PLUGIN (fixture->plugin));
+
+  hints = g_hash_table_new_full (g_str_hash,
+                                 g_str_equal,
+                                 (GDestroyNotify) g_free,
+                                 (GDestroyNotify) hint_value_free);
+  value = g_new0 (GValue, 1);
+  g_value_init (value, G_TYPE_STRING);
+  g_value_set_string (value, "email-message");
+  g_hash_table_insert (hints, g_strdup ("category"), value);
+
+  fixture->notification = hd_notification_new (1,
+                                               "icon",
+                                               "summary",
+                                               "body",
+                                               NULL,
+                                               hints,
+                                               -1,
+                                               "test");
+}
+
+/* Lets the idles of the queue run */
+static void
+iterate_main_loop (void)
+{
+  while (g_main_context_iteration (NULL, FALSE));
+}
+
+static void
+fixture_teardown (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  gpointer plugin = fixture->plugin;
+
+  g_object_add_weak_pointer (plugin, &plugin);
+
+  hd_notification_plugin_queue_free (fixture->queue);
+  test_plugin_set_blocked (fixture->plugin, FALSE);
+  g_object_unref (fixture->plugin);
+  g_object_unref (fixture->notification);
+
+  /* The queue releases the plugin once its thread is done */
+  while (plugin)
+    {
+      iterate_main_loop ();
+      g_usleep (1000);
+    }
+}
+
+/* Plugins without "thread-safe" are called in the main loop, never
+ * from notify */
+static void
+test_main_loop (Fixture       *fixture,
+                gconstpointer  data)
+{
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  g_assert_cmpuint (fixture->plugin->n_calls, ==, 0);
+
+  iterate_main_loop ();
+  g_assert_cmpuint (fixture->plugin->n_calls, ==, 2);
+  g_assert (fixture->plugin->thread == g_thread_self ());
+  g_assert (fixture->plugin->last == fixture->notification);
+}
+
+/* Thread-safe plugins are called in their thread with a copy */
+static void
+test_thread (Fixture       *fixture,
+             gconstpointer  data)
+{
+  HDNotification *last;
+
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  test_plugin_wait (fixture->plugin, 1);
+
+  g_mutex_lock (&fixture->plugin->mutex);
+  last = fixture->plugin->last;
+  g_assert (fixture->plugin->thread != g_thread_self ());
+  g_assert (last != fixture->notification);
+  g_assert_cmpuint (hd_notification_get_id (last), ==, 1);
+  g_assert_cmpstr (hd_notification_get_summary (last), ==, "summary");
+  g_assert_cmpstr (hd_notification_get_category (last), ==, "email-message");
+  g_assert_cmpstr (hd_notification_get_sender (last), ==, "test");
+  g_mutex_unlock (&fixture->plugin->mutex);
+}
+
+/* A plugin blocked in a call gets at most MAX_QUEUED more */
+static void
+test_backlog (Fixture       *fixture,
+              gconstpointer  data)
+{
+  guint i;
+
+  test_plugin_set_blocked (fixture->plugin, TRUE);
+
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  test_plugin_wait (fixture->plugin, 1);
+
+  for (i = 0; i < MAX_QUEUED; i++)
+    g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                   fixture->notification));
+  g_assert (!hd_notification_plugin_queue_notify (fixture->queue,
+                                                  fixture->notification));
+
+  test_plugin_set_blocked (fixture->plugin, FALSE);
+  test_plugin_wait (fixture->plugin, MAX_QUEUED + 1);
+}
+
+/* A hung plugin gets no notifications, and neither does it keep the
+ * queue from being freed */
+static void
+test_hung (Fixture       *fixture,
+           gconstpointer  data)
+{
+  gint64 start;
+
+  test_plugin_set_blocked (fixture->plugin, TRUE);
+
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  test_plugin_wait (fixture->plugin, 1);
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+
+  g_usleep (HUNG_TIMEOUT_US + G_USEC_PER_SEC / 10);
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*did not return*");
+  g_assert (!hd_notification_plugin_queue_notify (fixture->queue,
+                                                  fixture->notification));
+  g_test_assert_expected_messages ();
+
+  /* Warned only once */
+  g_assert (!hd_notification_plugin_queue_notify (fixture->queue,
+                                                  fixture->notification));
+  g_assert (fixture->queue->hung);
+
+  /* Freeing the queue does not wait for the call and the queued
+   * notification is skipped */
+  start = g_get_monotonic_time ();
+  hd_notification_plugin_queue_free (fixture->queue);
+  fixture->queue = NULL;
+  g_assert_cmpint (g_get_monotonic_time () - start, <, G_USEC_PER_SEC / 10);
+
+  test_plugin_set_blocked (fixture->plugin, FALSE);
+  g_usleep (G_USEC_PER_SEC / 10);
+  g_assert_cmpuint (fixture->plugin->n_calls, ==, 1);
+}
+
+/* A plugin called in the main loop that runs a main loop of its own
+ * counts as hung too, and the queue may be freed meanwhile */
+static gboolean
+nested_hung_cb (gpointer data)
+{
+  Fixture *fixture = data;
+
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*did not return*");
+  g_assert (!hd_notification_plugin_queue_notify (fixture->queue,
+                                                  fixture->notification));
+  g_test_assert_expected_messages ();
+
+  hd_notification_plugin_queue_free (fixture->queue);
+  fixture->queue = NULL;
+
+  test_plugin_set_blocked (fixture->plugin, FALSE);
+
+  return FALSE;
+}
+
+static void
+test_nested_hung (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  test_plugin_set_blocked (fixture->plugin, TRUE);
+
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+
+  g_timeout_add ((HUNG_TIMEOUT_US + G_USEC_PER_SEC / 10) / 1000,
+                 nested_hung_cb,
+                 fixture);
+  iterate_main_loop ();
+
+  /* The second one was dropped with the queue */
+  g_assert (!fixture->queue);
+  g_assert_cmpuint (fixture->plugin->n_calls, ==, 1);
+}
+
+/* Each copy the plugin got emits "closed" in its thread, after the
+ * calls queued before the close */
+static void
+test_closed (Fixture       *fixture,
+             gconstpointer  data)
+{
+  test_plugin_set_blocked (fixture->plugin, TRUE);
+
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  test_plugin_wait (fixture->plugin, 1);
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  hd_notification_closed (fixture->notification);
+
+  g_usleep (G_USEC_PER_SEC / 10);
+  g_assert_cmpuint (fixture->plugin->n_closed, ==, 0);
+
+  test_plugin_set_blocked (fixture->plugin, FALSE);
+  test_plugin_wait_closed (fixture->plugin, 2);
+
+  g_mutex_lock (&fixture->plugin->mutex);
+  g_assert_cmpuint (fixture->plugin->n_calls, ==, 2);
+  g_assert (fixture->plugin->closed_thread == fixture->plugin->thread);
+  g_assert (fixture->plugin->closed_thread != g_thread_self ());
+  g_mutex_unlock (&fixture->plugin->mutex);
+
+  /* A notification queued once it was closed gets closed right away */
+  g_assert (hd_notification_plugin_queue_notify (fixture->queue,
+                                                 fixture->notification));
+  test_plugin_wait_closed (fixture->plugin, 3);
+  g_assert_cmpuint (fixture->plugin->n_calls, ==, 3);
+}
+
+/* A flood of notifications to a slow plugin never blocks the caller,
+ * is dropped beyond MAX_QUEUED and counted */
+static void
+test_flood (Fixture       *fixture,
+            gconstpointer  data)
+{
+  gint dropped;
+  guint i, n_accepted = 0;
+  gint64 start, longest = 0;
+
+  fixture->plugin->delay_us = G_USEC_PER_SEC / 100;
+  dropped = test_counter ("plugin-notifications-dropped");
+
+  for (i = 0; i < 500; i++)
+    {
+      start = g_get_monotonic_time ();
+      if (hd_notification_plugin_queue_notify (fixture->queue,
+                                               fixture->notification))
+        n_accepted++;
+      longest = MAX (longest, g_get_monotonic_time () - start);
+    }
+
+  g_assert_cmpint (longest, <, fixture->plugin->delay_us);
+  g_assert_cmpuint (n_accepted, >=, MAX_QUEUED);
+  g_assert_cmpuint (n_accepted, <, 500);
+  g_assert_cmpint (test_counter ("plugin-notifications-dropped") - dropped,
+                   ==,
+                   500 - n_accepted);
+
+  /* Nothing is called in the main loop before it runs */
+  if (!data)
+    {
+      g_assert_cmpuint (n_accepted, ==, MAX_QUEUED);
+      g_assert_cmpuint (fixture->plugin->n_calls, ==, 0);
+      iterate_main_loop ();
+    }
+
+  test_plugin_wait (fixture->plugin, n_accepted);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/notification-plugin-queue/main-loop", Fixture, GINT_TO_POINTER (FALSE),
+              fixture_setup, test_main_loop, fixture_teardown);
+  g_test_add ("/notification-plugin-queue/thread", Fixture, GINT_TO_POINTER (TRUE),
+              fixture_setup, test_thread, fixture_teardown);
+  g_test_add ("/notification-plugin-queue/backlog", Fixture, GINT_TO_POINTER (TRUE),
+              fixture_setup, test_backlog, fixture_teardown);
+  g_test_add ("/notification-plugin-queue/hung", Fixture, GINT_TO_POINTER (TRUE),
+              fixture_setup, test_hung, fixture_teardown);
+  g_test_add ("/notification-plugin-queue/nested-hung", Fixture, GINT_TO_POINTER (FALSE),
+              fixture_setup, test_nested_hung, fixture_teardown);
+  g_test_add ("/notification-plugin-queue/closed", Fixture, GINT_TO_POINTER (TRUE),
+              fixture_setup, test_closed, fixture_teardown);
+  g_test_add ("/notification-plugin-queue/flood", Fixture, GINT_TO_POINTER (TRUE),
+              fixture_setup, test_flood, fixture_teardown);
+  g_test_add ("/notification-plugin-queue/flood-main-loop", Fixture, GINT_TO_POINTER (FALSE),
+              fixture_setup, test_flood, fixture_teardown);
+
+  return g_test_run ();
+}
+
+#endif
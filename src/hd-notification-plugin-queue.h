@@ -0,0 +1,66 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_NOTIFICATION_PLUGIN_QUEUE_H__
+#define __HD_NOTIFICATION_PLUGIN_QUEUE_H__
+
+#include <glib.h>
+
+#include <libhildondesktop/libhildondesktop.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HDNotificationPluginQueue HDNotificationPluginQueue;
+
+/** HDNotificationPluginQueue:
+ *
+ * Calls hd_notification_plugin_notify () of @plugin in the order the
+ * notifications were queued, so a slow plugin does not delay the
+ * windows.  Notifications are dropped while the plugin has too many of
+ * them waiting.
+ *
+ * By default the plugin is called from an idle in the main loop, with
+ * the GDK lock held, as plugins always have been.
+ *
+ * A plugin with a readable boolean "thread-safe" property set to %TRUE
+ * is instead called in a thread of its own, without the GDK lock, and
+ * must use gdk_threads_add_idle () for widgets, GConf and D-Bus proxies
+ * of the default main context.  It gets a copy of the notification that
+ * is not changed by later updates.  Once the notification closes, each
+ * copy it got emits "closed" in that thread, after the calls queued
+ * before.
+ *
+ * Notifications are also dropped while the plugin has been stuck in a
+ * call for too long, which a plugin called in the main loop can only be
+ * if it runs a main loop of its own.
+ */
+HDNotificationPluginQueue *hd_notification_plugin_queue_new        (HDNotificationPlugin      *plugin);
+void                       hd_notification_plugin_queue_free       (HDNotificationPluginQueue *queue);
+
+HDNotificationPlugin      *hd_notification_plugin_queue_get_plugin (HDNotificationPluginQueue *queue);
+
+gboolean                   hd_notification_plugin_queue_notify     (HDNotificationPluginQueue *queue,
+                                                                    HDNotification            *notification);
+
+G_END_DECLS
+
+#endif
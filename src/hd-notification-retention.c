@@ -0,0 +1,528 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "hd-notification-retention.h"
+
+#define RETENTION_GROUP_PREFIX  HD_NOTIFICATION_RETENTION_GROUP " "
+#define RETENTION_KEY_MAX_AGE   "Max-Age"
+#define RETENTION_KEY_MAX_COUNT "Max-Count"
+#define RETENTION_KEY_MAX_SIZE  "Max-Size"
+
+/* Limits on the persistent notifications of a category,
+ * 0 for no limit. */
+typedef struct
+{
+  gint64 max_age;   /* seconds */
+  guint  max_count;
+} RetentionRule;
+
+/* @rule applies to the categories not in @category_rules and
+ * @max_db_size (bytes, 0 for no limit) to the whole database. */
+struct _HDNotificationRetention
+{
+  RetentionRule  rule;
+  GHashTable    *category_rules;
+  gint64         max_db_size;
+};
+
+static void
+load_rule (GKeyFile      *key_file,
+           const gchar   *group,
+           RetentionRule *rule)
+{
+  /* Max-Age is in days */
+  if (g_key_file_has_key (key_file, group, RETENTION_KEY_MAX_AGE, NULL))
+    rule->max_age = MAX (g_key_file_get_integer (key_file,
+                                                 group,
+                                                 RETENTION_KEY_MAX_AGE,
+                                                 NULL), 0) * 24 * 60 * 60;
+
+  if (g_key_file_has_key (key_file, group, RETENTION_KEY_MAX_COUNT, NULL))
+    rule->max_count = MAX (g_key_file_get_integer (key_file,
+                                                   group,
+                                                   RETENTION_KEY_MAX_COUNT,
+                                                   NULL), 0);
+}
+
+/* Reads the [Retention] and "[Retention <category>]" groups of
+ * @key_file, which can be %NULL.  Nothing is limited by default,
+ * categories inherit what they do not set from [Retention]. */
+HDNotificationRetention *
+hd_notification_retention_new_from_key_file (GKeyFile *key_file)
+{
+  HDNotificationRetention *retention = g_slice_new0 (HDNotificationRetention);
+  gchar **groups;
+  guint i;
+
+  retention->category_rules = g_hash_table_new_full (g_str_hash,
+                                                     g_str_equal,
+                                                     g_free,
+                                                     g_free);
+
+  if (!key_file)
+    return retention;
+
+  load_rule (key_file, HD_NOTIFICATION_RETENTION_GROUP, &retention->rule);
+
+  if (g_key_file_has_key (key_file,
+                          HD_NOTIFICATION_RETENTION_GROUP,
+                          RETENTION_KEY_MAX_SIZE,
+                          NULL))
+    retention->max_db_size = MAX (g_key_file_get_integer (key_file,
+                                                          HD_NOTIFICATION_RETENTION_GROUP,
+                                                          RETENTION_KEY_MAX_SIZE,
+                                                          NULL), 0) * (gint64) 1024;
+
+  groups = g_key_file_get_groups (key_file, NULL);
+  for (i = 0; groups && groups[i]; i++)
+    {
+      RetentionRule *rule;
+
+      if (!g_str_has_prefix (groups[i], RETENTION_GROUP_PREFIX))
+        continue;
+
+      rule = g_memdup (&retention->rule, sizeof (RetentionRule));
+      load_rule (key_file, groups[i], rule);
+      g_hash_table_insert (retention->category_rules,
+                           g_strdup (groups[i] + strlen (RETENTION_GROUP_PREFIX)),
+                           rule);
+    }
+  g_strfreev (groups);
+
+  return retention;
+}
+
+void
+hd_notification_retention_free (HDNotificationRetention *retention)
+{
+  if (!retention)
+    return;
+
+  g_hash_table_destroy (retention->category_rules);
+  g_slice_free (HDNotificationRetention, retention);
+}
+
+static const RetentionRule *
+get_rule (HDNotificationRetention *retention,
+          const gchar             *category)
+{
+  const RetentionRule *rule = NULL;
+
+  if (category)
+    rule = g_hash_table_lookup (retention->category_rules, category);
+
+  return rule ? rule : &retention->rule;
+}
+
+static gint64
+get_int (sqlite3     *db,
+         const gchar *sql)
+{
+  sqlite3_stmt *stmt;
+  gint64 result = 0;
+
+  if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return 0;
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    result = sqlite3_column_int64 (stmt, 0);
+
+  sqlite3_finalize (stmt);
+
+  return result;
+}
+
+/* Returns the IDs (guint) of the notifications in @db which are too
+ * old or too many for their category at @now, then of the oldest ones
+ * if the database is larger than allowed. */
+GArray *
+hd_notification_retention_select (HDNotificationRetention *retention,
+                                  sqlite3                 *db,
+                                  time_t                   now)
+{
+  sqlite3_stmt *select;
+  GHashTable *counts;
+  GArray *kept, *pruned;
+  gint64 size, n_rows;
+  guint i;
+
+  pruned = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  /* Newest first */
+  if (sqlite3_prepare_v2 (db,
+                          "SELECT n.id, c.value, CAST (t.value AS INTEGER) "
+                          "FROM notifications n "
+                          "LEFT JOIN hints c ON c.nid = n.id AND c.id = 'category' "
+                          "LEFT JOIN hints t ON t.nid = n.id AND t.id = 'time' "
+                          "ORDER BY CAST (t.value AS INTEGER) DESC, n.id DESC",
+                          -1, &select, NULL) != SQLITE_OK)
+    {
+      g_warning ("%s. Unable to prepare the query: %s",
+                 __FUNCTION__,
+                 sqlite3_errmsg (db));
+      return pruned;
+    }
+
+  counts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  kept = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  while (sqlite3_step (select) == SQLITE_ROW)
+    {
+      guint id = sqlite3_column_int (select, 0);
+      const gchar *category = (const gchar *) sqlite3_column_text (select, 1);
+      const RetentionRule *rule;
+      guint count;
+
+      rule = get_rule (retention, category);
+
+      category = category ? category : "";
+      count = GPOINTER_TO_UINT (g_hash_table_lookup (counts, category)) + 1;
+      g_hash_table_insert (counts, g_strdup (category), GUINT_TO_POINTER (count));
+
+      if ((rule->max_count && count > rule->max_count) ||
+          (rule->max_age && sqlite3_column_type (select, 2) != SQLITE_NULL &&
+           now - sqlite3_column_int64 (select, 2) > rule->max_age))
+        g_array_append_val (pruned, id);
+      else
+        g_array_append_val (kept, id);
+    }
+  sqlite3_finalize (select);
+
+  /* Estimate how many rows fit by the average row size and drop
+   * the oldest of those left over */
+  n_rows = kept->len + pruned->len;
+  if (retention->max_db_size && n_rows)
+    {
+      size = (get_int (db, "PRAGMA page_count") -
+              get_int (db, "PRAGMA freelist_count")) *
+             get_int (db, "PRAGMA page_size");
+
+      if (size > retention->max_db_size)
+        {
+          guint max_rows = n_rows * retention->max_db_size / size;
+
+          for (i = max_rows; i < kept->len; i++)
+            g_array_append_val (pruned, g_array_index (kept, guint, i));
+        }
+    }
+
+  g_array_free (kept, TRUE);
+  g_hash_table_destroy (counts);
+
+  return pruned;
+}
+
+#ifdef COMPILE_FOR_TEST
+#include <glib/gstdio.h>
+
+#define TEST_ROWS 100000
+#define TEST_NOW  1234567890
+#define DAY       (24 * 60 * 60)
+
+typedef struct
+{
+  gchar   *dir;
+  gchar   *path;
+  sqlite3 *db;
+} Fixture;
+
+/* The tables of hd_notification_manager_db_create() the selection
+ * reads.  Notification i is i minutes old, every third one is an
+ * "im.received" and the others have no category. */
+static void
+fixture_setup (Fixture       *fixture,
+               gconstpointer  data)
+{
+  sqlite3_stmt *notification, *hint;
+  guint i;
+
+  fixture->dir = g_dir_make_tmp ("test-retention-XXXXXX", NULL);
+  g_assert (fixture->dir);
+  fixture->path = g_build_filename (fixture->dir, "notifications.db", NULL);
+
+  g_assert_cmpint (sqlite3_open (fixture->path, &fixture->db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_exec (fixture->db,
+                                 "CREATE TABLE notifications (\n"
+                                 "    id        INTEGER PRIMARY KEY,\n"
+                                 "    app_name  VARCHAR(30)  NOT NULL,\n"
+                                 "    icon_name VARCHAR(50)  NOT NULL,\n"
+                                 "    summary   VARCHAR(100) NOT NULL,\n"
+                                 "    body      VARCHAR(100) NOT NULL,\n"
+                                 "    timeout   INTEGER DEFAULT 0,\n"
+                                 "    dest      VARCHAR(100) NOT NULL\n"
+                                 ");"
+                                 "CREATE TABLE hints (\n"
+                                 "    id        VARCHAR(50),\n"
+                                 "    type      INTEGER,\n"
+                                 "    value     VARCHAR(200) NOT NULL,\n"
+                                 "    nid       INTEGER,\n"
+                                 "    PRIMARY KEY (id, nid)\n"
+                                 ");"
+                                 "BEGIN",
+                                 NULL, NULL, NULL), ==, SQLITE_OK);
+
+  sqlite3_prepare_v2 (fixture->db,
+                      "INSERT INTO notifications "
+                      "VALUES (?1, 'app', 'icon', 'Summary', 'Body', 0, '')",
+                      -1, &notification, NULL);
+  sqlite3_prepare_v2 (fixture->db,
+                      "INSERT INTO hints VALUES (?1, 0, ?2, ?3)",
+                      -1, &hint, NULL);
+
+  for (i = 1; i <= TEST_ROWS; i++)
+    {
+      sqlite3_bind_int (notification, 1, i);
+      g_assert_cmpint (sqlite3_step (notification), ==, SQLITE_DONE);
+      sqlite3_reset (notification);
+
+      sqlite3_bind_text (hint, 1, "time", -1, SQLITE_STATIC);
+      sqlite3_bind_int64 (hint, 2, TEST_NOW - i * 60);
+      sqlite3_bind_int (hint, 3, i);
+      g_assert_cmpint (sqlite3_step (hint), ==, SQLITE_DONE);
+      sqlite3_reset (hint);
+
+      if (i % 3)
+        continue;
+
+      sqlite3_bind_text (hint, 1, "category", -1, SQLITE_STATIC);
+      sqlite3_bind_text (hint, 2, "im.received", -1, SQLITE_STATIC);
+      sqlite3_bind_int (hint, 3, i);
+      g_assert_cmpint (sqlite3_step (hint), ==, SQLITE_DONE);
+      sqlite3_reset (hint);
+    }
+
+  sqlite3_finalize (notification);
+  sqlite3_finalize (hint);
+  g_assert_cmpint (sqlite3_exec (fixture->db, "COMMIT", NULL, NULL, NULL),
+                   ==, SQLITE_OK);
+}
+
+static void
+fixture_teardown (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  sqlite3_close (fixture->db);
+  g_unlink (fixture->path);
+  g_rmdir (fixture->dir);
+  g_free (fixture->path);
+  g_free (fixture->dir);
+}
+
+static HDNotificationRetention *
+retention_new_from_data (const gchar *data)
+{
+  HDNotificationRetention *retention;
+  GKeyFile *key_file = g_key_file_new ();
+
+  g_assert (g_key_file_load_from_data (key_file, data, -1, G_KEY_FILE_NONE, NULL));
+  retention = hd_notification_retention_new_from_key_file (key_file);
+  g_key_file_free (key_file);
+
+  return retention;
+}
+
+static gboolean
+contains (GArray *ids,
+          guint   id)
+{
+  guint i;
+
+  for (i = 0; i < ids->len; i++)
+    if (g_array_index (ids, guint, i) == id)
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Existing notifications must survive an upgrade however large the
+ * database is, the limits are opt-in. */
+static void
+test_default (Fixture       *fixture,
+              gconstpointer  data)
+{
+  HDNotificationRetention *retention;
+  GArray *pruned;
+
+  retention = hd_notification_retention_new_from_key_file (NULL);
+  pruned = hd_notification_retention_select (retention, fixture->db, TEST_NOW);
+  g_assert_cmpuint (pruned->len, ==, 0);
+  g_array_free (pruned, TRUE);
+  hd_notification_retention_free (retention);
+
+  retention = retention_new_from_data ("[Retention]\n");
+  pruned = hd_notification_retention_select (retention, fixture->db, TEST_NOW);
+  g_assert_cmpuint (pruned->len, ==, 0);
+  g_array_free (pruned, TRUE);
+  hd_notification_retention_free (retention);
+}
+
+static void
+test_max_count (Fixture       *fixture,
+                gconstpointer  data)
+{
+  HDNotificationRetention *retention;
+  GArray *pruned;
+
+  retention = retention_new_from_data ("[Retention]\n"
+                                       "Max-Count=1000\n"
+                                       "[Retention im.received]\n"
+                                       "Max-Count=500\n");
+  pruned = hd_notification_retention_select (retention, fixture->db, TEST_NOW);
+
+  /* The newest of each category are kept */
+  g_assert_cmpuint (pruned->len, ==, TEST_ROWS - 1000 - 500);
+  g_assert (!contains (pruned, 1));
+  g_assert (!contains (pruned, 1499));
+  g_assert (!contains (pruned, 1500));
+  g_assert (contains (pruned, 1501));
+  g_assert (contains (pruned, 1503));
+  g_assert (contains (pruned, 3003));
+
+  g_array_free (pruned, TRUE);
+  hd_notification_retention_free (retention);
+}
+
+static void
+test_max_age (Fixture       *fixture,
+              gconstpointer  data)
+{
+  HDNotificationRetention *retention;
+  GArray *pruned;
+  guint day = DAY / 60;
+
+  retention = retention_new_from_data ("[Retention]\n"
+                                       "Max-Age=30\n"
+                                       "[Retention im.received]\n"
+                                       "Max-Age=1\n");
+  pruned = hd_notification_retention_select (retention, fixture->db, TEST_NOW);
+
+  g_assert (!contains (pruned, day));
+  g_assert (!contains (pruned, day + 1));
+  g_assert (contains (pruned, 3 * (day / 3 + 1)));
+  g_assert (!contains (pruned, 30 * day - 1));
+  g_assert (contains (pruned, 30 * day + 1));
+  g_assert_cmpuint (pruned->len, ==,
+                    (TEST_ROWS - 30 * day) + (30 * day - day) / 3);
+
+  g_array_free (pruned, TRUE);
+  hd_notification_retention_free (retention);
+}
+
+static void
+test_max_size (Fixture       *fixture,
+               gconstpointer  data)
+{
+  HDNotificationRetention *retention;
+  GArray *pruned;
+  gint64 size;
+
+  size = get_int (fixture->db, "PRAGMA page_count") *
+         get_int (fixture->db, "PRAGMA page_size");
+
+  retention = retention_new_from_data ("[Retention]\n"
+                                       "Max-Size=256\n");
+  pruned = hd_notification_retention_select (retention, fixture->db, TEST_NOW);
+
+  /* The oldest go first, about in proportion to the size */
+  g_assert_cmpuint (pruned->len, >, 0);
+  g_assert (contains (pruned, TEST_ROWS));
+  g_assert (!contains (pruned, 1));
+  g_assert_cmpint (TEST_ROWS - pruned->len, <=,
+                   (gint64) TEST_ROWS * 256 * 1024 / size + 1);
+
+  g_array_free (pruned, TRUE);
+  hd_notification_retention_free (retention);
+}
+
+/* The selection runs on the main thread at startup. */
+static void
+test_select_performance (Fixture       *fixture,
+                         gconstpointer  data)
+{
+  HDNotificationRetention *retention;
+  GArray *pruned;
+  gdouble elapsed;
+
+  retention = retention_new_from_data ("[Retention]\n"
+                                       "Max-Age=30\n"
+                                       "Max-Count=1000\n"
+                                       "Max-Size=1024\n");
+
+  g_test_timer_start ();
+  pruned = hd_notification_retention_select (retention, fixture->db, TEST_NOW);
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_minimized_result (elapsed, "Selected %u of %u notifications in %f s",
+                           pruned->len, TEST_ROWS, elapsed);
+
+  g_array_free (pruned, TRUE);
+  hd_notification_retention_free (retention);
+}
+
+/* Converting an old database to incremental auto-vacuum, done once
+ * when hildon-home exits. */
+static void
+test_vacuum_performance (Fixture       *fixture,
+                         gconstpointer  data)
+{
+  gdouble elapsed;
+
+  g_test_timer_start ();
+  g_assert_cmpint (sqlite3_exec (fixture->db,
+                                 "PRAGMA auto_vacuum = INCREMENTAL; VACUUM",
+                                 NULL, NULL, NULL), ==, SQLITE_OK);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_cmpint (get_int (fixture->db, "PRAGMA auto_vacuum"), ==, 2);
+  g_test_minimized_result (elapsed, "Converted %u notifications in %f s",
+                           TEST_ROWS, elapsed);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/notification-retention/default", Fixture, NULL,
+              fixture_setup, test_default, fixture_teardown);
+  g_test_add ("/notification-retention/max-count", Fixture, NULL,
+              fixture_setup, test_max_count, fixture_teardown);
+  g_test_add ("/notification-retention/max-age", Fixture, NULL,
+              fixture_setup, test_max_age, fixture_teardown);
+  g_test_add ("/notification-retention/max-size", Fixture, NULL,
+              fixture_setup, test_max_size, fixture_teardown);
+  if (g_test_perf ())
+    {
+      g_test_add ("/notification-retention/select-performance", Fixture, NULL,
+                  fixture_setup, test_select_performance, fixture_teardown);
+      g_test_add ("/notification-retention/vacuum-performance", Fixture, NULL,
+                  fixture_setup, test_vacuum_performance, fixture_teardown);
+    }
+
+  return g_test_run ();
+}
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_NOTIFICATION_RETENTION_H__
+#define __HD_NOTIFICATION_RETENTION_H__
+
+#include <glib.h>
+#include <sqlite3.h>
+#include <time.h>
+
+G_BEGIN_DECLS
+
+/* The retention settings, see notification.conf */
+#define HD_NOTIFICATION_RETENTION_GROUP "Retention"
+
+/* Limits on the persistent notifications kept in notifications.db,
+ * by age and count per category and by the size of the database. */
+typedef struct _HDNotificationRetention HDNotificationRetention;
+
+HDNotificationRetention *hd_notification_retention_new_from_key_file (GKeyFile                *key_file);
+void                     hd_notification_retention_free              (HDNotificationRetention *retention);
+
+GArray                  *hd_notification_retention_select            (HDNotificationRetention *retention,
+                                                                      sqlite3                 *db,
+                                                                      time_t                   now);
+
+G_END_DECLS
+
+#endif
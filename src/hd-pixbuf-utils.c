@@ -24,8 +24,27 @@
 #include <config.h>
 #endif
 
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gfiledescriptorbased.h>
+
+#ifdef HAVE_LIBJPEG
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#endif
+
 #include "hd-pixbuf-utils.h"
 
+/* Images are read in large blocks, the source is often a FAT file
+ * system on flash (MyDocs or a memory card) where small reads are
+ * slow.  Cancellation is checked between the blocks. */
+#define READ_BLOCK_SIZE (256 * 1024)
+
 /*
  * Background image should be resized and cropped. That means the image
  * is centered and scaled to make sure the shortest side fit the home 
@@ -106,27 +125,164 @@ scale_and_crop_pixbuf (const GdkPixbuf *source,
   return pixbuf;
 }
 
+/* Returns the EXIF orientation (1-8) gdk-pixbuf loaders store in
+ * the "orientation" option, 1 if it is not set. */
+static guint
+get_pixbuf_orientation (GdkPixbuf *pixbuf)
+{
+  const gchar *option;
+  guint orientation = 1;
+
+  option = gdk_pixbuf_get_option (pixbuf, "orientation");
+  if (option)
+    orientation = atoi (option);
+
+  return orientation >= 1 && orientation <= 8 ? orientation : 1;
+}
+
+/* Orientations 5 to 8 swap width and height */
+static void
+get_unoriented_size (guint        orientation,
+                     HDImageSize *size,
+                     HDImageSize *unoriented_size)
+{
+  if (orientation >= 5)
+    {
+      unoriented_size->width = size->height;
+      unoriented_size->height = size->width;
+    }
+  else
+    *unoriented_size = *size;
+}
+
+/*
+ * Returns a copy of @source transformed as EXIF @orientation says,
+ * like gdk_pixbuf_apply_embedded_orientation() but in one pass.
+ */
+static GdkPixbuf *
+orient_pixbuf (GdkPixbuf *source,
+               guint      orientation)
+{
+  GdkPixbuf *pixbuf;
+  const guchar *src_pixels;
+  guchar *pixels;
+  gint width, height, src_rowstride, rowstride, n_channels, x, y;
+
+  width = gdk_pixbuf_get_width (source);
+  height = gdk_pixbuf_get_height (source);
+  src_rowstride = gdk_pixbuf_get_rowstride (source);
+  n_channels = gdk_pixbuf_get_n_channels (source);
+  src_pixels = gdk_pixbuf_get_pixels (source);
+
+  pixbuf = gdk_pixbuf_new (gdk_pixbuf_get_colorspace (source),
+                           gdk_pixbuf_get_has_alpha (source),
+                           gdk_pixbuf_get_bits_per_sample (source),
+                           orientation >= 5 ? height : width,
+                           orientation >= 5 ? width : height);
+  if (!pixbuf)
+    return NULL;
+
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y = 0; y < gdk_pixbuf_get_height (pixbuf); y++)
+    {
+      guchar *dest = pixels + y * rowstride;
+
+      for (x = 0; x < gdk_pixbuf_get_width (pixbuf); x++)
+        {
+          gint sx, sy;
+
+          switch (orientation)
+            {
+            case 2:  sx = width - 1 - x; sy = y;               break;
+            case 3:  sx = width - 1 - x; sy = height - 1 - y;  break;
+            case 4:  sx = x;             sy = height - 1 - y;  break;
+            case 5:  sx = y;             sy = x;               break;
+            case 6:  sx = y;             sy = height - 1 - x;  break;
+            case 7:  sx = width - 1 - y; sy = height - 1 - x;  break;
+            case 8:  sx = width - 1 - y; sy = x;               break;
+            default: sx = x;             sy = y;               break;
+            }
+
+          memcpy (dest, src_pixels + sy * src_rowstride + sx * n_channels,
+                  n_channels);
+          dest += n_channels;
+        }
+    }
+
+  return pixbuf;
+}
+
+/*
+ * Scales and crops @source to @destination_size as it looks after its
+ * embedded orientation is applied.  The scaling and cropping is done on
+ * @source as it is, to the unoriented destination size, so only the
+ * destination sized result is rotated or flipped instead of @source.
+ */
+static GdkPixbuf *
+scale_crop_and_orient_pixbuf (GdkPixbuf   *source,
+                              HDImageSize *destination_size)
+{
+  HDImageSize unoriented_size;
+  GdkPixbuf *scaled, *pixbuf;
+  guint orientation;
+
+  orientation = get_pixbuf_orientation (source);
+  if (orientation == 1)
+    return scale_and_crop_pixbuf (source, destination_size);
+
+  get_unoriented_size (orientation, destination_size, &unoriented_size);
+
+  scaled = scale_and_crop_pixbuf (source, &unoriented_size);
+  pixbuf = orient_pixbuf (scaled, orientation);
+  g_object_unref (scaled);
+
+  return pixbuf;
+}
+
+/* Tells the kernel @stream is read sequentially to the end, so it
+ * can read ahead aggressively. */
+static void
+advise_sequential_read (GFileInputStream *stream)
+{
+#if defined (POSIX_FADV_SEQUENTIAL) && defined (POSIX_FADV_WILLNEED)
+  gint fd;
+
+  if (!G_IS_FILE_DESCRIPTOR_BASED (stream))
+    return;
+
+  fd = g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (stream));
+
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+}
+
 static gboolean
 read_from_input_stream_into_pixbuf_loader (GInputStream     *stream,
                                            GdkPixbufLoader  *loader,
                                            GCancellable     *cancellable,
                                            GError          **error)
 {
-  guchar buffer[8192];
+  guchar *buffer;
   gssize read_bytes;
+  gboolean result = FALSE;
+
+  buffer = g_malloc (READ_BLOCK_SIZE);
 
   /* Parse input stream into the loader */
   do
     {
       read_bytes = g_input_stream_read (stream,
                                         buffer,
-                                        sizeof (buffer),
+                                        READ_BLOCK_SIZE,
                                         cancellable,
                                         error);
       if (read_bytes < 0)
         {
           gdk_pixbuf_loader_close (loader, NULL);
-          return FALSE;
+          goto cleanup;
         }
 
       if (!gdk_pixbuf_loader_write (loader,
@@ -135,21 +291,368 @@ read_from_input_stream_into_pixbuf_loader (GInputStream     *stream,
                                     error))
         {
           gdk_pixbuf_loader_close (loader, NULL);
-          return FALSE;
+          goto cleanup;
         }
     } while (read_bytes > 0);
 
   if (!gdk_pixbuf_loader_close (loader, error))
-    return FALSE;
+    goto cleanup;
 
   if (!g_input_stream_close (stream,
                              cancellable,
                              error))
-    return FALSE;
+    goto cleanup;
+
+  result = TRUE;
+
+cleanup:
+  g_free (buffer);
+
+  return result;
+}
+
+/* Decodes @stream with gdk-pixbuf at the size size_prepared_cb() asks
+ * for.  Returns %NULL with @error unset if the loader gave no image. */
+static GdkPixbuf *
+load_with_pixbuf_loader (GInputStream  *stream,
+                         HDImageSize   *size,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  GdkPixbufLoader *loader;
+  GdkPixbuf *pixbuf = NULL;
+
+  loader = gdk_pixbuf_loader_new ();
+  g_signal_connect (loader, "size-prepared",
+                    G_CALLBACK (size_prepared_cb),
+                    size);
+
+  if (read_from_input_stream_into_pixbuf_loader (stream,
+                                                 loader,
+                                                 cancellable,
+                                                 error))
+    {
+      pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+      if (pixbuf)
+        g_object_ref (pixbuf);
+    }
+
+  g_object_unref (loader);
+
+  return pixbuf;
+}
+
+#ifdef HAVE_LIBJPEG
+
+/* libjpeg source manager reading from a #GInputStream */
+typedef struct
+{
+  struct jpeg_source_mgr  source;
+  GInputStream           *stream;
+  GCancellable           *cancellable;
+  GError                 *error;
+  JOCTET                  buffer[READ_BLOCK_SIZE];
+} JpegSource;
+
+typedef struct
+{
+  struct jpeg_error_mgr error;
+  jmp_buf               setjmp_buffer;
+} JpegError;
+
+static void
+jpeg_source_init (j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+jpeg_source_fill (j_decompress_ptr cinfo)
+{
+  JpegSource *source = (JpegSource *) cinfo->src;
+  gssize read_bytes;
+
+  read_bytes = g_input_stream_read (source->stream,
+                                    source->buffer,
+                                    sizeof (source->buffer),
+                                    source->cancellable,
+                                    &source->error);
+  if (read_bytes < 0)
+    ERREXIT (cinfo, JERR_FILE_READ);
+
+  /* Insert a fake EOI marker at a premature end, as libjpeg does */
+  if (read_bytes == 0)
+    {
+      WARNMS (cinfo, JWRN_JPEG_EOF);
+      source->buffer[0] = (JOCTET) 0xFF;
+      source->buffer[1] = (JOCTET) JPEG_EOI;
+      read_bytes = 2;
+    }
+
+  source->source.next_input_byte = source->buffer;
+  source->source.bytes_in_buffer = read_bytes;
 
   return TRUE;
 }
 
+static void
+jpeg_source_skip (j_decompress_ptr cinfo,
+                  long             num_bytes)
+{
+  JpegSource *source = (JpegSource *) cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+
+  while (num_bytes > (long) source->source.bytes_in_buffer)
+    {
+      num_bytes -= source->source.bytes_in_buffer;
+      jpeg_source_fill (cinfo);
+    }
+
+  source->source.next_input_byte += num_bytes;
+  source->source.bytes_in_buffer -= num_bytes;
+}
+
+static void
+jpeg_source_term (j_decompress_ptr cinfo)
+{
+}
+
+static void
+jpeg_error_exit (j_common_ptr cinfo)
+{
+  JpegError *jerr = (JpegError *) cinfo->err;
+
+  longjmp (jerr->setjmp_buffer, 1);
+}
+
+static void
+jpeg_output_message (j_common_ptr cinfo)
+{
+  char buffer[JMSG_LENGTH_MAX];
+
+  cinfo->err->format_message (cinfo, buffer);
+  g_debug ("%s. %s", __FUNCTION__, buffer);
+}
+
+static guint
+exif_get16 (const JOCTET *p,
+            gboolean      big_endian)
+{
+  return big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static guint
+exif_get32 (const JOCTET *p,
+            gboolean      big_endian)
+{
+  return big_endian
+    ? (exif_get16 (p, TRUE) << 16) | exif_get16 (p + 2, TRUE)
+    : (exif_get16 (p + 2, FALSE) << 16) | exif_get16 (p, FALSE);
+}
+
+/* Returns the EXIF orientation tag of IFD0, 1 if there is none. */
+static guint
+get_jpeg_orientation (j_decompress_ptr cinfo)
+{
+  jpeg_saved_marker_ptr marker;
+
+  for (marker = cinfo->marker_list; marker; marker = marker->next)
+    {
+      const JOCTET *tiff;
+      guint length, ifd, n_entries, i;
+      gboolean big_endian;
+
+      if (marker->marker != JPEG_APP0 + 1 ||
+          marker->data_length < 6 + 8 ||
+          memcmp (marker->data, "Exif\0\0", 6))
+        continue;
+
+      tiff = marker->data + 6;
+      length = marker->data_length - 6;
+
+      if (!memcmp (tiff, "MM", 2))
+        big_endian = TRUE;
+      else if (!memcmp (tiff, "II", 2))
+        big_endian = FALSE;
+      else
+        return 1;
+
+      ifd = exif_get32 (tiff + 4, big_endian);
+      if (ifd > length - 2)
+        return 1;
+
+      n_entries = exif_get16 (tiff + ifd, big_endian);
+      for (i = 0; i < n_entries && ifd + 2 + (i + 1) * 12 <= length; i++)
+        {
+          const JOCTET *entry = tiff + ifd + 2 + i * 12;
+
+          if (exif_get16 (entry, big_endian) == 0x0112)
+            {
+              guint orientation = exif_get16 (entry + 8, big_endian);
+
+              return orientation >= 1 && orientation <= 8 ? orientation : 1;
+            }
+        }
+
+      return 1;
+    }
+
+  return 1;
+}
+
+/*
+ * Decodes the JPEG image in @stream with libjpeg at the smallest DCT
+ * scale (1/1 to 1/8) that still gives at least the size size_prepared_cb()
+ * would ask from gdk-pixbuf.  Only the scanlines and columns which end
+ * up in the @size crop are kept, and decoding stops after the last of
+ * them.  The EXIF orientation is stored in the "orientation" option like
+ * the gdk-pixbuf loader does, the crop is taken from the unoriented image.
+ *
+ * Returns %NULL without setting @error if @stream is not a JPEG image
+ * libjpeg can decode, the caller should fall back to gdk-pixbuf then.
+ */
+static GdkPixbuf *
+load_jpeg_scaled_and_cropped (GInputStream  *stream,
+                              HDImageSize   *size,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  struct jpeg_decompress_struct cinfo;
+  JpegError jerr;
+  JpegSource *source;
+  GdkPixbuf *volatile pixbuf = NULL;
+  JSAMPLE *volatile row = NULL;
+  HDImageSize image_size, minimum_size, crop_size, unoriented_size;
+  guint orientation, denom, x, y;
+  guchar *pixels;
+  gint rowstride;
+  double scale;
+
+  source = g_new0 (JpegSource, 1);
+  source->source.init_source = jpeg_source_init;
+  source->source.fill_input_buffer = jpeg_source_fill;
+  source->source.skip_input_data = jpeg_source_skip;
+  source->source.resync_to_restart = jpeg_resync_to_restart;
+  source->source.term_source = jpeg_source_term;
+  source->stream = stream;
+  source->cancellable = cancellable;
+
+  cinfo.err = jpeg_std_error (&jerr.error);
+  jerr.error.error_exit = jpeg_error_exit;
+  jerr.error.output_message = jpeg_output_message;
+
+  jpeg_create_decompress (&cinfo);
+
+  if (setjmp (jerr.setjmp_buffer))
+    {
+      /* Only I/O errors are reported, decoding errors fall back */
+      if (source->error)
+        g_propagate_error (error, source->error);
+      else
+        g_debug ("%s. Falling back to gdk-pixbuf", __FUNCTION__);
+
+      if (pixbuf)
+        pixbuf = (g_object_unref (pixbuf), NULL);
+
+      goto cleanup;
+    }
+
+  cinfo.src = &source->source;
+  jpeg_save_markers (&cinfo, JPEG_APP0 + 1, 0xffff);
+  jpeg_read_header (&cinfo, TRUE);
+
+  /* libjpeg does not convert these to RGB */
+  if (cinfo.jpeg_color_space == JCS_CMYK ||
+      cinfo.jpeg_color_space == JCS_YCCK)
+    goto cleanup;
+
+  orientation = get_jpeg_orientation (&cinfo);
+
+  /* The same as size_prepared_cb() */
+  image_size.width = cinfo.image_width;
+  image_size.height = cinfo.image_height;
+  minimum_size.width = minimum_size.height = MAX (size->width, size->height);
+  scale = MIN (get_scale_for_aspect_ratio (&image_size, &minimum_size), 1);
+
+  for (denom = 8; denom > 1; denom /= 2)
+    if (image_size.width / denom >= image_size.width * scale &&
+        image_size.height / denom >= image_size.height * scale)
+      break;
+
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE
+    ? JCS_GRAYSCALE
+    : JCS_RGB;
+
+  jpeg_start_decompress (&cinfo);
+
+  image_size.width = cinfo.output_width;
+  image_size.height = cinfo.output_height;
+
+  /* The part scale_crop_and_orient_pixbuf() will use */
+  get_unoriented_size (orientation, size, &unoriented_size);
+  scale = get_scale_for_aspect_ratio (&image_size, &unoriented_size);
+  crop_size.width = MIN (image_size.width,
+                         (gint) ceil (unoriented_size.width / scale));
+  crop_size.height = MIN (image_size.height,
+                          (gint) ceil (unoriented_size.height / scale));
+  x = (image_size.width - crop_size.width) / 2;
+  y = (image_size.height - crop_size.height) / 2;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+                           FALSE,
+                           8,
+                           crop_size.width,
+                           crop_size.height);
+  if (!pixbuf)
+    goto cleanup;
+
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  row = g_new (JSAMPLE, image_size.width * cinfo.output_components);
+
+  while (cinfo.output_scanline < y + crop_size.height)
+    {
+      guint line = cinfo.output_scanline;
+      JSAMPROW rows[1] = { row };
+      guchar *dest;
+      gint i;
+
+      jpeg_read_scanlines (&cinfo, rows, 1);
+
+      if (line < y)
+        continue;
+
+      dest = pixels + (line - y) * rowstride;
+      if (cinfo.output_components == 3)
+        memcpy (dest, row + x * 3, crop_size.width * 3);
+      else
+        for (i = 0; i < crop_size.width; i++, dest += 3)
+          dest[0] = dest[1] = dest[2] = row[x + i];
+    }
+
+  if (orientation != 1)
+    {
+      gchar value[2] = { '0' + orientation, '\0' };
+
+      gdk_pixbuf_set_option (pixbuf, "orientation", value);
+    }
+
+  /* The rest of the scanlines are not needed */
+  jpeg_abort_decompress (&cinfo);
+
+cleanup:
+  jpeg_destroy_decompress (&cinfo);
+  g_free (row);
+  g_free (source);
+
+  return pixbuf;
+}
+
+#endif
+
 static gboolean
 get_etag_from_file_input_stream (GFileInputStream  *stream,
                                  char             **etag,
@@ -181,8 +684,7 @@ hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
                                          GError       **error)
 {
   GFileInputStream *stream = NULL;
-  GdkPixbufLoader *loader = NULL;
-  GdkPixbuf *pixbuf = NULL;
+  GdkPixbuf *decoded = NULL, *pixbuf = NULL;
 
   /* Open file for read */
   stream = g_file_read (file, cancellable, error);
@@ -190,11 +692,7 @@ hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
   if (!stream)
     goto cleanup;
 
-  /* Create pixbuf loader */
-  loader = gdk_pixbuf_loader_new ();
-  g_signal_connect (loader, "size-prepared",
-                    G_CALLBACK (size_prepared_cb),
-                    size);
+  advise_sequential_read (stream);
 
   if (!get_etag_from_file_input_stream (stream,
                                         etag,
@@ -202,19 +700,51 @@ hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
                                         error))
     goto cleanup;
 
-  if (!read_from_input_stream_into_pixbuf_loader (G_INPUT_STREAM (stream),
-                                                  loader,
-                                                  cancellable,
-                                                  error))
-    goto cleanup;
+#ifdef HAVE_LIBJPEG
+  {
+    GError *local_error = NULL;
+
+    decoded = load_jpeg_scaled_and_cropped (G_INPUT_STREAM (stream),
+                                            size,
+                                            cancellable,
+                                            &local_error);
+    if (local_error)
+      {
+        g_propagate_error (error, local_error);
+        goto cleanup;
+      }
+
+    /* Not a JPEG, start over with gdk-pixbuf */
+    if (!decoded &&
+        !g_seekable_seek (G_SEEKABLE (stream),
+                          0,
+                          G_SEEK_SET,
+                          cancellable,
+                          error))
+      goto cleanup;
+  }
+#endif
+
+  if (!decoded)
+    {
+      GError *local_error = NULL;
+
+      decoded = load_with_pixbuf_loader (G_INPUT_STREAM (stream),
+                                         size,
+                                         cancellable,
+                                         &local_error);
+      if (local_error)
+        {
+          g_propagate_error (error, local_error);
+          goto cleanup;
+        }
+    }
 
   /* Set resulting pixbuf */
-  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
-  if (pixbuf)
+  if (decoded)
     {
-      GdkPixbuf *rotated = gdk_pixbuf_apply_embedded_orientation (pixbuf);
-      pixbuf = scale_and_crop_pixbuf (rotated, size);
-      g_object_unref (rotated);
+      pixbuf = scale_crop_and_orient_pixbuf (decoded, size);
+      g_object_unref (decoded);
     }
   else
     g_set_error_literal (error,
@@ -225,8 +755,6 @@ hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
 cleanup:
   if (stream)
     g_object_unref (stream);
-  if (loader)
-    g_object_unref (loader);
 
   return pixbuf;
 }
@@ -301,6 +829,8 @@ hd_pixbuf_utils_load_at_size (GFile         *file,
   if (!stream)
     goto cleanup;
 
+  advise_sequential_read (stream);
+
   /* Create pixbuf loader */
   loader = gdk_pixbuf_loader_new ();
   g_signal_connect (loader, "size-prepared",
@@ -340,3 +870,933 @@ cleanup:
 
   return pixbuf;
 }
+
+#ifdef COMPILE_FOR_TEST
+#include <stdio.h>
+
+#include <glib/gstdio.h>
+
+/* The cached image size, see hd-backgrounds.c */
+#define TEST_WIDTH  800
+#define TEST_HEIGHT 480
+
+/* Mean difference per channel allowed between the libjpeg and the
+ * gdk-pixbuf decodes, they scale with other filters */
+#define TEST_TOLERANCE 4.0
+
+/* The same for orienting before or after the scaling, only the
+ * sub-pixel rounding differs */
+#define TEST_ORIENT_TOLERANCE 1.0
+
+/* The slow storage the I/O benchmark simulates, a memory card behind
+ * FAT: every request costs 1 ms and the card reads 10 MB/s */
+#define TEST_LATENCY_USEC 1000
+#define TEST_BANDWIDTH    (10 * 1000 * 1000)
+
+static gchar *test_dir;
+
+/* Creates a test image, gradients with a brighter and a darker pair of
+ * quadrants so the crop and the orientation can be seen */
+static GdkPixbuf *
+create_test_pixbuf (gint width,
+                    gint height)
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  gint rowstride, x, y;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y = 0; y < height; y++)
+    {
+      guchar *p = pixels + y * rowstride;
+
+      for (x = 0; x < width; x++, p += 3)
+        {
+          p[0] = 255 * x / width;
+          p[1] = 255 * y / height;
+          p[2] = (x < width / 2) == (y < height / 2) ? 64 : 192;
+        }
+    }
+
+  return pixbuf;
+}
+
+#ifdef HAVE_LIBJPEG
+
+static void
+exif_put16 (guchar   *p,
+            guint     value,
+            gboolean  big_endian)
+{
+  p[big_endian ? 0 : 1] = value >> 8;
+  p[big_endian ? 1 : 0] = value & 0xff;
+}
+
+/* Writes an EXIF block with @orientation in IFD0 */
+static void
+write_exif_orientation (j_compress_ptr cinfo,
+                        guint          orientation,
+                        gboolean       big_endian)
+{
+  guchar exif[6 + 8 + 2 + 12 + 4] = "Exif\0\0";
+  guchar *tiff = exif + 6, *entry = tiff + 8 + 2;
+
+  memcpy (tiff, big_endian ? "MM" : "II", 2);
+  exif_put16 (tiff + 2, 42, big_endian);
+  exif_put16 (tiff + (big_endian ? 6 : 4), 8, big_endian);
+  exif_put16 (tiff + 8, 1, big_endian);
+  exif_put16 (entry, 0x0112, big_endian);
+  exif_put16 (entry + 2, 3, big_endian);
+  exif_put16 (entry + (big_endian ? 6 : 4), 1, big_endian);
+  exif_put16 (entry + 8, orientation, big_endian);
+
+  jpeg_write_marker (cinfo, JPEG_APP0 + 1, exif, sizeof (exif));
+}
+
+/* Writes @pixbuf as a JPEG file, in grayscale if @grayscale.  An EXIF
+ * @orientation is stored unless it is 0, in big endian byte order for
+ * the odd ones. */
+static gchar *
+write_test_jpeg (const gchar *name,
+                 GdkPixbuf   *pixbuf,
+                 gboolean     grayscale,
+                 guint        orientation)
+{
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  gchar *filename;
+  FILE *file;
+  JSAMPLE *row;
+  guint y;
+
+  filename = g_build_filename (test_dir, name, NULL);
+  file = fopen (filename, "wb");
+  g_assert (file);
+
+  cinfo.err = jpeg_std_error (&jerr);
+  jpeg_create_compress (&cinfo);
+  jpeg_stdio_dest (&cinfo, file);
+
+  cinfo.image_width = gdk_pixbuf_get_width (pixbuf);
+  cinfo.image_height = gdk_pixbuf_get_height (pixbuf);
+  cinfo.input_components = grayscale ? 1 : 3;
+  cinfo.in_color_space = grayscale ? JCS_GRAYSCALE : JCS_RGB;
+  jpeg_set_defaults (&cinfo);
+  jpeg_set_quality (&cinfo, 95, TRUE);
+  jpeg_start_compress (&cinfo, TRUE);
+  if (orientation)
+    write_exif_orientation (&cinfo, orientation, orientation % 2);
+
+  row = g_new (JSAMPLE, cinfo.image_width * 3);
+  for (y = 0; y < cinfo.image_height; y++)
+    {
+      const guchar *p = gdk_pixbuf_get_pixels (pixbuf) +
+                        y * gdk_pixbuf_get_rowstride (pixbuf);
+      JSAMPROW rows[1] = { grayscale ? row : (JSAMPLE *) p };
+      guint x;
+
+      if (grayscale)
+        for (x = 0; x < cinfo.image_width; x++)
+          row[x] = p[x * 3];
+
+      jpeg_write_scanlines (&cinfo, rows, 1);
+    }
+  g_free (row);
+
+  jpeg_finish_compress (&cinfo);
+  jpeg_destroy_compress (&cinfo);
+  fclose (file);
+
+  return filename;
+}
+
+#endif
+
+static GdkPixbuf *
+load (const gchar *filename,
+      GError     **error)
+{
+  HDImageSize size = { TEST_WIDTH, TEST_HEIGHT };
+  GFile *file = g_file_new_for_path (filename);
+  GdkPixbuf *pixbuf;
+
+  pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (file, &size, NULL,
+                                                    NULL, error);
+  g_object_unref (file);
+
+  return pixbuf;
+}
+
+/* Applies the orientation of @source to a copy before scaling and
+ * cropping it, as it was done before */
+static GdkPixbuf *
+scale_crop_oriented_copy (GdkPixbuf   *source,
+                          HDImageSize *size)
+{
+  GdkPixbuf *oriented, *pixbuf;
+
+  oriented = gdk_pixbuf_apply_embedded_orientation (source);
+  pixbuf = scale_and_crop_pixbuf (oriented, size);
+  g_object_unref (oriented);
+
+  return pixbuf;
+}
+
+/* Loads @filename with gdk-pixbuf alone, as before libjpeg was used */
+static GdkPixbuf *
+load_reference (const gchar *filename)
+{
+  HDImageSize size = { TEST_WIDTH, TEST_HEIGHT };
+  GFile *file = g_file_new_for_path (filename);
+  GFileInputStream *stream;
+  GdkPixbuf *decoded, *pixbuf;
+
+  stream = g_file_read (file, NULL, NULL);
+  g_assert (stream);
+  decoded = load_with_pixbuf_loader (G_INPUT_STREAM (stream), &size,
+                                     NULL, NULL);
+  g_assert (decoded);
+  pixbuf = scale_crop_oriented_copy (decoded, &size);
+
+  g_object_unref (decoded);
+  g_object_unref (stream);
+  g_object_unref (file);
+
+  return pixbuf;
+}
+
+/* Returns the mean difference per channel of @a and @b */
+static gdouble
+compare_pixbufs (GdkPixbuf *a,
+                 GdkPixbuf *b)
+{
+  gint width, height, n_channels, x, y;
+  guint64 sum = 0;
+
+  width = gdk_pixbuf_get_width (a);
+  height = gdk_pixbuf_get_height (a);
+  n_channels = gdk_pixbuf_get_n_channels (a);
+  g_assert_cmpint (gdk_pixbuf_get_width (b), ==, width);
+  g_assert_cmpint (gdk_pixbuf_get_height (b), ==, height);
+  g_assert_cmpint (gdk_pixbuf_get_n_channels (b), ==, n_channels);
+
+  for (y = 0; y < height; y++)
+    {
+      const guchar *p = gdk_pixbuf_get_pixels (a) +
+                        y * gdk_pixbuf_get_rowstride (a);
+      const guchar *q = gdk_pixbuf_get_pixels (b) +
+                        y * gdk_pixbuf_get_rowstride (b);
+
+      for (x = 0; x < width * n_channels; x++)
+        sum += ABS (p[x] - q[x]);
+    }
+
+  return (gdouble) sum / (width * height * n_channels);
+}
+
+#ifdef HAVE_LIBJPEG
+
+/* Sizes of camera photos and wallpapers, 2 to 20 MP */
+static const HDImageSize test_sizes[] =
+{
+  {  800,  480 },
+  {  640,  400 },
+  { 1600, 1200 },
+  { 2592, 1944 },
+  { 1944, 2592 },
+  { 4000, 3000 },
+  { 4000, 1000 },
+  { 5184, 3888 },
+};
+
+/* The libjpeg path gives the gdk-pixbuf result from a smaller decode */
+static void
+test_jpeg (void)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (test_sizes); i++)
+    {
+      const HDImageSize *size = &test_sizes[i];
+      HDImageSize cached_size = { TEST_WIDTH, TEST_HEIGHT };
+      GdkPixbuf *source, *pixbuf, *reference, *decoded;
+      GFileInputStream *stream;
+      GFile *file;
+      gchar *name, *filename;
+      GError *error = NULL;
+
+      name = g_strdup_printf ("%dx%d.jpg", size->width, size->height);
+      source = create_test_pixbuf (size->width, size->height);
+      filename = write_test_jpeg (name, source, FALSE, 0);
+
+      /* Only the crop is kept, at a reduced scale for the big ones */
+      file = g_file_new_for_path (filename);
+      stream = g_file_read (file, NULL, NULL);
+      decoded = load_jpeg_scaled_and_cropped (G_INPUT_STREAM (stream),
+                                              &cached_size, NULL, &error);
+      g_assert_no_error (error);
+      g_assert (decoded);
+      g_assert_cmpint (gdk_pixbuf_get_width (decoded), <=, size->width);
+      g_assert_cmpint (gdk_pixbuf_get_height (decoded), <=, size->height);
+      if (MIN (size->width, size->height) >= 2 * TEST_WIDTH)
+        g_assert_cmpint (4 * gdk_pixbuf_get_width (decoded) *
+                         gdk_pixbuf_get_height (decoded), <=,
+                         size->width * size->height);
+      g_object_unref (decoded);
+      g_object_unref (stream);
+      g_object_unref (file);
+
+      pixbuf = load (filename, &error);
+      g_assert_no_error (error);
+      reference = load_reference (filename);
+      g_assert_cmpfloat (compare_pixbufs (pixbuf, reference), <=,
+                         TEST_TOLERANCE);
+
+      g_object_unref (reference);
+      g_object_unref (pixbuf);
+      g_object_unref (source);
+      g_unlink (filename);
+      g_free (filename);
+      g_free (name);
+    }
+}
+
+static void
+test_jpeg_grayscale (void)
+{
+  GdkPixbuf *source, *pixbuf, *reference;
+  gchar *filename;
+  GError *error = NULL;
+
+  source = create_test_pixbuf (2592, 1944);
+  filename = write_test_jpeg ("grayscale.jpg", source, TRUE, 0);
+
+  pixbuf = load (filename, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (gdk_pixbuf_get_n_channels (pixbuf), ==, 3);
+  reference = load_reference (filename);
+  g_assert_cmpfloat (compare_pixbufs (pixbuf, reference), <=,
+                     TEST_TOLERANCE);
+
+  g_object_unref (reference);
+  g_object_unref (pixbuf);
+  g_object_unref (source);
+  g_unlink (filename);
+  g_free (filename);
+}
+
+/* The EXIF orientation is read in both byte orders, and the crop taken
+ * before orienting gives what gdk-pixbuf gave */
+static void
+test_jpeg_orientation (void)
+{
+  GdkPixbuf *source;
+  guint orientation;
+
+  source = create_test_pixbuf (2592, 1944);
+
+  for (orientation = 1; orientation <= 8; orientation++)
+    {
+      GdkPixbuf *pixbuf, *reference;
+      gchar *name, *filename;
+      GError *error = NULL;
+
+      name = g_strdup_printf ("orientation-%u.jpg", orientation);
+      filename = write_test_jpeg (name, source, FALSE, orientation);
+
+      pixbuf = load (filename, &error);
+      g_assert_no_error (error);
+      reference = load_reference (filename);
+      g_assert_cmpfloat (compare_pixbufs (pixbuf, reference), <=,
+                         TEST_TOLERANCE);
+
+      g_object_unref (reference);
+      g_object_unref (pixbuf);
+      g_unlink (filename);
+      g_free (filename);
+      g_free (name);
+    }
+
+  g_object_unref (source);
+}
+
+#endif
+
+/* orient_pixbuf() moves the pixels as gdk-pixbuf does */
+static void
+test_orient (void)
+{
+  GdkPixbuf *source;
+  guchar *pixels;
+  gint i;
+  guint orientation;
+
+  /* Odd sizes and a pixel of its own everywhere */
+  source = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 7, 5);
+  pixels = gdk_pixbuf_get_pixels (source);
+  for (i = 0; i < gdk_pixbuf_get_rowstride (source) * 5; i++)
+    pixels[i] = i;
+
+  for (orientation = 1; orientation <= 8; orientation++)
+    {
+      GdkPixbuf *pixbuf, *reference;
+      gchar value[2] = { '0' + orientation, '\0' };
+
+      gdk_pixbuf_set_option (source, "orientation", value);
+
+      pixbuf = orient_pixbuf (source, orientation);
+      reference = gdk_pixbuf_apply_embedded_orientation (source);
+      g_assert_cmpfloat (compare_pixbufs (pixbuf, reference), ==, 0);
+
+      g_object_unref (reference);
+      g_object_unref (pixbuf);
+    }
+
+  g_object_unref (source);
+}
+
+/* Scaling before orienting gives what orienting first gave, for
+ * landscape and portrait sources */
+static void
+test_scale_crop_orient (void)
+{
+  static const HDImageSize sizes[] = { { 2592, 1944 }, { 1944, 2592 } };
+  HDImageSize size = { TEST_WIDTH, TEST_HEIGHT };
+  guint i, orientation;
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      GdkPixbuf *source;
+
+      source = create_test_pixbuf (sizes[i].width, sizes[i].height);
+
+      for (orientation = 1; orientation <= 8; orientation++)
+        {
+          GdkPixbuf *pixbuf, *reference;
+          gchar value[2] = { '0' + orientation, '\0' };
+
+          gdk_pixbuf_set_option (source, "orientation", value);
+
+          pixbuf = scale_crop_and_orient_pixbuf (source, &size);
+          reference = scale_crop_oriented_copy (source, &size);
+          g_assert_cmpint (gdk_pixbuf_get_width (pixbuf), ==, TEST_WIDTH);
+          g_assert_cmpint (gdk_pixbuf_get_height (pixbuf), ==, TEST_HEIGHT);
+          g_assert_cmpfloat (compare_pixbufs (pixbuf, reference), <=,
+                             TEST_ORIENT_TOLERANCE);
+
+          g_object_unref (reference);
+          g_object_unref (pixbuf);
+        }
+
+      g_object_unref (source);
+    }
+}
+
+/* Other formats and broken JPEG files are left to gdk-pixbuf */
+static void
+test_fallback (void)
+{
+  GdkPixbuf *source, *pixbuf, *reference;
+  gchar *filename;
+  GError *error = NULL;
+
+  source = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 1600, 1200);
+  gdk_pixbuf_fill (source, 0x336699ff);
+  filename = g_build_filename (test_dir, "fallback.png", NULL);
+  g_assert (gdk_pixbuf_save (source, filename, "png", NULL, NULL));
+
+  pixbuf = load (filename, &error);
+  g_assert_no_error (error);
+  reference = load_reference (filename);
+  g_assert_cmpfloat (compare_pixbufs (pixbuf, reference), ==, 0);
+  g_object_unref (reference);
+  g_object_unref (pixbuf);
+  g_unlink (filename);
+  g_free (filename);
+
+  /* A JPEG header and nothing else */
+  filename = g_build_filename (test_dir, "truncated.jpg", NULL);
+  g_assert (g_file_set_contents (filename, "\xff\xd8\xff\xe0", 4, NULL));
+  pixbuf = load (filename, &error);
+  g_assert (!pixbuf);
+  g_assert (error);
+  g_clear_error (&error);
+  g_unlink (filename);
+  g_free (filename);
+
+  g_object_unref (source);
+}
+
+/* An input stream reading at most @block_size bytes from its base
+ * stream per request, as the reads made before, and counting the
+ * requests.  With a @latency_usec it sleeps as slow storage would. */
+typedef struct
+{
+  GFilterInputStream  parent;
+
+  gsize               block_size;
+  gulong              latency_usec;
+  guint               n_reads;
+
+  /* Cancel the load after this many reads */
+  guint               cancel_after;
+  GCancellable       *cancellable;
+} TestSlowStream;
+
+typedef struct
+{
+  GFilterInputStreamClass parent_class;
+} TestSlowStreamClass;
+
+GType test_slow_stream_get_type (void);
+
+G_DEFINE_TYPE (TestSlowStream, test_slow_stream, G_TYPE_FILTER_INPUT_STREAM);
+
+static gssize
+test_slow_stream_read (GInputStream  *stream,
+                       void          *buffer,
+                       gsize          count,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  TestSlowStream *slow = (TestSlowStream *) stream;
+  GInputStream *base;
+  gssize read_bytes;
+
+  base = g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (stream));
+  read_bytes = g_input_stream_read (base,
+                                    buffer,
+                                    MIN (count, slow->block_size),
+                                    cancellable,
+                                    error);
+  if (read_bytes < 0)
+    return read_bytes;
+
+  slow->n_reads++;
+
+  if (read_bytes > 0 && slow->latency_usec)
+    g_usleep (slow->latency_usec +
+              read_bytes * (guint64) G_USEC_PER_SEC / TEST_BANDWIDTH);
+
+  if (slow->n_reads == slow->cancel_after)
+    g_cancellable_cancel (slow->cancellable);
+
+  return read_bytes;
+}
+
+static void
+test_slow_stream_class_init (TestSlowStreamClass *klass)
+{
+  G_INPUT_STREAM_CLASS (klass)->read_fn = test_slow_stream_read;
+}
+
+static void
+test_slow_stream_init (TestSlowStream *slow)
+{
+  slow->block_size = G_MAXSIZE;
+}
+
+static TestSlowStream *
+test_slow_stream_new (const gchar *filename)
+{
+  GFile *file = g_file_new_for_path (filename);
+  GFileInputStream *base;
+  TestSlowStream *slow;
+
+  base = g_file_read (file, NULL, NULL);
+  g_assert (base);
+  advise_sequential_read (base);
+
+  slow = g_object_new (test_slow_stream_get_type (),
+                       "base-stream", base,
+                       NULL);
+
+  g_object_unref (base);
+  g_object_unref (file);
+
+  return slow;
+}
+
+/* Decodes @slow with libjpeg or with the gdk-pixbuf loader */
+static GdkPixbuf *
+load_slow (TestSlowStream *slow,
+           gboolean        libjpeg,
+           GCancellable   *cancellable,
+           GError        **error)
+{
+  HDImageSize size = { TEST_WIDTH, TEST_HEIGHT };
+
+#ifdef HAVE_LIBJPEG
+  if (libjpeg)
+    return load_jpeg_scaled_and_cropped (G_INPUT_STREAM (slow), &size,
+                                         cancellable, error);
+#endif
+
+  return load_with_pixbuf_loader (G_INPUT_STREAM (slow), &size,
+                                  cancellable, error);
+}
+
+/* Writes a 12 MP JPEG with noise added, so it compresses about as
+ * well as a photo */
+static gchar *
+write_test_photo (void)
+{
+  GdkPixbuf *source;
+  GRand *rand;
+  guchar *pixels;
+  gchar *filename;
+  gint i, value;
+
+  source = create_test_pixbuf (4000, 3000);
+  pixels = gdk_pixbuf_get_pixels (source);
+  rand = g_rand_new_with_seed (42);
+  for (i = 0; i < gdk_pixbuf_get_rowstride (source) * 3000; i++)
+    {
+      value = pixels[i] + g_rand_int_range (rand, -24, 24);
+      pixels[i] = CLAMP (value, 0, 255);
+    }
+  g_rand_free (rand);
+
+#ifdef HAVE_LIBJPEG
+  filename = write_test_jpeg ("photo.jpg", source, FALSE, 0);
+#else
+  filename = g_build_filename (test_dir, "photo.jpg", NULL);
+  g_assert (gdk_pixbuf_save (source, filename, "jpeg", NULL,
+                             "quality", "95", NULL));
+#endif
+
+  g_object_unref (source);
+
+  return filename;
+}
+
+/* Images are read in READ_BLOCK_SIZE requests, and a cancelled load
+ * stops reading at the next block */
+static void
+test_read_blocks (gconstpointer data)
+{
+  gboolean libjpeg = GPOINTER_TO_INT (data);
+  TestSlowStream *slow;
+  GCancellable *cancellable;
+  GdkPixbuf *pixbuf;
+  gchar *filename, *contents;
+  gsize length;
+  GError *error = NULL;
+
+  filename = write_test_photo ();
+  g_assert (g_file_get_contents (filename, &contents, &length, NULL));
+  g_free (contents);
+  g_assert_cmpuint (length, >, 2 * READ_BLOCK_SIZE);
+
+  slow = test_slow_stream_new (filename);
+  pixbuf = load_slow (slow, libjpeg, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (pixbuf);
+  g_assert_cmpuint (slow->n_reads, <=, length / READ_BLOCK_SIZE + 2);
+  g_object_unref (pixbuf);
+  g_object_unref (slow);
+
+  cancellable = g_cancellable_new ();
+  slow = test_slow_stream_new (filename);
+  slow->cancel_after = 1;
+  slow->cancellable = cancellable;
+  pixbuf = load_slow (slow, libjpeg, cancellable, &error);
+  g_assert (!pixbuf);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpuint (slow->n_reads, ==, 1);
+  g_clear_error (&error);
+  g_object_unref (slow);
+  g_object_unref (cancellable);
+
+  g_unlink (filename);
+  g_free (filename);
+}
+
+/* Returns the number of read system calls the process made */
+static glong
+get_read_syscalls (void)
+{
+  gchar *io, *line;
+  glong syscalls = 0;
+
+  if (g_file_get_contents ("/proc/self/io", &io, NULL, NULL))
+    {
+      line = strstr (io, "syscr:");
+      if (line)
+        syscalls = atol (line + strlen ("syscr:"));
+      g_free (io);
+    }
+
+  return syscalls;
+}
+
+/* Returns the peak resident set size of the process in KiB.  Unlike
+ * getrusage(), it starts over at exec(). */
+static glong
+get_peak_rss (void)
+{
+  gchar *status, *line;
+  glong peak = 0;
+
+  if (g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    {
+      line = strstr (status, "VmHWM:");
+      if (line)
+        peak = atol (line + strlen ("VmHWM:"));
+      g_free (status);
+    }
+
+  return peak;
+}
+
+/* Run as "test-pixbuf-utils --measure MODE ARGUMENT", prints the time
+ * MODE took and the growth of the peak resident set size in KiB.  A
+ * process of its own starts from a clean heap.  The modes are
+ * "libjpeg" and "gdk-pixbuf", loading the file ARGUMENT,
+ * "orient-fused" and "orient-copy", scaling a 12 MP image with the
+ * orientation ARGUMENT, and "slow-libjpeg-N" and "slow-loader-N",
+ * decoding the file ARGUMENT from simulated slow storage read in
+ * blocks of N KiB.  The read system calls made are printed too. */
+static int
+measure_child (const gchar *mode,
+               const gchar *argument)
+{
+  HDImageSize size = { TEST_WIDTH, TEST_HEIGHT };
+  GdkPixbuf *source = NULL, *pixbuf;
+  TestSlowStream *slow = NULL;
+  gint64 start;
+  glong peak, syscalls;
+
+  if (g_str_has_prefix (mode, "orient-"))
+    {
+      source = create_test_pixbuf (4000, 3000);
+      gdk_pixbuf_set_option (source, "orientation", argument);
+    }
+  else if (g_str_has_prefix (mode, "slow-"))
+    {
+      slow = test_slow_stream_new (argument);
+      slow->block_size = atoi (strrchr (mode, '-') + 1) * 1024;
+      slow->latency_usec = TEST_LATENCY_USEC;
+    }
+
+  peak = get_peak_rss ();
+  syscalls = get_read_syscalls ();
+
+  start = g_get_monotonic_time ();
+  if (!strcmp (mode, "libjpeg"))
+    pixbuf = load (argument, NULL);
+  else if (!strcmp (mode, "gdk-pixbuf"))
+    pixbuf = load_reference (argument);
+  else if (!strcmp (mode, "orient-fused"))
+    pixbuf = scale_crop_and_orient_pixbuf (source, &size);
+  else if (!strcmp (mode, "orient-copy"))
+    pixbuf = scale_crop_oriented_copy (source, &size);
+  else
+    pixbuf = load_slow (slow, g_str_has_prefix (mode, "slow-libjpeg-"),
+                        NULL, NULL);
+  if (!pixbuf)
+    return 1;
+
+  syscalls = get_read_syscalls () - syscalls;
+  g_print ("%" G_GINT64_FORMAT " %ld %ld\n",
+           g_get_monotonic_time () - start,
+           get_peak_rss () - peak,
+           syscalls);
+  g_object_unref (pixbuf);
+  if (source)
+    g_object_unref (source);
+  if (slow)
+    g_object_unref (slow);
+
+  return 0;
+}
+
+/* Returns the time @mode takes on @argument in a child process, its
+ * peak memory in @peak_kib and the read system calls it made in
+ * @syscalls */
+static gdouble
+measure (const gchar *mode,
+         const gchar *argument,
+         glong       *peak_kib,
+         glong       *syscalls)
+{
+  gchar *argv[] = { "/proc/self/exe", "--measure", NULL, NULL, NULL };
+  gchar *output = NULL;
+  gint64 usec;
+  glong n_syscalls;
+  gint status;
+
+  argv[2] = (gchar *) mode;
+  argv[3] = (gchar *) argument;
+  g_assert (g_spawn_sync (NULL, argv, NULL, 0, NULL, NULL,
+                          &output, NULL, &status, NULL));
+  g_assert_cmpint (status, ==, 0);
+  g_assert_cmpint (sscanf (output, "%" G_GINT64_FORMAT " %ld %ld",
+                           &usec, peak_kib, &n_syscalls), ==, 3);
+  if (syscalls)
+    *syscalls = n_syscalls;
+  g_free (output);
+
+  return usec / (gdouble) G_USEC_PER_SEC;
+}
+
+#ifdef HAVE_LIBJPEG
+
+/* Decode time and peak memory of 2 to 20 MP photos */
+static void
+test_jpeg_benchmark (void)
+{
+  static const HDImageSize sizes[] =
+  {
+    { 1600, 1200 },   /*  2 MP */
+    { 2592, 1944 },   /*  5 MP */
+    { 4000, 3000 },   /* 12 MP */
+    { 5184, 3888 },   /* 20 MP */
+  };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      GdkPixbuf *source;
+      gchar *name, *filename;
+      gdouble libjpeg, gdk_pixbuf;
+      glong libjpeg_peak, gdk_pixbuf_peak;
+
+      name = g_strdup_printf ("benchmark-%dx%d.jpg",
+                              sizes[i].width, sizes[i].height);
+      source = create_test_pixbuf (sizes[i].width, sizes[i].height);
+      filename = write_test_jpeg (name, source, FALSE, 0);
+      g_object_unref (source);
+
+      libjpeg = measure ("libjpeg", filename, &libjpeg_peak, NULL);
+      gdk_pixbuf = measure ("gdk-pixbuf", filename, &gdk_pixbuf_peak, NULL);
+
+      g_test_message ("%.0f MP: libjpeg %.1f ms %ld KiB, "
+                      "gdk-pixbuf %.1f ms %ld KiB",
+                      sizes[i].width * sizes[i].height / 1e6,
+                      libjpeg * 1e3, libjpeg_peak,
+                      gdk_pixbuf * 1e3, gdk_pixbuf_peak);
+      if (sizes[i].width == 4000)
+        g_test_minimized_result (libjpeg,
+                                 "12 MP: libjpeg %.1f ms, gdk-pixbuf %.1f ms",
+                                 libjpeg * 1e3, gdk_pixbuf * 1e3);
+
+      g_unlink (filename);
+      g_free (filename);
+      g_free (name);
+    }
+}
+
+#endif
+
+/* Time and memory of orienting a 12 MP portrait photo, after the
+ * scaling and before it */
+static void
+test_orient_benchmark (void)
+{
+  gdouble fused, copy;
+  glong fused_peak, copy_peak;
+
+  fused = measure ("orient-fused", "6", &fused_peak, NULL);
+  copy = measure ("orient-copy", "6", &copy_peak, NULL);
+
+  g_test_minimized_result (fused,
+                           "12 MP, orientation 6: oriented after scaling "
+                           "%.1f ms %ld KiB, before %.1f ms %ld KiB",
+                           fused * 1e3, fused_peak, copy * 1e3, copy_peak);
+}
+
+/* Time and read system calls of a 12 MP photo on simulated slow
+ * storage, in the blocks read before and in READ_BLOCK_SIZE blocks */
+static void
+test_io_benchmark (void)
+{
+  static const struct
+  {
+    const gchar *before;
+    const gchar *after;
+  } loads[] =
+  {
+    { "slow-loader-8", "slow-loader-256" },
+#ifdef HAVE_LIBJPEG
+    { "slow-libjpeg-64", "slow-libjpeg-256" },
+#endif
+  };
+  gchar *filename;
+  guint i;
+
+  filename = write_test_photo ();
+
+  for (i = 0; i < G_N_ELEMENTS (loads); i++)
+    {
+      gdouble before, after;
+      glong before_peak, after_peak, before_syscalls, after_syscalls;
+
+      before = measure (loads[i].before, filename,
+                        &before_peak, &before_syscalls);
+      after = measure (loads[i].after, filename,
+                       &after_peak, &after_syscalls);
+
+      g_test_message ("%s: %.1f ms %ld reads, %s: %.1f ms %ld reads",
+                      loads[i].before, before * 1e3, before_syscalls,
+                      loads[i].after, after * 1e3, after_syscalls);
+      if (i == 0)
+        g_test_minimized_result (after,
+                                 "12 MP photo on slow storage: %.1f ms in "
+                                 "8 KiB reads, %.1f ms in 256 KiB reads",
+                                 before * 1e3, after * 1e3);
+    }
+
+  g_unlink (filename);
+  g_free (filename);
+}
+
+int
+main (int argc, char **argv)
+{
+  gint result;
+
+  if (argc == 4 && !strcmp (argv[1], "--measure"))
+    return measure_child (argv[2], argv[3]);
+
+  g_test_init (&argc, &argv, NULL);
+
+  test_dir = g_dir_make_tmp ("test-pixbuf-utils-XXXXXX", NULL);
+  g_assert (test_dir);
+
+#ifdef HAVE_LIBJPEG
+  g_test_add_func ("/pixbuf-utils/jpeg", test_jpeg);
+  g_test_add_func ("/pixbuf-utils/jpeg-grayscale", test_jpeg_grayscale);
+  g_test_add_func ("/pixbuf-utils/jpeg-orientation", test_jpeg_orientation);
+#endif
+  g_test_add_func ("/pixbuf-utils/orient", test_orient);
+  g_test_add_func ("/pixbuf-utils/scale-crop-orient", test_scale_crop_orient);
+  g_test_add_func ("/pixbuf-utils/fallback", test_fallback);
+  g_test_add_data_func ("/pixbuf-utils/read-blocks/loader",
+                        GINT_TO_POINTER (FALSE), test_read_blocks);
+#ifdef HAVE_LIBJPEG
+  g_test_add_data_func ("/pixbuf-utils/read-blocks/libjpeg",
+                        GINT_TO_POINTER (TRUE), test_read_blocks);
+#endif
+  if (g_test_perf ())
+    {
+#ifdef HAVE_LIBJPEG
+      g_test_add_func ("/pixbuf-utils/jpeg-benchmark", test_jpeg_benchmark);
+#endif
+      g_test_add_func ("/pixbuf-utils/orient-benchmark",
+                       test_orient_benchmark);
+      g_test_add_func ("/pixbuf-utils/io-benchmark", test_io_benchmark);
+    }
+
+  result = g_test_run ();
+
+  g_rmdir (test_dir);
+  g_free (test_dir);
+
+  return result;
+}
+
+#endif
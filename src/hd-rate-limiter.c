@@ -0,0 +1,181 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "hd-rate-limiter.h"
+
+/* Full buckets are forgotten when there are more of them, a new
+ * bucket is full anyway. */
+#define MAX_BUCKETS 64
+
+typedef struct
+{
+  gdouble tokens;
+  gint64  last;
+} Bucket;
+
+struct _HDRateLimiter
+{
+  gdouble     rate;
+  guint       burst;
+  GHashTable *buckets;
+};
+
+static void
+bucket_free (Bucket *bucket)
+{
+  g_slice_free (Bucket, bucket);
+}
+
+HDRateLimiter *
+hd_rate_limiter_new (gdouble rate,
+                     guint   burst)
+{
+  HDRateLimiter *limiter = g_slice_new (HDRateLimiter);
+
+  limiter->rate = rate;
+  limiter->burst = MAX (burst, 1);
+  limiter->buckets = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify) bucket_free);
+
+  return limiter;
+}
+
+/* Reads the limits from @prefix"Rate" and @prefix"Burst" in @group of
+ * @key_file.  Returns %NULL if the rate is 0, which disables limiting. */
+HDRateLimiter *
+hd_rate_limiter_new_from_key_file (GKeyFile    *key_file,
+                                   const gchar *group,
+                                   const gchar *prefix,
+                                   gdouble      default_rate,
+                                   guint        default_burst)
+{
+  gdouble rate = default_rate;
+  gint burst = default_burst;
+  gchar *key;
+  GError *error = NULL;
+
+  key = g_strconcat (prefix, "Rate", NULL);
+  if (key_file && g_key_file_has_key (key_file, group, key, NULL))
+    {
+      rate = g_key_file_get_double (key_file, group, key, &error);
+      if (error)
+        {
+          g_warning ("%s. Could not read %s. %s", __FUNCTION__, key, error->message);
+          g_clear_error (&error);
+          rate = default_rate;
+        }
+    }
+  g_free (key);
+
+  key = g_strconcat (prefix, "Burst", NULL);
+  if (key_file && g_key_file_has_key (key_file, group, key, NULL))
+    {
+      burst = g_key_file_get_integer (key_file, group, key, &error);
+      if (error)
+        {
+          g_warning ("%s. Could not read %s. %s", __FUNCTION__, key, error->message);
+          g_clear_error (&error);
+          burst = default_burst;
+        }
+    }
+  g_free (key);
+
+  if (rate <= 0)
+    return NULL;
+
+  return hd_rate_limiter_new (rate, MAX (burst, 1));
+}
+
+void
+hd_rate_limiter_free (HDRateLimiter *limiter)
+{
+  if (!limiter)
+    return;
+
+  g_hash_table_destroy (limiter->buckets);
+
+  g_slice_free (HDRateLimiter, limiter);
+}
+
+static void
+refill (HDRateLimiter *limiter,
+        Bucket        *bucket,
+        gint64         now)
+{
+  bucket->tokens = MIN (limiter->burst,
+                        bucket->tokens +
+                        (now - bucket->last) * limiter->rate / G_USEC_PER_SEC);
+  bucket->last = now;
+}
+
+static gboolean
+bucket_is_full (gpointer       key,
+                Bucket        *bucket,
+                HDRateLimiter *limiter)
+{
+  refill (limiter, bucket, g_get_monotonic_time ());
+
+  return bucket->tokens >= limiter->burst;
+}
+
+/* Takes a token from the bucket of @key and returns whether there
+ * was one. */
+gboolean
+hd_rate_limiter_consume (HDRateLimiter *limiter,
+                         const gchar   *key)
+{
+  Bucket *bucket;
+  gint64 now;
+
+  g_return_val_if_fail (limiter, TRUE);
+  g_return_val_if_fail (key, TRUE);
+
+  now = g_get_monotonic_time ();
+
+  bucket = g_hash_table_lookup (limiter->buckets, key);
+  if (!bucket)
+    {
+      if (g_hash_table_size (limiter->buckets) >= MAX_BUCKETS)
+        g_hash_table_foreach_remove (limiter->buckets,
+                                     (GHRFunc) bucket_is_full,
+                                     limiter);
+
+      bucket = g_slice_new (Bucket);
+      bucket->tokens = limiter->burst;
+      bucket->last = now;
+      g_hash_table_insert (limiter->buckets, g_strdup (key), bucket);
+    }
+  else
+    refill (limiter, bucket, now);
+
+  if (bucket->tokens < 1)
+    return FALSE;
+
+  bucket->tokens -= 1;
+
+  return TRUE;
+}
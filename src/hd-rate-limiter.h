@@ -0,0 +1,51 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_RATE_LIMITER_H__
+#define __HD_RATE_LIMITER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The notification flood control settings, see notification.conf */
+#define HD_FLOOD_CONTROL_CONFIG_FILE HD_DESKTOP_CONFIG_PATH "/notification.conf"
+#define HD_FLOOD_CONTROL_GROUP       "Flood-Control"
+
+/* Token buckets by key.  Each key may pass @burst times at once and
+ * @rate times per second after that. */
+typedef struct _HDRateLimiter HDRateLimiter;
+
+HDRateLimiter *hd_rate_limiter_new               (gdouble        rate,
+                                                  guint          burst);
+HDRateLimiter *hd_rate_limiter_new_from_key_file (GKeyFile      *key_file,
+                                                  const gchar   *group,
+                                                  const gchar   *prefix,
+                                                  gdouble        default_rate,
+                                                  guint          default_burst);
+void           hd_rate_limiter_free              (HDRateLimiter *limiter);
+
+gboolean       hd_rate_limiter_consume           (HDRateLimiter *limiter,
+                                                  const gchar   *key);
+
+G_END_DECLS
+
+#endif
@@ -30,11 +30,13 @@
 #include <gconf/gconf-client.h>
 #include <dbus/dbus-glib.h>
 
+#include <glib/gstdio.h>
 #include <string.h>
 
 #define _XOPEN_SOURCE 500
 #include <ftw.h>
 
+#include "hd-memory-pressure.h"
 #include "hd-shortcut-widgets.h"
 
 #define HD_SHORTCUT_WIDGETS_GET_PRIVATE(object) \
@@ -64,6 +66,8 @@ struct _HDShortcutWidgetsPrivate
   GHashTable *monitors;
 
   GConfClient *gconf_client;
+
+  guint shrinker_id;
 };
 
 typedef struct
@@ -92,6 +96,16 @@ enum
 
 static guint shortcut_widgets_signals [LAST_SIGNAL] = { 0 };
 
+/* .desktop files parsed by hd_shortcut_widgets_preload () */
+typedef struct
+{
+  GKeyFile *desktop_file;
+  time_t    mtime;
+} HDPreloadedFile;
+
+static GHashTable *preloaded_files = NULL;
+static GMutex preload_mutex;
+
 static gboolean hd_shortcut_widgets_scan_for_desktop_files (const gchar *directory);
 
 G_DEFINE_TYPE (HDShortcutWidgets, hd_shortcut_widgets, HD_TYPE_WIDGETS);
@@ -207,6 +221,67 @@ load_icon_from_icon_name (const gchar *icon_name)
   return pixbuf;
 }
 
+static void
+hd_preloaded_file_free (HDPreloadedFile *preloaded)
+{
+  g_key_file_free (preloaded->desktop_file);
+
+  g_slice_free (HDPreloadedFile, preloaded);
+}
+
+/* Returns the preloaded key file of @filename if there is one and
+ * the file was not modified since. */
+static GKeyFile *
+steal_preloaded_file (const gchar *filename)
+{
+  HDPreloadedFile *preloaded = NULL;
+  GKeyFile *desktop_file = NULL;
+  gchar *key;
+  struct stat sb;
+
+  g_mutex_lock (&preload_mutex);
+  if (preloaded_files)
+    {
+      if (g_hash_table_steal_extended (preloaded_files,
+                                       filename,
+                                       (gpointer *) &key,
+                                       (gpointer *) &preloaded))
+        g_free (key);
+
+      /* Everything was loaded by now */
+      if (!g_hash_table_size (preloaded_files))
+        preloaded_files = (g_hash_table_destroy (preloaded_files), NULL);
+    }
+  g_mutex_unlock (&preload_mutex);
+
+  if (!preloaded)
+    return NULL;
+
+  if (!g_stat (filename, &sb) && sb.st_mtime == preloaded->mtime)
+    {
+      desktop_file = preloaded->desktop_file;
+      preloaded->desktop_file = NULL;
+      g_slice_free (HDPreloadedFile, preloaded);
+    }
+  else
+    hd_preloaded_file_free (preloaded);
+
+  return desktop_file;
+}
+
+/* Frees the files the first scan did not load, they were removed
+ * or are not .desktop files. */
+static gboolean
+drop_preloaded_files (gpointer data)
+{
+  g_mutex_lock (&preload_mutex);
+  if (preloaded_files)
+    preloaded_files = (g_hash_table_destroy (preloaded_files), NULL);
+  g_mutex_unlock (&preload_mutex);
+
+  return FALSE;
+}
+
 static gboolean
 hd_shortcut_widgets_load_desktop_file (const gchar *filename)
 {
@@ -220,17 +295,21 @@ hd_shortcut_widgets_load_desktop_file (const gchar *filename)
 
   g_debug ("hd_shortcut_widgets_load_desktop_file (%s)", filename);
 
-  desktop_file = g_key_file_new ();
-  if (!g_key_file_load_from_file (desktop_file,
-                                  filename,
-                                  G_KEY_FILE_NONE,
-                                  &error))
+  desktop_file = steal_preloaded_file (filename);
+  if (!desktop_file)
     {
-      g_debug ("Could not read .desktop file `%s'. %s",
-               filename,
-               error->message);
-      g_error_free (error);
-      goto cleanup;
+      desktop_file = g_key_file_new ();
+      if (!g_key_file_load_from_file (desktop_file,
+                                      filename,
+                                      G_KEY_FILE_NONE,
+                                      &error))
+        {
+          g_debug ("Could not read .desktop file `%s'. %s",
+                   filename,
+                   error->message);
+          g_error_free (error);
+          goto cleanup;
+        }
     }
 
   type = g_key_file_get_string (desktop_file,
@@ -370,17 +449,11 @@ cleanup:
 }
 
 static void
-update_icon (HDShortcutWidgets *widgets,
-             const gchar       *desktop_id,
-             HDTaskInfo        *info)
+set_row_icon (HDShortcutWidgets *widgets,
+              HDTaskInfo        *info)
 {
   HDShortcutWidgetsPrivate *priv = widgets->priv;
 
-  if (info->icon)
-    g_object_unref (info->icon);
-
-  info->icon = load_icon_from_icon_name (info->icon_name);
-
   if (gtk_tree_row_reference_valid (info->row))
     {
       GtkTreeIter iter;
@@ -396,6 +469,29 @@ update_icon (HDShortcutWidgets *widgets,
         }
       gtk_tree_path_free (path);
     }
+}
+
+/* Loads the icon again if it was released on memory pressure */
+static void
+ensure_icon (HDShortcutWidgets *widgets,
+             HDTaskInfo        *info)
+{
+  if (info->icon)
+    return;
+
+  info->icon = load_icon_from_icon_name (info->icon_name);
+  set_row_icon (widgets, info);
+}
+
+static void
+update_icon (HDShortcutWidgets *widgets,
+             const gchar       *desktop_id,
+             HDTaskInfo        *info)
+{
+  if (info->icon)
+    info->icon = (g_object_unref (info->icon), NULL);
+
+  ensure_icon (widgets, info);
 
   g_signal_emit (widgets,
                  shortcut_widgets_signals[DESKTOP_FILE_CHANGED],
@@ -557,6 +653,81 @@ hd_shortcut_widgets_scan_for_desktop_files (const gchar *directory)
   return FALSE;
 }
 
+/* The first scan.  The files it found are loaded in idles of the
+ * same priority, so the preloaded ones left are dropped after them. */
+static gboolean
+scan_at_startup (gpointer data)
+{
+  hd_shortcut_widgets_scan_for_desktop_files (HD_APPLICATIONS_DIR);
+  hd_shortcut_widgets_scan_for_desktop_files (HD_USER_APPLICATIONS_DIR);
+
+  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                   drop_preloaded_files,
+                   NULL,
+                   NULL);
+
+  return FALSE;
+}
+
+static int
+preload_visit_func (const char        *f_path,
+                    const struct stat *sb,
+                    int                type_flag,
+                    struct FTW        *ftw_buf)
+{
+  HDPreloadedFile *preloaded;
+  GKeyFile *desktop_file;
+
+  if (type_flag != FTW_F)
+    return 0;
+
+  desktop_file = g_key_file_new ();
+  if (!g_key_file_load_from_file (desktop_file,
+                                  f_path,
+                                  G_KEY_FILE_NONE,
+                                  NULL))
+    {
+      /* Reported when it is loaded again */
+      g_key_file_free (desktop_file);
+      return 0;
+    }
+
+  preloaded = g_slice_new (HDPreloadedFile);
+  preloaded->desktop_file = desktop_file;
+  preloaded->mtime = sb->st_mtime;
+
+  g_mutex_lock (&preload_mutex);
+  if (preloaded_files)
+    g_hash_table_insert (preloaded_files,
+                         g_strdup (f_path),
+                         preloaded);
+  else
+    hd_preloaded_file_free (preloaded);
+  g_mutex_unlock (&preload_mutex);
+
+  return 0;
+}
+
+/** hd_shortcut_widgets_preload:
+ *
+ * Reads and parses the application .desktop files, so the scan started
+ * by hd_shortcut_widgets_get () does not have to wait for the disk.
+ * Can be called from any thread, but not while the scan is running.
+ **/
+void
+hd_shortcut_widgets_preload (void)
+{
+  g_mutex_lock (&preload_mutex);
+  if (!preloaded_files)
+    preloaded_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free,
+                                             (GDestroyNotify) hd_preloaded_file_free);
+  g_mutex_unlock (&preload_mutex);
+
+  nftw (HD_APPLICATIONS_DIR, preload_visit_func, 20, FTW_PHYS);
+  nftw (HD_USER_APPLICATIONS_DIR, preload_visit_func, 20, FTW_PHYS);
+}
+
 static void
 update_installed_shortcuts (HDShortcutWidgets *widgets)
 {
@@ -625,6 +796,36 @@ filtered_model_visible_func (GtkTreeModel *model,
   return value == NULL;
 }
 
+/* Releases the icons of the tasks without a shortcut, they are only
+ * shown in the shortcut selection dialog and loaded again for it. */
+static gsize
+shrink (HDMemoryPressureLevel  level,
+        HDShortcutWidgets     *widgets)
+{
+  HDShortcutWidgetsPrivate *priv = widgets->priv;
+  GHashTableIter iter;
+  gpointer desktop_id, value;
+  gsize released = 0;
+
+  g_hash_table_iter_init (&iter, priv->available_tasks);
+  while (g_hash_table_iter_next (&iter, &desktop_id, &value))
+    {
+      HDTaskInfo *info = value;
+
+      if (!info->icon ||
+          g_hash_table_lookup (priv->installed_shortcuts, desktop_id))
+        continue;
+
+      released += gdk_pixbuf_get_rowstride (info->icon) *
+                  gdk_pixbuf_get_height (info->icon);
+
+      info->icon = (g_object_unref (info->icon), NULL);
+      set_row_icon (widgets, info);
+    }
+
+  return released;
+}
+
 static void
 destroy_monitor (GFileMonitor *monitor)
 {
@@ -676,6 +877,11 @@ hd_shortcut_widgets_init (HDShortcutWidgets *widgets)
 
   g_signal_connect_swapped (gtk_icon_theme_get_default (), "changed",
                             G_CALLBACK (update_all_icons), widgets);
+
+  priv->shrinker_id = hd_memory_pressure_add_shrinker ("shortcut-icons",
+                                                       HD_MEMORY_PRESSURE_PRIORITY_ICONS,
+                                                       (HDMemoryPressureShrinkFunc) shrink,
+                                                       widgets);
 }
 
 static void
@@ -683,6 +889,9 @@ hd_shortcut_widgets_dispose (GObject *obj)
 {
   HDShortcutWidgetsPrivate *priv = HD_SHORTCUT_WIDGETS (obj)->priv;
 
+  if (priv->shrinker_id)
+    priv->shrinker_id = (hd_memory_pressure_remove_shrinker (priv->shrinker_id), 0);
+
   if (priv->gconf_client)
     priv->gconf_client = (g_object_unref (priv->gconf_client), NULL);
 
@@ -711,6 +920,13 @@ static GtkTreeModel *
 hd_shortcut_widgets_get_model (HDWidgets *widgets)
 {
   HDShortcutWidgetsPrivate *priv = HD_SHORTCUT_WIDGETS (widgets)->priv;
+  GHashTableIter iter;
+  gpointer task_info;
+
+  /* The dialog shows all icons */
+  g_hash_table_iter_init (&iter, priv->available_tasks);
+  while (g_hash_table_iter_next (&iter, NULL, &task_info))
+    ensure_icon (HD_SHORTCUT_WIDGETS (widgets), task_info);
 
   return g_object_ref (priv->filtered_model);
 }
@@ -878,10 +1094,7 @@ hd_shortcut_widgets_get (void)
     {
       widgets = g_object_new (HD_TYPE_SHORTCUT_WIDGETS, NULL);
 
-      gdk_threads_add_idle ((GSourceFunc) hd_shortcut_widgets_scan_for_desktop_files,
-                            HD_APPLICATIONS_DIR);
-      gdk_threads_add_idle ((GSourceFunc) hd_shortcut_widgets_scan_for_desktop_files,
-                            HD_USER_APPLICATIONS_DIR);
+      gdk_threads_add_idle (scan_at_startup, NULL);
     }
 
   return widgets;
@@ -918,5 +1131,7 @@ hd_shortcut_widgets_get_icon (HDShortcutWidgets *widgets,
   if (!info)
     return NULL;
 
+  ensure_icon (widgets, info);
+
   return info->icon;
 }
@@ -54,6 +54,7 @@ struct _HDShortcutWidgetsClass
 GType          hd_shortcut_widgets_get_type    (void);
 
 HDWidgets    *hd_shortcut_widgets_get          (void);
+void          hd_shortcut_widgets_preload      (void);
 
 gboolean      hd_shortcut_widgets_is_available (HDShortcutWidgets *widgets,
                                                 const gchar       *desktop_id);
@@ -0,0 +1,707 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <string.h>
+
+#include "hd-startup.h"
+#include "hd-trace.h"
+
+/* Most of the work in the workers is waiting for the disk,
+ * a few threads are enough. */
+#define MAX_WORKERS 2
+
+typedef struct
+{
+  const gchar      *name;
+  HDStartupContext  context;
+  HDStartupFunc     func;
+  gpointer          data;
+
+  /* Number of dependencies not finished yet */
+  guint             n_pending;
+  /* Tasks depending on this one */
+  GSList           *dependents;
+} HDStartupTask;
+
+struct _HDStartup
+{
+  GPtrArray   *tasks;
+
+  GQueue       ready;
+  GThreadPool *pool;
+  GAsyncQueue *finished;
+};
+
+HDStartup *
+hd_startup_new (void)
+{
+  HDStartup *startup = g_slice_new0 (HDStartup);
+
+  startup->tasks = g_ptr_array_new ();
+  g_queue_init (&startup->ready);
+
+  return startup;
+}
+
+void
+hd_startup_free (HDStartup *startup)
+{
+  guint i;
+
+  if (!startup)
+    return;
+
+  for (i = 0; i < startup->tasks->len; i++)
+    {
+      HDStartupTask *task = g_ptr_array_index (startup->tasks, i);
+
+      g_slist_free (task->dependents);
+      g_slice_free (HDStartupTask, task);
+    }
+  g_ptr_array_free (startup->tasks, TRUE);
+
+  g_queue_clear (&startup->ready);
+
+  g_slice_free (HDStartup, startup);
+}
+
+static HDStartupTask *
+lookup_task (HDStartup   *startup,
+             const gchar *name)
+{
+  guint i;
+
+  for (i = 0; i < startup->tasks->len; i++)
+    {
+      HDStartupTask *task = g_ptr_array_index (startup->tasks, i);
+
+      if (!strcmp (task->name, name))
+        return task;
+    }
+
+  return NULL;
+}
+
+/* Adds a task named @name which calls @func with @data.  The NULL
+ * terminated list of dependencies names tasks which were added
+ * before, so the tasks can never depend on each other in a cycle.
+ * @name must be a static string. */
+void
+hd_startup_add (HDStartup        *startup,
+                const gchar      *name,
+                HDStartupContext  context,
+                HDStartupFunc     func,
+                gpointer          data,
+                const gchar      *first_dependency,
+                ...)
+{
+  HDStartupTask *task;
+  const gchar *dependency;
+  va_list args;
+
+  g_return_if_fail (startup);
+  g_return_if_fail (name);
+  g_return_if_fail (func);
+
+  task = g_slice_new0 (HDStartupTask);
+  task->name = name;
+  task->context = context;
+  task->func = func;
+  task->data = data;
+
+  va_start (args, first_dependency);
+  for (dependency = first_dependency; dependency;
+       dependency = va_arg (args, const gchar *))
+    {
+      HDStartupTask *parent = lookup_task (startup, dependency);
+
+      if (!parent)
+        {
+          g_warning ("%s. Task %s depends on unknown task %s",
+                     __FUNCTION__,
+                     name,
+                     dependency);
+          continue;
+        }
+
+      parent->dependents = g_slist_prepend (parent->dependents, task);
+      task->n_pending++;
+    }
+  va_end (args);
+
+  g_ptr_array_add (startup->tasks, task);
+}
+
+static void
+run_task (HDStartupTask *task)
+{
+  HD_TRACE_BEGIN (task->name);
+  task->func (task->data);
+  HD_TRACE_END (task->name);
+}
+
+static void
+worker_func (HDStartupTask *task,
+             HDStartup     *startup)
+{
+  run_task (task);
+
+  g_async_queue_push (startup->finished, task);
+}
+
+static void
+schedule_task (HDStartup     *startup,
+               HDStartupTask *task)
+{
+  GError *error = NULL;
+
+  if (task->context == HD_STARTUP_WORKER && startup->pool)
+    {
+      g_thread_pool_push (startup->pool, task, &error);
+      if (!error)
+        return;
+
+      g_warning ("%s. Could not start task %s in a thread. %s",
+                 __FUNCTION__,
+                 task->name,
+                 error->message);
+      g_error_free (error);
+    }
+
+  /* Fall back to the main thread if the task cannot be pushed
+   * to the pool. */
+  g_queue_push_tail (&startup->ready, task);
+}
+
+static void
+task_finished (HDStartup     *startup,
+               HDStartupTask *task)
+{
+  GSList *l;
+
+  /* The tasks were prepended, reverse to start them in order */
+  task->dependents = g_slist_reverse (task->dependents);
+
+  for (l = task->dependents; l; l = l->next)
+    {
+      HDStartupTask *dependent = l->data;
+
+      if (!--dependent->n_pending)
+        schedule_task (startup, dependent);
+    }
+}
+
+/* Runs all tasks and returns when all of them finished.  The main
+ * thread tasks are run in the order they became ready, interleaved
+ * with the workers. */
+void
+hd_startup_run (HDStartup *startup)
+{
+  GError *error = NULL;
+  guint i, n_finished = 0;
+
+  g_return_if_fail (startup);
+
+  startup->finished = g_async_queue_new ();
+  startup->pool = g_thread_pool_new ((GFunc) worker_func,
+                                     startup,
+                                     MAX_WORKERS,
+                                     FALSE,
+                                     &error);
+  if (error)
+    {
+      g_warning ("%s. Could not create thread pool, running all tasks"
+                 " in the main thread. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+    }
+
+  for (i = 0; i < startup->tasks->len; i++)
+    {
+      HDStartupTask *task = g_ptr_array_index (startup->tasks, i);
+
+      if (!task->n_pending)
+        schedule_task (startup, task);
+    }
+
+  while (n_finished < startup->tasks->len)
+    {
+      HDStartupTask *task;
+
+      /* Release the dependents of finished workers first, so
+       * more of them can start while the main thread is busy. */
+      task = g_async_queue_try_pop (startup->finished);
+
+      if (!task)
+        {
+          task = g_queue_pop_head (&startup->ready);
+          if (task)
+            run_task (task);
+        }
+
+      /* Nothing to do in the main thread, wait for a worker. */
+      if (!task)
+        task = g_async_queue_pop (startup->finished);
+
+      task_finished (startup, task);
+      n_finished++;
+    }
+
+  if (startup->pool)
+    startup->pool = (g_thread_pool_free (startup->pool, FALSE, TRUE), NULL);
+  startup->finished = (g_async_queue_unref (startup->finished), NULL);
+}
+
+#ifdef COMPILE_FOR_TEST
+#include <glib/gstdio.h>
+#include <sqlite3.h>
+
+/* A populated home directory */
+#define TEST_DESKTOP_FILES 400
+#define TEST_NOTIFICATIONS 2000
+#define TEST_BACKGROUNDS   64
+/* The main thread work which does not wait for the disk, creating
+ * the windows and widgets */
+#define TEST_UI_US         (50 * 1000)
+#define TEST_RUNS          5
+
+typedef struct
+{
+  gchar   *home;
+  gchar   *applications;
+  gchar   *db_path;
+  gchar   *cache_info;
+
+  /* Run everything in the main thread, as before the task graph */
+  gboolean serial;
+
+  /* What the tasks read */
+  GMutex   mutex;
+  GSList  *desktop_files;
+  guint    n_desktop_files;
+  guint    n_notifications;
+  guint    n_backgrounds;
+  guint    n_loaded;
+} Fixture;
+
+static void
+write_file (const gchar *path,
+            const gchar *contents)
+{
+  g_assert (g_file_set_contents (path, contents, -1, NULL));
+}
+
+static void
+fixture_setup (Fixture       *fixture,
+               gconstpointer  data)
+{
+  sqlite3 *db;
+  sqlite3_stmt *insert;
+  GString *cache_info;
+  gchar *dir;
+  guint i, j;
+
+  fixture->home = g_dir_make_tmp ("test-startup-XXXXXX", NULL);
+  g_assert (fixture->home);
+  fixture->applications = g_build_filename (fixture->home, "applications", NULL);
+  g_assert (!g_mkdir (fixture->applications, 0755));
+  dir = g_build_filename (fixture->applications, "hildon", NULL);
+  g_assert (!g_mkdir (dir, 0755));
+
+  /* .desktop files with translations, like the installed ones */
+  for (i = 0; i < TEST_DESKTOP_FILES; i++)
+    {
+      GString *contents = g_string_new ("[Desktop Entry]\n"
+                                        "Encoding=UTF-8\n"
+                                        "Version=1.0\n"
+                                        "Type=Application\n");
+      gchar *path;
+
+      g_string_append_printf (contents,
+                              "Name=app_%u\n"
+                              "Comment=Application number %u\n"
+                              "Exec=/usr/bin/app-%u\n"
+                              "Icon=app_%u_icon\n"
+                              "X-Osso-Service=com.example.app%u\n"
+                              "X-Osso-Type=application/x-executable\n",
+                              i, i, i, i, i);
+      for (j = 0; j < 20; j++)
+        g_string_append_printf (contents,
+                                "Name[l%02u]=Application %u in language %u\n",
+                                j, i, j);
+
+      path = g_strdup_printf ("%s/app-%u.desktop", dir, i);
+      write_file (path, contents->str);
+      g_free (path);
+      g_string_free (contents, TRUE);
+    }
+  g_free (dir);
+
+  fixture->db_path = g_build_filename (fixture->home, "notifications.db", NULL);
+  g_assert_cmpint (sqlite3_open (fixture->db_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_exec (db,
+                                 "CREATE TABLE notifications (\n"
+                                 "    id        INTEGER PRIMARY KEY,\n"
+                                 "    app_name  VARCHAR(30)  NOT NULL,\n"
+                                 "    icon_name VARCHAR(50)  NOT NULL,\n"
+                                 "    summary   VARCHAR(100) NOT NULL,\n"
+                                 "    body      VARCHAR(100) NOT NULL,\n"
+                                 "    timeout   INTEGER DEFAULT 0,\n"
+                                 "    dest      VARCHAR(100) NOT NULL\n"
+                                 ");"
+                                 "BEGIN",
+                                 NULL, NULL, NULL), ==, SQLITE_OK);
+  sqlite3_prepare_v2 (db,
+                      "INSERT INTO notifications VALUES "
+                      "(?1, 'app', 'icon', 'Summary', 'Body', 0, '')",
+                      -1, &insert, NULL);
+  for (i = 1; i <= TEST_NOTIFICATIONS; i++)
+    {
+      sqlite3_bind_int (insert, 1, i);
+      g_assert_cmpint (sqlite3_step (insert), ==, SQLITE_DONE);
+      sqlite3_reset (insert);
+    }
+  sqlite3_finalize (insert);
+  g_assert_cmpint (sqlite3_exec (db, "COMMIT", NULL, NULL, NULL), ==, SQLITE_OK);
+  sqlite3_close (db);
+
+  cache_info = g_string_new (NULL);
+  for (i = 0; i < TEST_BACKGROUNDS; i++)
+    g_string_append_printf (cache_info,
+                            "[%u]\n"
+                            "Uri=file:///home/user/MyDocs/.images/%u.jpg\n"
+                            "Mtime=%u\n"
+                            "Size=%u\n",
+                            i, i, 1234567890 + i, 100000 + i);
+  fixture->cache_info = g_build_filename (fixture->home, "cache.info", NULL);
+  write_file (fixture->cache_info, cache_info->str);
+  g_string_free (cache_info, TRUE);
+
+  g_mutex_init (&fixture->mutex);
+}
+
+static void
+fixture_teardown (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  gchar *dir = g_build_filename (fixture->applications, "hildon", NULL);
+  gchar *path;
+  guint i;
+
+  for (i = 0; i < TEST_DESKTOP_FILES; i++)
+    {
+      path = g_strdup_printf ("%s/app-%u.desktop", dir, i);
+      g_unlink (path);
+      g_free (path);
+    }
+  g_rmdir (dir);
+  g_free (dir);
+  g_rmdir (fixture->applications);
+  g_unlink (fixture->db_path);
+  g_unlink (fixture->cache_info);
+  g_rmdir (fixture->home);
+
+  g_slist_free_full (fixture->desktop_files, (GDestroyNotify) g_key_file_free);
+  g_mutex_clear (&fixture->mutex);
+  g_free (fixture->applications);
+  g_free (fixture->db_path);
+  g_free (fixture->cache_info);
+  g_free (fixture->home);
+}
+
+/* The stand-ins for the hildon-home tasks do the same I/O */
+static void
+parse_desktop_files (Fixture     *fixture,
+                     const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  if (!dir)
+    return;
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *child = g_build_filename (path, name, NULL);
+
+      if (g_file_test (child, G_FILE_TEST_IS_DIR))
+        parse_desktop_files (fixture, child);
+      else
+        {
+          GKeyFile *key_file = g_key_file_new ();
+
+          g_assert (g_key_file_load_from_file (key_file, child,
+                                               G_KEY_FILE_NONE, NULL));
+          g_mutex_lock (&fixture->mutex);
+          fixture->desktop_files = g_slist_prepend (fixture->desktop_files,
+                                                    key_file);
+          fixture->n_desktop_files++;
+          g_mutex_unlock (&fixture->mutex);
+        }
+
+      g_free (child);
+    }
+
+  g_dir_close (dir);
+}
+
+static void
+task_desktop_files (Fixture *fixture)
+{
+  parse_desktop_files (fixture, fixture->applications);
+}
+
+static void
+task_notifications_db (Fixture *fixture)
+{
+  sqlite3 *db;
+  sqlite3_stmt *select;
+
+  g_assert_cmpint (sqlite3_open (fixture->db_path, &db), ==, SQLITE_OK);
+  sqlite3_prepare_v2 (db,
+                      "SELECT id, app_name, icon_name, summary, body, "
+                      "timeout, dest FROM notifications",
+                      -1, &select, NULL);
+  while (sqlite3_step (select) == SQLITE_ROW)
+    fixture->n_notifications++;
+  sqlite3_finalize (select);
+  sqlite3_close (db);
+}
+
+static void
+task_backgrounds (Fixture *fixture)
+{
+  GKeyFile *key_file = g_key_file_new ();
+  gchar **groups;
+
+  g_assert (g_key_file_load_from_file (key_file, fixture->cache_info,
+                                       G_KEY_FILE_NONE, NULL));
+  groups = g_key_file_get_groups (key_file, NULL);
+  fixture->n_backgrounds = g_strv_length (groups);
+  g_strfreev (groups);
+  g_key_file_free (key_file);
+}
+
+static void
+task_ui (Fixture *fixture)
+{
+  gint64 end = g_get_monotonic_time () + TEST_UI_US;
+
+  while (g_get_monotonic_time () < end)
+    ;
+}
+
+static void
+task_shortcuts (Fixture *fixture)
+{
+  GSList *l;
+
+  for (l = fixture->desktop_files; l; l = l->next)
+    {
+      gchar *name = g_key_file_get_locale_string (l->data,
+                                                  "Desktop Entry",
+                                                  "Name",
+                                                  NULL,
+                                                  NULL);
+      if (name)
+        fixture->n_loaded++;
+      g_free (name);
+    }
+}
+
+static void
+task_notifications_load (Fixture *fixture)
+{
+  g_assert_cmpuint (fixture->n_notifications, ==, TEST_NOTIFICATIONS);
+}
+
+static void
+add_tasks (HDStartup *startup,
+           Fixture   *fixture)
+{
+  HDStartupContext worker = fixture->serial ? HD_STARTUP_MAIN
+                                            : HD_STARTUP_WORKER;
+
+  hd_startup_add (startup, "notifications-db", worker,
+                  (HDStartupFunc) task_notifications_db, fixture, NULL);
+  hd_startup_add (startup, "desktop-files", worker,
+                  (HDStartupFunc) task_desktop_files, fixture, NULL);
+  hd_startup_add (startup, "backgrounds", worker,
+                  (HDStartupFunc) task_backgrounds, fixture, NULL);
+  hd_startup_add (startup, "ui", HD_STARTUP_MAIN,
+                  (HDStartupFunc) task_ui, fixture, NULL);
+  hd_startup_add (startup, "notifications-load", HD_STARTUP_MAIN,
+                  (HDStartupFunc) task_notifications_load, fixture,
+                  "notifications-db", "ui", NULL);
+  hd_startup_add (startup, "shortcuts", HD_STARTUP_MAIN,
+                  (HDStartupFunc) task_shortcuts, fixture,
+                  "desktop-files", "ui", NULL);
+}
+
+static void
+reset (Fixture *fixture)
+{
+  g_slist_free_full (fixture->desktop_files, (GDestroyNotify) g_key_file_free);
+  fixture->desktop_files = NULL;
+  fixture->n_desktop_files = 0;
+  fixture->n_notifications = 0;
+  fixture->n_backgrounds = 0;
+  fixture->n_loaded = 0;
+}
+
+static gdouble
+run (Fixture *fixture)
+{
+  HDStartup *startup = hd_startup_new ();
+  gdouble elapsed;
+
+  reset (fixture);
+  add_tasks (startup, fixture);
+
+  g_test_timer_start ();
+  hd_startup_run (startup);
+  elapsed = g_test_timer_elapsed ();
+
+  hd_startup_free (startup);
+
+  g_assert_cmpuint (fixture->n_desktop_files, ==, TEST_DESKTOP_FILES);
+  g_assert_cmpuint (fixture->n_loaded, ==, TEST_DESKTOP_FILES);
+  g_assert_cmpuint (fixture->n_notifications, ==, TEST_NOTIFICATIONS);
+  g_assert_cmpuint (fixture->n_backgrounds, ==, TEST_BACKGROUNDS);
+
+  return elapsed;
+}
+
+typedef struct
+{
+  GThread *main_thread;
+  GMutex   mutex;
+  GString *order;
+  gboolean wrong_thread;
+} OrderData;
+
+typedef struct
+{
+  OrderData   *data;
+  const gchar *name;
+  gboolean     worker;
+} OrderTask;
+
+static void
+order_task (OrderTask *task)
+{
+  /* Let the other tasks overtake this one if they can */
+  g_usleep (10 * 1000);
+
+  g_mutex_lock (&task->data->mutex);
+  g_string_append (task->data->order, task->name);
+  if ((g_thread_self () == task->data->main_thread) == task->worker)
+    task->data->wrong_thread = TRUE;
+  g_mutex_unlock (&task->data->mutex);
+}
+
+static void
+test_order (void)
+{
+  HDStartup *startup = hd_startup_new ();
+  OrderData data = { g_thread_self (), };
+  OrderTask a = { &data, "a", TRUE };
+  OrderTask b = { &data, "b", FALSE };
+  OrderTask c = { &data, "c", TRUE };
+  OrderTask d = { &data, "d", FALSE };
+
+  g_mutex_init (&data.mutex);
+  data.order = g_string_new (NULL);
+
+  /* d needs a and c, c needs b */
+  hd_startup_add (startup, "a", HD_STARTUP_WORKER,
+                  (HDStartupFunc) order_task, &a, NULL);
+  hd_startup_add (startup, "b", HD_STARTUP_MAIN,
+                  (HDStartupFunc) order_task, &b, NULL);
+  hd_startup_add (startup, "c", HD_STARTUP_WORKER,
+                  (HDStartupFunc) order_task, &c, "b", NULL);
+  hd_startup_add (startup, "d", HD_STARTUP_MAIN,
+                  (HDStartupFunc) order_task, &d, "a", "c", NULL);
+  hd_startup_run (startup);
+  hd_startup_free (startup);
+
+  g_assert_cmpuint (data.order->len, ==, 4);
+  g_assert (strchr (data.order->str, 'b') < strchr (data.order->str, 'c'));
+  g_assert (strchr (data.order->str, 'a') < strchr (data.order->str, 'd'));
+  g_assert (strchr (data.order->str, 'c') < strchr (data.order->str, 'd'));
+  g_assert (!data.wrong_thread);
+
+  g_string_free (data.order, TRUE);
+  g_mutex_clear (&data.mutex);
+}
+
+static void
+test_populated_home (Fixture       *fixture,
+                     gconstpointer  data)
+{
+  fixture->serial = TRUE;
+  run (fixture);
+  fixture->serial = FALSE;
+  run (fixture);
+}
+
+/* The page cache is warm after the first run, so this measures the
+ * parsing overlapped with the main thread rather than the disk. */
+static void
+test_performance (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  gdouble serial = G_MAXDOUBLE, graph = G_MAXDOUBLE;
+  guint i;
+
+  for (i = 0; i < TEST_RUNS; i++)
+    {
+      fixture->serial = TRUE;
+      serial = MIN (serial, run (fixture));
+      fixture->serial = FALSE;
+      graph = MIN (graph, run (fixture));
+    }
+
+  g_test_message ("Serial startup in %f s", serial);
+  g_test_minimized_result (graph, "Task graph startup in %f s", graph);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/startup/order", test_order);
+  g_test_add ("/startup/populated-home", Fixture, NULL,
+              fixture_setup, test_populated_home, fixture_teardown);
+  if (g_test_perf ())
+    g_test_add ("/startup/performance", Fixture, NULL,
+                fixture_setup, test_performance, fixture_teardown);
+
+  return g_test_run ();
+}
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_STARTUP_H__
+#define __HD_STARTUP_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HDStartup HDStartup;
+
+typedef enum
+{
+  HD_STARTUP_MAIN,
+  HD_STARTUP_WORKER
+} HDStartupContext;
+
+typedef void (*HDStartupFunc) (gpointer data);
+
+/** HDStartup:
+ *
+ * A set of initialization tasks with dependencies between them.
+ * %HD_STARTUP_MAIN tasks run in the thread calling hd_startup_run (),
+ * %HD_STARTUP_WORKER tasks run in a thread pool so they may only do
+ * work which is safe outside the main thread, like file or database
+ * I/O.  A task is started as soon as all of its dependencies finished.
+ */
+HDStartup *hd_startup_new  (void);
+void       hd_startup_free (HDStartup        *startup);
+
+void       hd_startup_add  (HDStartup        *startup,
+                            const gchar      *name,
+                            HDStartupContext  context,
+                            HDStartupFunc     func,
+                            gpointer          data,
+                            const gchar      *first_dependency,
+                            ...);
+
+void       hd_startup_run  (HDStartup        *startup);
+
+G_END_DECLS
+
+#endif
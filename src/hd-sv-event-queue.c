@@ -0,0 +1,719 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib-object.h>
+
+#include "hd-sv-event-queue.h"
+
+/* Freedesktop notification urgency levels */
+#define URGENCY_LOW      0
+#define URGENCY_NORMAL   1
+#define URGENCY_CRITICAL 2
+
+typedef enum
+{
+  EVENT_QUEUED,
+  EVENT_PLAYING,
+  EVENT_PLAYED
+} EventState;
+
+typedef struct
+{
+  HDSVEventQueue *queue;
+  EventState      state;
+  guint       urgency;
+  gchar      *category;
+
+  /* Copies of the PlayEvent arguments, until the event is played */
+  GHashTable *hints;
+  gchar      *sender;
+
+  /* Id returned by the plugin, -1 if not played (anymore) */
+  gint        plugin_id;
+
+  /* Number of ids referring to this event, merged events share it */
+  guint       n_ids;
+
+  /* Ends the window of a playing event */
+  guint       window_timeout;
+} Event;
+
+struct _HDSVEventQueue
+{
+  HDSVPlugin *plugin;
+  guint       window;
+
+  /* Waiting events, most urgent first */
+  GQueue      queue;
+
+  /* Events played less than @window ago */
+  GList      *playing;
+
+  /* Maps the ids returned by PlayEvent to the events */
+  GHashTable *ids;
+  gint        next_id;
+};
+
+static void dispatch (HDSVEventQueue *queue);
+
+static void
+hint_value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_free (value);
+}
+
+static void
+copy_hint (const gchar *key,
+           GValue      *value,
+           GHashTable  *copy)
+{
+  GValue *value_copy = g_new0 (GValue, 1);
+
+  g_value_init (value_copy, G_VALUE_TYPE (value));
+  g_value_copy (value, value_copy);
+
+  g_hash_table_insert (copy, g_strdup (key), value_copy);
+}
+
+static guint
+get_urgency (GHashTable *hints)
+{
+  GValue *value = g_hash_table_lookup (hints, "urgency");
+
+  if (value && G_VALUE_HOLDS_UCHAR (value))
+    return MIN (g_value_get_uchar (value), URGENCY_CRITICAL);
+  if (value && G_VALUE_HOLDS_INT (value))
+    return CLAMP (g_value_get_int (value), URGENCY_LOW, URGENCY_CRITICAL);
+
+  return URGENCY_NORMAL;
+}
+
+static Event *
+event_new (HDSVEventQueue *queue,
+           GHashTable     *hints,
+           const gchar    *sender)
+{
+  Event *event = g_slice_new0 (Event);
+  GValue *category;
+
+  event->queue = queue;
+  event->state = EVENT_QUEUED;
+  event->urgency = get_urgency (hints);
+  event->plugin_id = -1;
+
+  category = g_hash_table_lookup (hints, "category");
+  if (category && G_VALUE_HOLDS_STRING (category))
+    event->category = g_value_dup_string (category);
+
+  event->hints = g_hash_table_new_full (g_str_hash,
+                                        g_str_equal,
+                                        (GDestroyNotify) g_free,
+                                        (GDestroyNotify) hint_value_free);
+  g_hash_table_foreach (hints, (GHFunc) copy_hint, event->hints);
+  event->sender = g_strdup (sender);
+
+  return event;
+}
+
+static void
+event_free (Event *event)
+{
+  if (event->window_timeout)
+    g_source_remove (event->window_timeout);
+  g_free (event->category);
+  if (event->hints)
+    g_hash_table_destroy (event->hints);
+  g_free (event->sender);
+
+  g_slice_free (Event, event);
+}
+
+HDSVEventQueue *
+hd_sv_event_queue_new (HDSVPlugin *plugin,
+                       guint       window)
+{
+  HDSVEventQueue *queue = g_slice_new0 (HDSVEventQueue);
+
+  queue->plugin = plugin;
+  queue->window = window;
+  g_queue_init (&queue->queue);
+  queue->ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+  queue->next_id = 1;
+
+  return queue;
+}
+
+static void
+collect_event (gpointer   id,
+               Event     *event,
+               GList    **events)
+{
+  if (!g_list_find (*events, event))
+    *events = g_list_prepend (*events, event);
+}
+
+/* Frees @queue but does not stop the events already played. */
+void
+hd_sv_event_queue_free (HDSVEventQueue *queue)
+{
+  GList *events = NULL;
+
+  if (!queue)
+    return;
+
+  g_hash_table_foreach (queue->ids, (GHFunc) collect_event, &events);
+  g_list_foreach (events, (GFunc) event_free, NULL);
+  g_list_free (events);
+
+  g_hash_table_destroy (queue->ids);
+  g_queue_clear (&queue->queue);
+  g_list_free (queue->playing);
+
+  g_slice_free (HDSVEventQueue, queue);
+}
+
+/* Used with g_queue_insert_sorted (), which inserts @event before the
+ * first @queued for which this returns >= 0.  Keeps more urgent events
+ * first and equally urgent ones in arrival order. */
+static gint
+compare_urgency (Event    *queued,
+                 Event    *event,
+                 gpointer  data)
+{
+  return queued->urgency >= event->urgency ? -1 : 1;
+}
+
+static Event *
+find_mergeable (HDSVEventQueue *queue,
+                Event          *event)
+{
+  GList *l;
+
+  if (!event->category)
+    return NULL;
+
+  for (l = queue->playing; l; l = l->next)
+    {
+      Event *playing = l->data;
+
+      if (!g_strcmp0 (playing->category, event->category) &&
+          playing->urgency >= event->urgency)
+        return playing;
+    }
+
+  for (l = queue->queue.head; l; l = l->next)
+    {
+      Event *queued = l->data;
+
+      if (!g_strcmp0 (queued->category, event->category))
+        return queued;
+    }
+
+  return NULL;
+}
+
+/* Ends the window of the playing @event. */
+static void
+end_window (Event *event)
+{
+  HDSVEventQueue *queue = event->queue;
+
+  if (event->window_timeout)
+    event->window_timeout = (g_source_remove (event->window_timeout), 0);
+
+  queue->playing = g_list_remove (queue->playing, event);
+  event->state = EVENT_PLAYED;
+}
+
+/* Stops the playing @event. */
+static void
+stop_playing (Event *event)
+{
+  end_window (event);
+
+  if (event->plugin_id >= 0)
+    hd_sv_plugin_stop_event (event->queue->plugin, event->plugin_id);
+  event->plugin_id = -1;
+}
+
+static gboolean
+window_timeout_cb (Event *event)
+{
+  event->window_timeout = 0;
+
+  /* The window is over, the event keeps playing until it is
+   * stopped but does not hold back less urgent ones anymore. */
+  end_window (event);
+
+  dispatch (event->queue);
+
+  return FALSE;
+}
+
+static guint
+playing_urgency (HDSVEventQueue *queue)
+{
+  guint urgency = URGENCY_LOW;
+  GList *l;
+
+  for (l = queue->playing; l; l = l->next)
+    urgency = MAX (urgency, ((Event *) l->data)->urgency);
+
+  return urgency;
+}
+
+/* Plays the waiting events which are at least as urgent as the ones
+ * in their window.  Events of other categories do not wait for the
+ * window, it is only there to merge the same category. */
+static void
+dispatch (HDSVEventQueue *queue)
+{
+  Event *event;
+
+  while ((event = g_queue_peek_head (&queue->queue)) &&
+         event->urgency >= playing_urgency (queue))
+    {
+      g_queue_pop_head (&queue->queue);
+
+      event->state = EVENT_PLAYING;
+      event->plugin_id = hd_sv_plugin_play_event (queue->plugin,
+                                                  event->hints,
+                                                  event->sender);
+
+      /* Not needed anymore */
+      event->hints = (g_hash_table_destroy (event->hints), NULL);
+      event->sender = (g_free (event->sender), NULL);
+
+      queue->playing = g_list_prepend (queue->playing, event);
+      event->window_timeout = g_timeout_add (queue->window,
+                                             (GSourceFunc) window_timeout_cb,
+                                             event);
+    }
+}
+
+/* Queues an event for @hints and returns the id to stop it with.
+ * The event is played right away unless a more urgent one is in its
+ * window. */
+gint
+hd_sv_event_queue_play (HDSVEventQueue *queue,
+                        GHashTable     *hints,
+                        const gchar    *sender)
+{
+  Event *event, *merged;
+  gint id;
+
+  g_return_val_if_fail (queue, -1);
+  g_return_val_if_fail (hints, -1);
+
+  id = queue->next_id++;
+  if (queue->next_id <= 0)
+    queue->next_id = 1;
+
+  event = event_new (queue, hints, sender);
+
+  merged = find_mergeable (queue, event);
+  if (merged)
+    {
+      /* The merged event plays with the higher urgency of both */
+      if (merged->state == EVENT_QUEUED && event->urgency > merged->urgency)
+        {
+          merged->urgency = event->urgency;
+          g_queue_remove (&queue->queue, merged);
+          g_queue_insert_sorted (&queue->queue, merged,
+                                 (GCompareDataFunc) compare_urgency, NULL);
+        }
+
+      event_free (event);
+      event = merged;
+    }
+  else
+    {
+      g_queue_insert_sorted (&queue->queue, event,
+                             (GCompareDataFunc) compare_urgency, NULL);
+    }
+
+  event->n_ids++;
+  g_hash_table_insert (queue->ids, GINT_TO_POINTER (id), event);
+
+  /* Preempt less urgent feedback */
+  if (event->state == EVENT_QUEUED)
+    {
+      GList *l, *next;
+
+      for (l = queue->playing; l; l = next)
+        {
+          Event *playing = l->data;
+
+          next = l->next;
+          if (playing->urgency < event->urgency)
+            stop_playing (playing);
+        }
+    }
+
+  dispatch (queue);
+
+  return id;
+}
+
+/* Stops the event of @id.  Merged events are stopped if all ids
+ * referring to them are stopped. */
+void
+hd_sv_event_queue_stop (HDSVEventQueue *queue,
+                        gint            id)
+{
+  Event *event;
+
+  g_return_if_fail (queue);
+
+  event = g_hash_table_lookup (queue->ids, GINT_TO_POINTER (id));
+  if (!event)
+    return;
+
+  g_hash_table_remove (queue->ids, GINT_TO_POINTER (id));
+  if (--event->n_ids)
+    return;
+
+  switch (event->state)
+    {
+      case EVENT_QUEUED:
+        g_queue_remove (&queue->queue, event);
+        break;
+      case EVENT_PLAYING:
+        stop_playing (event);
+        dispatch (queue);
+        break;
+      case EVENT_PLAYED:
+        if (event->plugin_id >= 0)
+          hd_sv_plugin_stop_event (queue->plugin, event->plugin_id);
+        break;
+    }
+
+  event_free (event);
+}
+
+#ifdef COMPILE_FOR_TEST
+#define TEST_WINDOW 20 /* ms */
+
+/* A sound/vibra plugin which records the calls */
+struct _HDSVPlugin
+{
+  GPtrArray *played;    /* Categories of the played events */
+  GArray    *stopped;   /* Plugin ids of the stopped events */
+  gint       next_id;
+};
+
+gint
+hd_sv_plugin_play_event (HDSVPlugin  *plugin,
+                         GHashTable  *hints,
+                         const gchar *sender)
+{
+  GValue *category = g_hash_table_lookup (hints, "category");
+
+  g_assert_cmpstr (sender, ==, "test");
+
+  g_ptr_array_add (plugin->played,
+                   g_value_dup_string (category));
+
+  return plugin->next_id++;
+}
+
+void
+hd_sv_plugin_stop_event (HDSVPlugin *plugin,
+                         gint        id)
+{
+  g_array_append_val (plugin->stopped, id);
+}
+
+typedef struct
+{
+  HDSVPlugin      plugin;
+  HDSVEventQueue *queue;
+} Fixture;
+
+static void
+fixture_setup (Fixture       *fixture,
+               gconstpointer  data)
+{
+  fixture->plugin.played = g_ptr_array_new_with_free_func (g_free);
+  fixture->plugin.stopped = g_array_new (FALSE, FALSE, sizeof (gint));
+  fixture->plugin.next_id = 1;
+  fixture->queue = hd_sv_event_queue_new (&fixture->plugin,
+                                          GPOINTER_TO_UINT (data));
+}
+
+static void
+fixture_teardown (Fixture       *fixture,
+                  gconstpointer  data)
+{
+  hd_sv_event_queue_free (fixture->queue);
+  g_ptr_array_free (fixture->plugin.played, TRUE);
+  g_array_free (fixture->plugin.stopped, TRUE);
+}
+
+static gint
+play (Fixture     *fixture,
+      const gchar *category,
+      guchar       urgency)
+{
+  GHashTable *hints;
+  GValue *value;
+  gint id;
+
+  hints = g_hash_table_new_full (g_str_hash,
+                                 g_str_equal,
+                                 NULL,
+                                 (GDestroyNotify) hint_value_free);
+
+  value = g_new0 (GValue, 1);
+  g_value_init (value, G_TYPE_STRING);
+  g_value_set_string (value, category);
+  g_hash_table_insert (hints, "category", value);
+
+  value = g_new0 (GValue, 1);
+  g_value_init (value, G_TYPE_UCHAR);
+  g_value_set_uchar (value, urgency);
+  g_hash_table_insert (hints, "urgency", value);
+
+  id = hd_sv_event_queue_play (fixture->queue, hints, "test");
+  g_hash_table_destroy (hints);
+
+  g_assert_cmpint (id, >, 0);
+
+  return id;
+}
+
+static gboolean
+quit_cb (GMainLoop *loop)
+{
+  g_main_loop_quit (loop);
+
+  return FALSE;
+}
+
+/* Lets @n_windows of the queue pass */
+static void
+wait_windows (guint n_windows)
+{
+  GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+
+  g_timeout_add (n_windows * TEST_WINDOW + TEST_WINDOW / 2,
+                 (GSourceFunc) quit_cb,
+                 loop);
+  g_main_loop_run (loop);
+  g_main_loop_unref (loop);
+}
+
+static void
+assert_played (Fixture     *fixture,
+               const gchar *categories)
+{
+  gchar **expected = g_strsplit (categories, " ", -1);
+  guint i;
+
+  g_assert_cmpuint (fixture->plugin.played->len, ==, g_strv_length (expected));
+  for (i = 0; expected[i]; i++)
+    g_assert_cmpstr (g_ptr_array_index (fixture->plugin.played, i), ==, expected[i]);
+
+  g_strfreev (expected);
+}
+
+static void
+test_play_stop (Fixture       *fixture,
+                gconstpointer  data)
+{
+  gint id;
+
+  id = play (fixture, "email", URGENCY_NORMAL);
+  assert_played (fixture, "email");
+
+  hd_sv_event_queue_stop (fixture->queue, id);
+  g_assert_cmpuint (fixture->plugin.stopped->len, ==, 1);
+  g_assert_cmpint (g_array_index (fixture->plugin.stopped, gint, 0), ==, 1);
+
+  /* Unknown and repeated ids are ignored */
+  hd_sv_event_queue_stop (fixture->queue, id);
+  hd_sv_event_queue_stop (fixture->queue, 1000);
+  g_assert_cmpuint (fixture->plugin.stopped->len, ==, 1);
+}
+
+/* Events of the same category share the playing or a waiting event,
+ * which is stopped with the last of their ids.  Other categories do
+ * not wait. */
+static void
+test_merge (Fixture       *fixture,
+            gconstpointer  data)
+{
+  gint email1, email2, im1, im2, im3;
+
+  email1 = play (fixture, "email", URGENCY_NORMAL);
+  email2 = play (fixture, "email", URGENCY_NORMAL);
+  im1 = play (fixture, "im", URGENCY_NORMAL);
+  im2 = play (fixture, "im", URGENCY_NORMAL);
+  im3 = play (fixture, "im", URGENCY_NORMAL);
+  g_assert_cmpint (email1, !=, email2);
+  assert_played (fixture, "email im");
+
+  hd_sv_event_queue_stop (fixture->queue, email1);
+  hd_sv_event_queue_stop (fixture->queue, im1);
+  hd_sv_event_queue_stop (fixture->queue, im2);
+  g_assert_cmpuint (fixture->plugin.stopped->len, ==, 0);
+
+  hd_sv_event_queue_stop (fixture->queue, email2);
+  hd_sv_event_queue_stop (fixture->queue, im3);
+  g_assert_cmpuint (fixture->plugin.stopped->len, ==, 2);
+}
+
+/* After the window the same category plays again */
+static void
+test_window (Fixture       *fixture,
+             gconstpointer  data)
+{
+  play (fixture, "email", URGENCY_NORMAL);
+  play (fixture, "email", URGENCY_NORMAL);
+  assert_played (fixture, "email");
+
+  wait_windows (1);
+  play (fixture, "email", URGENCY_NORMAL);
+  assert_played (fixture, "email email");
+  g_assert_cmpuint (fixture->plugin.stopped->len, ==, 0);
+}
+
+/* Less urgent events wait for the window of more urgent ones, by
+ * urgency, then in arrival order, and a more urgent event preempts
+ * the less urgent playing ones. */
+static void
+test_urgency (Fixture       *fixture,
+              gconstpointer  data)
+{
+  play (fixture, "email", URGENCY_NORMAL);
+  play (fixture, "battery", URGENCY_LOW);
+  play (fixture, "im", URGENCY_NORMAL);
+  play (fixture, "sms", URGENCY_NORMAL);
+  assert_played (fixture, "email im sms");
+
+  play (fixture, "call", URGENCY_CRITICAL);
+  play (fixture, "alarm", URGENCY_CRITICAL);
+  play (fixture, "update", URGENCY_NORMAL);
+  assert_played (fixture, "email im sms call alarm");
+  g_assert_cmpuint (fixture->plugin.stopped->len, ==, 3);
+
+  wait_windows (1);
+  assert_played (fixture, "email im sms call alarm update");
+
+  wait_windows (1);
+  assert_played (fixture, "email im sms call alarm update battery");
+  g_assert_cmpuint (fixture->plugin.stopped->len, ==, 3);
+}
+
+static void
+test_stop_waiting (Fixture       *fixture,
+                   gconstpointer  data)
+{
+  gint id;
+
+  play (fixture, "email", URGENCY_NORMAL);
+  id = play (fixture, "battery", URGENCY_LOW);
+  hd_sv_event_queue_stop (fixture->queue, id);
+
+  wait_windows (1);
+  assert_played (fixture, "email");
+  g_assert_cmpuint (fixture->plugin.stopped->len, ==, 0);
+}
+
+/* 1,000 events from @n_categories categories in a row, then until all
+ * of them were handed to the plugin.  The window is 0. */
+static void
+run_throughput (Fixture *fixture,
+                guint    n_categories)
+{
+  gdouble queued, drained;
+  guint i;
+
+  g_test_timer_start ();
+  for (i = 0; i < 1000; i++)
+    {
+      gchar *category = g_strdup_printf ("category-%u", i % n_categories);
+
+      play (fixture, category, i % 10 ? URGENCY_NORMAL : URGENCY_CRITICAL);
+      g_free (category);
+    }
+  queued = g_test_timer_elapsed ();
+
+  while (fixture->queue->playing || fixture->queue->queue.length)
+    g_main_context_iteration (NULL, TRUE);
+  drained = g_test_timer_elapsed ();
+
+  g_test_minimized_result (drained,
+                           "1000 events, %u categories: queued in %f s, "
+                           "%u plugin calls done in %f s (%.0f events/s)",
+                           n_categories, queued,
+                           fixture->plugin.played->len, drained,
+                           1000 / drained);
+}
+
+static void
+test_throughput (Fixture       *fixture,
+                 gconstpointer  data)
+{
+  run_throughput (fixture, 10);
+}
+
+static void
+test_throughput_distinct (Fixture       *fixture,
+                          gconstpointer  data)
+{
+  run_throughput (fixture, 1000);
+  g_assert_cmpuint (fixture->plugin.played->len, ==, 1000);
+}
+
+int main (int argc, char **argv)
+{
+  gconstpointer window = GUINT_TO_POINTER (TEST_WINDOW);
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/sv-event-queue/play-stop", Fixture, window,
+              fixture_setup, test_play_stop, fixture_teardown);
+  g_test_add ("/sv-event-queue/merge", Fixture, window,
+              fixture_setup, test_merge, fixture_teardown);
+  g_test_add ("/sv-event-queue/window", Fixture, window,
+              fixture_setup, test_window, fixture_teardown);
+  g_test_add ("/sv-event-queue/urgency", Fixture, window,
+              fixture_setup, test_urgency, fixture_teardown);
+  g_test_add ("/sv-event-queue/stop-waiting", Fixture, window,
+              fixture_setup, test_stop_waiting, fixture_teardown);
+  if (g_test_perf ())
+    {
+      g_test_add ("/sv-event-queue/throughput", Fixture, NULL,
+                  fixture_setup, test_throughput, fixture_teardown);
+      g_test_add ("/sv-event-queue/throughput-distinct", Fixture, NULL,
+                  fixture_setup, test_throughput_distinct, fixture_teardown);
+    }
+
+  return g_test_run ();
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_SV_EVENT_QUEUE_H__
+#define __HD_SV_EVENT_QUEUE_H__
+
+#include <glib.h>
+
+#include "hd-sv-plugin.h"
+
+G_BEGIN_DECLS
+
+/* Time in which events of the same category are merged into a
+ * started one, and less urgent events wait for it. */
+#define HD_SV_EVENT_QUEUE_WINDOW 2000 /* ms */
+
+typedef struct _HDSVEventQueue HDSVEventQueue;
+
+/** HDSVEventQueue:
+ *
+ * Orders the play requests for the sound/vibra plugin, in
+ * hildon-sv-notification-daemon or hildon-home.
+ * Events play right away unless a more urgent one was started less
+ * than @window milliseconds ago, then they wait ordered by the
+ * "urgency" hint.  A more urgent event preempts the less urgent
+ * playing ones.  Events with the same "category" hint as a waiting
+ * or just started event are merged into that one.
+ */
+HDSVEventQueue *hd_sv_event_queue_new  (HDSVPlugin     *plugin,
+                                        guint           window);
+void            hd_sv_event_queue_free (HDSVEventQueue *queue);
+
+gint            hd_sv_event_queue_play (HDSVEventQueue *queue,
+                                        GHashTable     *hints,
+                                        const gchar    *sender);
+void            hd_sv_event_queue_stop (HDSVEventQueue *queue,
+                                        gint            id);
+
+G_END_DECLS
+
+#endif
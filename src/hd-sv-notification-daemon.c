@@ -12,7 +12,6 @@
 
 #include <glib.h>
 #include <glib-object.h>
-#include <gmodule.h>
 
 #include <dbus/dbus.h>
 #include <dbus/dbus-glib-lowlevel.h>
@@ -20,109 +19,25 @@
 
 #include "hd-sv-notification-daemon.h"
 #include "hd-sv-notification-daemon-glue.h"
+#include "hd-sv-event-queue.h"
+#include "hd-sv-plugin.h"
 
 #define HD_SV_NOTIFICATION_DAEMON_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_SV_NOTIFICATION_DAEMON, HDSVNotificationDaemonPrivate))
 
-typedef void (* NSVPluginLoad)      (void);
-typedef void (* NSVPluginUnload)    (void);
-typedef gint (* NSVPluginPlayEvent) (GHashTable *hints,
-                                     const char *sender);
-typedef void (* NSVPluginStopEvent) (gint        id);
-
 struct _HDSVNotificationDaemonPrivate
 {
-  GModule            *nsv_module;
-
-  NSVPluginLoad       nsv_plugin_load;
-  NSVPluginUnload     nsv_plugin_unload;
-  NSVPluginPlayEvent  nsv_plugin_play_event;
-  NSVPluginStopEvent  nsv_plugin_stop_event;
+  HDSVPlugin     *plugin;
+  HDSVEventQueue *queue;
 };
 
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_NAME  "com.nokia.HildonSVNotificationDaemon" 
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_PATH  "/com/nokia/HildonSVNotificationDaemon"
 
-#define HILDON_NOTIFY_SV_PLUGIN_PATH "/usr/lib/hildon-desktop/libhildon-plugins-notify-sv.so"
-
 #define MEMLOCK_LIMIT (1024 * 1024 * 64) /* 64 megabytes */
 
 G_DEFINE_TYPE (HDSVNotificationDaemon, hd_sv_notification_daemon, G_TYPE_OBJECT);
 
-static void
-load_sv_plugin (HDSVNotificationDaemon *sv_nd)
-{
-  HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
-  gpointer symbol;
-
-  priv->nsv_module = g_module_open (HILDON_NOTIFY_SV_PLUGIN_PATH,
-                                    G_MODULE_BIND_LAZY);
-  if (!priv->nsv_module)
-    {
-      g_warning ("%s. Could not load sound/vibra notification module %s. %s",
-                 __FUNCTION__,
-                 HILDON_NOTIFY_SV_PLUGIN_PATH,
-                 g_module_error ());
-
-      return;
-    }
-
-  if (g_module_symbol (priv->nsv_module, "nsv_plugin_load", &symbol))
-    {
-      priv->nsv_plugin_load = symbol;
-    }
-  else
-    {
-      g_warning ("%s. Could not get symbol nsv_plugin_load. %s",
-                 __FUNCTION__,
-                 g_module_error ());
-      goto close_module;
-    }
-
-  if (g_module_symbol (priv->nsv_module, "nsv_plugin_unload", &symbol))
-    {
-      priv->nsv_plugin_unload = symbol;
-    }
-  else
-    {
-      g_warning ("%s. Could not get symbol nsv_plugin_unload. %s",
-                 __FUNCTION__,
-                 g_module_error ());
-      goto close_module;
-    }
-
-  if (g_module_symbol (priv->nsv_module, "nsv_plugin_play_event", &symbol))
-    {
-      priv->nsv_plugin_play_event = symbol;
-    }
-  else
-    {
-      g_warning ("%s. Could not get symbol nsv_plugin_play_event. %s",
-                 __FUNCTION__,
-                 g_module_error ());
-      goto close_module;
-    }
-
-
-  if (g_module_symbol (priv->nsv_module, "nsv_plugin_stop_event", &symbol))
-    {
-      priv->nsv_plugin_stop_event = symbol;
-    }
-  else
-    {
-      g_warning ("%s. Could not get symbol nsv_plugin_stop_event. %s",
-                 __FUNCTION__,
-                 g_module_error ());
-      goto close_module;
-    }
-
-  return;
-
-close_module:
-  g_module_close (priv->nsv_module);
-  priv->nsv_module = NULL;
-}
-
 static void
 hd_sv_notification_daemon_init (HDSVNotificationDaemon *sv_nd)
 {
@@ -178,10 +93,9 @@ hd_sv_notification_daemon_init (HDSVNotificationDaemon *sv_nd)
                                        HD_SV_NOTIFICATION_DAEMON_DBUS_PATH,
                                        G_OBJECT (sv_nd));
 
-  load_sv_plugin (sv_nd);
-
-  if (priv->nsv_plugin_load)
-    priv->nsv_plugin_load ();
+  priv->plugin = hd_sv_plugin_load (HD_SV_PLUGIN_PATH);
+  if (priv->plugin)
+    priv->queue = hd_sv_event_queue_new (priv->plugin, HD_SV_EVENT_QUEUE_WINDOW);
 
 cleanup:
   if (bus_proxy)
@@ -193,11 +107,11 @@ hd_sv_notification_daemon_finalize (GObject *object)
 {
   HDSVNotificationDaemonPrivate *priv = HD_SV_NOTIFICATION_DAEMON (object)->priv;
 
-  if (priv->nsv_plugin_unload)
-    priv->nsv_plugin_unload ();
+  if (priv->queue)
+    priv->queue = (hd_sv_event_queue_free (priv->queue), NULL);
 
-  if (priv->nsv_module)
-    priv->nsv_module = (g_module_close (priv->nsv_module), NULL);
+  if (priv->plugin)
+    priv->plugin = (hd_sv_plugin_unload (priv->plugin), NULL);
 
   G_OBJECT_CLASS (hd_sv_notification_daemon_parent_class)->finalize (object);
 }
@@ -222,9 +136,10 @@ hd_sv_notification_daemon_play_event (HDSVNotificationDaemon *sv_nd,
   HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
   gint id = -1;
 
-  if (priv->nsv_plugin_play_event)
-    id = priv->nsv_plugin_play_event (hints,
-                                      notification_sender);
+  if (priv->queue)
+    id = hd_sv_event_queue_play (priv->queue,
+                                 hints,
+                                 notification_sender);
 
   dbus_g_method_return (context, id);
 
@@ -238,8 +153,8 @@ hd_sv_notification_daemon_stop_event  (HDSVNotificationDaemon *sv_nd,
 {
   HDSVNotificationDaemonPrivate *priv = sv_nd->priv;
 
-  if (priv->nsv_plugin_stop_event)
-    priv->nsv_plugin_stop_event (id);
+  if (priv->queue)
+    hd_sv_event_queue_stop (priv->queue, id);
 
   dbus_g_method_return (context, id);
 
@@ -318,10 +233,6 @@ main (int argc, char **argv)
   /* Ignore debug output */
   g_log_set_default_handler (log_ignore_debug_handler, NULL);
 
-#if !GLIB_CHECK_VERSION(2,35,0)
-  g_type_init ();
-#endif
-
   hd_sv_notification_daemon = g_object_new (HD_TYPE_SV_NOTIFICATION_DAEMON,
                                             NULL);
 
@@ -0,0 +1,533 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gmodule.h>
+
+#include "hd-sv-plugin.h"
+
+typedef void (* NSVPluginLoad)      (void);
+typedef void (* NSVPluginUnload)    (void);
+typedef gint (* NSVPluginPlayEvent) (GHashTable *hints,
+                                     const char *sender);
+typedef void (* NSVPluginStopEvent) (gint        id);
+
+struct _HDSVPlugin
+{
+  GModule            *nsv_module;
+
+  NSVPluginLoad       nsv_plugin_load;
+  NSVPluginUnload     nsv_plugin_unload;
+  NSVPluginPlayEvent  nsv_plugin_play_event;
+  NSVPluginStopEvent  nsv_plugin_stop_event;
+};
+
+static gboolean
+lookup_symbol (HDSVPlugin  *plugin,
+               const gchar *name,
+               gpointer    *symbol)
+{
+  if (g_module_symbol (plugin->nsv_module, name, symbol))
+    return TRUE;
+
+  g_warning ("%s. Could not get symbol %s. %s",
+             __FUNCTION__,
+             name,
+             g_module_error ());
+
+  return FALSE;
+}
+
+/* Loads the plugin from @path and calls its load function.
+ * Returns %NULL if the plugin could not be loaded. */
+HDSVPlugin *
+hd_sv_plugin_load (const gchar *path)
+{
+  HDSVPlugin *plugin;
+
+  g_return_val_if_fail (path, NULL);
+
+  plugin = g_slice_new0 (HDSVPlugin);
+
+  plugin->nsv_module = g_module_open (path,
+                                      G_MODULE_BIND_LAZY);
+  if (!plugin->nsv_module)
+    {
+      g_warning ("%s. Could not load sound/vibra notification module %s. %s",
+                 __FUNCTION__,
+                 path,
+                 g_module_error ());
+      g_slice_free (HDSVPlugin, plugin);
+
+      return NULL;
+    }
+
+  if (!lookup_symbol (plugin, "nsv_plugin_load",
+                      (gpointer *) &plugin->nsv_plugin_load) ||
+      !lookup_symbol (plugin, "nsv_plugin_unload",
+                      (gpointer *) &plugin->nsv_plugin_unload) ||
+      !lookup_symbol (plugin, "nsv_plugin_play_event",
+                      (gpointer *) &plugin->nsv_plugin_play_event) ||
+      !lookup_symbol (plugin, "nsv_plugin_stop_event",
+                      (gpointer *) &plugin->nsv_plugin_stop_event))
+    {
+      g_module_close (plugin->nsv_module);
+      g_slice_free (HDSVPlugin, plugin);
+
+      return NULL;
+    }
+
+  plugin->nsv_plugin_load ();
+
+  return plugin;
+}
+
+void
+hd_sv_plugin_unload (HDSVPlugin *plugin)
+{
+  if (!plugin)
+    return;
+
+  plugin->nsv_plugin_unload ();
+  g_module_close (plugin->nsv_module);
+
+  g_slice_free (HDSVPlugin, plugin);
+}
+
+/* Starts the feedback for a notification with @hints sent by @sender.
+ * Returns the id to stop it with or -1. */
+gint
+hd_sv_plugin_play_event (HDSVPlugin  *plugin,
+                         GHashTable  *hints,
+                         const gchar *sender)
+{
+  g_return_val_if_fail (plugin, -1);
+
+  return plugin->nsv_plugin_play_event (hints, sender);
+}
+
+void
+hd_sv_plugin_stop_event (HDSVPlugin *plugin,
+                         gint        id)
+{
+  g_return_if_fail (plugin);
+
+  plugin->nsv_plugin_stop_event (id);
+}
+
+#ifdef COMPILE_FOR_TEST
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib-object.h>
+#include <dbus/dbus.h>
+
+/* TEST_SV_PLUGIN is the path of the stand-in plugin, test-sv-plugin.c */
+
+#define TEST_EVENTS 1000
+#define DAEMON_NAME "com.nokia.HildonSVNotificationDaemon"
+#define DAEMON_PATH "/com/nokia/HildonSVNotificationDaemon"
+
+/* The stand-in writes the time of its play_event calls here */
+static gint call_times[2];
+
+static GHashTable *
+hints_new (void)
+{
+  GHashTable *hints = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             NULL,
+                                             (GDestroyNotify) g_free);
+  static const gchar *strings[][2] = {
+    { "category", "sms-message" },
+    { "sound-file", "/usr/share/sounds/ui-new_sms.wav" },
+    { "vibra", "PatternIncomingMessage" },
+    { "led-pattern", "PatternCommunicationSMS" },
+  };
+  GValue *value;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (strings); i++)
+    {
+      value = g_new0 (GValue, 1);
+      g_value_init (value, G_TYPE_STRING);
+      g_value_set_static_string (value, strings[i][1]);
+      g_hash_table_insert (hints, (gpointer) strings[i][0], value);
+    }
+
+  value = g_new0 (GValue, 1);
+  g_value_init (value, G_TYPE_UCHAR);
+  g_value_set_uchar (value, TRUE);
+  g_hash_table_insert (hints, "persistent", value);
+
+  return hints;
+}
+
+static gint64
+read_call_time (void)
+{
+  gint64 time;
+
+  g_assert_cmpint (read (call_times[0], &time, sizeof (time)), ==, sizeof (time));
+
+  return time;
+}
+
+static void
+test_load (void)
+{
+  HDSVPlugin *plugin = hd_sv_plugin_load (TEST_SV_PLUGIN);
+  GHashTable *hints = hints_new ();
+  gint64 start = g_get_monotonic_time ();
+
+  g_assert (plugin);
+  g_assert_cmpint (hd_sv_plugin_play_event (plugin, hints, "test"), ==, 1);
+  g_assert_cmpint (read_call_time (), >=, start);
+  g_assert_cmpint (hd_sv_plugin_play_event (plugin, hints, "test"), ==, 2);
+  g_assert_cmpint (read_call_time (), >=, start);
+  hd_sv_plugin_stop_event (plugin, 1);
+
+  g_hash_table_destroy (hints);
+  hd_sv_plugin_unload (plugin);
+}
+
+static void
+test_missing (void)
+{
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+                         "*Could not load sound/vibra notification module*");
+  g_assert (!hd_sv_plugin_load ("/nonexistent/libhildon-plugins-notify-sv.so"));
+  g_test_assert_expected_messages ();
+}
+
+static GPid
+start_bus (void)
+{
+  gchar *argv[] = { "dbus-daemon", "--session", "--nofork", "--print-address", NULL };
+  GString *address;
+  GPid pid;
+  gint out;
+  gchar c;
+
+  if (!g_spawn_async_with_pipes (NULL, argv, NULL,
+                                 G_SPAWN_SEARCH_PATH,
+                                 NULL, NULL,
+                                 &pid,
+                                 NULL, &out, NULL,
+                                 NULL))
+    return 0;
+
+  address = g_string_new (NULL);
+  while (read (out, &c, 1) == 1 && c != '\n')
+    g_string_append_c (address, c);
+  close (out);
+
+  g_setenv ("DBUS_SESSION_BUS_ADDRESS", address->str, TRUE);
+  g_string_free (address, TRUE);
+
+  return pid;
+}
+
+/* The basic hint types hildon-home sends */
+static GValue *
+value_from_iter (DBusMessageIter *iter)
+{
+  GValue *value = g_new0 (GValue, 1);
+  union { const gchar *s; guchar y; dbus_bool_t b; gint32 i; guint32 u; } v;
+
+  dbus_message_iter_get_basic (iter, &v);
+  switch (dbus_message_iter_get_arg_type (iter))
+    {
+    case DBUS_TYPE_STRING:
+      g_value_init (value, G_TYPE_STRING);
+      g_value_set_string (value, v.s);
+      break;
+    case DBUS_TYPE_BYTE:
+      g_value_init (value, G_TYPE_UCHAR);
+      g_value_set_uchar (value, v.y);
+      break;
+    case DBUS_TYPE_BOOLEAN:
+      g_value_init (value, G_TYPE_BOOLEAN);
+      g_value_set_boolean (value, v.b);
+      break;
+    case DBUS_TYPE_INT32:
+      g_value_init (value, G_TYPE_INT);
+      g_value_set_int (value, v.i);
+      break;
+    case DBUS_TYPE_UINT32:
+      g_value_init (value, G_TYPE_UINT);
+      g_value_set_uint (value, v.u);
+      break;
+    default:
+      g_free (value);
+      return NULL;
+    }
+
+  return value;
+}
+
+static void
+value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_free (value);
+}
+
+/* A stand-in for hildon-sv-notification-daemon in a child process.
+ * It demarshals PlayEvent into a hash table of GValues as dbus-glib
+ * does and calls the plugin. */
+static void
+run_daemon (void)
+{
+  DBusConnection *connection = dbus_bus_get_private (DBUS_BUS_SESSION, NULL);
+  HDSVPlugin *plugin = hd_sv_plugin_load (TEST_SV_PLUGIN);
+
+  if (!connection || !plugin ||
+      dbus_bus_request_name (connection, DAEMON_NAME,
+                             DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _exit (1);
+
+  while (dbus_connection_read_write (connection, -1))
+    {
+      DBusMessage *message;
+
+      while ((message = dbus_connection_pop_message (connection)))
+        {
+          DBusMessageIter args, array;
+          GHashTable *hints;
+          const gchar *sender;
+          gint32 id;
+
+          if (!dbus_message_is_method_call (message, DAEMON_NAME, "PlayEvent"))
+            {
+              dbus_message_unref (message);
+              continue;
+            }
+
+          hints = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free,
+                                         (GDestroyNotify) value_free);
+          dbus_message_iter_init (message, &args);
+          for (dbus_message_iter_recurse (&args, &array);
+               dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_DICT_ENTRY;
+               dbus_message_iter_next (&array))
+            {
+              DBusMessageIter entry, variant;
+              const gchar *key;
+              GValue *value;
+
+              dbus_message_iter_recurse (&array, &entry);
+              dbus_message_iter_get_basic (&entry, &key);
+              dbus_message_iter_next (&entry);
+              dbus_message_iter_recurse (&entry, &variant);
+              value = value_from_iter (&variant);
+              if (value)
+                g_hash_table_insert (hints, g_strdup (key), value);
+            }
+          dbus_message_iter_next (&args);
+          dbus_message_iter_get_basic (&args, &sender);
+
+          id = hd_sv_plugin_play_event (plugin, hints, sender);
+          g_hash_table_destroy (hints);
+
+          if (!dbus_message_get_no_reply (message))
+            {
+              DBusMessage *reply = dbus_message_new_method_return (message);
+
+              dbus_message_append_args (reply, DBUS_TYPE_INT32, &id,
+                                        DBUS_TYPE_INVALID);
+              dbus_connection_send (connection, reply, NULL);
+              dbus_message_unref (reply);
+            }
+          dbus_message_unref (message);
+        }
+    }
+
+  _exit (0);
+}
+
+/* Marshals PlayEvent as hildon-home does and sends it, the reply is
+ * not waited for */
+static void
+send_play_event (DBusConnection *connection,
+                 GHashTable     *hints)
+{
+  DBusMessage *message;
+  DBusMessageIter args, array;
+  GHashTableIter iter;
+  gpointer key, value;
+  const gchar *sender = "test";
+
+  message = dbus_message_new_method_call (DAEMON_NAME, DAEMON_PATH,
+                                          DAEMON_NAME, "PlayEvent");
+  dbus_message_iter_init_append (message, &args);
+  dbus_message_iter_open_container (&args, DBUS_TYPE_ARRAY, "{sv}", &array);
+  g_hash_table_iter_init (&iter, hints);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      DBusMessageIter entry, variant;
+
+      dbus_message_iter_open_container (&array, DBUS_TYPE_DICT_ENTRY,
+                                        NULL, &entry);
+      dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &key);
+      if (G_VALUE_HOLDS_STRING (value))
+        {
+          const gchar *s = g_value_get_string (value);
+
+          dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                            "s", &variant);
+          dbus_message_iter_append_basic (&variant, DBUS_TYPE_STRING, &s);
+        }
+      else
+        {
+          guchar y = g_value_get_uchar (value);
+
+          dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                            "y", &variant);
+          dbus_message_iter_append_basic (&variant, DBUS_TYPE_BYTE, &y);
+        }
+      dbus_message_iter_close_container (&entry, &variant);
+      dbus_message_iter_close_container (&array, &entry);
+    }
+  dbus_message_iter_close_container (&args, &array);
+  dbus_message_iter_append_basic (&args, DBUS_TYPE_STRING, &sender);
+  dbus_message_set_no_reply (message, TRUE);
+
+  dbus_connection_send (connection, message, NULL);
+  dbus_connection_flush (connection);
+  dbus_message_unref (message);
+}
+
+static gint
+compare_int64 (gconstpointer a,
+               gconstpointer b)
+{
+  return *(const gint64 *) a < *(const gint64 *) b ? -1 : *(const gint64 *) a > *(const gint64 *) b;
+}
+
+static void
+report (const gchar *mode,
+        GArray      *latencies)
+{
+  g_array_sort (latencies, compare_int64);
+  g_test_minimized_result (g_array_index (latencies, gint64, latencies->len / 2) / 1e6,
+                           "%s: %u events, event to plugin call median %.1f us, "
+                           "95%% %.1f us, max %.1f us",
+                           mode,
+                           latencies->len,
+                           (gdouble) g_array_index (latencies, gint64, latencies->len / 2),
+                           (gdouble) g_array_index (latencies, gint64, latencies->len * 95 / 100),
+                           (gdouble) g_array_index (latencies, gint64, latencies->len - 1));
+}
+
+static void
+test_latency (void)
+{
+  GArray *in_process = g_array_new (FALSE, FALSE, sizeof (gint64));
+  GArray *daemon = g_array_new (FALSE, FALSE, sizeof (gint64));
+  GHashTable *hints = hints_new ();
+  DBusConnection *connection;
+  HDSVPlugin *plugin;
+  GPid bus;
+  pid_t child;
+  guint i;
+
+  bus = start_bus ();
+  if (!bus)
+    {
+      g_test_message ("Could not start dbus-daemon, skipping");
+      return;
+    }
+
+  child = fork ();
+  g_assert_cmpint (child, >=, 0);
+  if (!child)
+    run_daemon ();
+
+  connection = dbus_bus_get_private (DBUS_BUS_SESSION, NULL);
+  g_assert (connection);
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+  while (!dbus_bus_name_has_owner (connection, DAEMON_NAME, NULL))
+    g_usleep (10 * 1000);
+
+  plugin = hd_sv_plugin_load (TEST_SV_PLUGIN);
+  g_assert (plugin);
+
+  /* Gaps between the events, so the daemon has to be woken up */
+  for (i = 0; i < TEST_EVENTS; i++)
+    {
+      gint64 start, latency;
+
+      start = g_get_monotonic_time ();
+      hd_sv_plugin_play_event (plugin, hints, "test");
+      latency = read_call_time () - start;
+      g_array_append_val (in_process, latency);
+
+      g_usleep (g_random_int_range (0, 5000));
+
+      start = g_get_monotonic_time ();
+      send_play_event (connection, hints);
+      latency = read_call_time () - start;
+      g_array_append_val (daemon, latency);
+
+      g_usleep (g_random_int_range (0, 5000));
+    }
+
+  report ("in-process", in_process);
+  report ("daemon", daemon);
+
+  hd_sv_plugin_unload (plugin);
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  kill (child, SIGTERM);
+  waitpid (child, NULL, 0);
+  kill (bus, SIGTERM);
+  g_spawn_close_pid (bus);
+
+  g_hash_table_destroy (hints);
+  g_array_free (in_process, TRUE);
+  g_array_free (daemon, TRUE);
+}
+
+int main (int argc, char **argv)
+{
+  gchar *fd;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_assert (!pipe (call_times));
+  fd = g_strdup_printf ("%d", call_times[1]);
+  g_setenv ("HD_TEST_SV_PLUGIN_FD", fd, TRUE);
+  g_free (fd);
+
+  g_test_add_func ("/sv-plugin/load", test_load);
+  g_test_add_func ("/sv-plugin/missing", test_missing);
+  if (g_test_perf ())
+    g_test_add_func ("/sv-plugin/latency", test_latency);
+
+  return g_test_run ();
+}
+
+#endif
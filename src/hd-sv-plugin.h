@@ -0,0 +1,49 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_SV_PLUGIN_H__
+#define __HD_SV_PLUGIN_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define HD_SV_PLUGIN_PATH "/usr/lib/hildon-desktop/libhildon-plugins-notify-sv.so"
+
+typedef struct _HDSVPlugin HDSVPlugin;
+
+/** HDSVPlugin:
+ *
+ * The sound and vibra notification plugin.  It is loaded by
+ * hildon-sv-notification-daemon or directly into hildon-home.
+ */
+HDSVPlugin *hd_sv_plugin_load       (const gchar *path);
+void        hd_sv_plugin_unload     (HDSVPlugin  *plugin);
+
+gint        hd_sv_plugin_play_event (HDSVPlugin  *plugin,
+                                     GHashTable  *hints,
+                                     const gchar *sender);
+void        hd_sv_plugin_stop_event (HDSVPlugin  *plugin,
+                                     gint         id);
+
+G_END_DECLS
+
+#endif
@@ -30,6 +30,15 @@
 
 #include "hd-time-difference.h"
 
+#ifdef COMPILE_FOR_TEST
+/* The test does not depend on the installed hildon-libs catalogs */
+static const char *test_dngettext (const char    *domain,
+                                   const char    *msgid,
+                                   const char    *msgid_plural,
+                                   unsigned long  n);
+#define dngettext test_dngettext
+#endif
+
 #define MINUTE (60)
 #define HOUR   (MINUTE * 60)
 #define DAY    (HOUR * 24)
@@ -50,17 +59,78 @@ const static TimeDiffInfo entries[] = {
   { YEAR, -1, "wdgt_va_ago_one_year", "wdgt_va_ago_years" }
 };
 
+static HDTimeDifferenceClockFunc clock_func;
+
+/* The formatted texts by entry and amount.  They are only valid for
+ * @cache_locale, the cache is dropped when the locale changes.  Only
+ * to be used from the main thread. */
+static GHashTable *text_cache;
+static gchar *cache_locale;
+
+/* Sets the function returning the current time, %NULL restores
+ * the system clock.  Meant for tests. */
+void
+hd_time_difference_set_clock (HDTimeDifferenceClockFunc clock)
+{
+  clock_func = clock;
+}
+
+time_t
+hd_time_difference_now (void)
+{
+  if (clock_func)
+    return clock_func ();
+
+  return time (NULL);
+}
+
+static GHashTable *
+get_text_cache (void)
+{
+  const gchar *locale = setlocale (LC_MESSAGES, NULL);
+
+  if (text_cache && g_strcmp0 (locale, cache_locale))
+    {
+      text_cache = (g_hash_table_destroy (text_cache), NULL);
+      cache_locale = (g_free (cache_locale), NULL);
+    }
+
+  if (!text_cache)
+    {
+      text_cache = g_hash_table_new_full (g_direct_hash,
+                                          g_direct_equal,
+                                          NULL,
+                                          g_free);
+      cache_locale = g_strdup (locale);
+    }
+
+  return text_cache;
+}
+
 static inline gchar *
 get_time_diff_text_for_info (const TimeDiffInfo *info,
                              time_t              difference)
 {
   time_t diff_in_unit = (difference + (info->unit / 2)) / info->unit;
+  GHashTable *cache = get_text_cache ();
+  gpointer key;
+  gchar *text;
+
+  key = GUINT_TO_POINTER ((guint) diff_in_unit * G_N_ELEMENTS (entries) +
+                          (info - entries));
 
-  return g_strdup_printf (dngettext ("hildon-libs",
-                                     info->message_id,
-                                     info->message_id_plural,
-                                     diff_in_unit),
-                          diff_in_unit);
+  text = g_hash_table_lookup (cache, key);
+  if (!text)
+    {
+      text = g_strdup_printf (dngettext ("hildon-libs",
+                                         info->message_id,
+                                         info->message_id_plural,
+                                         diff_in_unit),
+                              diff_in_unit);
+      g_hash_table_insert (cache, key, text);
+    }
+
+  return g_strdup (text);
 }
 
 static inline gboolean
@@ -152,8 +222,56 @@ static const TestData test_data[] =
     { HOUR, "1 hour ago", HOUR / 2},
     { 3 * HOUR / 2 - 1, "1 hour ago", 1},
     { 3 * HOUR / 2, "2 hours ago", HOUR},
+    { DAY - HOUR / 2 - 1, "23 hours ago", 1},
+    { DAY - HOUR / 2, "1 day ago", DAY / 2 + HOUR / 2},
+    { DAY, "1 day ago", DAY / 2},
+    { 3 * DAY / 2 - 1, "1 day ago", 1},
+    { 3 * DAY / 2, "2 days ago", DAY},
+    { YEAR - DAY / 2 - 1, "364 days ago", 1},
+    { YEAR - DAY / 2, "1 year ago", YEAR / 2 + DAY / 2},
+    { YEAR, "1 year ago", YEAR / 2},
+    { 3 * YEAR / 2, "2 years ago", YEAR},
+};
+
+#define TEST_NOW 1234567890
+
+/* The en_GB translations of the hildon-libs messages */
+static const char *test_translations[][2] =
+{
+    { "wdgt_va_ago_one_minute", "%d minute ago" },
+    { "wdgt_va_ago_minutes", "%d minutes ago" },
+    { "wdgt_va_ago_one_hour", "%d hour ago" },
+    { "wdgt_va_ago_hours", "%d hours ago" },
+    { "wdgt_va_ago_one_day", "%d day ago" },
+    { "wdgt_va_ago_days", "%d days ago" },
+    { "wdgt_va_ago_one_year", "%d year ago" },
+    { "wdgt_va_ago_years", "%d years ago" },
 };
 
+static const char *
+test_dngettext (const char    *domain,
+                const char    *msgid,
+                const char    *msgid_plural,
+                unsigned long  n)
+{
+  const char *id = n == 1 ? msgid : msgid_plural;
+  guint i;
+
+  g_assert_cmpstr (domain, ==, "hildon-libs");
+
+  for (i = 0; i < G_N_ELEMENTS (test_translations); i++)
+    if (!g_strcmp0 (test_translations[i][0], id))
+      return test_translations[i][1];
+
+  return id;
+}
+
+static time_t
+test_clock (void)
+{
+  return TEST_NOW;
+}
+
 static void
 test_time_difference (gconstpointer test_data)
 {
@@ -167,6 +285,43 @@ test_time_difference (gconstpointer test_data)
 
   g_assert_cmpstr (text, ==, data->expected_text);
   g_assert_cmpint (timeout, ==, data->expected_timeout);
+
+  g_free (text);
+}
+
+static void
+test_clock_injection (void)
+{
+  hd_time_difference_set_clock (test_clock);
+  g_assert_cmpint (hd_time_difference_now (), ==, TEST_NOW);
+
+  hd_time_difference_set_clock (NULL);
+  g_assert_cmpint (hd_time_difference_now (), !=, TEST_NOW);
+}
+
+/* A refresh as done by HDIncomingEventWindow. */
+static void
+test_refresh_performance (void)
+{
+  time_t then = TEST_NOW - 2 * DAY;
+  gdouble elapsed;
+  guint i;
+
+  hd_time_difference_set_clock (test_clock);
+
+  g_test_timer_start ();
+  for (i = 0; i < 10000; i++)
+    {
+      time_t difference = hd_time_difference_now () - then + i % HOUR;
+
+      g_free (hd_time_difference_get_text (difference));
+      hd_time_difference_get_timeout (difference);
+    }
+  elapsed = g_test_timer_elapsed ();
+
+  hd_time_difference_set_clock (NULL);
+
+  g_test_minimized_result (elapsed, "10000 refreshes in %f s", elapsed);
 }
 
 int main (int argc, char **argv)
@@ -174,17 +329,22 @@ int main (int argc, char **argv)
   guint i;
 
   setlocale (LC_ALL, "");
-  bindtextdomain ("hildon-libs", "/usr/share/locale");
-  textdomain ("hildon-libs");
 
   g_test_init (&argc, &argv, NULL);
 
   for (i = 0; i < G_N_ELEMENTS (test_data); i++)
     {
       gconstpointer data = &test_data[i];
-      g_test_add_data_func ("/time-difference", data, test_time_difference);
+      gchar *path = g_strdup_printf ("/time-difference/%u", i);
+
+      g_test_add_data_func (path, data, test_time_difference);
+      g_free (path);
     }
 
+  g_test_add_func ("/time-difference/clock", test_clock_injection);
+  if (g_test_perf ())
+    g_test_add_func ("/time-difference/performance", test_refresh_performance);
+
   return g_test_run ();
 }
 
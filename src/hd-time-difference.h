@@ -23,8 +23,17 @@
 #ifndef __HD_TIME_DIFFERENCE_H__
 #define __HD_TIME_DIFFERENCE_H__
 
+#include <glib.h>
+#include <time.h>
+
 G_BEGIN_DECLS
 
+/* Returns the current time, like time (NULL). */
+typedef time_t (*HDTimeDifferenceClockFunc) (void);
+
+void    hd_time_difference_set_clock (HDTimeDifferenceClockFunc clock);
+time_t  hd_time_difference_now (void);
+
 char   *hd_time_difference_get_text (time_t difference);
 time_t  hd_time_difference_get_timeout (time_t difference);
 
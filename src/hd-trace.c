@@ -0,0 +1,645 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+
+#include "hd-trace.h"
+
+/* The events are recorded into a fixed size buffer so recording never
+ * allocates or locks.  Events which do not fit are dropped. */
+#define MAX_EVENTS 8192
+
+typedef struct
+{
+  const gchar *name;
+  gint64       time;
+  GThread     *thread;
+  gchar        phase;
+} TraceEvent;
+
+gboolean hd_trace_enabled = FALSE;
+
+static gchar *trace_filename;
+static gint64 trace_start;
+static TraceEvent *events;
+static volatile gint n_events;
+
+void
+hd_trace_init (const gchar *filename)
+{
+  if (!filename || !*filename || hd_trace_enabled)
+    return;
+
+  trace_filename = g_strdup (filename);
+  trace_start = g_get_monotonic_time ();
+  events = g_new0 (TraceEvent, MAX_EVENTS);
+  n_events = 0;
+
+  hd_trace_enabled = TRUE;
+}
+
+/* Records an event with @phase 'B'egin, 'E'nd or 'i'nstant.
+ * Safe to be called from any thread. */
+void
+hd_trace_event (const gchar *name,
+                gchar        phase)
+{
+  gint i;
+
+  if (!hd_trace_enabled)
+    return;
+
+  i = g_atomic_int_add (&n_events, 1);
+  if (i >= MAX_EVENTS)
+    return;
+
+  events[i].time = g_get_monotonic_time () - trace_start;
+  events[i].thread = g_thread_self ();
+  events[i].phase = phase;
+
+  /* Written last, the dumper skips events without a name. */
+  g_atomic_pointer_set (&events[i].name, name);
+}
+
+/* Appends @str to @json as the contents of a JSON string.  Unlike
+ * g_strescape () this leaves UTF-8 alone and writes the other control
+ * characters as \u escapes, which JSON requires. */
+static void
+append_escaped (GString     *json,
+                const gchar *str)
+{
+  for (; *str; str++)
+    {
+      guchar c = *str;
+
+      if (c == '"' || c == '\\')
+        g_string_append_printf (json, "\\%c", c);
+      else if (c == '\n')
+        g_string_append (json, "\\n");
+      else if (c == '\t')
+        g_string_append (json, "\\t");
+      else if (c < 0x20)
+        g_string_append_printf (json, "\\u%04x", c);
+      else
+        g_string_append_c (json, c);
+    }
+}
+
+/* Writes the events recorded so far to the trace file in the Chrome
+ * trace event JSON format, which Perfetto can import as well.
+ * The whole file is rewritten each time. */
+gboolean
+hd_trace_dump (GError **error)
+{
+  GHashTable *tids;
+  GString *json;
+  gint i, n;
+  gboolean result;
+
+  if (!hd_trace_enabled)
+    return TRUE;
+
+  n = MIN (g_atomic_int_get (&n_events), MAX_EVENTS);
+
+  /* Give the threads small numbers in order of appearance. */
+  tids = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  json = g_string_new ("{\"traceEvents\":[\n");
+  for (i = 0; i < n; i++)
+    {
+      const gchar *name = g_atomic_pointer_get (&events[i].name);
+      gpointer tid;
+
+      if (!name)
+        continue;
+
+      tid = g_hash_table_lookup (tids, events[i].thread);
+      if (!tid)
+        {
+          tid = GUINT_TO_POINTER (g_hash_table_size (tids) + 1);
+          g_hash_table_insert (tids, events[i].thread, tid);
+        }
+
+      g_string_append_printf (json,
+                              "%s{\"name\":\"",
+                              json->str[json->len - 1] == '\n' ? "" : ",\n");
+      append_escaped (json, name);
+      g_string_append_printf (json,
+                              "\",\"cat\":\"hildon-home\","
+                              "\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT ","
+                              "\"pid\":%d,\"tid\":%u%s}",
+                              events[i].phase,
+                              events[i].time,
+                              getpid (),
+                              GPOINTER_TO_UINT (tid),
+                              events[i].phase == 'i' ? ",\"s\":\"t\"" : "");
+    }
+  g_string_append_printf (json,
+                          "\n],\"displayTimeUnit\":\"ms\","
+                          "\"otherData\":{\"dropped\":%d}}\n",
+                          MAX (g_atomic_int_get (&n_events) - MAX_EVENTS, 0));
+
+  result = g_file_set_contents (trace_filename,
+                                json->str,
+                                json->len,
+                                error);
+
+  g_string_free (json, TRUE);
+  g_hash_table_destroy (tids);
+
+  return result;
+}
+
+#ifdef COMPILE_FOR_TEST
+#include <string.h>
+#include <stdlib.h>
+#include <glib/gstdio.h>
+
+#define TEST_THREADS       4
+#define TEST_THREAD_SPANS  100
+#define TEST_DISABLED_RUNS 10000000
+
+/* Enough of a JSON parser to check the dump is valid JSON and to read
+ * it back: objects become hash tables of nodes, arrays pointer arrays. */
+typedef enum
+{
+  NODE_NULL,
+  NODE_BOOLEAN,
+  NODE_NUMBER,
+  NODE_STRING,
+  NODE_ARRAY,
+  NODE_OBJECT
+} NodeType;
+
+typedef struct
+{
+  NodeType    type;
+  gdouble     number;
+  gchar      *string;
+  GPtrArray  *array;
+  GHashTable *object;
+} Node;
+
+static void
+node_free (Node *node)
+{
+  g_free (node->string);
+  if (node->array)
+    g_ptr_array_free (node->array, TRUE);
+  if (node->object)
+    g_hash_table_destroy (node->object);
+  g_slice_free (Node, node);
+}
+
+static Node *parse_value (const gchar **p);
+
+static void
+skip_space (const gchar **p)
+{
+  while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')
+    (*p)++;
+}
+
+static gchar *
+parse_string (const gchar **p)
+{
+  GString *str;
+
+  if (**p != '"')
+    return NULL;
+
+  str = g_string_new (NULL);
+  for ((*p)++; **p != '"'; (*p)++)
+    {
+      if ((guchar) **p < 0x20)
+        goto fail;
+
+      if (**p != '\\')
+        {
+          g_string_append_c (str, **p);
+          continue;
+        }
+
+      switch (*++*p)
+        {
+        case '"': case '\\': case '/':
+          g_string_append_c (str, **p);
+          break;
+        case 'b': g_string_append_c (str, '\b'); break;
+        case 'f': g_string_append_c (str, '\f'); break;
+        case 'n': g_string_append_c (str, '\n'); break;
+        case 'r': g_string_append_c (str, '\r'); break;
+        case 't': g_string_append_c (str, '\t'); break;
+        case 'u':
+          {
+            gchar hex[5] = { 0, };
+            gchar *end;
+            gulong c;
+
+            strncpy (hex, *p + 1, 4);
+            c = strtoul (hex, &end, 16);
+            if (end != hex + 4)
+              goto fail;
+            g_string_append_unichar (str, c);
+            *p += 4;
+          }
+          break;
+        default:
+          goto fail;
+        }
+    }
+  (*p)++;
+
+  return g_string_free (str, FALSE);
+
+fail:
+  g_string_free (str, TRUE);
+  return NULL;
+}
+
+static Node *
+parse_value (const gchar **p)
+{
+  Node *node = g_slice_new0 (Node);
+
+  skip_space (p);
+
+  if (**p == '{')
+    {
+      node->type = NODE_OBJECT;
+      node->object = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify) node_free);
+      (*p)++;
+      skip_space (p);
+      if (**p == '}')
+        {
+          (*p)++;
+          return node;
+        }
+      for (;;)
+        {
+          gchar *key;
+          Node *value;
+
+          skip_space (p);
+          key = parse_string (p);
+          if (!key)
+            goto fail;
+          skip_space (p);
+          if (**p != ':')
+            {
+              g_free (key);
+              goto fail;
+            }
+          (*p)++;
+          value = parse_value (p);
+          if (!value)
+            {
+              g_free (key);
+              goto fail;
+            }
+          g_hash_table_insert (node->object, key, value);
+          skip_space (p);
+          if (**p == '}')
+            break;
+          if (**p != ',')
+            goto fail;
+          (*p)++;
+        }
+      (*p)++;
+    }
+  else if (**p == '[')
+    {
+      node->type = NODE_ARRAY;
+      node->array = g_ptr_array_new_with_free_func ((GDestroyNotify) node_free);
+      (*p)++;
+      skip_space (p);
+      if (**p == ']')
+        {
+          (*p)++;
+          return node;
+        }
+      for (;;)
+        {
+          Node *value = parse_value (p);
+
+          if (!value)
+            goto fail;
+          g_ptr_array_add (node->array, value);
+          skip_space (p);
+          if (**p == ']')
+            break;
+          if (**p != ',')
+            goto fail;
+          (*p)++;
+        }
+      (*p)++;
+    }
+  else if (**p == '"')
+    {
+      node->type = NODE_STRING;
+      node->string = parse_string (p);
+      if (!node->string)
+        goto fail;
+    }
+  else if (g_str_has_prefix (*p, "true") || g_str_has_prefix (*p, "false"))
+    {
+      node->type = NODE_BOOLEAN;
+      node->number = **p == 't';
+      *p += **p == 't' ? 4 : 5;
+    }
+  else if (g_str_has_prefix (*p, "null"))
+    {
+      node->type = NODE_NULL;
+      *p += 4;
+    }
+  else
+    {
+      gchar *end;
+
+      node->type = NODE_NUMBER;
+      node->number = g_ascii_strtod (*p, &end);
+      if (end == *p)
+        goto fail;
+      *p = end;
+    }
+
+  return node;
+
+fail:
+  node_free (node);
+  return NULL;
+}
+
+static Node *
+parse_json (const gchar *json)
+{
+  const gchar *p = json;
+  Node *node = parse_value (&p);
+
+  if (node)
+    {
+      skip_space (&p);
+      if (*p)
+        node = (node_free (node), NULL);
+    }
+
+  return node;
+}
+
+static Node *
+member (Node        *object,
+        const gchar *name,
+        NodeType     type)
+{
+  Node *node;
+
+  g_assert_cmpint (object->type, ==, NODE_OBJECT);
+  node = g_hash_table_lookup (object->object, name);
+  g_assert (node);
+  g_assert_cmpint (node->type, ==, type);
+
+  return node;
+}
+
+/* Dumps the trace and returns it parsed, checking what every event
+ * must have. */
+static Node *
+dump_and_parse (const gchar *filename)
+{
+  gchar *json;
+  Node *root, *events;
+  GError *error = NULL;
+  guint i;
+
+  g_assert (hd_trace_dump (&error));
+  g_assert_no_error (error);
+  g_assert (g_file_get_contents (filename, &json, NULL, NULL));
+
+  root = parse_json (json);
+  g_assert (root);
+  g_free (json);
+
+  events = member (root, "traceEvents", NODE_ARRAY);
+  for (i = 0; i < events->array->len; i++)
+    {
+      Node *event = g_ptr_array_index (events->array, i);
+      const gchar *ph;
+
+      member (event, "name", NODE_STRING);
+      g_assert_cmpstr (member (event, "cat", NODE_STRING)->string,
+                       ==, "hildon-home");
+      ph = member (event, "ph", NODE_STRING)->string;
+      g_assert (!strcmp (ph, "B") || !strcmp (ph, "E") || !strcmp (ph, "i"));
+      g_assert_cmpfloat (member (event, "ts", NODE_NUMBER)->number, >=, 0);
+      g_assert_cmpfloat (member (event, "pid", NODE_NUMBER)->number,
+                         ==, getpid ());
+      g_assert_cmpfloat (member (event, "tid", NODE_NUMBER)->number, >=, 1);
+      if (!strcmp (ph, "i"))
+        g_assert_cmpstr (member (event, "s", NODE_STRING)->string, ==, "t");
+    }
+  member (member (root, "otherData", NODE_OBJECT), "dropped", NODE_NUMBER);
+
+  return root;
+}
+
+static gchar *
+trace_file_new (void)
+{
+  gchar *filename;
+  gint fd;
+
+  fd = g_file_open_tmp ("test-trace-XXXXXX.json", &filename, NULL);
+  g_assert_cmpint (fd, >=, 0);
+  close (fd);
+  g_unlink (filename);
+
+  return filename;
+}
+
+static void
+test_disabled (void)
+{
+  HD_TRACE_BEGIN ("disabled");
+  HD_TRACE_END ("disabled");
+
+  g_assert (!hd_trace_enabled);
+  g_assert (!events);
+  g_assert (hd_trace_dump (NULL));
+}
+
+static gpointer
+span_thread (gpointer data)
+{
+  guint i;
+
+  for (i = 0; i < TEST_THREAD_SPANS; i++)
+    {
+      HD_TRACE_BEGIN ("thread");
+      HD_TRACE_INSTANT ("thread-instant");
+      HD_TRACE_END ("thread");
+    }
+
+  return NULL;
+}
+
+static void
+test_format (void)
+{
+  static const gchar *odd_name = "quote \" backslash \\ newline \n"
+                                 " tab \t bell \a UTF-8 \xc3\xa4";
+  gchar *filename = trace_file_new ();
+  GThread *threads[TEST_THREADS];
+  GHashTable *stacks;
+  Node *root, *events;
+  gboolean found_odd = FALSE;
+  guint i;
+
+  hd_trace_init (filename);
+  g_assert (hd_trace_enabled);
+
+  HD_TRACE_BEGIN ("startup");
+  HD_TRACE_BEGIN ("nested");
+  HD_TRACE_INSTANT (odd_name);
+  HD_TRACE_END ("nested");
+
+  for (i = 0; i < TEST_THREADS; i++)
+    threads[i] = g_thread_new ("span", span_thread, NULL);
+  for (i = 0; i < TEST_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  HD_TRACE_END ("startup");
+
+  root = dump_and_parse (filename);
+  events = member (root, "traceEvents", NODE_ARRAY);
+  g_assert_cmpuint (events->array->len,
+                    ==, 5 + TEST_THREADS * TEST_THREAD_SPANS * 3);
+  g_assert_cmpfloat (member (member (root, "otherData", NODE_OBJECT),
+                             "dropped", NODE_NUMBER)->number, ==, 0);
+
+  /* Spans nest per thread and time goes forward in each */
+  stacks = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                  (GDestroyNotify) g_ptr_array_unref);
+  for (i = 0; i < events->array->len; i++)
+    {
+      Node *event = g_ptr_array_index (events->array, i);
+      gpointer tid = GUINT_TO_POINTER ((guint) member (event, "tid", NODE_NUMBER)->number);
+      const gchar *name = member (event, "name", NODE_STRING)->string;
+      const gchar *ph = member (event, "ph", NODE_STRING)->string;
+      GPtrArray *stack = g_hash_table_lookup (stacks, tid);
+
+      if (!stack)
+        {
+          stack = g_ptr_array_new ();
+          g_hash_table_insert (stacks, tid, stack);
+        }
+
+      if (!strcmp (name, odd_name))
+        found_odd = TRUE;
+
+      if (!strcmp (ph, "B"))
+        g_ptr_array_add (stack, event);
+      else if (!strcmp (ph, "E"))
+        {
+          Node *begin;
+
+          g_assert_cmpuint (stack->len, >, 0);
+          begin = g_ptr_array_index (stack, stack->len - 1);
+          g_assert_cmpstr (member (begin, "name", NODE_STRING)->string, ==, name);
+          g_assert_cmpfloat (member (begin, "ts", NODE_NUMBER)->number,
+                             <=, member (event, "ts", NODE_NUMBER)->number);
+          g_ptr_array_remove_index (stack, stack->len - 1);
+        }
+    }
+  g_assert (found_odd);
+  g_assert_cmpuint (g_hash_table_size (stacks), ==, 1 + TEST_THREADS);
+
+  g_hash_table_destroy (stacks);
+  node_free (root);
+  g_unlink (filename);
+  g_free (filename);
+}
+
+/* Events over MAX_EVENTS are counted but not kept */
+static void
+test_overflow (void)
+{
+  Node *root;
+  gint before = g_atomic_int_get (&n_events);
+  guint i;
+
+  for (i = 0; i < MAX_EVENTS; i++)
+    HD_TRACE_INSTANT ("overflow");
+
+  root = dump_and_parse (trace_filename);
+  g_assert_cmpuint (member (root, "traceEvents", NODE_ARRAY)->array->len,
+                    ==, MAX_EVENTS);
+  g_assert_cmpfloat (member (member (root, "otherData", NODE_OBJECT),
+                             "dropped", NODE_NUMBER)->number, ==, before);
+  node_free (root);
+  g_unlink (trace_filename);
+}
+
+/* Disabled tracing must cost no more than a predicted branch */
+static void
+test_disabled_performance (void)
+{
+  gboolean enabled = hd_trace_enabled;
+  gdouble elapsed;
+  guint i;
+
+  hd_trace_enabled = FALSE;
+
+  g_test_timer_start ();
+  for (i = 0; i < TEST_DISABLED_RUNS; i++)
+    {
+      HD_TRACE_BEGIN ("disabled");
+      HD_TRACE_END ("disabled");
+    }
+  elapsed = g_test_timer_elapsed ();
+
+  hd_trace_enabled = enabled;
+
+  g_test_minimized_result (elapsed * 1e9 / TEST_DISABLED_RUNS,
+                           "%f ns per disabled span",
+                           elapsed * 1e9 / TEST_DISABLED_RUNS);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  /* In this order, tracing cannot be turned off again */
+  g_test_add_func ("/trace/disabled", test_disabled);
+  g_test_add_func ("/trace/format", test_format);
+  g_test_add_func ("/trace/overflow", test_overflow);
+  if (g_test_perf ())
+    g_test_add_func ("/trace/disabled-performance", test_disabled_performance);
+
+  return g_test_run ();
+}
+
+#endif
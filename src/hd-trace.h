@@ -0,0 +1,55 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_TRACE_H__
+#define __HD_TRACE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Environment variable naming the file the trace is written to.
+ * Tracing is disabled if it is not set. */
+#define HD_TRACE_ENV "HILDON_HOME_TRACE"
+
+/* Span and event names must be static strings, they are not copied. */
+#define HD_TRACE_BEGIN(name)   G_STMT_START { \
+  if (G_UNLIKELY (hd_trace_enabled)) hd_trace_event ((name), 'B'); \
+} G_STMT_END
+#define HD_TRACE_END(name)     G_STMT_START { \
+  if (G_UNLIKELY (hd_trace_enabled)) hd_trace_event ((name), 'E'); \
+} G_STMT_END
+#define HD_TRACE_INSTANT(name) G_STMT_START { \
+  if (G_UNLIKELY (hd_trace_enabled)) hd_trace_event ((name), 'i'); \
+} G_STMT_END
+
+extern gboolean hd_trace_enabled;
+
+void     hd_trace_init  (const gchar  *filename);
+
+void     hd_trace_event (const gchar  *name,
+                         gchar         phase);
+
+gboolean hd_trace_dump  (GError      **error);
+
+G_END_DECLS
+
+#endif
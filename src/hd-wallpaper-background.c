@@ -30,6 +30,7 @@
 #include "hd-desktop.h"
 #include "hd-pixbuf-utils.h"
 #include "hd-search-service.h"
+#include "hd-trace.h"
 
 #include "hd-wallpaper-background.h"
 
@@ -146,6 +147,8 @@ create_cached_image_command (CommandData *data)
 
   gboolean error_dialogs = TRUE, update_gconf = TRUE;
 
+  HD_TRACE_BEGIN ("create-cached-image");
+
   pixbuf = hd_pixbuf_utils_load_at_size (data->file,
                                          &wallpaper_size,
                                          &etag,
@@ -183,6 +186,8 @@ cleanup:
   if (pixbuf)
     g_object_unref (pixbuf);
   g_free (etag);
+
+  HD_TRACE_END ("create-cached-image");
 }
 
 static void
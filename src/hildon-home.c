@@ -29,6 +29,7 @@
 #include <libhildondesktop/libhildondesktop.h>
 #include <hildon/hildon.h>
 #include <gconf/gconf-client.h>
+#include <dbus/dbus.h>
 
 #include <libintl.h>
 #include <locale.h>
@@ -45,6 +46,10 @@
 #include "hd-task-shortcut.h"
 #include "hd-hildon-home-dbus.h"
 #include "hd-applet-manager.h"
+#include "hd-idle-detector.h"
+#include "hd-memory-pressure.h"
+#include "hd-startup.h"
+#include "hd-trace.h"
 
 #define HD_STAMP_DIR   "/tmp/hildon-desktop/"
 #define HD_HOME_STAMP_FILE HD_STAMP_DIR "hildon-home.stamp"
@@ -147,153 +152,289 @@ check_error (GError **errp)
     return FALSE;
 }
 
-/* g_timeout_add() callback to check the idle time of the CPU periodically
- * until it reaches a certain percentage, then show the desktop widgets. */
+static HDIdleDetector *waitidle_detector;
+static GtkWidget *waitidle_bar, *waitidle_banner;
+static gboolean waitidle_tuning, waitidle_smiley;
+static guint waitidle_timeout_id;
+static guint waitidle_nsamples;
+
 static gboolean
-waitidle (GKeyFile *conf)
+trace_dump (gpointer data)
 {
-  static FILE *st;
-  static GtkWidget *bar;
-  static gboolean tuning, smiley;
-  static gdouble *idles, threshold;
-  static long long prev_total, prev_idle;
-  static guint ttl, window, nidles, idlep;
-  long long total, usr, nic, sys, idle, iowait, irq, softirq, steal;
-
-  if (!st)
-    { /* Initialize */
-      GError *err;
-
-      /* Where we can get the time spent in idle. */
-      if (!(st = fopen ("/proc/stat", "r")))
-        {
-          g_critical ("/proc/stat: %m");
-          g_key_file_free (conf);
-          return FALSE;
-        }
+  GError *error = NULL;
 
-      /* Don't buffer, we'll reread the file periodically. */
-      setvbuf (st, NULL, _IONBF, 0);
-
-      /* Read @ttl, @window, @threshold from the configuration. */
-      err = NULL;
-      ttl       = g_key_file_get_integer (conf, "Waitidle", "timeout", &err);
-      if (check_error(&err))
-        ttl = 60;
-      window  = g_key_file_get_integer (conf, "Waitidle", "window", &err);
-      if (check_error(&err))
-        window = 3;
-      threshold = g_key_file_get_double (conf,  "Waitidle", "threshold", &err);
-      if (check_error(&err))
-        threshold = 0.1;
-      tuning = g_key_file_get_boolean (conf,  "Waitidle", "tuning", NULL);
-      smiley = g_key_file_get_boolean (conf,  "Waitidle", "smiley", NULL);
-
-      idles = g_slice_alloc (sizeof (*idles) * window);
-      bar = gtk_progress_bar_new ();
-      if (tuning)
-        /* We're running forever if @tuning, use @ttl as a counter. */
-        ttl = 0;
-    } /* Initialize */
-
-  /* Read the jiffies. */
-  if (fscanf (st, "cpu  "
-              "%lld %lld %lld %lld %lld %lld %lld %lld",
-              &usr, &nic, &sys, &idle, &iowait, &irq,
-              &softirq, &steal) < 8)
+  if (!hd_trace_dump (&error))
     {
-      g_critical ("/proc/stat: nonsense");
-      goto done;
+      g_warning ("Could not write the trace. %s", error->message);
+      g_error_free (error);
     }
-  total = usr + nic + sys + idle + iowait + irq + softirq + steal;
 
-  /* We need two consecutive samples to calculate idle%. */
-  if (prev_total)
+  return FALSE;
+}
+
+static void
+waitidle_unthrottle (void)
+{
+  HD_TRACE_INSTANT ("waitidle-done");
+  g_object_set (hd_shortcuts_task_shortcuts,
+                "throttled", FALSE, NULL);
+  g_object_set (hd_shortcuts_bookmarks,
+                "throttled", FALSE, NULL);
+  hd_applet_manager_throttled (
+               HD_APPLET_MANAGER (hd_applet_manager_get ()),
+               FALSE);
+
+  /* Let the throttled widgets come up before dumping. */
+  if (hd_trace_enabled)
+    g_idle_add_full (G_PRIORITY_LOW, trace_dump, NULL, NULL);
+}
+
+static void
+waitidle_done (void)
+{ /* Final clean up. */
+  if (waitidle_timeout_id)
+    waitidle_timeout_id = (g_source_remove (waitidle_timeout_id), 0);
+
+  if (waitidle_detector)
     {
-      static GtkWidget *banner;
-      static double prev_idlef;
-      gdouble idlef;
+      hd_idle_detector_stop (waitidle_detector);
+      g_signal_handlers_disconnect_matched (waitidle_detector,
+                                            G_SIGNAL_MATCH_DATA,
+                                            0, 0, NULL, NULL, NULL);
+      waitidle_detector = (g_object_unref (waitidle_detector), NULL);
+    }
 
-      /* Calculate the ratio spent in idle. */
-      if (!(idlef = total-prev_total))
-        idlef = idle - prev_idle;
+  waitidle_bar = NULL;
+}
+
+/* HDIdleDetector::sample handler to show the progress. */
+static void
+waitidle_sample (HDIdleDetector *detector,
+                 gdouble         idlef,
+                 gpointer        data)
+{
+  static gdouble prev_idlef;
+
+  if (waitidle_bar != NULL)
+    { /* Update the progress with the current idle%. */
+      if (!waitidle_banner || ABS(idlef-prev_idlef) >= 0.05)
+        gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (waitidle_bar), idlef);
       else
-        idlef = (gdouble)(idle-prev_idle) / idlef;
+        gtk_progress_bar_pulse (GTK_PROGRESS_BAR (waitidle_bar));
+      waitidle_banner = hildon_banner_show_custom_widget (NULL, waitidle_bar);
+    }
 
-      /* Add it to the window. */
-      idles[idlep++] = idlef;
-      if (nidles < window)
-        nidles++;
+  prev_idlef = idlef;
+  waitidle_nsamples++;
+  if (waitidle_tuning)
+    g_warning ("waitidle: %u. %f", waitidle_nsamples, idlef);
+}
 
-      /* If the window is full see if the average has reached @threshold. */
-      if (bar && nidles >= window)
-        {
-          guint i;
-
-          idlep %= nidles;
-          for (idlef = i = 0; i < nidles; i++)
-            idlef += idles[i];
-          idlef /= nidles;
-          if (idlef >= threshold)
-            { /* Finish ourselves and show the widgets. */
-              g_object_set (hd_shortcuts_task_shortcuts,
-                            "throttled", FALSE, NULL);
-              g_object_set (hd_shortcuts_bookmarks,
-                            "throttled", FALSE, NULL);
-              hd_applet_manager_throttled (
-                           HD_APPLET_MANAGER (hd_applet_manager_get ()),
-                           FALSE);
-              gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (bar), 1.0);
-              if (smiley) g_signal_connect (banner, "hide",
-                                G_CALLBACK (waitidle_wait), NULL);
-              if (tuning)
-                { /* Just keep going on. */
-                  g_warning ("waitidle done");
-                  bar = NULL;
-                }
-              else
-                goto done;
-            }
-        }
+/* HDIdleDetector::idle handler to show the desktop widgets. */
+static void
+waitidle_idle (HDIdleDetector *detector,
+               gpointer        data)
+{
+  waitidle_unthrottle ();
+
+  if (waitidle_bar)
+    gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (waitidle_bar), 1.0);
+  if (waitidle_smiley && waitidle_banner)
+    g_signal_connect (waitidle_banner, "hide",
+                      G_CALLBACK (waitidle_wait), NULL);
+
+  if (waitidle_tuning)
+    { /* Just keep going on. */
+      g_warning ("waitidle done");
+      waitidle_bar = NULL;
+    }
+  else
+    waitidle_done ();
+}
 
-      if (bar != NULL)
-        { /* Update the progress with the current idle%. */
-          if (!banner || ABS(idlef-prev_idlef) >= 0.05)
-            gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (bar), idlef);
-          else
-            gtk_progress_bar_pulse (GTK_PROGRESS_BAR (bar));
-          banner = hildon_banner_show_custom_widget (NULL, bar);
-        }
+static gboolean
+waitidle_timeout (gpointer data)
+{
+  g_warning ("waitidle: timeout reached");
+
+  waitidle_timeout_id = 0;
+  waitidle_done ();
+
+  if (hd_trace_enabled)
+    g_idle_add_full (G_PRIORITY_LOW, trace_dump, NULL, NULL);
+
+  return FALSE;
+}
+
+/* Start watching the system load until it reaches a certain idle
+ * percentage, then show the desktop widgets.  Takes @conf. */
+static void
+waitidle (GKeyFile *conf)
+{
+  HDIdlePolicy *policy;
+  HDIdleDetectorSource source;
+  gchar *source_name;
+  guint ttl, window;
+  gdouble threshold, pressure_threshold, io_threshold;
+  GError *err;
+
+  /* Read the parameters from the configuration. */
+  err = NULL;
+  ttl       = g_key_file_get_integer (conf, "Waitidle", "timeout", &err);
+  if (check_error(&err))
+    ttl = 60;
+  window  = g_key_file_get_integer (conf, "Waitidle", "window", &err);
+  if (check_error(&err))
+    window = 3;
+  threshold = g_key_file_get_double (conf,  "Waitidle", "threshold", &err);
+  if (check_error(&err))
+    threshold = 0.1;
+  pressure_threshold = g_key_file_get_double (conf,  "Waitidle", "pressure-threshold", &err);
+  if (check_error(&err))
+    pressure_threshold = 0.05;
+  io_threshold = g_key_file_get_double (conf,  "Waitidle", "io-threshold", &err);
+  if (check_error(&err))
+    io_threshold = 0.3;
+  waitidle_tuning = g_key_file_get_boolean (conf,  "Waitidle", "tuning", NULL);
+  waitidle_smiley = g_key_file_get_boolean (conf,  "Waitidle", "smiley", NULL);
+
+  source_name = g_key_file_get_string (conf, "Waitidle", "source", NULL);
+  if (!g_strcmp0 (source_name, "stat"))
+    source = HD_IDLE_DETECTOR_SOURCE_STAT;
+  else if (!g_strcmp0 (source_name, "pressure"))
+    source = HD_IDLE_DETECTOR_SOURCE_PRESSURE;
+  else
+    source = HD_IDLE_DETECTOR_SOURCE_AUTO;
+  g_free (source_name);
+
+  g_key_file_free (conf);
 
-      prev_idlef = idlef;
-      if (tuning)
-        g_warning ("waitidle: %u. %f", ttl, idlef);
+  policy = hd_idle_policy_new (window * 1000, threshold,
+                               pressure_threshold, io_threshold);
+  waitidle_detector = hd_idle_detector_new (policy, source);
+  g_signal_connect (waitidle_detector, "sample",
+                    G_CALLBACK (waitidle_sample), NULL);
+  g_signal_connect (waitidle_detector, "idle",
+                    G_CALLBACK (waitidle_idle), NULL);
+
+  if (!hd_idle_detector_start (waitidle_detector))
+    {
+      waitidle_done ();
+      return;
     }
-  else if (tuning)
-    g_warning ("waitidle started");
 
-  /* Do we still have time to live? */
-  if (tuning)
-    ttl++;
-  else if (ttl > 0)
-    ttl--;
+  waitidle_bar = gtk_progress_bar_new ();
+
+  /* We're running forever if @tuning. */
+  if (waitidle_tuning)
+    g_warning ("waitidle started");
   else
+    waitidle_timeout_id = g_timeout_add_seconds (ttl, waitidle_timeout, NULL);
+}
+
+static void
+startup_dbus (gpointer data)
+{
+  hd_hildon_home_dbus_get ();
+}
+
+static void
+startup_notification_manager (gpointer data)
+{
+  hd_notification_manager_get ();
+}
+
+/* Runs in a worker thread */
+static void
+startup_notifications_db (gpointer data)
+{
+  hd_notification_manager_db_open (hd_notification_manager_get ());
+}
+
+/* Runs in a worker thread */
+static void
+startup_desktop_files (gpointer data)
+{
+  hd_shortcut_widgets_preload ();
+}
+
+static void
+startup_backgrounds (gpointer data)
+{
+  hd_backgrounds_startup (hd_backgrounds_get ());
+}
+
+static void
+startup_operator_applet (gpointer data)
+{
+  load_operator_applet ();
+}
+
+static void
+startup_applet_manager (gpointer throttled)
+{
+  hd_applet_manager_throttled (HD_APPLET_MANAGER (hd_applet_manager_get ()),
+                               GPOINTER_TO_INT (throttled));
+}
+
+static void
+startup_system_notifications (gpointer data)
+{
+  hd_system_notifications_get ();
+}
+
+static void
+startup_incoming_events (gpointer data)
+{
+  hd_incoming_events_get ();
+}
+
+static void
+startup_notifications_load (gpointer data)
+{
+  hd_notification_manager_db_load (hd_notification_manager_get ());
+}
+
+/* Add shortcuts gconf dirs so hildon-home gets notifications about changes */
+static void
+startup_gconf (gpointer data)
+{
+  GConfClient *client;
+  GError *error = NULL;
+
+  client = gconf_client_get_default ();
+  gconf_client_add_dir (client,
+                        HD_GCONF_DIR_HILDON_HOME,
+                        GCONF_CLIENT_PRELOAD_ONELEVEL,
+                        &error);
+  if (error)
     {
-      g_warning ("waitidle: timeout reached");
-      goto done;
+      g_warning ("Could not add gconf watch for dir %s. %s",
+                 HD_GCONF_DIR_HILDON_HOME,
+                 error->message);
+      g_error_free (error);
     }
+  g_object_unref (client);
+}
 
-  /* Prepare for the next turn. */
-  fseek(st, 0, SEEK_SET);
-  prev_total = total;
-  prev_idle  = idle;
-  return TRUE;
+static void
+startup_shortcuts (gpointer throttled)
+{
+  /* Task Shortcuts */
+  hd_shortcut_widgets_get ();
+  hd_shortcuts_task_shortcuts =
+    g_object_new (HD_TYPE_SHORTCUTS,
+                  "gconf-key",      HD_GCONF_KEY_HILDON_HOME_TASK_SHORTCUTS,
+                  "shortcut-type",  HD_TYPE_TASK_SHORTCUT,
+                  "throttled",      GPOINTER_TO_INT (throttled), NULL);
 
-done: /* Final clean up. */
-  g_slice_free1 (sizeof (*idles) * window, idles);
-  fclose (st);
-  g_key_file_free (conf);
-  return FALSE;
+  /* Bookmark Shortcuts */
+  hd_bookmark_widgets_get ();
+  hd_shortcuts_bookmarks =
+    g_object_new (HD_TYPE_SHORTCUTS,
+                  "gconf-key",      HD_GCONF_KEY_HILDON_HOME_BOOKMARK_SHORTCUTS,
+                  "shortcut-type",  HD_TYPE_BOOKMARK_SHORTCUT,
+                  "throttled",      GPOINTER_TO_INT (throttled), NULL);
 }
 
 static GdkFilterReturn
@@ -305,26 +446,26 @@ dont_reread_rcfiles (GdkXEvent *xevent, GdkEvent *event, gpointer data)
 int
 main (int argc, char **argv)
 {
-  GConfClient *client;
-  GError *error = NULL;
+  HDStartup *startup;
   GKeyFile *conf;
 
   setlocale (LC_ALL, "");
   bindtextdomain (GETTEXT_PACKAGE, "/usr/share/locale");
   textdomain (GETTEXT_PACKAGE);
 
-  /* Initialize threads */
-#if !GLIB_CHECK_VERSION(2,32,0)
-#ifdef G_THREADS_ENABLED
-  if (!g_thread_supported ())
-    g_thread_init (NULL);
-#endif
-#endif
+  /* Start tracing as early as possible */
+  hd_trace_init (g_getenv (HD_TRACE_ENV));
+  HD_TRACE_BEGIN ("startup");
+
+  /* Before the first connection, the notification ingress thread
+   * shares libdbus with the main thread */
+  dbus_threads_init_default ();
 
   /* Ignore debug output */
   g_log_set_default_handler (log_ignore_debug_handler, NULL);
 
   /* Initialize Gtk+ */
+  HD_TRACE_BEGIN ("gtk-init");
   gtk_init_with_args (&argc, &argv,
                       "Manage widgets, notifications and layout mode dialogs",
                       entries,
@@ -333,6 +474,7 @@ main (int argc, char **argv)
 
   /* Initialize Hildon */
   hildon_init ();
+  HD_TRACE_END ("gtk-init");
 
   /* Add handler for signals */
   signal (SIGINT,  signal_handler);
@@ -356,55 +498,45 @@ main (int argc, char **argv)
     }
   hd_stamp_file_init (HD_HOME_STAMP_FILE);
 
-  /* Backgrounds */
-  hd_backgrounds_startup (hd_backgrounds_get ());
-
-  /* Load operator applet */
-  load_operator_applet ();
-
-  /* Initialize applet manager */
-  hd_applet_manager_throttled (HD_APPLET_MANAGER (hd_applet_manager_get ()),
-                               !!conf);
-
-  /* Intialize notifications */
-  hd_notification_manager_get ();
-  hd_system_notifications_get ();
-  hd_incoming_events_get ();
-  hd_notification_manager_db_load (hd_notification_manager_get ());
-
-  /* Add shortcuts gconf dirs so hildon-home gets notifications about changes */
-  client = gconf_client_get_default ();
-  gconf_client_add_dir (client,
-                        HD_GCONF_DIR_HILDON_HOME,
-                        GCONF_CLIENT_PRELOAD_ONELEVEL,
-                        &error);
-  if (error)
-    {
-      g_warning ("Could not add gconf watch for dir %s. %s",
-                 HD_GCONF_DIR_HILDON_HOME,
-                 error->message);
-      g_error_free (error);
-    }
-  g_object_unref (client);
-
-  /* Task Shortcuts */
-  hd_shortcut_widgets_get ();
-  hd_shortcuts_task_shortcuts =
-    g_object_new (HD_TYPE_SHORTCUTS,
-                  "gconf-key",      HD_GCONF_KEY_HILDON_HOME_TASK_SHORTCUTS,
-                  "shortcut-type",  HD_TYPE_TASK_SHORTCUT,
-                  "throttled",      !!conf, NULL);
-
-  /* Bookmark Shortcuts */
-  hd_bookmark_widgets_get ();
-  hd_shortcuts_bookmarks =
-    g_object_new (HD_TYPE_SHORTCUTS,
-                  "gconf-key",      HD_GCONF_KEY_HILDON_HOME_BOOKMARK_SHORTCUTS,
-                  "shortcut-type",  HD_TYPE_BOOKMARK_SHORTCUT,
-                  "throttled",      !!conf, NULL);
-
-  /* D-Bus */
-  hd_hildon_home_dbus_get ();
+  /* Initialize the subsystems.  The name is taken on D-Bus as early
+   * as possible, nothing is dispatched until the main loop runs anyway.
+   * Reading the notifications database and the .desktop files does not
+   * need the main thread, so it overlaps with the rest. */
+  startup = hd_startup_new ();
+  hd_startup_add (startup, "dbus", HD_STARTUP_MAIN,
+                  startup_dbus, NULL, NULL);
+  hd_startup_add (startup, "notification-manager", HD_STARTUP_MAIN,
+                  startup_notification_manager, NULL, NULL);
+  hd_startup_add (startup, "notifications-db", HD_STARTUP_WORKER,
+                  startup_notifications_db, NULL,
+                  "notification-manager", NULL);
+  hd_startup_add (startup, "desktop-files", HD_STARTUP_WORKER,
+                  startup_desktop_files, NULL, NULL);
+  hd_startup_add (startup, "backgrounds", HD_STARTUP_MAIN,
+                  startup_backgrounds, NULL, NULL);
+  hd_startup_add (startup, "operator-applet", HD_STARTUP_MAIN,
+                  startup_operator_applet, NULL, NULL);
+  hd_startup_add (startup, "applet-manager", HD_STARTUP_MAIN,
+                  startup_applet_manager, GINT_TO_POINTER (!!conf), NULL);
+  hd_startup_add (startup, "system-notifications", HD_STARTUP_MAIN,
+                  startup_system_notifications, NULL,
+                  "notification-manager", NULL);
+  hd_startup_add (startup, "incoming-events", HD_STARTUP_MAIN,
+                  startup_incoming_events, NULL,
+                  "system-notifications", NULL);
+  hd_startup_add (startup, "notifications-load", HD_STARTUP_MAIN,
+                  startup_notifications_load, NULL,
+                  "notifications-db", "incoming-events", NULL);
+  hd_startup_add (startup, "gconf", HD_STARTUP_MAIN,
+                  startup_gconf, NULL, NULL);
+  hd_startup_add (startup, "shortcuts", HD_STARTUP_MAIN,
+                  startup_shortcuts, GINT_TO_POINTER (!!conf),
+                  "gconf", "desktop-files", NULL);
+  hd_startup_run (startup);
+  hd_startup_free (startup);
+
+  /* Let the caches shed under memory pressure */
+  hd_memory_pressure_start ();
 
   /* Don't bother re-styling widgets because we're restarted if the
    * theme changes anyway. */
@@ -414,11 +546,17 @@ main (int argc, char **argv)
 
   /* Start the main loop */
   if (conf)
-    g_timeout_add_seconds (1, (GSourceFunc)waitidle, conf);
+    waitidle (conf);
+  else if (hd_trace_enabled)
+    g_idle_add_full (G_PRIORITY_LOW, trace_dump, NULL, NULL);
+  HD_TRACE_END ("startup");
   gtk_main ();
   
   g_rename (HD_HOME_STAMP_FILE, HD_HOME_STAMP_FILE".sav");
 
+  /* Write everything recorded since the startup as well. */
+  trace_dump (NULL);
+
   /* We got a signal, flush the database.  How we do it breaks
    * if somebody has taken reference of the nm, but we don't. */
   g_object_unref (hd_notification_manager_get ());
@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# notifyreplay-session.sh -- run notifyreplay against a private hildon-home
+#
+# Starts Xvfb, a private session dbus-daemon and hildon-home in a
+# scratch home directory, waits for the notification manager to own
+# its name, runs "notifyreplay <args>" and tears everything down.
+# The exit status is notifyreplay's.
+#
+#   notifyreplay-session.sh replay traffic.log 10
+#   notifyreplay-session.sh generate 60 20 6:3:1
+#
+# HILDON_HOME, NOTIFYREPLAY and XVFB override the programs started,
+# DISPLAY_NUMBER the X display and STARTUP_TIMEOUT how many seconds
+# each of them may take to come up.  KEEP_LOGS=1 leaves the scratch
+# directory with their logs behind.
+
+set -e
+
+: ${HILDON_HOME:=hildon-home}
+: ${NOTIFYREPLAY:=$(dirname "$0")/notifyreplay}
+: ${XVFB:=Xvfb}
+: ${DISPLAY_NUMBER:=99}
+: ${STARTUP_TIMEOUT:=60}
+
+scratch=$(mktemp -d "${TMPDIR:-/tmp}/notifyreplay.XXXXXX")
+pids=
+
+cleanup()
+{
+	for pid in $pids; do
+		kill $pid 2>/dev/null || :
+	done
+	wait 2>/dev/null || :
+	if [ "$KEEP_LOGS" = 1 ]; then
+		echo "$0: logs are in $scratch" >&2
+	else
+		rm -rf "$scratch"
+	fi
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+# Runs "$@" every 0.1 s until it succeeds or STARTUP_TIMEOUT passes.
+wait_for()
+{
+	n=$((STARTUP_TIMEOUT * 10))
+	until "$@"; do
+		n=$((n - 1))
+		if [ $n -le 0 ]; then
+			echo "$0: timed out waiting for $*" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+has_notification_manager()
+{
+	dbus-send --session --print-reply --dest=org.freedesktop.DBus \
+		/org/freedesktop/DBus org.freedesktop.DBus.NameHasOwner \
+		string:org.freedesktop.Notifications 2>/dev/null \
+		| grep -q 'boolean true'
+}
+
+# GConf and the files hildon-home keeps are per user, a scratch home
+# gives them an empty database and directory.  gconfd is started by
+# the first client, on the private bus.
+export HOME="$scratch"
+unset SESSION_MANAGER
+
+"$XVFB" :$DISPLAY_NUMBER -nolisten tcp >"$scratch/xvfb.log" 2>&1 &
+pids="$pids $!"
+export DISPLAY=:$DISPLAY_NUMBER
+wait_for test -e /tmp/.X11-unix/X$DISPLAY_NUMBER
+
+dbus-daemon --session --nofork --print-address=3 \
+	3>"$scratch/bus" >"$scratch/dbus.log" 2>&1 &
+pids="$pids $!"
+wait_for test -s "$scratch/bus"
+DBUS_SESSION_BUS_ADDRESS=$(cat "$scratch/bus")
+export DBUS_SESSION_BUS_ADDRESS
+
+"$HILDON_HOME" >"$scratch/hildon-home.log" 2>&1 &
+pids="$pids $!"
+wait_for has_notification_manager
+
+set +e
+"$NOTIFYREPLAY" "$@"
+status=$?
+set -e
+
+exit $status
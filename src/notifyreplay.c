@@ -0,0 +1,697 @@
+/*
+ * notifyreplay.c -- record, replay and generate notification traffic
+ *
+ * This program loads hildon-home's notification manager with either
+ * real traffic recorded earlier or a synthetic mix, and reports the
+ * Notify latency percentiles and the throughput.
+ *
+ *   notifyreplay record <file>
+ *	Eavesdrops Notify, CloseNotification and ActionInvoked on the
+ *	session bus and appends them to <file> until interrupted.
+ *   notifyreplay replay <file> [<speed>]
+ *	Sends the recorded Notify and CloseNotification calls again,
+ *	<speed> times faster than they were recorded.  ActionInvoked
+ *	is hildon-home's output, it is recorded but not replayed.
+ *   notifyreplay generate <seconds> <rate> [<sms>:<email>:<call>]
+ *	Sends a Poisson stream of <rate> notifications per second for
+ *	<seconds>, SMS threads, e-mail bursts and missed calls mixed
+ *	by the given weights (6:3:1 by default), then closes them.
+ *
+ * It talks to the bus in $DBUS_SESSION_BUS_ADDRESS.  Built by
+ * "make notifyreplay", notifyreplay-session.sh runs it against a
+ * hildon-home of its own on a private bus, with Xvfb and an empty
+ * GConf database.
+ */
+
+/* Include files */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+/* Standard definitions */
+#define NM_NAME		"org.freedesktop.Notifications"
+#define NM_PATH		"/org/freedesktop/Notifications"
+#define NM_IFACE	"org.freedesktop.Notifications"
+
+/* How long the generator waits between the mails of a burst (ms). */
+#define BURST_GAP	10
+#define MAX_BURST	10
+#define SMS_THREADS	5
+
+/* Type definitions */
+/* A recorded or generated event.  @id is the one seen while recording,
+ * mapped to the one returned by hildon-home when replaying. */
+struct event_st
+{
+	unsigned time;		/* ms from the start */
+	char type;		/* 'N'otify, 'C'lose, 'A'ction */
+	unsigned id;
+	char *app, *icon, *summary, *body, *category, *action;
+	int persistent;
+};
+
+/* A Notify call waiting for its reply. */
+struct pending_st
+{
+	unsigned id;
+	gint64 sent;
+};
+
+/* Private variables */
+static GMainLoop *Loop;
+static DBusConnection *DBus;
+
+/* record: */
+static FILE *Out;
+static gint64 Start;
+static GHashTable *Calls;	/* "caller:serial" -> struct event_st */
+
+/* replay: */
+static GPtrArray *Events;
+static unsigned Next;
+static double Speed = 1;
+static GHashTable *Ids;		/* recorded id -> returned id */
+static GArray *Latencies;	/* us */
+static unsigned Outstanding;
+
+/* Program code */
+/* Returns the milliseconds since the start. */
+static unsigned now_ms(void)
+{
+	return (g_get_monotonic_time() - Start) / 1000;
+} /* now_ms */
+
+static void free_event(struct event_st *ev)
+{
+	g_free(ev->app);
+	g_free(ev->icon);
+	g_free(ev->summary);
+	g_free(ev->body);
+	g_free(ev->category);
+	g_free(ev->action);
+	g_slice_free(struct event_st, ev);
+} /* free_event */
+
+/* Writes @ev to the trace file, the strings are escaped so they
+ * cannot contain tabs or newlines. */
+static void write_event(struct event_st const *ev)
+{
+	char *s[5];
+	unsigned i;
+
+	if (ev->type == 'C')
+	{
+		fprintf(Out, "%u\tC\t%u\n", ev->time, ev->id);
+		goto out;
+	} else if (ev->type == 'A')
+	{
+		s[0] = g_strescape(ev->action, NULL);
+		fprintf(Out, "%u\tA\t%u\t%s\n", ev->time, ev->id, s[0]);
+		g_free(s[0]);
+		goto out;
+	}
+
+	s[0] = g_strescape(ev->app ? ev->app : "", NULL);
+	s[1] = g_strescape(ev->icon ? ev->icon : "", NULL);
+	s[2] = g_strescape(ev->summary ? ev->summary : "", NULL);
+	s[3] = g_strescape(ev->body ? ev->body : "", NULL);
+	s[4] = g_strescape(ev->category ? ev->category : "", NULL);
+	fprintf(Out, "%u\tN\t%u\t%s\t%s\t%s\t%s\t%s\t%d\n",
+		ev->time, ev->id, s[0], s[1], s[2], s[3], s[4],
+		ev->persistent);
+	for (i = 0; i < G_N_ELEMENTS(s); i++)
+		g_free(s[i]);
+
+out:	fflush(Out);
+} /* write_event */
+
+/* Parses a trace line.  Returns NULL if it's malformed. */
+static struct event_st *parse_event(char const *line)
+{
+	char **f;
+	unsigned n;
+	struct event_st *ev;
+
+	f = g_strsplit(line, "\t", 0);
+	n = g_strv_length(f);
+	ev = NULL;
+	if (n < 3 || strlen(f[1]) != 1)
+		goto out;
+
+	ev = g_slice_new0(struct event_st);
+	ev->time = strtoul(f[0], NULL, 10);
+	ev->type = f[1][0];
+	ev->id   = strtoul(f[2], NULL, 10);
+
+	if (ev->type == 'N' && n >= 9)
+	{
+		ev->app		= g_strcompress(f[3]);
+		ev->icon	= g_strcompress(f[4]);
+		ev->summary	= g_strcompress(f[5]);
+		ev->body	= g_strcompress(f[6]);
+		ev->category	= g_strcompress(f[7]);
+		ev->persistent	= atoi(f[8]);
+	} else if (ev->type == 'A' && n >= 4)
+		ev->action = g_strcompress(f[3]);
+	else if (ev->type != 'C')
+		ev = (free_event(ev), NULL);
+
+out:	g_strfreev(f);
+	return ev;
+} /* parse_event */
+
+/* Reads the category and persistent hints of a Notify call. */
+static void parse_hints(DBusMessageIter *hints, struct event_st *ev)
+{
+	DBusMessageIter entry, variant;
+
+	for (; dbus_message_iter_get_arg_type(hints) == DBUS_TYPE_DICT_ENTRY;
+		dbus_message_iter_next(hints))
+	{
+		char const *key;
+		int type;
+
+		dbus_message_iter_recurse(hints, &entry);
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+			continue;
+		dbus_message_iter_get_basic(&entry, &key);
+		dbus_message_iter_next(&entry);
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT)
+			continue;
+		dbus_message_iter_recurse(&entry, &variant);
+		type = dbus_message_iter_get_arg_type(&variant);
+
+		if (!strcmp(key, "category") && type == DBUS_TYPE_STRING)
+		{
+			char const *str;
+
+			dbus_message_iter_get_basic(&variant, &str);
+			ev->category = g_strdup(str);
+		} else if (!strcmp(key, "persistent") && type == DBUS_TYPE_BYTE)
+		{
+			unsigned char val;
+
+			dbus_message_iter_get_basic(&variant, &val);
+			ev->persistent = val != 0;
+		} else if (!strcmp(key, "persistent")
+			&& type == DBUS_TYPE_BOOLEAN)
+		{
+			dbus_bool_t val;
+
+			dbus_message_iter_get_basic(&variant, &val);
+			ev->persistent = val != 0;
+		}
+	}
+} /* parse_hints */
+
+/* Returns a copy of the string argument at @args and moves to the
+ * next one, or NULL if it's of another type. */
+static char *next_string(DBusMessageIter *args)
+{
+	char const *str;
+
+	if (dbus_message_iter_get_arg_type(args) != DBUS_TYPE_STRING)
+		return NULL;
+	dbus_message_iter_get_basic(args, &str);
+	dbus_message_iter_next(args);
+	return g_strdup(str);
+} /* next_string */
+
+/* Turns an eavesdropped Notify call into an event waiting for the
+ * reply, which carries the id. */
+static void record_notify(DBusMessage *msg)
+{
+	struct event_st *ev;
+	DBusMessageIter args, sub;
+
+	ev = g_slice_new0(struct event_st);
+	ev->time = now_ms();
+	ev->type = 'N';
+
+	if (!dbus_message_iter_init(msg, &args)
+		|| !(ev->app = next_string(&args)))
+		goto bad;
+
+	/* Skip the replaced id. */
+	if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_UINT32)
+		goto bad;
+	dbus_message_iter_next(&args);
+
+	if (!(ev->icon = next_string(&args))
+		|| !(ev->summary = next_string(&args))
+		|| !(ev->body = next_string(&args)))
+		goto bad;
+
+	/* Skip the actions. */
+	if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY)
+		goto bad;
+	dbus_message_iter_next(&args);
+	if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY)
+		goto bad;
+	dbus_message_iter_recurse(&args, &sub);
+	parse_hints(&sub, ev);
+
+	g_hash_table_insert(Calls,
+		g_strdup_printf("%s:%u", dbus_message_get_sender(msg),
+			dbus_message_get_serial(msg)),
+		ev);
+	return;
+
+bad:	g_warning("malformed Notify call");
+	free_event(ev);
+} /* record_notify */
+
+/* D-BUS filter of the recorder. */
+static DBusHandlerResult record_filter(DBusConnection *con,
+	DBusMessage *msg, void *unused)
+{
+	struct event_st ev, *evp;
+	char *key;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.time = now_ms();
+	switch (dbus_message_get_type(msg))
+	{
+	case DBUS_MESSAGE_TYPE_METHOD_CALL:
+		if (dbus_message_is_method_call(msg, NM_IFACE, "Notify"))
+			record_notify(msg);
+		else if (dbus_message_is_method_call(msg, NM_IFACE,
+				"CloseNotification")
+			&& dbus_message_get_args(msg, NULL,
+				DBUS_TYPE_UINT32, &ev.id,
+				DBUS_TYPE_INVALID))
+		{
+			ev.type = 'C';
+			write_event(&ev);
+		}
+		/* Eavesdropped calls are someone else's; libdbus would
+		 * answer them with UnknownMethod before hildon-home. */
+		return DBUS_HANDLER_RESULT_HANDLED;
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+		key = g_strdup_printf("%s:%u",
+			dbus_message_get_destination(msg),
+			dbus_message_get_reply_serial(msg));
+		if ((evp = g_hash_table_lookup(Calls, key)) != NULL)
+		{
+			if (dbus_message_get_args(msg, NULL,
+				DBUS_TYPE_UINT32, &evp->id,
+				DBUS_TYPE_INVALID))
+				write_event(evp);
+			g_hash_table_remove(Calls, key);
+		}
+		g_free(key);
+		break;
+	case DBUS_MESSAGE_TYPE_SIGNAL:
+		if (dbus_message_is_signal(msg, NM_IFACE, "ActionInvoked")
+			&& dbus_message_get_args(msg, NULL,
+				DBUS_TYPE_UINT32, &ev.id,
+				DBUS_TYPE_STRING, &ev.action,
+				DBUS_TYPE_INVALID))
+		{
+			ev.type = 'A';
+			write_event(&ev);
+		}
+		break;
+	}
+
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+} /* record_filter */
+
+static void record(char const *fname)
+{
+	static char const *rules[] =
+	{
+		"type='method_call',interface='" NM_IFACE "',eavesdrop=true",
+		"type='method_return',sender='" NM_NAME "',eavesdrop=true",
+		"type='signal',interface='" NM_IFACE "',member='ActionInvoked'",
+	};
+	unsigned i;
+
+	if (!(Out = fopen(fname, "a")))
+	{
+		perror(fname);
+		exit(1);
+	}
+
+	Start = g_get_monotonic_time();
+	Calls = g_hash_table_new_full(g_str_hash, g_str_equal,
+		g_free, (GDestroyNotify)free_event);
+	for (i = 0; i < G_N_ELEMENTS(rules); i++)
+		dbus_bus_add_match(DBus, rules[i], NULL);
+	dbus_connection_add_filter(DBus, record_filter, NULL, NULL);
+
+	g_main_loop_run(Loop);
+} /* record */
+
+/* Appends the hints of @ev to the Notify call being built. */
+static void append_hints(DBusMessageIter *args, struct event_st const *ev)
+{
+	DBusMessageIter hints, entry, variant;
+	char const *key;
+	unsigned char persistent;
+
+	dbus_message_iter_open_container(args, DBUS_TYPE_ARRAY, "{sv}",
+		&hints);
+
+	if (ev->category && *ev->category)
+	{
+		key = "category";
+		dbus_message_iter_open_container(&hints,
+			DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+		dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+			"s", &variant);
+		dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING,
+			&ev->category);
+		dbus_message_iter_close_container(&entry, &variant);
+		dbus_message_iter_close_container(&hints, &entry);
+	}
+
+	key = "persistent";
+	persistent = ev->persistent;
+	dbus_message_iter_open_container(&hints,
+		DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+		"y", &variant);
+	dbus_message_iter_append_basic(&variant, DBUS_TYPE_BYTE, &persistent);
+	dbus_message_iter_close_container(&entry, &variant);
+	dbus_message_iter_close_container(&hints, &entry);
+
+	dbus_message_iter_close_container(args, &hints);
+} /* append_hints */
+
+static int cmplatency(guint const *lhs, guint const *rhs)
+{
+	return *lhs < *rhs ? -1 : *lhs > *rhs;
+} /* cmplatency */
+
+/* Prints the latency percentiles and the throughput, then quits. */
+static void report(void)
+{
+	double secs;
+	guint *lat;
+	unsigned n;
+
+	secs = (g_get_monotonic_time() - Start) / 1e6;
+	n = Latencies->len;
+	lat = (guint *)Latencies->data;
+	qsort(lat, n, sizeof(*lat), (void *)cmplatency);
+
+	printf("%u notifications in %.2f s, %.1f/s\n", n, secs,
+		secs > 0 ? n / secs : 0);
+	if (n)
+		printf("latency ms: p50=%.2f p90=%.2f p99=%.2f max=%.2f\n",
+			lat[n*50/100] / 1000.0, lat[n*90/100] / 1000.0,
+			lat[n*99/100] / 1000.0, lat[n-1] / 1000.0);
+
+	g_main_loop_quit(Loop);
+} /* report */
+
+static void free_pending(struct pending_st *pending)
+{
+	g_slice_free(struct pending_st, pending);
+} /* free_pending */
+
+/* Notes the latency of a Notify call and the id it returned. */
+static void notify_reply(DBusPendingCall *call, void *data)
+{
+	struct pending_st *pending = data;
+	DBusMessage *reply;
+	dbus_uint32_t id;
+	guint latency;
+
+	latency = g_get_monotonic_time() - pending->sent;
+	reply = dbus_pending_call_steal_reply(call);
+	if (dbus_message_get_args(reply, NULL,
+		DBUS_TYPE_UINT32, &id, DBUS_TYPE_INVALID))
+	{
+		g_array_append_val(Latencies, latency);
+		g_hash_table_insert(Ids, GUINT_TO_POINTER(pending->id),
+			GUINT_TO_POINTER(id));
+	} else
+		g_warning("Notify failed");
+
+	dbus_message_unref(reply);
+	dbus_pending_call_unref(call);
+
+	if (!--Outstanding && Next >= Events->len)
+		report();
+} /* notify_reply */
+
+static void send_notify(struct event_st const *ev)
+{
+	DBusMessage *msg;
+	DBusMessageIter args, actions;
+	DBusPendingCall *call;
+	struct pending_st *pending;
+	dbus_uint32_t replaces = 0;
+	dbus_int32_t timeout = 0;
+
+	msg = dbus_message_new_method_call(NM_NAME, NM_PATH, NM_IFACE,
+		"Notify");
+	dbus_message_iter_init_append(msg, &args);
+	dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &ev->app);
+	dbus_message_iter_append_basic(&args, DBUS_TYPE_UINT32, &replaces);
+	dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &ev->icon);
+	dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &ev->summary);
+	dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &ev->body);
+	dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "s",
+		&actions);
+	dbus_message_iter_close_container(&args, &actions);
+	append_hints(&args, ev);
+	dbus_message_iter_append_basic(&args, DBUS_TYPE_INT32, &timeout);
+
+	pending = g_slice_new(struct pending_st);
+	pending->id = ev->id;
+	pending->sent = g_get_monotonic_time();
+	if (dbus_connection_send_with_reply(DBus, msg, &call, -1) && call)
+	{
+		Outstanding++;
+		dbus_pending_call_set_notify(call, notify_reply, pending,
+			(DBusFreeFunction)free_pending);
+	} else
+		free_pending(pending);
+
+	dbus_message_unref(msg);
+} /* send_notify */
+
+static void send_close(struct event_st const *ev)
+{
+	DBusMessage *msg;
+	dbus_uint32_t id;
+
+	/* Not replayed if the Notify failed or is still pending. */
+	if (!(id = GPOINTER_TO_UINT(g_hash_table_lookup(Ids,
+		GUINT_TO_POINTER(ev->id)))))
+		return;
+
+	msg = dbus_message_new_method_call(NM_NAME, NM_PATH, NM_IFACE,
+		"CloseNotification");
+	dbus_message_append_args(msg, DBUS_TYPE_UINT32, &id,
+		DBUS_TYPE_INVALID);
+	dbus_message_set_no_reply(msg, TRUE);
+	dbus_connection_send(DBus, msg, NULL);
+	dbus_message_unref(msg);
+} /* send_close */
+
+/* Sends the events which are due and reschedules itself for the next. */
+static gboolean dispatch(void *unused)
+{
+	unsigned now;
+
+	now = now_ms() * Speed;
+	for (; Next < Events->len; Next++)
+	{
+		struct event_st const *ev = g_ptr_array_index(Events, Next);
+
+		if (ev->time > now)
+		{
+			g_timeout_add((ev->time - now) / Speed + 1,
+				dispatch, NULL);
+			return FALSE;
+		}
+
+		if (ev->type == 'N')
+			send_notify(ev);
+		else if (ev->type == 'C')
+			send_close(ev);
+	}
+
+	if (!Outstanding)
+		report();
+	return FALSE;
+} /* dispatch */
+
+static void replay(void)
+{
+	Ids = g_hash_table_new(NULL, NULL);
+	Latencies = g_array_new(FALSE, FALSE, sizeof(guint));
+	Start = g_get_monotonic_time();
+	g_idle_add(dispatch, NULL);
+	g_main_loop_run(Loop);
+} /* replay */
+
+static void load(char const *fname)
+{
+	char *text, **lines;
+	unsigned i;
+	GError *error = NULL;
+
+	if (!g_file_get_contents(fname, &text, NULL, &error))
+	{
+		fprintf(stderr, "%s\n", error->message);
+		exit(1);
+	}
+
+	lines = g_strsplit(text, "\n", 0);
+	for (i = 0; lines[i]; i++)
+	{
+		struct event_st *ev;
+
+		if (!*lines[i])
+			continue;
+		if ((ev = parse_event(lines[i])) != NULL)
+			g_ptr_array_add(Events, ev);
+		else
+			fprintf(stderr, "%s:%u: malformed\n", fname, i+1);
+	}
+
+	g_strfreev(lines);
+	g_free(text);
+} /* load */
+
+/* Returns an exponentially distributed delay with @rate per second. */
+static unsigned poisson_ms(double rate)
+{
+	return -log(1 - g_random_double()) / rate * 1000;
+} /* poisson_ms */
+
+static struct event_st *new_notify(unsigned time, unsigned id,
+	char const *category)
+{
+	struct event_st *ev;
+
+	ev = g_slice_new0(struct event_st);
+	ev->time = time;
+	ev->type = 'N';
+	ev->id = id;
+	ev->app = g_strdup("notifyreplay");
+	ev->icon = g_strdup("");
+	ev->category = g_strdup(category);
+	ev->persistent = 1;
+	return ev;
+} /* new_notify */
+
+/* Fills Events with @secs of synthetic traffic, the mix given by
+ * the weights "sms:email:call", then closes everything. */
+static void generate(unsigned secs, double rate, char const *mix)
+{
+	double w[3] = { 6, 3, 1 }, sum;
+	unsigned t, id, i;
+
+	if (mix)
+		sscanf(mix, "%lf:%lf:%lf", &w[0], &w[1], &w[2]);
+	sum = w[0] + w[1] + w[2];
+
+	for (t = poisson_ms(rate), id = 1; t < secs*1000;
+		t += poisson_ms(rate))
+	{
+		struct event_st *ev;
+		double r;
+
+		r = g_random_double() * sum;
+		if (r < w[0])
+		{	/* A message in one of the SMS threads. */
+			unsigned thread = g_random_int_range(0, SMS_THREADS);
+
+			ev = new_notify(t, id++, "sms-message");
+			ev->summary = g_strdup_printf("+35840%07u", thread);
+			ev->body = g_strdup_printf("message %u", id);
+			g_ptr_array_add(Events, ev);
+		} else if (r < w[0] + w[1])
+		{	/* A burst of mails. */
+			unsigned n = g_random_int_range(1, MAX_BURST+1);
+
+			for (i = 0; i < n; i++, t += BURST_GAP)
+			{
+				ev = new_notify(t, id++, "email-message");
+				ev->summary = g_strdup_printf("mail %u", id);
+				ev->body = g_strdup("Subject");
+				g_ptr_array_add(Events, ev);
+			}
+		} else
+		{	/* A missed call. */
+			ev = new_notify(t, id++, "missed-call");
+			ev->summary = g_strdup("+358401234567");
+			ev->body = g_strdup("");
+			g_ptr_array_add(Events, ev);
+		}
+	}
+
+	/* Close them at the end in order, like a user would. */
+	for (i = 1; i < id; i++)
+	{
+		struct event_st *ev;
+
+		ev = g_slice_new0(struct event_st);
+		ev->time = t;
+		ev->type = 'C';
+		ev->id = i;
+		g_ptr_array_add(Events, ev);
+	}
+} /* generate */
+
+/* The main function */
+int main(int argc, char const *argv[])
+{
+	DBusError dbe;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: %s record <file>\n"
+			"       %s replay <file> [<speed>]\n"
+			"       %s generate <seconds> <rate> "
+				"[<sms>:<email>:<call>]\n",
+			argv[0], argv[0], argv[0]);
+		return 1;
+	}
+
+	Loop = g_main_loop_new(NULL, FALSE);
+	dbus_error_init(&dbe);
+	if (!(DBus = dbus_bus_get(DBUS_BUS_SESSION, &dbe)))
+	{
+		fprintf(stderr, "%s\n", dbe.message);
+		return 1;
+	}
+	dbus_connection_setup_with_g_main(DBus, NULL);
+
+	Events = g_ptr_array_new_with_free_func((GDestroyNotify)free_event);
+	if (!strcmp(argv[1], "record"))
+		record(argv[2]);
+	else if (!strcmp(argv[1], "replay"))
+	{
+		if (argv[3])
+			Speed = atof(argv[3]);
+		if (Speed <= 0)
+			Speed = 1;
+		load(argv[2]);
+		replay();
+	} else if (!strcmp(argv[1], "generate") && argc >= 4)
+	{
+		generate(atoi(argv[2]), atof(argv[3]), argv[4]);
+		replay();
+	} else
+	{
+		fprintf(stderr, "%s: unknown command\n", argv[1]);
+		return 1;
+	}
+
+	g_ptr_array_free(Events, TRUE);
+	return 0;
+} /* main */
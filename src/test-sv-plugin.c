@@ -0,0 +1,77 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+/* A stand-in for the sound and vibra plugin, loaded by test-sv-plugin.
+ * It writes the monotonic time of every play_event call to the file
+ * descriptor in $HD_TEST_SV_PLUGIN_FD, so the test can tell when the
+ * call arrived in either process. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+/* The entry points hd-sv-plugin.c looks up */
+void nsv_plugin_load       (void);
+void nsv_plugin_unload     (void);
+gint nsv_plugin_play_event (GHashTable *hints,
+                            const char *sender);
+void nsv_plugin_stop_event (gint        id);
+
+static gint fd = -1;
+static gint next_id;
+
+void
+nsv_plugin_load (void)
+{
+  const gchar *variable = g_getenv ("HD_TEST_SV_PLUGIN_FD");
+
+  fd = variable ? atoi (variable) : -1;
+  next_id = 1;
+}
+
+void
+nsv_plugin_unload (void)
+{
+  fd = -1;
+}
+
+gint
+nsv_plugin_play_event (GHashTable *hints,
+                       const char *sender)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (fd >= 0 && write (fd, &now, sizeof (now)) != sizeof (now))
+    g_warning ("%s. Could not write the call time", __FUNCTION__);
+
+  return next_id++;
+}
+
+void
+nsv_plugin_stop_event (gint id)
+{
+}